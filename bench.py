@@ -0,0 +1,522 @@
+"""
+Benchmarks FloodClone on a topologies/scenarioN.txt network without Mininet.
+
+The network is built out of plain Linux network namespaces: one per host and
+one per switch, a veth pair per link, a bridge inside every switch namespace,
+and tc on both ends of every veth (tbf for the bandwidth, netem under it for
+delay and loss) the way Mininet's TCIntf shapes them. Every L2 segment, a group
+of switches or a host to host link, gets its own /24 and hosts that are on more
+than one segment forward for the others, so the routes, network_info and ip_map
+FloodClone is given look like what controller.py gathers.
+
+The result is JSON: the utility metric U (when the last destination finished,
+counted from the source starting), every node's completion time and how much
+of each link was used, from the kernel's byte counters on the veths.
+
+Needs root. The kernel has to have the bridge, veth and tbf modules; without
+sch_netem links keep their bandwidth but lose their delay and loss, which the
+output says.
+
+sudo python bench.py topologies/scenario1.txt --runs 5 --output bench.json
+"""
+import hashlib
+import json
+import logging
+import shutil
+import statistics
+import subprocess
+import sys
+import time
+from argparse import ArgumentParser
+from collections import defaultdict, deque
+from dataclasses import dataclass, field
+from pathlib import Path
+from threading import Event, Thread
+from typing import Dict, List, Optional, Tuple
+
+NS_PREFIX = "fc-"
+MTU = 1514
+TC_HZ = 250                 # tbf needs a burst of at least a tick worth of data
+
+logger = logging.getLogger("Project")
+
+
+@dataclass
+class Link:
+    node1: str
+    node2: str
+    bw: float               # Mbit/s
+    delay: str
+    max_queue_size: int
+    loss: float             # percent
+    intf1: str = ""
+    intf2: str = ""
+
+
+@dataclass
+class Topology:
+    hosts: List[str] = field(default_factory=list)
+    switches: List[str] = field(default_factory=list)
+    links: List[Link] = field(default_factory=list)
+    paths: Dict[Tuple[str, str], List[str]] = field(default_factory=dict)
+
+    @staticmethod
+    def parse(topology_file: str) -> "Topology":
+        topo = Topology()
+        with open(topology_file) as f:
+            for line in f:
+                parts = line.split()
+                if not parts:
+                    continue
+                if parts[0] == "host":
+                    topo.hosts.append(parts[1])
+                elif parts[0] == "switch":
+                    topo.switches.append(parts[1])
+                elif parts[0] == "link":
+                    node1, node2, bw, delay, queue, loss = parts[1:7]
+                    topo.links.append(Link(node1, node2, float(bw), delay, int(queue), float(loss)))
+                elif parts[0] == "path":
+                    topo.paths[(parts[1], parts[-1])] = parts[2:-1]
+                else:
+                    raise ValueError(f"Unknown line in {topology_file}: {line.strip()}")
+        return topo
+
+    def is_switch(self, node: str) -> bool:
+        return node in self.switches
+
+
+@dataclass
+class TraceEvent:
+    timestamp: float        # ms from the start of the run
+    node1: str
+    node2: str
+    link_number: int = 0
+    bw: Optional[float] = None
+    delay: Optional[str] = None
+    max_queue_size: Optional[int] = None
+    loss: Optional[float] = None
+
+    @staticmethod
+    def parse(trace_file: str) -> List["TraceEvent"]:
+        events = []
+        with open(trace_file) as f:
+            for line in f:
+                parts = line.split()
+                if not parts:
+                    continue
+                if parts[1] != "link":
+                    raise ValueError(f"Unknown event type: {parts[1]}")
+                d = dict(p.split("=") for p in parts[2:])
+                events.append(TraceEvent(
+                    float(parts[0]), d["node1"], d["node2"], int(d.get("link_number", 0)),
+                    float(d["bw"]) if "bw" in d else None, d.get("delay"),
+                    int(d["max_queue_size"]) if "max_queue_size" in d else None,
+                    float(d["loss"]) if "loss" in d else None))
+        return sorted(events, key=lambda e: e.timestamp)
+
+
+def run(cmd: List[str], check=True) -> subprocess.CompletedProcess:
+    logger.debug(" ".join(cmd))
+    result = subprocess.run(cmd, capture_output=True, text=True)
+    if check and result.returncode != 0:
+        raise RuntimeError(f"{' '.join(cmd)} failed: {result.stderr.strip()}")
+    return result
+
+
+def ns(node: str) -> str:
+    return NS_PREFIX + node
+
+
+def in_ns(node: str, *cmd: str) -> List[str]:
+    return ["ip", "netns", "exec", ns(node), *cmd]
+
+
+class Network:
+    """The namespaces, veths and routes for one topology"""
+
+    def __init__(self, topo: Topology):
+        self.topo = topo
+        self.netem = True
+        self.ips: Dict[str, List[Tuple[str, str, int]]] = defaultdict(list)   # host -> [(intf, ip, segment)]
+        self.forwarders = set()
+
+    def build(self):
+        self.tear_down()
+        for node in self.topo.hosts + self.topo.switches:
+            run(["ip", "netns", "add", ns(node)])
+            run(in_ns(node, "ip", "link", "set", "lo", "up"))
+        for switch in self.topo.switches:
+            run(in_ns(switch, "ip", "link", "add", "br0", "type", "bridge"))
+            run(in_ns(switch, "ip", "link", "set", "br0", "up"))
+
+        ports = defaultdict(int)
+        for i, link in enumerate(self.topo.links):
+            link.intf1 = f"{link.node1}-eth{ports[link.node1]}"
+            link.intf2 = f"{link.node2}-eth{ports[link.node2]}"
+            ports[link.node1] += 1
+            ports[link.node2] += 1
+            # made in the root namespace under throwaway names so two nodes can both have an eth0
+            run(["ip", "link", "add", f"fcb{i}a", "type", "veth", "peer", "name", f"fcb{i}b"])
+            for tmp, node, intf in ((f"fcb{i}a", link.node1, link.intf1), (f"fcb{i}b", link.node2, link.intf2)):
+                run(["ip", "link", "set", tmp, "netns", ns(node)])
+                run(in_ns(node, "ip", "link", "set", tmp, "name", intf))
+                if self.topo.is_switch(node):
+                    run(in_ns(node, "ip", "link", "set", intf, "master", "br0"))
+                run(in_ns(node, "ip", "link", "set", intf, "up"))
+                self.shape(node, intf, link)
+
+        self.address()
+        self.route()
+
+    def tear_down(self):
+        for node in self.topo.hosts + self.topo.switches:
+            run(["ip", "netns", "del", ns(node)], check=False)
+
+    def shape(self, node: str, intf: str, link: Link, change=False):
+        verb = "replace" if change else "add"
+        # like BasicIntf, segmentation offload would let tbf send bursts far past the rate
+        if not change and shutil.which("ethtool"):
+            run(in_ns(node, "ethtool", "-K", intf, "tso", "off", "gso", "off"), check=False)
+        rate = link.bw * 1e6 / 8
+        burst = max(int(rate / TC_HZ), 10 * MTU)
+        run(in_ns(node, "tc", "qdisc", verb, "dev", intf, "root", "handle", "1:", "tbf",
+                  "rate", f"{link.bw}mbit", "burst", str(burst), "limit", str(link.max_queue_size * MTU)))
+        if not self.netem or (not change and link.delay in ("0", "0ms") and link.loss == 0):
+            return
+        result = run(in_ns(node, "tc", "qdisc", verb, "dev", intf, "parent", "1:1", "handle", "10:", "netem",
+                           "delay", link.delay, "loss", f"{link.loss}%", "limit", str(link.max_queue_size)),
+                     check=False)
+        if result.returncode != 0 and not change:
+            logger.warning(f"netem unavailable ({result.stderr.strip()}), links only keep their bandwidth")
+            self.netem = False
+
+    def segments(self) -> Dict[str, int]:
+        """every link end on a host -> the segment it is on"""
+        parent = {s: s for s in self.topo.switches}
+
+        def find(s):
+            while parent[s] != s:
+                parent[s] = parent[parent[s]]
+                s = parent[s]
+            return s
+
+        for link in self.topo.links:
+            if self.topo.is_switch(link.node1) and self.topo.is_switch(link.node2):
+                parent[find(link.node1)] = find(link.node2)
+
+        segment_of = {}
+        result = {}
+        for link in self.topo.links:
+            ends = ((link.node1, link.intf1, link.node2), (link.node2, link.intf2, link.node1))
+            if not self.topo.is_switch(link.node1) and not self.topo.is_switch(link.node2):
+                key = ("link", link.intf1, link.node1)
+                segment_of.setdefault(key, len(segment_of))
+                result[(link.node1, link.intf1)] = segment_of[key]
+                result[(link.node2, link.intf2)] = segment_of[key]
+                continue
+            for node, intf, other in ends:
+                if not self.topo.is_switch(node):
+                    key = ("switch", find(other))
+                    segment_of.setdefault(key, len(segment_of))
+                    result[(node, intf)] = segment_of[key]
+        return result
+
+    def address(self):
+        next_host = defaultdict(lambda: 1)
+        for (host, intf), segment in self.segments().items():
+            if segment > 255:
+                raise ValueError("Topology has more than 256 segments")
+            ip = f"10.0.{segment}.{next_host[segment]}"
+            next_host[segment] += 1
+            run(in_ns(host, "ip", "addr", "add", f"{ip}/24", "dev", intf))
+            self.ips[host].append((intf, ip, segment))
+        for host in self.topo.hosts:
+            run(in_ns(host, "sysctl", "-q", "-w", "net.ipv4.conf.all.rp_filter=0"), check=False)
+            run(in_ns(host, "sysctl", "-q", "-w", "net.ipv4.conf.default.rp_filter=0"), check=False)
+
+    def neighbours(self, host: str) -> Dict[str, Tuple[str, str]]:
+        """hosts sharing a segment with host -> (our intf, their ip) on it"""
+        result = {}
+        for intf, _, segment in self.ips[host]:
+            for other in self.topo.hosts:
+                if other == host:
+                    continue
+                for _, ip, other_segment in self.ips[other]:
+                    if other_segment == segment and other not in result:
+                        result[other] = (intf, ip)
+        return result
+
+    def host_path(self, src: str, dst: str) -> Optional[List[str]]:
+        # a path line in the topology wins over the shortest one
+        for (a, b), hops in self.topo.paths.items():
+            if (a, b) in ((src, dst), (dst, src)):
+                hosts = [h for h in hops if h in self.topo.hosts]
+                path = [a, *hosts, b]
+                return path if a == src else path[::-1]
+        previous = {src: None}
+        queue = deque([src])
+        while queue:
+            host = queue.popleft()
+            if host == dst:
+                path = []
+                while host is not None:
+                    path.append(host)
+                    host = previous[host]
+                return path[::-1]
+            for other in self.neighbours(host):
+                if other not in previous:
+                    previous[other] = host
+                    queue.append(other)
+        return None
+
+    def route(self):
+        for host in self.topo.hosts:
+            neighbours = self.neighbours(host)
+            for other in self.topo.hosts:
+                if other == host:
+                    continue
+                path = self.host_path(host, other)
+                if path is None or len(path) < 3:
+                    continue
+                intf, via = neighbours[path[1]]
+                for _, ip, segment in self.ips[other]:
+                    if any(segment == s for _, _, s in self.ips[host]):
+                        continue
+                    run(in_ns(host, "ip", "route", "add", ip, "via", via, "dev", intf))
+                self.forwarders.update(path[1:-1])
+        for host in self.forwarders:
+            run(in_ns(host, "sysctl", "-q", "-w", "net.ipv4.ip_forward=1"))
+
+    def network_info(self):
+        """same shape as Controller._gather_dests: node -> other -> [(intf, hop count, intermediaries)]"""
+        info = defaultdict(dict)
+        for host in self.topo.hosts:
+            neighbours = self.neighbours(host)
+            for other in self.topo.hosts:
+                if other == host:
+                    continue
+                paths = set()
+                path = self.host_path(host, other)
+                for _, ip, segment in self.ips[other]:
+                    direct = [intf for intf, _, s in self.ips[host] if s == segment]
+                    if direct:
+                        paths.add((direct[0], 1, ()))
+                    elif path is not None:
+                        paths.add((neighbours[path[1]][0], len(path) - 1, tuple(path[1:-1])))
+                info[host][other] = list(paths)
+        return info
+
+    def ip_map(self):
+        return {host: [(intf, ip) for intf, ip, _ in self.ips[host]] for host in self.topo.hosts}
+
+    def tx_bytes(self) -> Dict[Tuple[str, str], int]:
+        counters = {}
+        for link in self.topo.links:
+            for node, intf in ((link.node1, link.intf1), (link.node2, link.intf2)):
+                out = run(in_ns(node, "cat", f"/sys/class/net/{intf}/statistics/tx_bytes")).stdout
+                counters[(node, intf)] = int(out)
+        return counters
+
+    def apply_event(self, event: TraceEvent):
+        between = [l for l in self.topo.links if {l.node1, l.node2} == {event.node1, event.node2}]
+        link = between[event.link_number]
+        for name in ("bw", "delay", "max_queue_size", "loss"):
+            if getattr(event, name) is not None:
+                setattr(link, name, getattr(event, name))
+        # same end the controller reconfigures: Mininet's intf1 is the end of
+        # whoever came first on the link line, whichever node is the switch
+        if self.topo.is_switch(event.node1):
+            self.shape(link.node1, link.intf1, link, change=True)
+        elif self.topo.is_switch(event.node2):
+            self.shape(link.node2, link.intf2, link, change=True)
+        else:
+            raise ValueError(f"Invalid topology: two hosts ({event.node1}, {event.node2}) are connected together")
+
+
+class Bench:
+    def __init__(self, args):
+        self.args = args
+        self.topo = Topology.parse(args.topology)
+        self.events = TraceEvent.parse(args.trace_file) if args.trace_file else []
+        self.binary = str(Path(args.binary).resolve())
+        self.work = Path(args.work_dir).resolve()
+        self.src = "src"
+        if self.src not in self.topo.hosts:
+            raise ValueError(f"{args.topology} has no src host")
+        self.dests = [h for h in self.topo.hosts if h != self.src]
+        self.netem = True
+
+    def run_once(self, index: int) -> dict:
+        network = Network(Topology.parse(self.args.topology))
+        try:
+            network.build()
+            result = self.measure(network, index)
+            self.netem = self.netem and network.netem
+            return result
+        finally:
+            network.tear_down()
+
+    def measure(self, network: Network, index: int) -> dict:
+        shutil.rmtree(self.work, ignore_errors=True)
+        for host in self.topo.hosts:
+            (self.work / host / "pieces").mkdir(parents=True)
+        source_file = self.work / self.src / "file"
+        with open(source_file, "wb") as f:
+            remaining = self.args.size
+            while remaining > 0:
+                chunk = min(remaining, 1 << 24)
+                f.write(self.random_bytes(chunk))
+                remaining -= chunk
+        md5 = hashlib.md5(source_file.read_bytes()).hexdigest()
+
+        network_info = json.dumps(network.network_info())
+        ip_map = json.dumps(network.ip_map())
+        before = network.tx_bytes()
+        capacities = [link.bw for link in network.topo.links]   # a trace may change them while we run
+
+        processes = {}
+        for host in [self.src] + self.dests:
+            cmd = [self.binary,
+                   "--mode", "source" if host == self.src else "destination",
+                   "--node-name", host,
+                   "--file", str(self.work / host / "file"),
+                   "--pieces-dir", str(self.work / host / "pieces"),
+                   "--network-info", network_info,
+                   "--ip-map", ip_map,
+                   "--timestamp-file", str(self.work / f"{host}_completion_time")]
+            if host != self.src:
+                cmd[cmd.index("--file"):cmd.index("--file")] = ["--src-name", self.src]
+            cmd += self.args.extra
+            log = open(self.work / f"{host}_output.log", "w")
+            processes[host] = subprocess.Popen(in_ns(host, *cmd), stdout=log, stderr=subprocess.STDOUT)
+            log.close()
+
+        stop = Event()
+        trace = Thread(target=self.dynamic_network, args=(network, stop))
+        trace.start()
+        deadline = time.monotonic() + self.args.timeout
+        timed_out = []
+        for host, process in processes.items():
+            try:
+                process.wait(timeout=max(deadline - time.monotonic(), 0))
+            except subprocess.TimeoutExpired:
+                process.kill()
+                process.wait()
+                timed_out.append(host)
+        stop.set()
+        trace.join()
+        after = network.tx_bytes()
+
+        times = {host: self.read_times(host) for host in self.topo.hosts}
+        if times[self.src] is None:
+            raise RuntimeError(f"Source wrote no timestamps, see {self.work / self.src}_output.log")
+        start = times[self.src][0]
+
+        nodes = {}
+        for host in self.dests:
+            file = self.work / host / "file"
+            completion = (times[host][1] - start) / 1e6 if times[host] else None
+            nodes[host] = {
+                "completion_s": completion,
+                "verified": file.exists() and hashlib.md5(file.read_bytes()).hexdigest() == md5,
+                "exit_code": processes[host].returncode,
+                "timed_out": host in timed_out,
+            }
+        completions = [n["completion_s"] for n in nodes.values()]
+        utility = max(completions) if all(c is not None for c in completions) else None
+
+        links = []
+        for link, capacity in zip(network.topo.links, capacities):
+            sent = [after[(link.node1, link.intf1)] - before[(link.node1, link.intf1)],
+                    after[(link.node2, link.intf2)] - before[(link.node2, link.intf2)]]
+            busiest = max(sent) * 8 / 1e6 / utility if utility else 0
+            links.append({
+                "node1": link.node1,
+                "node2": link.node2,
+                "bw_mbps": capacity,
+                "bytes": {f"{link.node1}->{link.node2}": sent[0], f"{link.node2}->{link.node1}": sent[1]},
+                "mbps": busiest,
+                "utilization": busiest / capacity if capacity else 0,
+            })
+
+        result = {"run": index, "U_s": utility, "nodes": nodes, "links": links}
+        logger.info(f"run {index}: U = {utility}s, " +
+                    ", ".join(f"{h} {n['completion_s']}s{'' if n['verified'] else ' (BAD)'}"
+                              for h, n in nodes.items()))
+        return result
+
+    def read_times(self, host: str) -> Optional[Tuple[int, int]]:
+        try:
+            with open(self.work / f"{host}_completion_time") as f:
+                start, end = map(int, f.read().split())
+                return start, end
+        except (OSError, ValueError):
+            return None
+
+    def dynamic_network(self, network: Network, stop: Event):
+        begin = time.monotonic()
+        for event in self.events:
+            wait = begin + event.timestamp / 1000 - time.monotonic()
+            if stop.wait(max(wait, 0)):
+                return
+            logger.debug(f"trace: {event}")
+            network.apply_event(event)
+
+    @staticmethod
+    def random_bytes(n: int) -> bytes:
+        with open("/dev/urandom", "rb") as f:
+            return f.read(n)
+
+    def run(self) -> dict:
+        runs = [self.run_once(i) for i in range(self.args.runs)]
+        utilities = [r["U_s"] for r in runs if r["U_s"] is not None]
+        return {
+            "topology": self.args.topology,
+            "trace_file": self.args.trace_file,
+            "file_size": self.args.size,
+            "netem": self.netem,
+            "U_s": {
+                "min": min(utilities),
+                "median": statistics.median(utilities),
+                "max": max(utilities),
+            } if utilities else None,
+            "failed_runs": len(runs) - len(utilities),
+            "runs": runs,
+        }
+
+
+def parse_size(text: str) -> int:
+    units = {"K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+    if text[-1].upper() in units:
+        return int(float(text[:-1]) * units[text[-1].upper()])
+    return int(text)
+
+
+if __name__ == '__main__':
+    parser = ArgumentParser()
+    parser.add_argument("topology", help="Topology file")
+    parser.add_argument("--trace-file", help="Trace file", default=None)
+    parser.add_argument("--runs", type=int, default=1)
+    parser.add_argument("--size", type=parse_size, default="100M", help="File size, like head -c")
+    parser.add_argument("--binary", default=str(Path(__file__).parent / "floodclone" / "floodclone"))
+    parser.add_argument("--work-dir", default="/tmp/floodclone-bench")
+    parser.add_argument("--timeout", type=float, default=300, help="Seconds before a run is given up on")
+    parser.add_argument("--output", help="Write the JSON here instead of stdout")
+    parser.add_argument("--debug", action="store_const", dest="loglevel", const=logging.DEBUG, default=logging.INFO)
+    # everything after -- goes to every floodclone as is
+    argv = sys.argv[1:]
+    extra = argv[argv.index("--") + 1:] if "--" in argv else []
+    args = parser.parse_args(argv[:len(argv) - len(extra) - (1 if "--" in argv else 0)])
+    args.extra = extra
+
+    handler = logging.StreamHandler(sys.stderr)
+    handler.setFormatter(logging.Formatter("%(message)s"))
+    logger.addHandler(handler)
+    logger.setLevel(args.loglevel)
+
+    result = json.dumps(Bench(args).run(), indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(result + "\n")
+    else:
+        print(result)
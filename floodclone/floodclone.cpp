@@ -1,6 +1,8 @@
 
 #include "FloodClone.h"
+#include "Metrics.h"
 #include <iostream>
+#include <csignal>
 
 
 int main(int argc, char* argv[]) {
@@ -15,6 +17,10 @@ int main(int argc, char* argv[]) {
     std::cout << "Network info: " << args.network_info.dump(2) << std::endl;
     std::cout << "Ip Map: " << args.ip_map.dump(2) << std::endl;
 
+    // kill -USR1 takes a look at a running node, the last dump is written on the way out
+    std::string metrics_path = args.timestamp_file + ".metrics";
+    Metrics::dump_on_signal(SIGUSR1, metrics_path);
+
     try {
         std::cout << "Starting " << args.mode << " node: " << args.node_name << std::endl;
         
@@ -24,7 +30,9 @@ int main(int argc, char* argv[]) {
         std::cout << "Node " << args.node_name << " completed successfully" << std::endl;
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
+        Metrics::write(metrics_path);
         return 1;
     }
+    Metrics::write(metrics_path);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,59 @@
+#ifndef COMPLETION_TREE_H
+#define COMPLETION_TREE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+
+// The tree completion is aggregated over, rooted at the source. It is a
+// breadth first tree over the one hop links, so every node reports to a
+// direct neighbor one hop closer to the source, ties go to the smallest
+// name. Every node builds it from the same topology and they all agree on
+// it without talking.
+//
+// A node sends {"type": "done", "node": ..., "times": {node: micros}} to its
+// parent once it and every child's subtree are done, the source then sends
+// {"type": "all_done"} back down. Each pass takes as many rounds as the
+// source is hops from the furthest node and 2(N-1) messages in all.
+class CompletionTree {
+public:
+    explicit CompletionTree(const std::string& source);
+
+    // one hop link, messages go both ways over it
+    void add_link(const std::string& a, const std::string& b);
+    // picks node's parent and children, throws when the source can't reach it
+    void build(const std::string& node);
+
+    const std::string& parent() const { return parent_; }   // empty at the source
+    const std::vector<std::string>& children() const { return children_; }
+
+    // our own transfer finished at micros
+    void finished(int64_t micros);
+    // a done from one of our children or the all_done from our parent,
+    // throws on anything else
+    void receive(const nlohmann::json& message);
+    // every child's subtree is done
+    bool children_done() const { return reported_.size() == children_.size(); }
+    bool all_done() const { return all_done_; }
+
+    nlohmann::json done_message() const;
+    static nlohmann::json all_done_message() { return {{"type", "all_done"}}; }
+    // node -> finish time in micros, ours and our subtree's
+    const std::map<std::string, int64_t>& finish_times() const { return finish_times_; }
+
+private:
+    std::string source_;
+    std::map<std::string, std::set<std::string>> links_;
+
+    std::string node_;
+    std::string parent_;
+    std::vector<std::string> children_;
+    std::set<std::string> reported_;
+    bool all_done_ = false;
+    std::map<std::string, int64_t> finish_times_;
+};
+
+#endif // COMPLETION_TREE_H
@@ -6,36 +6,55 @@
 #include <cstdint>
 #include <memory>
 #include <cstring>
+#include <stdexcept>
 #include <map>
+#include <tuple>
 #include <optional>
 #include "FileManager.h"
+#include "SocketTuner.h"
+#include "Metrics.h"
+#include "SendScheduler.h"
 #include <set>
 #include <shared_mutex>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <functional>
+#include <string_view>
+#include <chrono>
+#include <netinet/in.h>
 
 typedef enum : uint16_t {
     META_REQ = 1,
     META_RES = 2,
     PIECE_REQ = 3,
     PIECE_RES = 4,
-    BUSY_RES = 5,
+    BUSY_RES = 5,        // no longer sent, a request waits for its turn on the interface instead
     NOT_AVAIL_RES = 6,
+    WATCH_REQ = 7,       // follow what the peer holds: one BITFIELD_RES, then HAVE_RES as pieces land
+    BITFIELD_RES = 8,    // payload is the peer's PieceBitset bytes, pieceIndex the piece count
+    HAVE_RES = 9,        // payload is pieceIndex uint64 piece indices
+    SYMBOL_REQ = 10,     // fountain symbols of block pieceIndex, payload is the u64 count wanted
+    SYMBOL_RES = 11,     // one symbol of block pieceIndex, payload is the u64 seed and the data
+    SUBSCRIBE_REQ = 12,  // push mode, payload is the receiver's PieceBitset bytes, pieceIndex the piece count.
+                         // Answered with PIECE_RES as the pieces come in and a NOT_AVAIL_RES after the last
+    CANCEL_REQ = 13,     // drop pieces asked for on this connection that haven't started going out,
+                         // payload is pieceIndex uint64 piece indices. Honoured while a request is being served
+    CANCELLED_RES = 14,  // takes the place of cancelled piece pieceIndex in the answer, no payload
+    CREDIT_REQ = 15,     // the peer may send pieceIndex more PIECE_RES on this connection. A connection
+                         // that never got one isn't limited
     SINGLE_PIECE = 1 << 0,  // 0001
     PIECE_RANGE  = 1 << 1,  // 0010
     PIECE_LIST   = 1 << 2   // 0100
 } RequestType;
 
-struct InterfaceState {
-    std::string interface_name;
-    std::atomic<bool> is_busy{false};
-    std::atomic<int> busy_socket{-1};   // FD of socket currently using the interface
-    std::set<int> associated_sockets;    // All sockets that can use this interface
-    std::mutex state_mutex;  // For socket set modifications
-};
-
 struct RequestHeader {
     RequestType type;
-    uint32_t payloadSize;
-    uint32_t pieceIndex;     // New field for piece identification
+    uint64_t payloadSize;    // 64 bit, metadata of huge files is well past 4 GB
+    uint64_t pieceIndex;     // New field for piece identification
+    uint16_t codec = PieceCodec::RAW;   // PIECE_RES only, payloadSize is the coded length then
+    uint32_t request = 0;    // id the client gave a PIECE_REQ, its answers carry it back
 
     std::vector<char> serialize() const {
         std::vector<char> data(sizeof(RequestHeader));
@@ -105,39 +124,46 @@ struct PieceRequest {
     static PieceRequest deserialize(const std::vector<char>& data) {
         PieceRequest req;
         size_t offset = 0;
+        // the payload comes from a peer, every count is checked against what is left
+        auto take = [&](void* value, size_t size) {
+            if (size > data.size() - offset) {
+                throw std::runtime_error("Truncated piece request");
+            }
+            std::memcpy(value, data.data() + offset, size);
+            offset += size;
+        };
 
-        std::memcpy(&req.types, data.data() + offset, sizeof(req.types));
-        offset += sizeof(req.types);
+        take(&req.types, sizeof(req.types));
 
         if (req.types & SINGLE_PIECE) {
-            std::memcpy(&req.pieceIndex, data.data() + offset, sizeof(size_t));
-            offset += sizeof(size_t);
+            take(&req.pieceIndex, sizeof(size_t));
         }
 
         if (req.types & PIECE_RANGE) {
             size_t range_size;
-            std::memcpy(&range_size, data.data() + offset, sizeof(size_t));
-            offset += sizeof(size_t);
-            
+            take(&range_size, sizeof(size_t));
+            if (range_size > (data.size() - offset) / (2 * sizeof(size_t))) {
+                throw std::runtime_error("Truncated piece request");
+            }
+
             for (size_t i = 0; i < range_size; i++) {
                 size_t start, end;
-                std::memcpy(&start, data.data() + offset, sizeof(size_t));
-                offset += sizeof(size_t);
-                std::memcpy(&end, data.data() + offset, sizeof(size_t));
-                offset += sizeof(size_t);
+                take(&start, sizeof(size_t));
+                take(&end, sizeof(size_t));
                 req.ranges.emplace_back(start, end);
             }
         }
 
         if (req.types & PIECE_LIST) {
             size_t list_size;
-            std::memcpy(&list_size, data.data() + offset, sizeof(size_t));
-            offset += sizeof(size_t);
-            
+            take(&list_size, sizeof(size_t));
+            if (list_size > (data.size() - offset) / sizeof(size_t)) {
+                throw std::runtime_error("Truncated piece request");
+            }
+
             for (size_t i = 0; i < list_size; i++) {
                 size_t piece;
-                std::memcpy(&piece, data.data() + offset, sizeof(size_t));
-                offset += sizeof(size_t);
+                take(&piece, sizeof(size_t));
                 req.pieces.push_back(piece);
             }
         }
@@ -148,7 +174,6 @@ struct PieceRequest {
 
 struct FileMetaData;
 class ThreadPool;
-class InterfaceGuard;
 
 class ConnectionManager {
 public:
@@ -158,7 +183,9 @@ public:
     
     // Constructor for server mode (requires FileManager)
     ConnectionManager(const std::string& localAddress, int localPort, ThreadPool& threadPool, FileManager& fileManager)
-        : localAddress_(localAddress), localPort_(localPort), threadPool_(threadPool), fileManager_(&fileManager) {}
+        : localAddress_(localAddress), localPort_(localPort), threadPool_(threadPool), fileManager_(nullptr) {
+        set_file_manager(fileManager);
+    }
     
     ~ConnectionManager();
 
@@ -167,16 +194,79 @@ public:
     void stop_listening();
 
     // Client operations
-    FileMetaData request_metadata(const std::string& destAddress, int destPort);
+    // localInterface pins the connection to one of our interfaces, empty lets the kernel route
+    FileMetaData request_metadata(const std::string& destAddress, int destPort,
+                                  const std::string& localInterface = "");
     void request_pieces(const std::string& destAddress, int destPort, 
                                      size_t single_piece,
                                      const std::vector<std::pair<size_t, size_t>>& ranges,
-                                     const std::vector<size_t>& piece_list);
-    void close_connection(const std::string& destAddress, int destPort);
-
-    void set_file_manager(FileManager& manager) {
-        fileManager_ = &manager;
-    }
+                                     const std::vector<size_t>& piece_list,
+                                     const std::string& localInterface = "");
+    // split halves of request_pieces so a caller can keep several requests in
+    // flight on one connection. The server answers them side by side,
+    // receive_pieces returns once the oldest one is complete and takes the
+    // answers to the others as they come. Throws NOT_AVAIL or BUSY when the
+    // oldest was turned down, the connection stays usable then
+    size_t send_piece_request(const std::string& destAddress, int destPort, 
+                                     size_t single_piece,
+                                     const std::vector<std::pair<size_t, size_t>>& ranges,
+                                     const std::vector<size_t>& piece_list,
+                                     const std::string& localInterface = "", size_t stream = 0);
+    void receive_pieces(const std::string& destAddress, int destPort,
+                        const std::string& localInterface = "", size_t stream = 0);
+    void close_connection(const std::string& destAddress, int destPort,
+                          const std::string& localInterface = "", size_t stream = 0);
+
+    // What the kernel knows about one of our connections, the piece calls
+    // take the same stream number to run several connections over one path
+    struct StreamInfo {
+        double rtt = 0;        // seconds, smoothed
+        size_t window = 0;     // bytes the receive buffer lets be in flight
+    };
+    std::optional<StreamInfo> stream_info(const std::string& destAddress, int destPort,
+                                          const std::string& localInterface = "", size_t stream = 0);
+
+    // Fountain mode. The peer answers with up to count SYMBOL_RES, a
+    // NOT_AVAIL_RES ends the answer early when it has nothing more for the
+    // block. receive_symbols returns how many came, symbols go to the FileManager
+    void send_symbol_request(const std::string& destAddress, int destPort, size_t block, size_t count,
+                             const std::string& localInterface = "");
+    size_t receive_symbols(const std::string& destAddress, int destPort, size_t count,
+                           const std::string& localInterface = "");
+
+    // Every piece we asked for on a connection is in the in-flight table
+    // until its answer comes. Once a piece lands here it is cancelled on
+    // every other connection still waiting for it, those answer with a
+    // CANCELLED_RES instead of the data, which receive_pieces counts like a piece
+    void cancel_duplicates(size_t piece);
+
+    // Follows which pieces destAddress holds over a connection of its own:
+    // on_bitfield gets a full snapshot once, on_have every piece that lands
+    // there afterwards. Blocks until the peer goes away or stop_watching()
+    void watch_pieces(const std::string& destAddress, int destPort, const std::string& localInterface,
+                      const std::function<void(std::string_view)>& on_bitfield,
+                      const std::function<void(size_t)>& on_have);
+    void stop_watching();
+
+    // Push mode: destAddress sends us every piece we lack that its push
+    // filter gives us, as it gets them, with no further requests. Blocks
+    // until it has sent the last one and returns how many came, throws if
+    // the connection breaks first
+    size_t subscribe(const std::string& destAddress, int destPort, const std::string& localInterface);
+
+    // Name of the interface the kernel routes destAddress through, empty if unknown
+    static std::string route_interface(const std::string& destAddress);
+
+    void set_file_manager(FileManager& manager);
+    // compress pieces for links too slow to keep up with the codec
+    void set_compression(bool enabled) { compression_ = enabled; }
+    // what our connections were tuned to, per peer
+    const SocketTuner& tuner() const { return tuner_; }
+    // how an interface is shared between the peers we send to, set before listening
+    void set_send_policy(SendScheduler::Policy policy) { sender_.set_policy(policy); }
+    void set_fanout(const std::string& address, size_t nodes) { sender_.set_fanout(address, nodes); }
+    // whether a subscriber connecting from address gets the piece from us, nothing is pushed without one
+    void set_push_filter(std::function<bool(const std::string&, size_t)> filter) { push_filter_ = std::move(filter); }
 
 private:
     std::string localAddress_;
@@ -184,30 +274,141 @@ private:
     int wake_fd_ = -1;  
     ThreadPool& threadPool_;
     FileManager* fileManager_;  // Optional pointer to FileManager
+    bool compression_ = false;
+    SocketTuner tuner_;
+    SendScheduler sender_;   // epoll thread only
+    std::function<bool(const std::string&, size_t)> push_filter_;
+
+    static constexpr size_t SKIP_CHUNK = 64 * 1024;   // duplicate piece data is read through this much at a time
+    static constexpr size_t PUSH_DEPTH = 4;   // pieces a subscription keeps queued, the rest wait in push_ready
+    static constexpr auto SUBSCRIBE_WAIT = std::chrono::seconds(5);   // for the peer to start listening
+    static constexpr size_t MAX_OPEN = 4;        // piece requests answered side by side on a connection
+    // pieces a peer may send us ahead of the pool processing them, the
+    // window moves between the bounds with how far behind the pool is
+    static constexpr size_t INITIAL_CREDIT = 64;
+    static constexpr size_t MIN_CREDIT = 8;
+    static constexpr size_t MAX_CREDIT = 2048;
 
     int listeningSocket_;
     std::atomic<bool> isListening_;
     std::mutex connectionMapMutex_;
     std::mutex listeningMutex_;
     std::mutex  fdLocksMapMutex_;
-    std::map<std::pair<std::string, int>, int> connectionMap_;
+    // (address, port, local interface, stream) -> fd
+    std::map<std::tuple<std::string, int, std::string, size_t>, int> connectionMap_;
     std::unordered_map<int, std::unique_ptr<std::mutex>> fdLocks_;  // fd -> lock
 
-    struct RequestContext {
-        std::set<size_t> availablePieces;
-        std::set<size_t> remainingPieces;  // Pieces we still need
-        std::condition_variable cv;
-        std::mutex mutex;
+    // what the metrics need to know about our own connections
+    struct ClientStats {
+        size_t interface = 0;   // Metrics index of our end
+    };
+    std::mutex clientStatsMutex_;
+    std::unordered_map<int, ClientStats> clientStats_;
+
+    // Client side of the connections we get pieces or symbols on, a symbol
+    // request is only here until its first answer
+    struct AskedRequest {
+        uint32_t id;
+        std::multiset<size_t> pieces;       // not answered yet
+        std::chrono::steady_clock::time_point sent;
+        bool started = false;               // an answer to it came
+        std::string refused;                // NOT_AVAIL or BUSY, thrown once it is the oldest
+    };
+    struct ClientFlow {
+        uint64_t generation;                // fds get reused, late credit returns check this
+        uint32_t next_id = 1;
+        std::deque<AskedRequest> requests;  // oldest first
+        size_t window = INITIAL_CREDIT;     // pieces the peer may send ahead of us processing them
+        size_t granted = 0;                 // credit given so far, 0 until the first request
+        size_t processed = 0;               // pieces that credit came back for
+        size_t sending = 0;                 // control messages on their way out without the lock
     };
 
-    std::unordered_map<std::string, std::unique_ptr<InterfaceState>> interface_states_;
-    std::shared_mutex interface_map_mutex_;
+    // In-flight table. Cancels and credit are sent without it, a full socket
+    // buffer on one connection mustn't stall every receiver. A flow with
+    // one on its way isn't forgotten (and its fd not closed) until it is out
+    std::mutex inFlightMutex_;
+    std::condition_variable controlSent_;
+    std::unordered_map<size_t, std::vector<int>> inFlight_;   // piece -> connections it was asked for on
+    std::unordered_map<int, ClientFlow> flows_;
+    std::unordered_map<size_t, std::pair<int, uint64_t>> processing_;   // piece on the pool -> connection it came on
+    uint64_t next_generation_ = 0;
+
+    // Serving side of an accepted connection. Only the epoll thread touches
+    // these, requests are parsed and answered without ever blocking so a slow
+    // downstream receiver can't hold on to a thread
+    struct OutItem {
+        std::vector<char> head;        // response header
+        std::string_view body;         // in-memory payload after head, must outlive the item
+        std::shared_ptr<const CodedPiece> coded;   // keeps a compressed body alive
+        std::shared_ptr<const std::string> symbol; // same for a fountain symbol
+        PieceExtent file{-1, 0, 0};    // piece data sent with sendfile after body
+        size_t piece = SIZE_MAX;       // PIECE_RES only, what a CANCEL_REQ is matched against
+        std::optional<uint32_t> request;   // the piece request it answers, unset for pushed pieces
+        size_t sent = 0;               // bytes of head + body + file already written
+        std::chrono::steady_clock::time_point started;   // first byte went out
+        std::chrono::steady_clock::time_point landed{};  // when the relayed piece reached us, unset otherwise
+    };
 
-    // Map socket fd -> interface name for quick lookups
-    // redudnet information as the sockets associated to interfaces could be found
-    // inside the interface_state map but makes for an easy look if I need to for now
-    std::unordered_map<int, std::string> socket_to_interface_;
-    std::shared_mutex socket_map_mutex_;
+    struct QueuedRequest {
+        RequestHeader header;
+        std::vector<char> payload;
+    };
+
+    struct ServeState {
+        uint64_t id;                   // fds get reused, late piece wakeups check this
+        std::string peer;              // address of the other end
+        size_t interface = 0;          // Metrics index of our end
+        RequestHeader header;
+        size_t header_read = 0;
+        std::vector<char> payload;
+        size_t payload_read = 0;
+        bool serving = false;          // answering a symbol request or subscription, the next request waits in next
+        std::unordered_map<uint32_t, size_t> open;   // piece request id -> answers still to go out
+        std::optional<QueuedRequest> next;
+        std::set<size_t> cancelled;    // pieces of next cancelled before it started
+        bool waiting_turn = false;     // has pieces to send but the interface is busy with others this round
+        bool watching = false;         // gets HAVE_RES for every piece we land
+        bool subscribed = false;       // gets pieces pushed until push_ready and push_later run out
+        std::set<size_t> push_ready;   // pieces to push that we hold, lowest first
+        std::set<size_t> push_later;   // pieces to push once they land here
+        std::multimap<size_t, std::optional<uint32_t>> waiting;   // pieces we don't have yet -> request they answer
+        size_t credit = SIZE_MAX;      // PIECE_RES the peer still takes, unlimited until its first CREDIT_REQ
+        bool waiting_credit = false;   // has a piece to send but no credit for it
+        bool encoding = false;         // symbols of the current request are being made on the pool
+        std::unordered_map<size_t, size_t> forwarded;   // block -> symbols of it passed on before we could make our own
+        std::deque<OutItem> out;       // responses ready to go, in order
+        double rate = 0;               // ewma of piece bytes per second the peer drains, 0 until measured
+        uint32_t events = 0;           // what the fd is registered for in epoll
+    };
+
+    struct ReadyPiece {
+        int fd;
+        uint64_t id;
+        size_t idx;
+        std::chrono::steady_clock::time_point landed;
+    };
+
+    struct ReadySymbols {
+        int fd;
+        uint64_t id;
+        size_t block;
+        std::vector<std::shared_ptr<const std::string>> symbols;
+    };
+
+    int epoll_fd_ = -1;
+    uint64_t next_serve_id_ = 0;
+    std::unordered_map<int, ServeState> serving_;
+    std::mutex ready_mutex_;
+    std::vector<ReadyPiece> ready_;    // relayed pieces that landed, handed over by FileManager callbacks
+    std::vector<ReadySymbols> ready_symbols_;   // symbols the pool made for a request
+    std::vector<size_t> landed_;       // every piece that landed since the last drain, for watchers
+    size_t watchers_ = 0;
+    size_t subscribers_ = 0;
+
+    std::mutex watchMutex_;
+    std::set<int> watchFds_;           // client side watch connections, stop_watching shuts them down
+    bool watchStopped_ = false;
 
     // Helper to get or create lock for a fd
     std::mutex& fd_lock(int fd) {
@@ -226,30 +427,57 @@ private:
         fdLocks_.erase(fd);
     }
 
-    // atomic lcok interface and return the status of interface
-    bool acquire_inter(int socket_fd);  // Returns false if interface is busy
-    void release_inter(int socket_fd);  // Release interface after transfer complete 
-    void update_inter(int socket_fd, const std::string& peer_ip);  // Associate socket with interface based on peer IP
-
-    // Helper methods
-    void process_request(int fd);
-    void process_meta_request(int fd, const RequestHeader& header);
-    void process_piece_request(int fd, const RequestHeader& header);
-    int connect_to(const std::string& destAddress, int destPort, int max_attempts);
-    void send_all(int fd, const std::string_view& data);
+    // Serving, all on the epoll thread
+    void accept_connection();
+    void service(int fd);
+    void read_requests(int fd, ServeState& state);
+    void start_request(int fd, ServeState& state);
+    void serve_meta_request(ServeState& state);
+    void serve_watch_request(ServeState& state);
+    void serve_piece_request(int fd, ServeState& state);
+    void serve_symbol_request(int fd, ServeState& state);
+    void serve_subscribe_request(ServeState& state);
+    void serve_cancel_request(ServeState& state);
+    static bool can_start(const ServeState& state, const RequestHeader& header);
+    size_t max_payload(uint16_t type) const;   // most a request of this type may carry, more closes the connection
+    static OutItem cancelled_item(size_t idx, std::optional<uint32_t> request);
+    bool push_pieces(int fd, ServeState& state);
+    void queue_symbols(ServeState& state, size_t block, const std::vector<std::shared_ptr<const std::string>>& symbols);
+    void queue_piece(int fd, ServeState& state, size_t idx, std::optional<uint32_t> request,
+                     std::chrono::steady_clock::time_point landed = {});
+    void queue_response(ServeState& state, RequestType type, std::optional<uint32_t> request = std::nullopt);
+    void flush(int fd, ServeState& state);
+    void update_events(int fd, ServeState& state);
+    void close_served(int fd);
+    void service_woken();
+    // called from whichever thread landed the piece, landed is set when it was relayed to us
+    void piece_ready(int fd, uint64_t id, size_t idx, std::chrono::steady_clock::time_point landed = {});
+    void piece_landed(size_t idx);                      // same, for every new piece
+    void symbols_ready(int fd, uint64_t id, size_t block, std::vector<std::shared_ptr<const std::string>> symbols);
+    void drain_ready();
+
+    // Client helpers, blocking
+    int connect_to(const std::string& destAddress, int destPort, int max_attempts,
+                   const std::string& localInterface = "", size_t stream = 0);
+    int open_connection(const std::string& destAddress, int destPort, int max_attempts,
+                        const std::string& localInterface);
+    static void bind_to_interface(int sock, const std::string& localInterface);
+    static std::string interface_with(const sockaddr_in& address);   // name of the interface holding address, empty if none
+    static size_t metrics_interface(int sock);
+    void receive_piece(int sock, const RequestHeader& header, size_t interface);
+    ClientFlow& client_flow(int sock);   // inFlightMutex_ held
+    void untrack(int sock, size_t piece);  // same
+    static void answer_started(AskedRequest& asked);
+    void symbols_answered(int sock);
+    void piece_answered(int sock, uint32_t request, size_t piece);   // a PIECE_RES or CANCELLED_RES for it came
+    void request_refused(int sock, uint32_t request, const std::string& reason);
+    void forget_requests(int sock);
+    // credit for a piece the pool is done with, or one dropped as a duplicate
+    void piece_processed(size_t piece);
+    size_t credit_due(ClientFlow& flow);   // inFlightMutex_ held, counts as sending when not 0
+    void send_credit(int sock, size_t grant);
+    void send_all(int fd, const std::string_view& data, int flags = 0);
     void receive_all(int found, char* buffer, size_t size);
-    void send_piece(int clientSocket, size_t idx, const std::shared_ptr<RequestContext>& context);
-    void wait_for_queue(int clientSocket, const std::shared_ptr<RequestContext>& context);
-
-    friend class InterfaceGuard;
-};
-
-class InterfaceGuard {
-    ConnectionManager& cm_;
-    int socket_;
-public:
-    InterfaceGuard(ConnectionManager& cm, int socket) : cm_(cm), socket_(socket) {}
-    ~InterfaceGuard() { cm_.release_inter(socket_); }
 };
 
 #endif // CONNECTION_MANAGER_H
\ No newline at end of file
@@ -0,0 +1,74 @@
+#ifndef DISTRIBUTION_PLANNER_H
+#define DISTRIBUTION_PLANNER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <utility>
+#include <cstddef>
+
+// Plans how pieces flow from the source over the topology every node is
+// given. An interface that reaches several neighbors in one hop sits on a
+// switch, so whatever it sends to any of them shares one uplink. The planner
+// packs spanning trees rooted at the source so that no interface is asked to
+// send or receive more than it can. Each tree gets a share of the pieces in
+// proportion to its rate, and a node fetches a tree's pieces from its parent
+// in that tree. Pieces move down every tree at once, so the file takes
+// N/(B1 + B2 + ...) instead of M*N/B to reach everyone.
+//
+// network_info has no bandwidths, so every interface counts as one unit of
+// capacity. Every node runs the same deterministic plan on the same input
+// and they all agree on it without talking.
+class DistributionPlanner {
+public:
+    explicit DistributionPlanner(const std::string& source);
+
+    // one hop route from -> to going out of from's interface
+    void add_link(const std::string& from, const std::string& to, const std::string& interface);
+
+    // packs the trees, false when some node can't be reached from the source
+    // and no plan was made
+    bool plan();
+
+    size_t num_trees() const { return trees_.size(); }
+    // share of an interface's capacity the tree moves pieces at
+    double tree_rate(size_t tree) const { return trees_[tree].rate; }
+    // who node gets the tree's pieces from, empty for the source
+    const std::string& parent(const std::string& node, size_t tree) const;
+    // which tree a piece goes down, pieces are interleaved by rate so every
+    // tree streams through the file in order
+    size_t tree_of(size_t piece) const { return slots_[piece % slots_.size()]; }
+
+    // node, interface pairs that reach more than one neighbor
+    std::vector<std::pair<std::string, std::string>> shared_interfaces() const;
+
+private:
+    static constexpr size_t MAX_TREES = 8;
+    static constexpr double MIN_RATE = 0.05;   // trees moving less than this aren't worth the bookkeeping
+    static constexpr size_t SLOTS = 64;        // pieces per round of the interleave
+
+    struct Edge {
+        size_t from, to;
+        size_t tx;   // resource of from's interface sending
+        size_t rx;   // resource of to's interface receiving
+    };
+
+    struct Tree {
+        std::vector<std::string> parent;   // by node id
+        double rate;
+    };
+
+    std::string source_;
+    // node -> interface -> neighbors reachable through it in one hop
+    std::map<std::string, std::map<std::string, std::set<std::string>>> links_;
+
+    std::vector<std::string> names_;
+    std::vector<Tree> trees_;
+    std::vector<size_t> slots_{0};
+
+    bool pack_tree(const std::vector<Edge>& edges, const std::vector<std::vector<size_t>>& out,
+                   size_t source, std::vector<double>& tx_left, std::vector<double>& rx_left);
+};
+
+#endif // DISTRIBUTION_PLANNER_H
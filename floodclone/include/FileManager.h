@@ -4,9 +4,19 @@
 #include <vector>
 #include <string>
 #include <sstream>
+#include <string_view>
+#include <cstdint>
 #include <array>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
 #include <mutex>
 #include "ThreadPool.h"
+#include "PieceBitset.h"
+#include "PieceStore.h"
+#include "PieceCodec.h"
+#include "Fountain.h"
 #include <sys/mman.h>  
 #include <unistd.h>  
 #include <cassert>
@@ -19,192 +29,221 @@ class ThreadPool;
 
 class ConnectionManager; 
 
-// contains information about a single piece of file
-struct PieceMetaData{
-    vector<array<char, IP4_LENGTH>> srcs; // list of ip addresses that are known to have the piece, fixed length for IPv4
-    std::string checksum; 
-
-
-    // serialize: converts the piece metadata to a binary string
-    string serialize() const {
-        stringstream ss;
-        
-        // Serialize the source IP addresses
-        size_t src_count = srcs.size();
-        ss.write(reinterpret_cast<const char*>(&src_count), sizeof(src_count));
-        for(const auto& src : srcs) {
-            ss.write(src.data(), IP4_LENGTH);
-        }
-
-        // Serialize the checksum
-        size_t checksum_len = checksum.length();
-        ss.write(reinterpret_cast<const char*>(&checksum_len), sizeof(checksum_len));
-        ss.write(checksum.data(), checksum_len);
+constexpr size_t CHECKSUM_LENGTH = 32;  // sha256, fixed width so checksums live in one array
 
-        return ss.str();
-    }
+// pieces [first, last] are held by peers[peer] of the metadata
+struct SourceRange {
+    uint64_t first;
+    uint64_t last;
+    uint32_t peer;
+};
 
-    // Deserialize: populates the metadata from a binary string
-    static PieceMetaData deserialize(const string& binary) {
-        PieceMetaData pieceMeta;
-        stringstream ss(binary);
-
-        // Deserialize the source IP addresses
-        size_t src_count;
-        ss.read(reinterpret_cast<char*>(&src_count), sizeof(src_count));
-        pieceMeta.srcs.resize(src_count);
-        for(size_t i = 0; i < src_count; ++i) {
-            ss.read(pieceMeta.srcs[i].data(), IP4_LENGTH);
+// rsync's weak checksum over a window, sliding it on by one byte is O(1)
+struct RollingChecksum {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t size;
+
+    RollingChecksum(const char* data, size_t size) : size(static_cast<uint32_t>(size)) {
+        for (size_t i = 0; i < size; ++i) {
+            uint32_t x = static_cast<unsigned char>(data[i]);
+            a += x;
+            b += static_cast<uint32_t>(size - i) * x;
         }
+    }
 
-        // Deserialize the checksum
-        size_t checksum_len;
-        ss.read(reinterpret_cast<char*>(&checksum_len), sizeof(checksum_len));
-        pieceMeta.checksum.resize(checksum_len);
-        ss.read(&pieceMeta.checksum[0], checksum_len);
+    uint32_t value() const { return (a & 0xffff) | (b << 16); }
 
-        return pieceMeta;
+    void slide(char out, char in) {
+        uint32_t old_byte = static_cast<unsigned char>(out);
+        a += static_cast<unsigned char>(in) - old_byte;
+        b += a - size * old_byte;
     }
 };
 
-// contains information about a file
+// Read only view over serialized FileMetaData, it parses in place so the
+// receive buffer never has to be copied just to be looked at. Layout, every
+// integer in host byte order (all nodes run the same build):
+//   header     u32 magic, u32 version, u64 fileSize, numPieces, pieceSize,
+//              startupPieceSize, startupPieces
+//   names      u32 fileId length, u32 filename length, then both strings
+//   peers      u32 count, then count * IP4_LENGTH bytes
+//   sources    u64 count, then count * (u64 first, u64 last, u32 peer)
+//   checksums  u32 width (0 when absent), then the width byte merkle root
+//              and numPieces * width bytes of leaves (sha256 of each piece)
+//   weak       u64 count (0 when absent, numPieces otherwise), then count *
+//              u32 rolling checksums of each piece for delta transfers
+class FileMetaDataView {
+public:
+    static constexpr uint32_t MAGIC = 0x444d4346;  // "FCMD"
+    static constexpr uint32_t VERSION = 3;
+    static constexpr size_t HEADER_SIZE = 2 * sizeof(uint32_t) + 5 * sizeof(uint64_t);
+    static constexpr size_t MAX_NAME_LENGTH = 4096;   // each of fileId and filename
+    static constexpr size_t MAX_PEERS = 65536;
+
+    // throws if data is truncated or isn't metadata
+    explicit FileMetaDataView(std::string_view data);
+
+    // largest buffer that can start with this HEADER_SIZE byte header, lets a
+    // receiver refuse a bogus length before allocating it. Throws like the
+    // constructor if header isn't metadata
+    static size_t max_size(std::string_view header);
+
+    uint64_t file_size() const { return file_size_; }
+    uint64_t num_pieces() const { return num_pieces_; }
+    uint64_t piece_size() const { return piece_size_; }
+    uint64_t startup_piece_size() const { return startup_piece_size_; }
+    uint64_t startup_pieces() const { return startup_pieces_; }
+    std::string_view file_id() const { return file_id_; }
+    std::string_view filename() const { return filename_; }
+
+    size_t peer_count() const { return peer_count_; }
+    std::string_view peer(size_t id) const;   // ip without the NUL padding
+    size_t source_count() const { return source_count_; }
+    SourceRange source(size_t i) const;
+    bool has_checksums() const { return checksums_ != nullptr; }
+    std::string_view merkle_root() const;
+    std::string_view checksums() const;       // every piece's checksum back to back
+    std::string_view checksum(size_t piece) const;
+    bool has_weak_checksums() const { return weak_ != nullptr; }
+    uint32_t weak_checksum(size_t piece) const;
+
+private:
+    uint64_t file_size_;
+    uint64_t num_pieces_;
+    uint64_t piece_size_;
+    uint64_t startup_piece_size_;
+    uint64_t startup_pieces_;
+    std::string_view file_id_;
+    std::string_view filename_;
+    const char* peers_;
+    size_t peer_count_;
+    const char* sources_;
+    size_t source_count_;
+    const char* merkle_root_ = nullptr;
+    const char* checksums_ = nullptr;
+    const char* weak_ = nullptr;
+};
+
+// contains information about a file, per piece data is kept in columns so
+// multi-million piece files serialize with a handful of memcpys
 struct FileMetaData {
     string fileId;         // unique hash of a specific file
     string filename;       // string name of the file
-    size_t numPieces;         // number of pieces that make up the file
-    size_t fileSize;
-    vector<PieceMetaData> pieces; // information about each of the pieces that make up a file 
-
-    // serialize: converts the file metadata to a binary string
-    string serialize() const {
-      stringstream ss;
-
-        // Serialize fileId
-        size_t fileId_len = fileId.length();
-        ss.write(reinterpret_cast<const char*>(&fileId_len), sizeof(fileId_len));
-        ss.write(fileId.data(), fileId_len);
-
-        // Serialize filename
-        size_t filename_len = filename.length();
-        ss.write(reinterpret_cast<const char*>(&filename_len), sizeof(filename_len));
-        ss.write(filename.data(), filename_len);
-
-        // Serialize fileSize
-        ss.write(reinterpret_cast<const char*>(&fileSize), sizeof(fileSize));
-
-        // Serialize numPieces
-        ss.write(reinterpret_cast<const char*>(&numPieces), sizeof(numPieces));
-
-        // Serialize each piece in pieces
-        for (const auto& piece : pieces) {
-            string serialized_piece = piece.serialize();
-            size_t piece_len = serialized_piece.length();
-            ss.write(reinterpret_cast<const char*>(&piece_len), sizeof(piece_len));
-            ss.write(serialized_piece.data(), piece_len);
-        }
-
-        return ss.str();
-    }
-
-    // deserialize: populates the metadata from a binary string
-    static FileMetaData deserialize(const string& binary) {
-        FileMetaData fileMeta;
-        stringstream ss(binary);
-
-        // Deserialize fileId
-        size_t fileId_len;
-        ss.read(reinterpret_cast<char*>(&fileId_len), sizeof(fileId_len));
-        fileMeta.fileId.resize(fileId_len);
-        ss.read(&fileMeta.fileId[0], fileId_len);
-
-        // Deserialize filename
-        size_t filename_len;
-        ss.read(reinterpret_cast<char*>(&filename_len), sizeof(filename_len));
-        fileMeta.filename.resize(filename_len);
-        ss.read(&fileMeta.filename[0], filename_len);
-
-        // Deserialize fileSize
-        ss.read(reinterpret_cast<char*>(&fileMeta.fileSize), sizeof(fileMeta.fileSize));
-
-        // Deserialize numPieces
-        ss.read(reinterpret_cast<char*>(&fileMeta.numPieces), sizeof(fileMeta.numPieces));
-
-        // Deserialize each piece in pieces
-        fileMeta.pieces.resize(fileMeta.numPieces);
-        for (size_t i = 0; i < fileMeta.numPieces; ++i) {
-            size_t piece_len;
-            ss.read(reinterpret_cast<char*>(&piece_len), sizeof(piece_len));
-            string piece_binary(piece_len, '\0');
-            ss.read(&piece_binary[0], piece_len);
-            fileMeta.pieces[i] = PieceMetaData::deserialize(piece_binary);
-        }
-
-        return fileMeta;
-    }
-
-    static FileMetaData deserialize(const vector<char>& binary) {
-        FileMetaData fileMeta;
-        stringstream ss;
-        ss.write(binary.data(), binary.size());
-        ss.seekg(0);  // Reset position for reading
-
-        // Deserialize fileId
-        size_t fileId_len;
-        ss.read(reinterpret_cast<char*>(&fileId_len), sizeof(fileId_len));
-        fileMeta.fileId.resize(fileId_len);
-        ss.read(&fileMeta.fileId[0], fileId_len);
-
-        // Deserialize filename
-        size_t filename_len;
-        ss.read(reinterpret_cast<char*>(&filename_len), sizeof(filename_len));
-        fileMeta.filename.resize(filename_len);
-        ss.read(&fileMeta.filename[0], filename_len);
-
-        // Deserialize fileSize
-        ss.read(reinterpret_cast<char*>(&fileMeta.fileSize), sizeof(fileMeta.fileSize));
-
-        // Deserialize numPieces
-        ss.read(reinterpret_cast<char*>(&fileMeta.numPieces), sizeof(fileMeta.numPieces));
-
-        // Deserialize each piece in pieces
-        fileMeta.pieces.resize(fileMeta.numPieces);
-        for (size_t i = 0; i < fileMeta.numPieces; ++i) {
-            size_t piece_len;
-            ss.read(reinterpret_cast<char*>(&piece_len), sizeof(piece_len));
-            string piece_binary(piece_len, '\0');
-            ss.read(&piece_binary[0], piece_len);
-            fileMeta.pieces[i] = PieceMetaData::deserialize(piece_binary);
-        }
-
-        return fileMeta;
-    }
+    size_t numPieces = 0;     // number of pieces that make up the file
+    size_t fileSize = 0;
+    // piece layout, the first startupPieces pieces are startupPieceSize bytes
+    // so the first hops can start relaying quickly, the rest are pieceSize
+    size_t pieceSize = 0;
+    size_t startupPieceSize = 0;
+    size_t startupPieces = 0;
+
+    vector<array<char, IP4_LENGTH>> peers;  // peer table, SourceRange::peer indexes it
+    vector<SourceRange> sources;            // who is known to hold which pieces
+    vector<char> checksums;                 // numPieces * CHECKSUM_LENGTH bytes, empty if not computed
+    array<char, CHECKSUM_LENGTH> merkleRoot{};  // root over checksums, only meaningful with them
+    vector<uint32_t> weakChecksums;         // rolling checksum per piece, empty if not computed
+
+    // serialize: converts the file metadata to the layout FileMetaDataView reads
+    string serialize() const;
+
+    // deserialize: copies what a view points at into owned columns
+    static FileMetaData deserialize(std::string_view binary);
 };
 
 class ConnectionManager;
 
+// location of a piece inside the file backing a FileManager, lets the
+// connection layer hand the byte range straight to the kernel (sendfile)
+struct PieceExtent {
+    int fd;
+    off_t offset;
+    size_t length;  // actual bytes of the piece, the last one may be short
+};
+
 class FileManager {
 public:
 
     FileManager(const std::string& file_path, size_t ipiece_size, const std::string& node_ip,
                 const std::string& pieces_folder, ThreadPool* thread_pool, bool is_source, 
-                const FileMetaData* metadata);  
+                const FileMetaData* metadata,
+                PieceStore::Backend store_backend = PieceStore::Backend::Mmap,
+                bool resume = false);
 
 
 
     const FileMetaData& get_metadata() const;
-    std::string  save_metadata();
-    void reconstruct();  // reconutructs a file based on pieces
+    // the metadata never changes once the FileManager exists, serialize it
+    // once and hand every requester the same bytes
+    std::string_view serialized_metadata();
+    std::string  save_metadata();   // next to the file, returns the path
+    static FileMetaData load_metadata(const std::string& path);
+    void reconstruct();  // waits for every piece to be on disk and trims the file to size
     void clean_up();
     void deconstruct(); 
     void update_piece_status(size_t i);
-    std::string_view send(size_t i);
+    std::string_view send(size_t i);  // source only, receivers don't keep the file mapped
+    PieceExtent extent(size_t i) const;
+    size_t piece_offset(size_t i) const;
+    size_t piece_length(size_t i) const;
+
+    // Steady state piece size for a file, bdp_bytes is the bandwidth-delay
+    // product of the links when known (0 otherwise)
+    static size_t choose_piece_size(size_t file_size, size_t bdp_bytes);
     bool has_piece(size_t i);
 
     using PieceCallback = std::function<void(size_t)>;
 
     void register_piece_callback(size_t piece_idx, PieceCallback callback);
-
-    std::string calculate_checksum(const std::string& data); 
+    // listener runs on whichever thread lands any new piece, add listeners
+    // before pieces start arriving
+    void add_piece_listener(PieceCallback listener);
+    // runs once a received piece has been dealt with on the pool, whether it
+    // landed or has to be fetched again
+    void add_processed_listener(PieceCallback listener);
+
+    const PieceBitset& pieces() const { return piece_status; }
+    // pieces whose bytes are in or on their way in, pieces() plus the ones
+    // still being received or verified, so nobody asks for them twice
+    const PieceBitset& claimed() const { return claimed_pieces_; }
+    // bumped every time a claimed piece goes missing again (broken receive
+    // or bad checksum), scanners that skip claimed pieces start over then
+    size_t reclaimed_pieces() const { return reclaimed_pieces_.load(); }
+
+    // sha256 of size bytes at data into out, CHECKSUM_LENGTH bytes
+    static void calculate_checksum(const char* data, size_t size, char* out);
+    // rsync style weak checksum, cheap to slide along a file one byte at a time
+    static uint32_t rolling_checksum(const char* data, size_t size);
+
+    // Compressed form of a piece we hold, nullptr until encode_piece made
+    // (or a receive brought) one. A RAW entry means it didn't compress
+    std::shared_ptr<const CodedPiece> coded_piece(size_t i);
+    // compresses piece i on the pool and calls done(i) once coded_piece has it
+    void encode_piece(size_t i, PieceCallback done);
+    bool compression_pays(double link_rate) { return codec_.worth_it(link_rate); }
+
+    // Delta transfer: finds pieces of the new file anywhere in an older copy
+    // at basis_path and copies them in locally so they are never fetched.
+    // Needs weak and strong checksums in the metadata, returns pieces found
+    size_t seed_from(const std::string& basis_path);
+
+    // Fountain mode, pieces travel as symbols of blocks of
+    // FountainDecoder::BLOCK_PIECES pieces, see Fountain.h
+    size_t fountain_blocks() const;
+    size_t symbol_size(size_t block) const;   // bytes of a symbol's data, without the seed
+    bool has_block(size_t block);
+    // independent symbols the block still needs, 0 once all its pieces are in
+    size_t block_missing(size_t block);
+    using SymbolsCallback = std::function<void(std::vector<std::shared_ptr<const std::string>>)>;
+    // makes count fresh symbols of a block we hold on the pool, each one is
+    // the u64 seed followed by the data, the way SYMBOL_RES carries it
+    void encode_symbols(size_t block, size_t count, SymbolsCallback done);
+    // symbols of a block we are still decoding that told us something new,
+    // the ones from index from on, relays pass them on before they can make their own
+    std::vector<std::shared_ptr<const std::string>> received_symbols(size_t block, size_t from);
+    // a symbol as SYMBOL_RES carries it, folded in on the pool. The block's
+    // pieces are checked and land like received pieces once it solves
+    void symbol_received(size_t block, std::string symbol);
 
     size_t available_pieces() const { 
         return available_pieces_.load(); 
@@ -215,8 +254,12 @@ private:
    
     string file_path;                       // path to original path
     size_t piece_size;                              
+    size_t startup_piece_size;
+    size_t startup_pieces = 0;
     FileMetaData file_metadata; 
     std::mutex metadata_mutex; 
+    std::once_flag serialized_once;
+    std::string serialized;
     
     string node_ip;                 
     size_t num_pieces;
@@ -228,28 +271,81 @@ private:
 
     
     bool is_source;
+    PieceStore::Backend store_backend;
+    // with resume a receiver picks up what file_path.metadata and the bitmap
+    // of pieces on disk (file_path.pieces) describe, and keeps both up to
+    // date. Without it neither is written, so the output is never synced
+    // while pieces come in
+    bool resume;
+    std::mutex progress_mutex_;
+    std::atomic<bool> saving_progress_{false};
+    std::atomic<int64_t> last_progress_save_{0};   // steady clock ms
 
     void* mapped_file = MAP_FAILED;
-    int merged_fd; 
+    std::unique_ptr<PieceStore> store_;  // receivers write the output through it
+    int source_fd = -1;  // kept open on the source so pieces can be sent with sendfile
 
-    std::deque<std::atomic<bool>> piece_status; // tells you about the current state of a piece weather it exists within this node or not
+    PieceBitset piece_status; // tells you about the current state of a piece weather it exists within this node or not
+    PieceBitset claimed_pieces_;
+    std::atomic<size_t> reclaimed_pieces_{0};
     
     std::mutex callbacks_mutex_;
     // Map of piece_idx -> vector of callbacks
     std::unordered_map<size_t, std::vector<PieceCallback>> piece_callbacks_;
+    std::vector<PieceCallback> piece_listeners_;
+    std::vector<PieceCallback> processed_listeners_;
+
+    // compressed pieces, kept so every peer (and every relay after us) gets
+    // the same bytes without compressing them again. Oldest go first once
+    // they add up to more than CODED_CACHE_BYTES
+    PieceCodec codec_;
+    std::mutex coded_mutex_;
+    std::unordered_map<size_t, std::shared_ptr<const CodedPiece>> coded_;
+    std::unordered_map<size_t, std::vector<PieceCallback>> encoding_;   // piece -> waiting for it
+    std::deque<size_t> coded_order_;
+    size_t coded_bytes_ = 0;
+    void cache_coded(size_t i, std::shared_ptr<const CodedPiece> piece);
+
+    struct BlockDecode {
+        std::mutex mutex;
+        std::unique_ptr<FountainDecoder> decoder;   // made with the first symbol
+        std::vector<std::shared_ptr<const std::string>> received;  // symbols that were new to us
+    };
+    std::mutex blocks_mutex_;
+    std::unordered_map<size_t, std::shared_ptr<BlockDecode>> blocks_;
+    std::atomic<uint64_t> next_seed_;   // starts random so no two nodes make the same symbols
+    std::shared_ptr<BlockDecode> block_decode(size_t block);
+    size_t block_first(size_t block) const { return block * FountainDecoder::BLOCK_PIECES; }
+    size_t block_end(size_t block) const;
+    void decode_symbol(size_t block, std::shared_ptr<const std::string> symbol);
 
     void verify_ip(const string& ip);
     void split(size_t i);  // splits the i-th peice file into piece_i 
     void merge(size_t i); // Merges the i-th piece into the main file
     void initialize_source();
     void initialize_receiver(const FileMetaData& metadata);
+    void parallel_for(size_t count, const std::function<void(size_t)>& run);
+    void for_each_block(const std::function<void(size_t, size_t)>& run);
+    bool seed_piece(size_t i, const char* data);
+    void compute_checksums();
+    bool can_resume(const FileMetaData& metadata) const;
+    void restore_progress();
+    void maybe_save_progress();
+    void save_progress();
+    bool verify_piece(size_t i, const char* data) const;
+    // claims piece i for one receiver and returns the buffer to receive it
+    // into, nullptr if it is held or claimed already. The claim ends with
+    // piece_received once the bytes are in, or release_piece_buffer when the
+    // receive broke off
     char* get_piece_buffer(size_t i, size_t& size);
+    // coded is set when the piece came compressed, buffer is filled from it
+    void piece_received(size_t i, char* buffer, std::shared_ptr<const CodedPiece> coded = nullptr);
+    void release_piece_buffer(size_t i, char* buffer);
+    void land_piece(size_t i, char* buffer, const std::shared_ptr<const CodedPiece>& coded);
     
 
     friend class ConnectionManager;
     
 };
 
-FileManager FileManagerFromMetadata(const string& metadataPath, const string& srcIp, const string& piecePath);
-
 #endif // FILEMANAGER_H
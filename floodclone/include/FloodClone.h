@@ -4,9 +4,14 @@
 #include <string>
 #include <nlohmann/json.hpp>
 #include <memory>
+#include <map>
+#include <atomic>
 #include "ThreadPool.h"
 #include "FileManager.h"
 #include "ConnectionManager.h"
+#include "PieceScheduler.h"
+#include "DistributionPlanner.h"
+#include "CompletionTree.h"
 
 struct Arguments {
     std::string mode;
@@ -15,6 +20,13 @@ struct Arguments {
     std::string file_path;
     std::string pieces_dir;
     std::string timestamp_file;
+    std::string store = "mmap";   // piece store backend receivers write through
+    bool resume = false;          // keep the output resumable, and pick up what an earlier --resume run left
+    std::string basis;            // older copy of the file, matching pieces are copied from it instead of fetched
+    bool compress = false;        // compress pieces for links slower than the codec
+    bool fountain = false;        // fetch fountain coded symbols instead of pieces
+    bool push = false;            // have our parents in the plan push pieces instead of asking for them
+    std::string send_policy = "fanout";   // who gets more of an interface we send on: fair, fastest, fanout
     nlohmann::json network_info;
     nlohmann::json ip_map;
 };
@@ -26,6 +38,19 @@ struct ConnectionOption {
     std::string local_interface;  
 };
 
+// Parallel TCP streams over one path to a neighbor. A single stream can't
+// have more than its receive window in flight, on a long fat link that
+// caps it below what the link carries, and one retransmit holds up
+// everything queued behind it. Every stream is a path of its own in the
+// scheduler, stream 0 sizes the group from what the kernel measures
+struct StreamGroup {
+    ConnectionOption option;
+    std::vector<size_t> paths;          // scheduler path of each stream
+    std::atomic<size_t> active{1};      // streams asking for pieces, the rest sit idle
+    size_t piece_size = 0;              // turns the scheduler's piece rates into bytes
+    std::chrono::steady_clock::time_point resized;
+};
+
 class FloodClone {
 private:
     ThreadPool thread_pool;
@@ -37,15 +62,17 @@ private:
 
     
 
+    // Completion goes over a tree of the one hop links rooted at the source,
+    // see CompletionTree. node_mtx guards it, node_change is signalled on
+    // every message it gets
     std::mutex node_mtx;
-    size_t completed_nodes_ = 0;
     std::condition_variable node_change;
-    size_t total_nodes_;
+    CompletionTree completion_;
 
     static constexpr int COMPLETION_PORT = 9090;
     int completion_socket_;
     std::thread completion_thread_;
-    bool is_listening_{true};
+    std::atomic<bool> is_listening_{true};
 
     std::string my_ip;
 
@@ -63,18 +90,41 @@ private:
     std::unordered_map<std::string, 
     std::unordered_map<std::string, std::vector<RouteInfo>>> network_map;
 
+    // trees pieces flow down, built from the one hop routes in network_map
+    DistributionPlanner planner;
+    bool planned_ = false;
+
     void setup_node();
     void setup_net_info();
     std::vector<ConnectionOption> get_ip(const std::string& node_name);
+    std::vector<ConnectionOption> get_paths(const std::string& neighbor);
     void record_time();
+    void write_tuning();
     void setup_completion();
     void listen_for_completion();
-    void notify_completion();
+    void wait_for_completion();
+    void send_completion(const std::string& node, const nlohmann::json& message);
     std::vector<std::string> find_immediate_neighbors();
+    int hops_to_source(const std::string& node);
+    bool is_upstream(const std::string& neighbor);
+    size_t downstream_of(const std::string& node);
+    void download(const FileMetaData& metadata, const std::vector<std::string>& neighbors);
+    void fetch_from(PieceScheduler& scheduler, StreamGroup& group, size_t stream);
+    void resize_streams(PieceScheduler& scheduler, StreamGroup& group);
+    void download_push(const FileMetaData& metadata, const std::vector<std::string>& neighbors);
+    void download_fountain(const FileMetaData& metadata, const std::vector<std::string>& neighbors);
+    void fetch_symbols_from(std::vector<std::atomic<size_t>>& asked, size_t start, const ConnectionOption& option);
 
 public:
     FloodClone(const Arguments& args);
     void start();
+
+    // get_paths() without the topology lookup: one option per local interface
+    // the kernel routes the target out of, or the first target if none is
+    static std::vector<ConnectionOption> routed_paths(const std::vector<ConnectionOption>& options);
+    // streams a group of at most max_streams needs to keep rate bytes per
+    // second over rtt seconds in flight with windows of window bytes
+    static size_t streams_wanted(double rate, double rtt, size_t window, size_t max_streams);
 };
 
 
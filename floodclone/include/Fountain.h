@@ -0,0 +1,45 @@
+#ifndef FOUNTAIN_H
+#define FOUNTAIN_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Rateless code over blocks of up to BLOCK_PIECES consecutive pieces. A
+// symbol is the xor of a subset of its block's pieces, and the subset
+// follows from the (block, seed) pair it travels with. Anyone holding the
+// block can make new symbols, and a symbol from any peer is as good as any
+// other. Subsets are dense random rather than LT's sparse degrees: blocks
+// are small enough that solving them by elimination is cheap, and that
+// needs about k + 2 symbols where peeling would need tens of percent more
+class FountainDecoder {
+public:
+    static constexpr size_t BLOCK_PIECES = 32;   // at most 64, a symbol's subset is one word
+
+    // the pieces of a k piece block the symbol with this seed covers, bit j
+    // is piece j, never empty
+    static uint64_t coefficients(uint64_t block, uint64_t seed, size_t k);
+    static void xor_into(char* out, const char* in, size_t size);
+
+    FountainDecoder(size_t k, size_t symbol_size);
+
+    // folds a symbol in, false when it told us nothing new
+    bool add(uint64_t mask, const char* data);
+    size_t rank() const { return rank_; }
+    bool complete() const { return rank_ == k_; }
+    // back substitution once complete, piece(j) then holds piece j padded
+    // out to symbol_size
+    void solve();
+    const std::string& piece(size_t j) const { return rows_[j]; }
+
+private:
+    size_t k_;
+    size_t symbol_size_;
+    size_t rank_ = 0;
+    // row j has its lowest set bit at j, 0 when there is none yet
+    std::vector<uint64_t> masks_;
+    std::vector<std::string> rows_;
+};
+
+#endif // FOUNTAIN_H
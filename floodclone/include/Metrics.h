@@ -0,0 +1,81 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Counters and latency histograms for the data plane. Every thread writes to
+// a shard of its own with plain relaxed stores, so recording costs about as
+// much as a local increment and never takes a lock. Shards are only summed
+// when the metrics get dumped, as JSON, at exit and on a signal.
+//
+// Histograms are log linear like HDR histograms: every power of two is split
+// in SUB_BUCKETS, so any value is known to within about 6% whatever its size.
+class Metrics {
+public:
+    enum Counter {
+        REQUESTS_SENT,
+        REQUESTS_SERVED,
+        PIECES_RECEIVED,
+        PIECES_DUPLICATE,       // came in after another path already landed them
+        PIECES_SERVED,
+        PIECES_PUSHED,          // of those, sent to a subscriber without being asked for
+        PIECES_CANCELLED,       // queued for a peer that cancelled them before they went out
+        CANCELS_SENT,           // pieces we cancelled on a connection after they landed through another
+        PIECES_MIGRATED,        // moved off a path that slowed down, to be asked for elsewhere
+        SYMBOLS_RECEIVED,
+        SYMBOLS_SERVED,
+        BUSY_RECEIVED,          // we no longer send BUSY, only a peer running an older build does
+        NOT_AVAIL_SENT,
+        NOT_AVAIL_RECEIVED,
+        CHECKSUM_FAILURES,
+        CONNECTIONS_ACCEPTED,
+        CONNECT_FAILURES,
+        COUNTERS
+    };
+
+    enum Histogram {
+        REQUEST_FIRST_BYTE_US,  // request sent to the first byte of its answer
+        PIECE_RECEIVE_US,       // piece header to its last byte
+        RELAY_DELAY_US,         // piece landed to it going out to a peer that was waiting on it
+        POOL_QUEUE_DEPTH,       // tasks queued on the pool, sampled whenever one is added
+        HISTOGRAMS
+    };
+
+    static void count(Counter counter, uint64_t n = 1);
+    static void record(Histogram histogram, uint64_t value);
+    static void record_since(Histogram histogram, std::chrono::steady_clock::time_point start);
+
+    // interfaces are looked up by name once per connection, the index is
+    // what goes with every byte count
+    static size_t interface_index(const std::string& name);
+    static void bytes_sent(size_t interface, uint64_t bytes);
+    static void bytes_received(size_t interface, uint64_t bytes);
+
+    static std::string dump();
+    static void write(const std::string& path);
+    // writes a dump to path whenever signo arrives. Has to be called before
+    // any other thread starts so they all inherit the blocked signal
+    static void dump_on_signal(int signo, const std::string& path);
+
+    static constexpr size_t MAX_INTERFACES = 32;   // more share the last slot
+    static constexpr size_t SUB_BITS = 4;
+    static constexpr size_t SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr size_t MAX_EXPONENT = 47;     // values past 2^48 land in the last bucket
+    static constexpr size_t BUCKETS = (MAX_EXPONENT - SUB_BITS + 2) * SUB_BUCKETS;
+
+    static size_t bucket_of(uint64_t value);
+    static uint64_t bucket_floor(size_t bucket);
+
+private:
+    struct Shard;
+    struct Registry;
+    static Shard& shard();
+    static Registry& registry();
+    static int64_t now_micros();
+};
+
+#endif // METRICS_H
@@ -0,0 +1,59 @@
+#ifndef PIECE_BITSET_H
+#define PIECE_BITSET_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+
+// One bit per piece packed into 64 bit atomic words. Setting a bit is a
+// single fetch_or so receivers can land pieces concurrently, and scans look
+// at 64 pieces per compare instead of one byte per piece.
+class PieceBitset {
+public:
+    explicit PieceBitset(size_t size = 0, bool value = false);
+
+    size_t size() const { return size_; }
+
+    bool test(size_t i) const {
+        return words_[i / 64].load(std::memory_order_acquire) & bit(i);
+    }
+
+    // returns whether the bit was already set
+    bool set(size_t i) {
+        return words_[i / 64].fetch_or(bit(i), std::memory_order_acq_rel) & bit(i);
+    }
+
+    void reset(size_t i) {
+        words_[i / 64].fetch_and(~bit(i), std::memory_order_acq_rel);
+    }
+
+    size_t count() const;
+
+    // first index >= from that is clear/set, size() if there is none
+    size_t find_first_clear(size_t from) const;
+    size_t find_first_set(size_t from) const;
+    // first index >= from set in has and clear in ours: a piece a peer can give us
+    static size_t find_first_wanted(const PieceBitset& has, const PieceBitset& ours, size_t from);
+
+    // packed words in host order, what BITFIELD messages carry
+    std::string to_bytes() const;
+    static size_t byte_size(size_t size) { return (size + 63) / 64 * sizeof(uint64_t); }  // what to_bytes gives for size bits
+    void merge_bytes(std::string_view bytes);   // ors bytes produced by to_bytes into this set
+
+private:
+    size_t size_;
+    size_t num_words_;
+    std::unique_ptr<std::atomic<uint64_t>[]> words_;
+
+    static uint64_t bit(size_t i) { return uint64_t(1) << (i % 64); }
+
+    // first index >= from where word_at(w) has a set bit, word_at must keep
+    // bits past size() clear
+    template <typename WordAt>
+    size_t scan(size_t from, WordAt word_at) const;
+};
+
+#endif // PIECE_BITSET_H
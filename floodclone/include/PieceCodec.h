@@ -0,0 +1,50 @@
+#ifndef PIECE_CODEC_H
+#define PIECE_CODEC_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// A piece as it goes on the wire. RAW pieces are sent straight from the
+// file and carry no data here
+struct CodedPiece {
+    uint16_t codec;
+    std::string data;
+};
+
+// Per piece compression for the data plane. Pieces that don't shrink are
+// left RAW, and the codec keeps running averages of how fast it compresses
+// and how much it saves so senders can tell whether a link is slow enough
+// for it to pay off
+class PieceCodec {
+public:
+    enum Id : uint16_t {
+        RAW = 0,
+        DEFLATE = 1,
+    };
+
+    // compresses size bytes at data into piece, RAW when it saves too little
+    void encode(const char* data, size_t size, CodedPiece& piece);
+    // false if data is corrupt or doesn't expand to exactly raw_size bytes
+    static bool decode(uint16_t codec, const char* data, size_t size, char* out, size_t raw_size);
+
+    // whether compressing beats sending raw on a link moving link_rate
+    // bytes per second. Every so often it says yes anyway so the averages
+    // follow the data
+    bool worth_it(double link_rate);
+
+private:
+    static constexpr double MIN_SAVING = 0.125;   // pieces that shrink less go RAW
+    static constexpr size_t PROBE_EVERY = 64;
+
+    std::mutex mutex_;
+    double speed_ = 0;   // ewma of bytes compressed per second, 0 until measured
+    double ratio_ = 1;   // ewma of coded / raw size
+    std::atomic<size_t> declined_{0};
+
+    void record(size_t raw, size_t coded, double seconds);
+};
+
+#endif // PIECE_CODEC_H
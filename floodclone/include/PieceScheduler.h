@@ -0,0 +1,147 @@
+#ifndef PIECE_SCHEDULER_H
+#define PIECE_SCHEDULER_H
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <deque>
+#include <map>
+#include <string_view>
+#include "PieceBitset.h"
+
+class FileManager;
+
+// Decides which pieces a destination asks each of its neighbors for. Every
+// path to a neighbor (one per local interface) gets its own worker that
+// repeatedly claims a batch, requests it and reports back; claims never overlap
+// unless a slow path's tail is re-split to an idle one or the endgame asks for
+// the last pieces on several paths, and pieces already in the FileManager are
+// never handed out. Batches are sized from each path's measured rate, so work
+// spreads across paths in proportion to their throughput. The rate of every
+// busy path is also sampled as its pieces come in, a path that slows down
+// mid batch has what it hasn't delivered yet moved to the others.
+class PieceScheduler {
+public:
+    using Ranges = std::vector<std::pair<size_t, size_t>>;
+
+    PieceScheduler(FileManager& file_manager, size_t num_pieces);
+
+    // upstream peers are closer to the source and can be asked for any piece,
+    // they will relay it once it reaches them, pieces they already hold go
+    // first. Other peers only get pieces they announced (mark_have). A backup
+    // peer only takes over work from peers that stalled, used for the source
+    // when a relay can feed us instead so we don't compete with that relay for
+    // the source's uplink
+    size_t add_peer(const std::string& name, bool upstream, bool has_all, bool backup = false);
+    // pieces the distribution plan routes to us through peer, it can be asked
+    // for them blindly like an upstream peer, it will relay them
+    void assign(size_t peer, PieceBitset pieces);
+    // A connection to peer, label is only used for logging. Paths of one
+    // group are parallel streams over the same link: when one of them stalls
+    // the others take over its oldest batch
+    size_t add_path(size_t peer, const std::string& label, size_t group = NO_GROUP);
+    const std::string& peer_name(size_t peer) const { return peers_[peer].name; }
+    const std::string& path_label(size_t path) const { return paths_[path].label; }
+    // delivered pieces per second, 0 until measured
+    double path_rate(size_t path) const;
+
+    void mark_have(size_t peer, size_t piece);
+    // ors in a BITFIELD snapshot of everything peer holds
+    void merge_have(size_t peer, std::string_view bitfield);
+
+    // Claims the next batch for a path, empty when there is nothing it can serve
+    // right now. Up to PIPELINE_DEPTH batches can be in flight per path so the
+    // link doesn't idle for a round trip between two requests
+    Ranges next_batch(size_t path);
+    // The path delivered its oldest batch
+    void complete(size_t path);
+    // The path turned down its oldest batch (BUSY, NOT_AVAIL...), hand the pieces back
+    void release_oldest(size_t path);
+    // Hand back everything the path has in flight
+    void release(size_t path);
+    // The path is gone for good, the peer goes with its last path
+    void drop_path(size_t path);
+
+    // Sleeps until new work might be available or the timeout expires
+    void wait_for_work(size_t path, std::chrono::milliseconds timeout);
+    bool done() const;
+    bool has_live_peers();
+
+    static constexpr size_t PIPELINE_DEPTH = 2;
+    static constexpr size_t NO_GROUP = static_cast<size_t>(-1);
+
+private:
+    static constexpr size_t MIN_BATCH = 8;
+    static constexpr size_t MAX_BATCH = 1024;
+    static constexpr size_t SCAN_WINDOW = 4096;
+    static constexpr double TARGET_BATCH_SECONDS = 1.0;   // how long a batch should keep a link busy
+    static constexpr double STALL_FACTOR = 3.0;           // a batch this many times late has stalled
+    static constexpr double MIN_STALL_SECONDS = 0.2;
+    static constexpr size_t ENDGAME_MIN = 16;             // pieces left that always count as the endgame
+    static constexpr size_t ENDGAME_FRACTION = 100;       // so does the last 1/this of the file
+    static constexpr uint16_t ENDGAME_COPIES = 3;         // paths one piece is asked for on at most
+    static constexpr double SAMPLE_SECONDS = 0.25;        // between two looks at how far each path got
+    static constexpr size_t DEGRADED_SAMPLES = 4;         // a path is judged on at least this many
+    static constexpr double DEGRADED_FACTOR = 3.0;        // this many times slower than it was has degraded
+    static constexpr double MIN_RATE = 0.5;               // what a degraded path that delivers nothing is taken to do
+
+    struct Peer {
+        std::string name;
+        bool upstream;
+        bool has_all;
+        bool backup;
+        bool alive = true;
+        bool degraded = false;          // its share of the plan went to the source as well
+        PieceBitset have;               // pieces the peer is known to hold
+        PieceBitset assigned;           // pieces the plan has it feed us, empty without a plan
+    };
+
+    struct Path {
+        size_t peer;
+        std::string label;
+        size_t group;
+        bool alive = true;
+        std::deque<std::vector<size_t>> batches;       // in flight, oldest first
+        std::chrono::steady_clock::time_point head_started;  // when the oldest batch started streaming
+        double rate = 0;                // ewma of delivered pieces per second, 0 until measured
+        size_t delivered = 0;           // pieces of its finished batches that came through it
+        size_t sampled = 0;             // delivered plus what it had in hand at the last sample
+        size_t samples = 0;             // taken since it last ran out of work
+        double live_rate = 0;           // ewma of pieces per second over those samples
+    };
+
+    FileManager& file_manager_;
+    size_t num_pieces_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::vector<Peer> peers_;
+    std::vector<Path> paths_;
+    std::vector<int32_t> claimed_by_;      // piece -> path currently fetching it, -1 if none
+    std::vector<uint16_t> requested_;      // piece -> batches in flight it is part of
+    std::vector<uint16_t> availability_;   // piece -> number of peers known to hold it
+    std::map<size_t, size_t> migrated_;    // piece moved off a degraded path -> that path
+    std::chrono::steady_clock::time_point sampled_at_;
+    size_t cursor_ = 0;                    // no unclaimed missing piece before this index
+    size_t reclaimed_seen_ = 0;            // FileManager::reclaimed_pieces() as of the last cursor move
+
+    bool can_serve(const Peer& peer, size_t piece) const;
+    size_t batch_size(const Path& path) const;
+    std::vector<size_t> pick_rarest(size_t path, size_t count);
+    std::vector<size_t> steal(size_t path);
+    std::vector<size_t> endgame(size_t path);
+    std::vector<size_t> take_stalled(size_t path);
+    std::vector<size_t> take_migrated(size_t path, size_t count);
+    size_t in_hand(size_t path) const;
+    void sample_rates();
+    bool degraded(size_t path) const;
+    void migrate(size_t path);
+    void unclaim(size_t path, const std::vector<size_t>& pieces);
+    static Ranges to_ranges(std::vector<size_t> pieces);
+};
+
+#endif // PIECE_SCHEDULER_H
@@ -0,0 +1,67 @@
+#ifndef PIECE_STORE_H
+#define PIECE_STORE_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <cstddef>
+
+// Where a receiver's pieces end up. A piece is received into a buffer the
+// store hands out, checked, and then committed to the output file. The file
+// is preallocated up front and every flush region gets its write-back
+// started as soon as its last piece is committed, so finishing the transfer
+// only waits for the tail instead of the whole file.
+class PieceStore {
+public:
+    enum class Backend {
+        Mmap,     // receive straight into a shared mapping of the file, commit copies nothing
+        Pwrite,   // receive into a pooled buffer, commit pwrites it
+        Direct,   // same with O_DIRECT and aligned buffers, keeps the page cache out of it
+    };
+
+    // throws on names other than mmap, pwrite and direct
+    static Backend parse_backend(const std::string& name);
+
+    // creates path at file_size bytes, truncating it unless keep_contents
+    // (resuming an earlier run). buffer_size is the largest piece, buffers
+    // are handed out for lengths up to it
+    static std::unique_ptr<PieceStore> open(Backend backend, const std::string& path,
+                                            size_t file_size, size_t buffer_size,
+                                            bool keep_contents = false);
+
+    virtual ~PieceStore();
+
+    // fd pieces can be read (and sent) from once committed
+    int fd() const { return read_fd_; }
+
+    // buffer to receive the length bytes at offset into, it goes back with
+    // commit or discard
+    virtual char* acquire(size_t offset, size_t length) = 0;
+    virtual void commit(char* buffer, size_t offset, size_t length) = 0;
+    virtual void discard(char* buffer) = 0;
+
+    // counts bytes towards their flush regions, commit does it itself, bytes
+    // that were already in a kept file are counted by whoever checked them
+    void written(size_t offset, size_t length);
+    // reads committed bytes back
+    void read(char* out, size_t offset, size_t length) const;
+
+    // waits until everything committed so far is on disk
+    void sync();
+    // sync and trim the file to size
+    void finish();
+
+protected:
+    PieceStore(const std::string& path, size_t file_size, int flags, bool keep_contents);
+
+    int fd_;           // what commits go through
+    int read_fd_;      // fd_ unless that one can't be read from normally
+    size_t file_size_;
+
+private:
+    static constexpr size_t FLUSH_REGION = 8 * 1024 * 1024;
+
+    std::unique_ptr<std::atomic<size_t>[]> region_bytes_;
+};
+
+#endif // PIECE_STORE_H
@@ -0,0 +1,71 @@
+#ifndef SEND_SCHEDULER_H
+#define SEND_SCHEDULER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <cstddef>
+
+// Shares each of our interfaces between the connections sending pieces
+// through it, deficit round robin style. Every round a connection with
+// pieces queued may write quantum * weight bytes, once all of them used up
+// their turn (or can't write because their socket is full) the next round
+// starts. A request that comes in while others are being served joins the
+// round instead of being turned away, so no peer has to retry.
+//
+// The weight is what the policy makes of the receiver:
+//  - FAIR      every connection the same
+//  - FASTEST   in proportion to how fast it drains, against the others on the interface
+//  - FANOUT    1 + the nodes that get pieces through it, relays first
+//
+// Only the epoll thread uses it, nothing is locked.
+class SendScheduler {
+public:
+    enum class Policy { FAIR, FASTEST, FANOUT };
+    static Policy parse_policy(const std::string& name);
+
+    void set_policy(Policy policy) { policy_ = policy; }
+    // nodes downstream of whoever connects from address
+    void set_fanout(const std::string& address, size_t nodes) { fanout_[address] = nodes; }
+
+    void add(int fd, const std::string& interface, const std::string& peer);
+    void remove(int fd);
+    // bytes per second the connection drained lately
+    void set_rate(int fd, double rate);
+
+    // Bytes fd may write now, 0 until its next turn. Asking marks it as
+    // having something to send
+    size_t allowance(int fd);
+    void charge(int fd, size_t bytes);
+    void blocked(int fd);      // its socket buffer is full
+    void idle(int fd);         // nothing left to send
+
+    // connections a new round gave a turn, they have to be serviced
+    std::vector<int> take_woken();
+
+private:
+    static constexpr size_t QUANTUM = 256 * 1024;
+    static constexpr double MIN_WEIGHT = 0.25;
+    static constexpr double MAX_WEIGHT = 8;
+
+    struct Flow {
+        std::string interface;
+        std::string peer;
+        double rate = 0;
+        size_t deficit = 0;
+        bool backlogged = false;
+        bool blocked = false;
+    };
+
+    Policy policy_ = Policy::FANOUT;
+    std::unordered_map<int, Flow> flows_;
+    std::map<std::string, std::vector<int>> interfaces_;   // interface -> its flows
+    std::unordered_map<std::string, size_t> fanout_;
+    std::vector<int> woken_;
+
+    double weight(const Flow& flow) const;
+    void next_round(const std::string& interface);
+};
+
+#endif // SEND_SCHEDULER_H
@@ -0,0 +1,117 @@
+#ifndef SOCKET_TUNER_H
+#define SOCKET_TUNER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <mutex>
+#include <chrono>
+#include <optional>
+#include <cstdint>
+#include <cstddef>
+
+// Tunes our TCP connections from what the kernel measures on them, so a
+// deployment doesn't need its sysctls set by hand. What is learned is kept
+// per peer address, every connection to that peer gets it from the start.
+//
+//  - buffers grow to a few times the measured bandwidth delay product, they
+//    are never shrunk below what the kernel's own autotuning got to
+//  - serving sockets keep little unsent data in the kernel so pieces wait in
+//    our queue where they can still go elsewhere
+//  - the sender picks the congestion control: bbr on lossy or long fat
+//    paths where loss based ones back off for nothing, the kernel default
+//    everywhere else
+class SocketTuner {
+public:
+    enum Role {
+        REQUESTING,   // we mostly receive on it
+        SERVING,      // we mostly send on it
+    };
+
+    // What TCP_INFO says about a connection
+    struct Sample {
+        double rtt = 0;              // seconds, smoothed, from what we send
+        double rcv_rtt = 0;          // seconds, the receiver's estimate, 0 if it has none
+        double delivery_rate = 0;    // bytes per second the peer acked lately
+        size_t cwnd = 0;             // bytes
+        uint32_t retransmits = 0;    // segments over the connection's lifetime
+        uint64_t segs_out = 0;
+        uint64_t bytes_received = 0;
+        size_t sndbuf = 0;           // bytes usable, without the kernel's overhead
+        size_t rcvbuf = 0;
+    };
+
+    // What the tuner settled on for a peer
+    struct Choice {
+        std::string peer;
+        double rtt = 0;              // seconds
+        double rate = 0;             // bytes per second
+        double loss = 0;             // share of segments retransmitted
+        std::string congestion;      // in use on the last connection tuned, empty if never looked at
+        size_t buffer = 0;           // bytes buffers were sized to, 0 if left to the kernel
+        size_t lowat = 0;            // TCP_NOTSENT_LOWAT on serving sockets, 0 if unset
+    };
+
+    SocketTuner();
+
+    // a fresh socket to or from peer, before connect() for our own
+    void configure(int fd, const std::string& peer, Role role);
+    // measures the connection and retunes it, at most every UPDATE_MS per socket
+    void update(int fd);
+    void forget(int fd);
+
+    static std::optional<Sample> sample(int fd);
+    std::vector<Choice> choices() const;
+
+    // buffer for a path moving rate bytes per second over rtt seconds, 0
+    // until both are measured
+    static size_t buffer_for(double rate, double rtt);
+    // TCP_NOTSENT_LOWAT for a serving socket on a path moving rate
+    static size_t lowat_for(double rate);
+
+private:
+    static constexpr int UPDATE_MS = 200;
+    static constexpr double BDP_FACTOR = 2.0;                 // buffers this many bdps deep
+    static constexpr size_t MIN_BUFFER = 128 * 1024;
+    static constexpr size_t MAX_BUFFER = 64 * 1024 * 1024;
+    static constexpr double LOWAT_SECONDS = 0.005;            // unsent data the kernel may hold, in time at the path rate
+    static constexpr size_t MIN_LOWAT = 128 * 1024;
+    static constexpr size_t MAX_LOWAT = 4 * 1024 * 1024;
+    static constexpr double LOSSY = 0.01;                     // retransmitted share past which a path counts as lossy
+    static constexpr double LONG_FAT_BDP = 4.0 * 1024 * 1024; // bytes in flight past which a path counts as long and fat
+
+    struct Path {
+        double rtt = 0;
+        double rate = 0;
+        double loss = 0;
+        std::string congestion;   // what we switched the path to, empty for the default
+        std::string in_use;       // what the kernel reported last
+        size_t buffer = 0;
+        size_t lowat = 0;
+    };
+
+    struct Socket {
+        std::string peer;
+        Role role;
+        std::chrono::steady_clock::time_point updated;
+        uint32_t retransmits = 0;
+        uint64_t segs_out = 0;
+        uint64_t bytes_received = 0;
+    };
+
+    std::set<std::string> congestion_available_;
+    size_t rmem_max_ = 0;
+    size_t wmem_max_ = 0;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Path> paths_;
+    std::unordered_map<int, Socket> sockets_;
+
+    void apply(int fd, Role role, Path& path);
+    bool grow_buffer(int fd, int option, int force_option, size_t limit, size_t bytes);
+    static std::string congestion(int fd);
+};
+
+#endif // SOCKET_TUNER_H
@@ -2,31 +2,196 @@
 #define TRHEADPOOL_H
 
 #include <thread>
-#include <queue>
+#include <vector>
+#include <memory>
 #include <mutex>
 #include <condition_variable>
 #include <functional>
 #include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
 
+// Move only callable with inline storage, tasks that capture a few pointers
+// and indices (all of ours) are submitted without touching the heap
+class Task {
+public:
+    static constexpr size_t INLINE_SIZE = 48;
+
+    Task() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F&& f) {
+        using Fn = std::decay_t<F>;
+        if constexpr (sizeof(Fn) <= INLINE_SIZE && alignof(Fn) <= alignof(std::max_align_t)
+                      && std::is_nothrow_move_constructible_v<Fn>) {
+            new (storage_) Fn(std::forward<F>(f));
+            ops_ = &inline_ops<Fn>;
+        } else {
+            // too big to fit, keep a pointer to it instead
+            new (storage_) Fn*(new Fn(std::forward<F>(f)));
+            ops_ = &heap_ops<Fn>;
+        }
+    }
+
+    Task(Task&& other) noexcept : ops_(other.ops_) {
+        if (ops_) {
+            ops_->move(storage_, other.storage_);
+            other.ops_ = nullptr;
+        }
+    }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            ops_ = other.ops_;
+            if (ops_) {
+                ops_->move(storage_, other.storage_);
+                other.ops_ = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() { reset(); }
+
+    void operator()() { ops_->call(storage_); }
+    explicit operator bool() const { return ops_ != nullptr; }
+
+private:
+    struct Ops {
+        void (*call)(void*);
+        void (*move)(void* dst, void* src);   // move constructs into dst and destroys src
+        void (*destroy)(void*);
+    };
+
+    template <typename Fn>
+    static constexpr Ops inline_ops = {
+        [](void* p) { (*static_cast<Fn*>(p))(); },
+        [](void* dst, void* src) {
+            new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+            static_cast<Fn*>(src)->~Fn();
+        },
+        [](void* p) { static_cast<Fn*>(p)->~Fn(); },
+    };
+
+    template <typename Fn>
+    static constexpr Ops heap_ops = {
+        [](void* p) { (**static_cast<Fn**>(p))(); },
+        [](void* dst, void* src) { new (dst) Fn*(*static_cast<Fn**>(src)); },
+        [](void* p) { delete *static_cast<Fn**>(p); },
+    };
+
+    void reset() {
+        if (ops_) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage_[INLINE_SIZE];
+    const Ops* ops_ = nullptr;
+};
+
+// Every worker owns a deque per priority. Tasks submitted from a worker go
+// to its own deque, tasks from other threads (epoll, downloaders) are spread
+// round robin, and a worker that runs dry steals from the back of the others.
+// Workers always drain every High task they can find before Normal ones and
+// Normal before Background. High is the receive side: landing a piece
+// (decompress, verify, write) and decoding fountain symbols, they hold
+// buffers and gate what we can relay. Serving (compressing, encoding
+// symbols) is Normal, splitting the source and saving progress Background.
 class ThreadPool {
 public:
+    enum class Priority { High = 0, Normal = 1, Background = 2 };
+
     ThreadPool(size_t threads);
     ~ThreadPool();
-    void enqueue(std::function<void()> task);
+
+    template <typename F>
+    void enqueue(F&& task, Priority priority = Priority::Normal) {
+        push(Task(std::forward<F>(task)), priority);
+    }
+
     void join();
-    void wait(); // waits until task ueue is empty
+    void wait(); // waits until every queued and running task is done
+
+    size_t size() const { return workers.size(); }
+    size_t backlog() const { return queued.load(); }   // tasks waiting for a worker
 
 private:
+    static constexpr size_t PRIORITIES = 3;
+
+    // Growable ring buffer, unlike std::deque it stops allocating once it
+    // reached the pool's working size
+    class TaskQueue {
+    public:
+        bool empty() const { return count_ == 0; }
+
+        void push_back(Task&& task) {
+            if (count_ == slots_.size()) grow();
+            slots_[(head_ + count_) & (slots_.size() - 1)] = std::move(task);
+            count_++;
+        }
+
+        Task pop_front() {
+            Task task = std::move(slots_[head_]);
+            head_ = (head_ + 1) & (slots_.size() - 1);
+            count_--;
+            return task;
+        }
+
+        Task pop_back() {
+            count_--;
+            return std::move(slots_[(head_ + count_) & (slots_.size() - 1)]);
+        }
+
+    private:
+        std::vector<Task> slots_;   // size is always a power of two
+        size_t head_ = 0;
+        size_t count_ = 0;
+
+        void grow() {
+            std::vector<Task> bigger(slots_.empty() ? 64 : slots_.size() * 2);
+            for (size_t i = 0; i < count_; ++i) {
+                bigger[i] = std::move(slots_[(head_ + i) & (slots_.size() - 1)]);
+            }
+            slots_.swap(bigger);
+            head_ = 0;
+        }
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        TaskQueue queues[PRIORITIES];
+        std::atomic<size_t> sizes[PRIORITIES] = {};   // lets others skip empty deques without locking
+    };
+
+    std::vector<std::unique_ptr<Worker>> queues;
     std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
+    std::atomic<size_t> next_queue{0};   // round robin target for outside submissions
+
+    std::atomic<size_t> queued{0};       // tasks sitting in some deque
+    std::atomic<size_t> queued_by_priority[PRIORITIES] = {};
+    std::atomic<size_t> pending{0};      // queued plus running, for wait()
+    std::atomic<size_t> sleeping{0};
 
-    std::mutex queue_mutex;
+    std::mutex sleep_mutex;
     std::condition_variable condition;
     bool stop;
 
+    std::mutex idle_mutex;
     std::condition_variable idle_condition;
-    std::atomic<int> active_tasks{0};
+
+    void push(Task task, Priority priority);
+    bool pop(size_t self, Task& task);
+    bool take(Worker& worker, size_t priority, bool oldest, Task& task);
+    void run(size_t self);
 };
 
 
-#endif
\ No newline at end of file
+#endif
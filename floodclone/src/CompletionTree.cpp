@@ -0,0 +1,69 @@
+#include "CompletionTree.h"
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+
+CompletionTree::CompletionTree(const std::string& source) : source_(source) {}
+
+void CompletionTree::add_link(const std::string& a, const std::string& b) {
+    links_[a].insert(b);
+    links_[b].insert(a);
+}
+
+void CompletionTree::build(const std::string& node) {
+    node_ = node;
+    parent_.clear();
+    children_.clear();
+
+    std::map<std::string, size_t> hops{{source_, 0}};
+    std::deque<std::string> queue{source_};
+    while (!queue.empty()) {
+        std::string at = queue.front();
+        queue.pop_front();
+        for (const auto& next : links_[at]) {
+            if (hops.emplace(next, hops[at] + 1).second) queue.push_back(next);
+        }
+    }
+    if (!hops.count(node)) {
+        throw std::runtime_error("Node " + node + " can't be reached from " + source_);
+    }
+
+    // neighbors are sorted, the first one a hop closer is the parent
+    auto parent_of = [&](const std::string& of) {
+        for (const auto& neighbor : links_[of]) {
+            if (hops[neighbor] + 1 == hops[of]) return neighbor;
+        }
+        return std::string();
+    };
+    if (node != source_) parent_ = parent_of(node);
+    for (const auto& neighbor : links_[node]) {
+        if (hops.count(neighbor) && hops[neighbor] == hops[node] + 1 && parent_of(neighbor) == node) {
+            children_.push_back(neighbor);
+        }
+    }
+}
+
+void CompletionTree::finished(int64_t micros) {
+    finish_times_[node_] = micros;
+}
+
+void CompletionTree::receive(const nlohmann::json& message) {
+    std::string type = message.value("type", std::string());
+    if (type == "done") {
+        std::string from = message.value("node", std::string());
+        if (std::find(children_.begin(), children_.end(), from) == children_.end() || !reported_.insert(from).second) {
+            throw std::runtime_error("Unexpected done from " + from);
+        }
+        for (const auto& [node, micros] : message.at("times").items()) {
+            finish_times_[node] = micros.get<int64_t>();
+        }
+    } else if (type == "all_done") {
+        all_done_ = true;
+    } else {
+        throw std::runtime_error("Unknown completion message " + message.dump());
+    }
+}
+
+nlohmann::json CompletionTree::done_message() const {
+    return {{"type", "done"}, {"node", node_}, {"times", finish_times_}};
+}
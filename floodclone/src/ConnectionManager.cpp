@@ -10,8 +10,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/eventfd.h> 
+#include <sys/sendfile.h>
+#include <csignal>
+#include <ifaddrs.h>
 #include <set>
 #include <shared_mutex>
+#include <algorithm>
 
 
 
@@ -32,8 +36,11 @@ void ConnectionManager::stop_listening() {
     isListening_ = false;
     
     // Wake up epoll_wait
-    uint64_t value = 1;
-    write(wake_fd_, &value, sizeof(value));
+    std::lock_guard<std::mutex> lock(ready_mutex_);
+    if (wake_fd_ >= 0) {
+        uint64_t value = 1;
+        write(wake_fd_, &value, sizeof(value));
+    }
 }
 
 void ConnectionManager::start_listening() {
@@ -47,6 +54,11 @@ void ConnectionManager::start_listening() {
         throw std::runtime_error("Failed to create socket");
     }
 
+    // we close served connections ourselves on shutdown, don't let their
+    // TIME_WAIT keep the port from being reused right away
+    int reuse = 1;
+    setsockopt(listeningSocket_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     sockaddr_in serverAddress;
     serverAddress.sin_family = AF_INET;
     serverAddress.sin_port = htons(localPort_);
@@ -98,13 +110,15 @@ void ConnectionManager::start_listening() {
     }
 
 
+    // a peer hanging up mid send must not kill us, writes fail with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    epoll_fd_ = epoll_fd;
     isListening_ = true;
     const int MAX_EVENTS = 32;
     struct epoll_event events[MAX_EVENTS];
 
     while (isListening_) {
-        std::cout << "Listening \n";
-
         int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
         if (nfds == -1) {
             if (errno == EINTR) continue;
@@ -115,74 +129,491 @@ void ConnectionManager::start_listening() {
             int fd = events[n].data.fd;
 
             if (fd == wake_fd_) {
-                // Just drain the eventfd
+                // either we are stopping or relayed pieces landed for a request
                 uint64_t value;
                 read(wake_fd_, &value, sizeof(value));
-                std::cout << "Stopping \n";
+                drain_ready();
                 continue;
             }
             else if (fd == listeningSocket_) {
-                // Handle new connection
-                struct sockaddr_in peer_addr;
-                socklen_t peer_addr_len = sizeof(peer_addr);
-                struct sockaddr_in local_addr;
-                socklen_t local_addr_len = sizeof(local_addr);
-    
-                int clientSocket = accept(listeningSocket_, 
-                            (struct sockaddr*)&peer_addr, 
-                            &peer_addr_len);
-
-                if (clientSocket >= 0) {
-                    std::cout << "New connection accepted: " << clientSocket << "\n" << std::flush;
-
-                    if (getsockname(clientSocket, (struct sockaddr*)&local_addr, &local_addr_len) == 0) {
-                        std::string local_ip = inet_ntoa(local_addr.sin_addr);
-                        // Use the IP directly as our interface identifier
-                        // to store which interfaces are being used for outward 
-                        update_inter(clientSocket, local_ip);
-                    }
-
-                    
-                    // Add new socket to epoll with EPOLLONESHOT
-                    struct epoll_event client_ev;
-                    client_ev.events = EPOLLIN | EPOLLONESHOT;
-                    client_ev.data.fd = clientSocket;
-                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, clientSocket, &client_ev) == -1) {
-                        close(clientSocket);
-                        std::cerr << "Failed to add client to epoll" << std::endl;
-                    }
-                }
+                accept_connection();
+            } else if ((events[n].events & (EPOLLHUP | EPOLLERR)) && !(events[n].events & EPOLLIN)) {
+                // Socket closed or error, a hangup that comes with data is
+                // noticed when the read fails
+                close_served(fd);
             } else {
-                if (events[n].events & EPOLLIN) {
-                    // Data available to read
-                    threadPool_.enqueue([this, fd, epoll_fd]() {
-                        // std::cout << "Adding task from " << fd <<"\n";
-                        process_request(fd);
-                        
-                        // Re-arm the socket after processing
-                        struct epoll_event client_ev;
-                        client_ev.events = EPOLLIN | EPOLLONESHOT;
-                        client_ev.data.fd = fd;
-                        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &client_ev);
-                    });
-                }
-                
-                if (events[n].events & (EPOLLHUP | EPOLLERR)) {
-                    // Socket closed or error
-                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
-                    close(fd);
-                }
+                service(fd);
             }
         }
+        service_woken();
+    }
+    std::cout << "Stopping \n";
+
+    std::vector<int> open_fds;
+    for (const auto& [fd, state] : serving_) {
+        open_fds.push_back(fd);
+    }
+    for (int fd : open_fds) {
+        close_served(fd);
     }
 
-    close(wake_fd_);
+    {
+        // late piece callbacks must not write to a closed (maybe reused) fd
+        std::lock_guard<std::mutex> lock(ready_mutex_);
+        close(wake_fd_);
+        wake_fd_ = -1;
+        ready_.clear();
+        ready_symbols_.clear();
+    }
     close(epoll_fd);
+    epoll_fd_ = -1;
     close(listeningSocket_);
 }
 
-int ConnectionManager::connect_to(const std::string& destAddress, int destPort, int max_attempts) {
-    auto key = std::make_pair(destAddress, destPort);
+void ConnectionManager::accept_connection() {
+    struct sockaddr_in peer_addr;
+    socklen_t peer_addr_len = sizeof(peer_addr);
+    struct sockaddr_in local_addr;
+    socklen_t local_addr_len = sizeof(local_addr);
+
+    int clientSocket = accept4(listeningSocket_, (struct sockaddr*)&peer_addr, &peer_addr_len, SOCK_NONBLOCK);
+    if (clientSocket < 0) return;
+
+    Metrics::count(Metrics::CONNECTIONS_ACCEPTED);
+    tuner_.configure(clientSocket, inet_ntoa(peer_addr.sin_addr), SocketTuner::SERVING);
+
+    // the address the peer reached us on stands for our interface, every
+    // connection on it shares its sending
+    std::string local_ip;
+    if (getsockname(clientSocket, (struct sockaddr*)&local_addr, &local_addr_len) == 0) {
+        local_ip = inet_ntoa(local_addr.sin_addr);
+    }
+
+    // level triggered, update_events switches between reading requests and
+    // waiting for the socket to drain
+    struct epoll_event client_ev;
+    client_ev.events = EPOLLIN;
+    client_ev.data.fd = clientSocket;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, clientSocket, &client_ev) == -1) {
+        std::cerr << "Failed to add client to epoll" << std::endl;
+        tuner_.forget(clientSocket);
+        close(clientSocket);
+        return;
+    }
+    sender_.add(clientSocket, local_ip, inet_ntoa(peer_addr.sin_addr));
+
+    ServeState& state = serving_[clientSocket];
+    state.id = next_serve_id_++;
+    state.peer = inet_ntoa(peer_addr.sin_addr);
+    state.interface = metrics_interface(clientSocket);
+    state.events = EPOLLIN;
+}
+
+// Moves a connection as far along as it can go without blocking: read
+// requests while idle, push queued responses out, and once a piece request
+// is fully answered start on the next one
+void ConnectionManager::service(int fd) {
+    auto it = serving_.find(fd);
+    if (it == serving_.end()) return;
+    ServeState& state = it->second;
+
+    try {
+        while (true) {
+            read_requests(fd, state);
+            flush(fd, state);
+            // a subscription is topped up whenever the socket took all it had
+            if (state.out.empty() && push_pieces(fd, state)) continue;
+            if (state.serving && !state.subscribed && !state.encoding && state.out.empty()) {
+                state.serving = false;
+                continue;
+            }
+            // answers that went out may have made room for the request put aside
+            if (state.next && can_start(state, state.next->header)) continue;
+            break;
+        }
+        update_events(fd, state);
+    } catch (const std::exception& e) {
+        // peer went away mid request, drop the connection
+        std::cerr << "Closing connection " << fd << ": " << e.what() << "\n";
+        close_served(fd);
+    }
+}
+
+// Reads whatever part of the next requests has arrived. Up to MAX_OPEN
+// piece requests are answered side by side, anything else one at a time.
+// A request that can't start yet is read and put aside, the rest stay in
+// the socket which also pushes back on a client that floods us. Reading
+// goes on behind it so a CANCEL_REQ or CREDIT_REQ is acted on right away,
+// as long as the client doesn't have more than MAX_OPEN + 1 requests out
+void ConnectionManager::read_requests(int fd, ServeState& state) {
+    if (state.next && can_start(state, state.next->header)) {
+        // whatever got read since may be half in, it waits while the queued one starts
+        std::swap(state.header, state.next->header);
+        std::swap(state.payload, state.next->payload);
+        start_request(fd, state);
+        std::swap(state.header, state.next->header);
+        std::swap(state.payload, state.next->payload);
+        state.next.reset();
+        state.cancelled.clear();
+    }
+
+    while (true) {
+        char* target;
+        size_t wanted;
+        if (state.header_read < sizeof(RequestHeader)) {
+            target = reinterpret_cast<char*>(&state.header) + state.header_read;
+            wanted = sizeof(RequestHeader) - state.header_read;
+        } else if (state.payload_read < state.payload.size()) {
+            target = state.payload.data() + state.payload_read;
+            wanted = state.payload.size() - state.payload_read;
+        } else if (state.header.type == CANCEL_REQ) {
+            state.header_read = 0;
+            serve_cancel_request(state);
+            continue;
+        } else if (state.header.type == CREDIT_REQ) {
+            state.header_read = 0;
+            state.credit = (state.credit == SIZE_MAX ? 0 : state.credit) + state.header.pieceIndex;
+            continue;
+        } else if (!state.next && can_start(state, state.header)) {
+            // full request in, get ready for the next one
+            state.header_read = 0;
+            start_request(fd, state);
+            continue;
+        } else if (!state.next) {
+            state.next = QueuedRequest{state.header, std::move(state.payload)};
+            state.header_read = 0;
+            state.payload.clear();
+            continue;
+        } else {
+            return;
+        }
+
+        ssize_t received = recv(fd, target, wanted, 0);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            throw std::runtime_error("Failed to receive data from socket");
+        }
+        if (received == 0) {
+            throw std::runtime_error("Connection closed by peer");
+        }
+
+        if (state.header_read < sizeof(RequestHeader)) {
+            state.header_read += received;
+            if (state.header_read == sizeof(RequestHeader)) {
+                if (state.header.payloadSize > max_payload(state.header.type)) {
+                    throw std::runtime_error("Request payload too large");
+                }
+                state.payload.assign(state.header.payloadSize, 0);
+                state.payload_read = 0;
+            }
+        } else {
+            state.payload_read += received;
+        }
+    }
+}
+
+size_t ConnectionManager::max_payload(uint16_t type) const {
+    size_t pieces = fileManager_ ? fileManager_->num_pieces : 0;
+    switch (type) {
+        case SYMBOL_REQ:
+            return sizeof(uint64_t);
+        case PIECE_REQ:
+            // types, a single piece, then every piece as a range and in the list
+            return sizeof(uint32_t) + 3 * sizeof(size_t) + pieces * 3 * sizeof(size_t);
+        case SUBSCRIBE_REQ:
+            return PieceBitset::byte_size(pieces);
+        case CANCEL_REQ:
+            return pieces * sizeof(uint64_t);
+        default:
+            return 0;
+    }
+}
+
+bool ConnectionManager::can_start(const ServeState& state, const RequestHeader& header) {
+    if (state.serving) return false;
+    // piece answers carry their request's id, other answers don't mix
+    if (header.type == PIECE_REQ) return state.open.size() < MAX_OPEN;
+    return state.open.empty();
+}
+
+void ConnectionManager::start_request(int fd, ServeState& state) {
+    switch (state.header.type) {
+        case META_REQ:
+            serve_meta_request(state);
+            break;
+        case PIECE_REQ:
+            serve_piece_request(fd, state);
+            break;
+        case WATCH_REQ:
+            serve_watch_request(state);
+            break;
+        case SYMBOL_REQ:
+            serve_symbol_request(fd, state);
+            break;
+        case SUBSCRIBE_REQ:
+            serve_subscribe_request(state);
+            break;
+        default:
+            std::cout << "Unkown request: " << state.header.type;
+            throw std::runtime_error("Unknown request type");
+    }
+}
+
+// Pins a socket to one of our interfaces: SO_BINDTODEVICE picks the egress
+// device (needs CAP_NET_RAW, skipped without it) and binding the interface's
+// address makes the peer see which of our links the connection uses
+void ConnectionManager::bind_to_interface(int sock, const std::string& localInterface) {
+    if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, localInterface.c_str(), localInterface.size()) < 0
+        && errno != EPERM) {
+        std::cerr << "Failed to bind socket to device " << localInterface << ": " << strerror(errno) << "\n";
+    }
+
+    struct ifaddrs* addrs = nullptr;
+    if (getifaddrs(&addrs) < 0) return;
+    for (struct ifaddrs* it = addrs; it != nullptr; it = it->ifa_next) {
+        if (it->ifa_addr == nullptr || it->ifa_addr->sa_family != AF_INET) continue;
+        if (localInterface != it->ifa_name) continue;
+
+        sockaddr_in localAddress;
+        std::memcpy(&localAddress, it->ifa_addr, sizeof(localAddress));
+        localAddress.sin_port = 0;
+        if (bind(sock, reinterpret_cast<sockaddr*>(&localAddress), sizeof(localAddress)) < 0) {
+            std::cerr << "Failed to bind socket to " << localInterface << ": " << strerror(errno) << "\n";
+        }
+        break;
+    }
+    freeifaddrs(addrs);
+}
+
+std::string ConnectionManager::route_interface(const std::string& destAddress) {
+    // connecting a UDP socket sends nothing but runs the route lookup
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) return "";
+
+    sockaddr_in dest;
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(9);
+    sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    if (inet_pton(AF_INET, destAddress.c_str(), &dest.sin_addr) <= 0
+        || connect(sock, reinterpret_cast<sockaddr*>(&dest), sizeof(dest)) < 0
+        || getsockname(sock, reinterpret_cast<sockaddr*>(&local), &local_len) < 0) {
+        close(sock);
+        return "";
+    }
+    close(sock);
+    return interface_with(local);
+}
+
+std::string ConnectionManager::interface_with(const sockaddr_in& address) {
+    std::string name;
+    struct ifaddrs* addrs = nullptr;
+    if (getifaddrs(&addrs) < 0) return "";
+    for (struct ifaddrs* it = addrs; it != nullptr; it = it->ifa_next) {
+        if (it->ifa_addr == nullptr || it->ifa_addr->sa_family != AF_INET) continue;
+        if (reinterpret_cast<sockaddr_in*>(it->ifa_addr)->sin_addr.s_addr == address.sin_addr.s_addr) {
+            name = it->ifa_name;
+            break;
+        }
+    }
+    freeifaddrs(addrs);
+    return name;
+}
+
+// Bytes are counted per local interface, by name where we can find it
+size_t ConnectionManager::metrics_interface(int sock) {
+    sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    if (getsockname(sock, reinterpret_cast<sockaddr*>(&local), &local_len) < 0) {
+        return Metrics::interface_index("unknown");
+    }
+    std::string name = interface_with(local);
+    return Metrics::interface_index(name.empty() ? inet_ntoa(local.sin_addr) : name);
+}
+
+// the one place REQUEST_FIRST_BYTE_US is recorded, for piece and symbol
+// requests alike. inFlightMutex_ held
+void ConnectionManager::answer_started(AskedRequest& asked) {
+    if (asked.started) return;
+    asked.started = true;
+    Metrics::record_since(Metrics::REQUEST_FIRST_BYTE_US, asked.sent);
+}
+
+// symbol requests are answered in order, the first header is the oldest's
+void ConnectionManager::symbols_answered(int sock) {
+    std::lock_guard<std::mutex> lock(inFlightMutex_);
+    auto flow = flows_.find(sock);
+    if (flow == flows_.end() || flow->second.requests.empty()) return;
+    answer_started(flow->second.requests.front());
+    flow->second.requests.pop_front();
+}
+
+ConnectionManager::ClientFlow& ConnectionManager::client_flow(int sock) {
+    auto it = flows_.find(sock);
+    if (it == flows_.end()) {
+        it = flows_.emplace(sock, ClientFlow{}).first;
+        it->second.generation = next_generation_++;
+    }
+    return it->second;
+}
+
+void ConnectionManager::untrack(int sock, size_t piece) {
+    auto it = inFlight_.find(piece);
+    if (it == inFlight_.end()) return;
+    auto& socks = it->second;
+    auto found = std::find(socks.begin(), socks.end(), sock);
+    if (found != socks.end()) socks.erase(found);
+    if (socks.empty()) inFlight_.erase(it);
+}
+
+void ConnectionManager::piece_answered(int sock, uint32_t request, size_t piece) {
+    std::lock_guard<std::mutex> lock(inFlightMutex_);
+    auto flow = flows_.find(sock);
+    if (flow == flows_.end()) return;
+    for (auto& asked : flow->second.requests) {
+        if (asked.id != request) continue;
+        answer_started(asked);
+        auto it = asked.pieces.find(piece);
+        if (it == asked.pieces.end()) return;
+        asked.pieces.erase(it);
+        untrack(sock, piece);
+        return;
+    }
+}
+
+// whatever of it didn't come won't, the pieces are someone else's to ask for
+void ConnectionManager::request_refused(int sock, uint32_t request, const std::string& reason) {
+    std::lock_guard<std::mutex> lock(inFlightMutex_);
+    auto flow = flows_.find(sock);
+    if (flow == flows_.end()) return;
+    for (auto& asked : flow->second.requests) {
+        if (asked.id != request) continue;
+        for (size_t idx : asked.pieces) {
+            untrack(sock, idx);
+        }
+        asked.pieces.clear();
+        asked.refused = reason;
+        return;
+    }
+}
+
+void ConnectionManager::forget_requests(int sock) {
+    std::unique_lock<std::mutex> lock(inFlightMutex_);
+    auto flow = flows_.find(sock);
+    if (flow == flows_.end()) return;
+    if (flow->second.sending > 0) {
+        // a send stuck on a full buffer fails once the socket is shut down
+        shutdown(sock, SHUT_RDWR);
+        controlSent_.wait(lock, [&] { return flows_.at(sock).sending == 0; });
+        flow = flows_.find(sock);
+    }
+    for (const auto& asked : flow->second.requests) {
+        for (size_t idx : asked.pieces) {
+            untrack(sock, idx);
+        }
+    }
+    // pieces of it still on the pool find the generation gone
+    flows_.erase(flow);
+}
+
+// Runs on the pool once a piece we received is verified or thrown away
+void ConnectionManager::piece_processed(size_t piece) {
+    int sock;
+    size_t grant;
+    {
+        std::lock_guard<std::mutex> lock(inFlightMutex_);
+        auto it = processing_.find(piece);
+        if (it == processing_.end()) return;
+        uint64_t generation;
+        std::tie(sock, generation) = it->second;
+        processing_.erase(it);
+
+        auto flow = flows_.find(sock);
+        if (flow == flows_.end() || flow->second.generation != generation) return;
+        grant = credit_due(flow->second);
+    }
+    if (grant > 0) send_credit(sock, grant);
+}
+
+// The window grows by a piece for every piece processed while the pool
+// keeps up and shrinks the same way while work queues up for it, so a fast
+// peer can't bury us in pieces we can't verify or relay yet. Credit goes
+// back in batches of a quarter window, the peer always has some left while
+// the rest is on its way
+size_t ConnectionManager::credit_due(ClientFlow& flow) {
+    flow.processed++;
+    if (threadPool_.backlog() > threadPool_.size()) {
+        flow.window = std::max(MIN_CREDIT, flow.window - 1);
+    } else {
+        flow.window = std::min(MAX_CREDIT, flow.window + 1);
+    }
+
+    size_t outstanding = flow.granted > flow.processed ? flow.granted - flow.processed : 0;
+    if (flow.granted == 0 || outstanding >= flow.window) return 0;
+    size_t grant = flow.window - outstanding;
+    if (grant < std::max<size_t>(1, flow.window / 4)) return 0;
+
+    // counted as given right away so a second return doesn't grant it again
+    flow.granted += grant;
+    flow.sending++;
+    return grant;
+}
+
+void ConnectionManager::send_credit(int sock, size_t grant) {
+    RequestHeader header = {CREDIT_REQ, 0, grant};
+    bool sent = true;
+    try {
+        send_all(sock, std::string_view(reinterpret_cast<const char*>(&header), sizeof(header)));
+    } catch (const std::runtime_error&) {
+        // the worker reading the connection finds out itself
+        sent = false;
+    }
+
+    std::lock_guard<std::mutex> lock(inFlightMutex_);
+    ClientFlow& flow = flows_.at(sock);
+    if (!sent) flow.granted -= grant;
+    flow.sending--;
+    controlSent_.notify_all();
+}
+
+// Runs on whichever thread landed the piece. A cancel that can't be sent
+// is left alone, the worker reading that connection finds out itself
+void ConnectionManager::cancel_duplicates(size_t piece) {
+    std::set<int> socks;
+    {
+        std::lock_guard<std::mutex> lock(inFlightMutex_);
+        auto it = inFlight_.find(piece);
+        if (it == inFlight_.end()) return;
+        for (int sock : it->second) {
+            // every connection a piece is asked for on has a flow
+            if (socks.insert(sock).second) flows_.at(sock).sending++;
+        }
+    }
+
+    uint64_t value = piece;
+    RequestHeader header = {CANCEL_REQ, sizeof(value), 1};
+    std::vector<char> message = header.serialize();
+    message.insert(message.end(), reinterpret_cast<const char*>(&value),
+                   reinterpret_cast<const char*>(&value) + sizeof(value));
+    for (int sock : socks) {
+        try {
+            send_all(sock, std::string_view(message.data(), message.size()));
+            Metrics::count(Metrics::CANCELS_SENT);
+        } catch (const std::runtime_error&) {
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(inFlightMutex_);
+    for (int sock : socks) {
+        flows_.at(sock).sending--;
+    }
+    controlSent_.notify_all();
+}
+
+int ConnectionManager::connect_to(const std::string& destAddress, int destPort, int max_attempts,
+                                  const std::string& localInterface, size_t stream) {
+    auto key = std::make_tuple(destAddress, destPort, localInterface, stream);
     
     {
         std::lock_guard<std::mutex> lock(connectionMapMutex_);
@@ -192,6 +623,21 @@ int ConnectionManager::connect_to(const std::string& destAddress, int destPort,
         }
     }
 
+    int sock = open_connection(destAddress, destPort, max_attempts, localInterface);
+    if (sock >= 0) {
+        {
+            std::lock_guard<std::mutex> lock(clientStatsMutex_);
+            clientStats_[sock] = ClientStats{metrics_interface(sock)};
+        }
+        std::lock_guard<std::mutex> lock(connectionMapMutex_);
+        connectionMap_[key] = sock;
+    }
+    return sock;
+}
+
+// A fresh connection that isn't shared through connectionMap_
+int ConnectionManager::open_connection(const std::string& destAddress, int destPort, int max_attempts,
+                                       const std::string& localInterface) {
     // Keep trying until successful - assuming all nodes must eventually come online
     // Note: This assumes no permanent node failures, only delayed starts
     int attempt = 1;
@@ -201,6 +647,10 @@ int ConnectionManager::connect_to(const std::string& destAddress, int destPort,
             throw std::runtime_error("Failed to create socket");
         }
 
+        if (!localInterface.empty()) {
+            bind_to_interface(sock, localInterface);
+        }
+
         sockaddr_in serverAddress;
         serverAddress.sin_family = AF_INET;
         serverAddress.sin_port = htons(destPort);
@@ -209,33 +659,37 @@ int ConnectionManager::connect_to(const std::string& destAddress, int destPort,
             throw std::runtime_error("Invalid address format");
         }
 
+        // buffers have to be set before connect to count for the window scale
+        tuner_.configure(sock, destAddress, SocketTuner::REQUESTING);
         if (connect(sock, reinterpret_cast<sockaddr*>(&serverAddress), sizeof(serverAddress)) < 0) {
             std::string error_msg = strerror(errno);  // Get human readable error
+            tuner_.forget(sock);
             close(sock);
-            std::cout << "Connection attempt " << attempt << " failed to " 
-                    << destAddress << ":" << destPort 
-                    << " - Error: " << error_msg 
-                    << " (errno: " << errno << ")\n" << std::flush;
+            Metrics::count(Metrics::CONNECT_FAILURES);
+            // peers come up at their own pace, every retry would flood the log
+            if (attempt == 1) {
+                std::cout << "Connection attempt " << attempt << " failed to " 
+                        << destAddress << ":" << destPort 
+                        << " - Error: " << error_msg 
+                        << " (errno: " << errno << "), retrying\n" << std::flush;
+            }
             std::this_thread::sleep_for(std::chrono::milliseconds(1));
             attempt++;
             continue;
         }
 
-        {
-            std::lock_guard<std::mutex> lock(connectionMapMutex_);
-            connectionMap_[key] = sock;
-        }
-        
         fd_lock(sock);
         std::cout << "Connected to: " << destAddress << ":" << destPort 
+                  << (localInterface.empty() ? "" : " via " + localInterface)
                   << " after " << attempt << " attempts\n";
         return sock;
     }
     return -1;
 }
 
-void ConnectionManager::close_connection(const std::string& destAddress, int destPort) {
-    auto key = std::make_pair(destAddress, destPort);
+void ConnectionManager::close_connection(const std::string& destAddress, int destPort,
+                                         const std::string& localInterface, size_t stream) {
+    auto key = std::make_tuple(destAddress, destPort, localInterface, stream);
     int fd_to_close = -1;
     {
         std::lock_guard<std::mutex> lock(connectionMapMutex_);
@@ -247,19 +701,48 @@ void ConnectionManager::close_connection(const std::string& destAddress, int des
     }
     
     if (fd_to_close != -1) {
+        {
+            std::lock_guard<std::mutex> lock(clientStatsMutex_);
+            clientStats_.erase(fd_to_close);
+        }
+        forget_requests(fd_to_close);
+        tuner_.forget(fd_to_close);
         dfd_lock(fd_to_close);
         close(fd_to_close);
     }
 }
 
-void ConnectionManager::send_all(int fd, const std::string_view& data)  {
+// Only looks at connections already open, nothing is measured on a fresh one
+std::optional<ConnectionManager::StreamInfo> ConnectionManager::stream_info(const std::string& destAddress, int destPort,
+                                                                            const std::string& localInterface, size_t stream) {
+    int sock;
+    {
+        std::lock_guard<std::mutex> lock(connectionMapMutex_);
+        auto it = connectionMap_.find(std::make_tuple(destAddress, destPort, localInterface, stream));
+        if (it == connectionMap_.end()) return std::nullopt;
+        sock = it->second;
+    }
+
+    auto sample = SocketTuner::sample(sock);
+    if (!sample) return std::nullopt;
+
+    StreamInfo result;
+    // we mostly receive, the receiver side estimate is the one that tracks
+    // the data, the plain rtt only sees our small requests
+    result.rtt = sample->rcv_rtt > 0 ? sample->rcv_rtt : sample->rtt;
+    result.window = sample->rcvbuf;
+    return result;
+}
+
+void ConnectionManager::send_all(int fd, const std::string_view& data, int flags)  {
     
     std::lock_guard<std::mutex> lock(fd_lock(fd));
     size_t totalSent = 0;
     while (totalSent < data.size()) {
-        ssize_t sent = send(fd, data.data() + totalSent, data.size() - totalSent, 0);
+        ssize_t sent = send(fd, data.data() + totalSent, data.size() - totalSent, flags);
         
         if (sent < 0) {
+            if (errno == EINTR) continue;
             if (errno == EPIPE) {
                 std::cerr << "Error: SIGPIPE - Peer closed the connection." << std::endl;
                 throw std::runtime_error("Socket closed by peer");
@@ -273,9 +756,9 @@ void ConnectionManager::send_all(int fd, const std::string_view& data)  {
     }
 }
 
+// Only the thread that asked reads a connection, the fd lock is left to
+// writers so a cancel can go out while we wait for the answer
 void ConnectionManager::receive_all(int fd, char* buffer, size_t size) {
-    std::lock_guard<std::mutex> lock(fd_lock(fd));
-    
     ssize_t received = recv(fd, buffer, size, MSG_WAITALL);
     if (received < 0) {
         throw std::runtime_error("Failed to receive data from socket");
@@ -289,26 +772,9 @@ void ConnectionManager::receive_all(int fd, char* buffer, size_t size) {
     // std::cout << "Received " << received << " bytes\n";
 }
 
-// Update process_request to handle piece requests
-void ConnectionManager::process_request(int clientSocket) {
-    RequestHeader header;
-    receive_all(clientSocket, reinterpret_cast<char*>(&header), sizeof(RequestHeader));
-
-    switch (header.type) {
-        case META_REQ:
-            process_meta_request(clientSocket, header);
-            break;
-        case PIECE_REQ:
-            process_piece_request(clientSocket, header);
-            break;
-        default:
-            std::cout << "Unkown request: " << header.type;
-            throw std::runtime_error("Unknown request type");
-    }
-}
-
-FileMetaData ConnectionManager::request_metadata(const std::string& destAddress, int destPort) {
-    int sock = connect_to(destAddress, destPort, 100000);
+FileMetaData ConnectionManager::request_metadata(const std::string& destAddress, int destPort,
+                                                const std::string& localInterface) {
+    int sock = connect_to(destAddress, destPort, 100000, localInterface);
     assert(sock >= 0);
     // std::cout << "Connected to: " << destAddress<<":"<< destPort<<"\n";
 
@@ -330,97 +796,129 @@ FileMetaData ConnectionManager::request_metadata(const std::string& destAddress,
         throw std::runtime_error("Unexpected response type");
     }
 
-    // Receive the metadata payload
-    std::vector<char> payloadBuffer(responseHeader.payloadSize);
-    receive_all(sock, payloadBuffer.data(), responseHeader.payloadSize);
-
+    // Receive the metadata payload, its fixed header says how big the rest may be
+    std::vector<char> payloadBuffer(FileMetaDataView::HEADER_SIZE);
+    try {
+        if (responseHeader.payloadSize < payloadBuffer.size()) {
+            throw std::runtime_error("Metadata too short");
+        }
+        receive_all(sock, payloadBuffer.data(), payloadBuffer.size());
+        if (responseHeader.payloadSize > FileMetaDataView::max_size(
+                std::string_view(payloadBuffer.data(), payloadBuffer.size()))) {
+            throw std::runtime_error("Metadata too large");
+        }
+        payloadBuffer.resize(responseHeader.payloadSize);
+        receive_all(sock, payloadBuffer.data() + FileMetaDataView::HEADER_SIZE,
+                    payloadBuffer.size() - FileMetaDataView::HEADER_SIZE);
+    } catch (const std::runtime_error&) {
+        close(sock);
+        throw;
+    }
 
-    return FileMetaData::deserialize(payloadBuffer);
+    // parsed straight out of the receive buffer
+    return FileMetaData::deserialize(std::string_view(payloadBuffer.data(), payloadBuffer.size()));
 }
 
-void ConnectionManager::send_piece(int clientSocket, size_t idx, const std::shared_ptr<RequestContext>& context) {
-
-    // std::cout << "Attempting to send piece " << idx << "\n" << std::flush;
-    // std::cout << "Has piece: " << fileManager_->has_piece(idx) << "\n" << std::flush;
-    
-    
-    if (fileManager_->has_piece(idx)){
-        // std::cout<<"HAVE PIECE so sending "<<idx<<"\n"<<std::flush; 
-        std::string_view pieceData = fileManager_->send(idx);
-        // std::cout << "Piece size: " << pieceData.size() << "\n" << std::flush;
-        // std::cout << "Piece data: " << pieceData.data()[0] << "\n" << std::flush;
-        RequestHeader responseHeader = {
-            PIECE_RES, 
-            static_cast<uint32_t>(pieceData.size()),
-            static_cast<uint32_t>(idx)
-        };
-        std::vector<char> serializedHeader = responseHeader.serialize();
-        send_all(clientSocket, std::string_view(serializedHeader.data(), serializedHeader.size()));
-        send_all(clientSocket, pieceData);
-        // std::cout<<"Piece Sent\n"; 
-    } else {
-        // std::cout<<"PIECE Not found so queeing task " << idx <<std::flush; 
-        context->remainingPieces.insert(idx);
-        fileManager_->register_piece_callback(idx, 
-            [context, idx = idx](size_t) {
-                // std::cout<<"Callback wake up! found piece\n";
-                // what happens if the node becomes availabel between the time I hccked
-                // and between the time I call registore that is definelty posisbly
-                // a lsot wakeup type of problem could be avoided by filemanager
-                // calling all remaining callbacks once it has all the list of pieces  
-                std::lock_guard<std::mutex> lock(context->mutex);
-                context->availablePieces.insert(idx);
-                context->cv.notify_one();
-            });
+void ConnectionManager::serve_meta_request(ServeState& state) {
+    if (!fileManager_) {
+        throw std::runtime_error("Cannot serve metadata request: no FileManager available");
     }
-   
-}
 
+    std::cout << "Got meta data request\n";
+
+    // the FileManager keeps the serialized form around, nothing gets copied
+    std::string_view serializedData = fileManager_->serialized_metadata();
+    RequestHeader responseHeader = {META_RES, serializedData.size(), 0};
+
+    OutItem item;
+    item.head = responseHeader.serialize();
+    item.body = serializedData;
+    state.out.push_back(std::move(item));
+}
 
-void ConnectionManager::process_piece_request(int clientSocket, const RequestHeader& header) {
+// From now on the connection gets a HAVE_RES for every piece we land. The
+// snapshot is taken after we start collecting landings, so a piece is at
+// worst announced twice and never missed
+void ConnectionManager::serve_watch_request(ServeState& state) {
     if (!fileManager_) {
-        throw std::runtime_error("Cannot serve piece request: no FileManager available");
+        throw std::runtime_error("Cannot serve watch request: no FileManager available");
+    }
+    if (!state.watching) {
+        state.watching = true;
+        watchers_++;
     }
 
-    std::vector<char> requestBuffer(header.payloadSize);
-    receive_all(clientSocket, requestBuffer.data(), header.payloadSize);
-    PieceRequest request = PieceRequest::deserialize(requestBuffer);
+    std::string bitfield = fileManager_->pieces().to_bytes();
+    RequestHeader responseHeader = {BITFIELD_RES, bitfield.size(), fileManager_->pieces().size()};
 
-    // First check if we can use the interface
-    if (!acquire_inter(clientSocket)) {
-        // Interface is busy, send BUSY_RES
-        RequestHeader busyHeader = {BUSY_RES, 0, 0};
-        std::vector<char> serializedHeader = busyHeader.serialize();
-        send_all(clientSocket, std::string_view(serializedHeader.data(), serializedHeader.size()));
-        return;
+    OutItem item;
+    item.head = responseHeader.serialize();
+    item.head.insert(item.head.end(), bitfield.begin(), bitfield.end());
+    state.out.push_back(std::move(item));
+}
+
+void ConnectionManager::serve_piece_request(int fd, ServeState& state) {
+    if (!fileManager_) {
+        throw std::runtime_error("Cannot serve piece request: no FileManager available");
     }
 
-    // if interface acquisition succeds setup automatica unlcoker
-    InterfaceGuard guard(*this, clientSocket);
+    PieceRequest request = PieceRequest::deserialize(state.payload);
+    uint32_t id = state.header.request;
+    Metrics::count(Metrics::REQUESTS_SERVED);
+
+    // indices come from the peer and the FileManager only asserts them, a
+    // bad one or more pieces than the file has closes the connection
+    size_t num_pieces = fileManager_->num_pieces;
+    size_t asked = 0;
+    auto check_range = [&](size_t first, size_t last) {
+        if (first > last || last >= num_pieces) {
+            throw std::runtime_error("Piece request out of range");
+        }
+        asked += last - first + 1;
+        if (asked > num_pieces) {
+            throw std::runtime_error("Piece request asks for too many pieces");
+        }
+    };
+    if (request.types & SINGLE_PIECE) check_range(request.pieceIndex, request.pieceIndex);
+    if (request.types & PIECE_RANGE) {
+        for (const auto& range : request.ranges) check_range(range.first, range.second);
+    }
+    if (request.types & PIECE_LIST) {
+        for (size_t idx : request.pieces) check_range(idx, idx);
+    }
 
     if (fileManager_->available_pieces() == 0) {
-        // Interface is busy, send BUSY_RES
-        RequestHeader busyHeader = {NOT_AVAIL_RES, 0, 0};
-        std::vector<char> serializedHeader = busyHeader.serialize();
-        send_all(clientSocket, std::string_view(serializedHeader.data(), serializedHeader.size()));
+        Metrics::count(Metrics::NOT_AVAIL_SENT);
+        state.open[id]++;
+        queue_response(state, NOT_AVAIL_RES, id);
         return;
     }
 
-
-
-    // Create context for this request
-    auto context = std::make_shared<RequestContext>();
+    // however busy the interface is the request is taken, its pieces go out
+    // as the send scheduler gives this connection turns. Every piece gets
+    // one answer, the request stays open until the last went out.
+    // Pieces cancelled while the request waited its turn are only answered for
+    size_t answers = 0;
+    auto queue = [&](size_t idx) {
+        answers++;
+        if (state.cancelled.erase(idx)) {
+            state.out.push_back(cancelled_item(idx, id));
+            Metrics::count(Metrics::PIECES_CANCELLED);
+        } else {
+            queue_piece(fd, state, idx, id);
+        }
+    };
 
     // Process single piece request
     if (request.types & SINGLE_PIECE) {
-        send_piece(clientSocket, request.pieceIndex, context);
+        queue(request.pieceIndex);
     }
 
     // Process range requests
     if (request.types & PIECE_RANGE) {
         for (const auto& range : request.ranges) {
             for (size_t idx = range.first; idx <= range.second; idx++) {
-                send_piece(clientSocket, idx, context);
+                queue(idx);
             }
         }
     }
@@ -428,69 +926,511 @@ void ConnectionManager::process_piece_request(int clientSocket, const RequestHea
     // Process piece list
     if (request.types & PIECE_LIST) {
         for (size_t idx : request.pieces) {
-            send_piece(clientSocket, idx, context);
+            queue(idx);
         }
     }
+    if (answers > 0) state.open[id] += answers;
+}
 
-    wait_for_queue(clientSocket, context);
-    
+void ConnectionManager::queue_piece(int fd, ServeState& state, size_t idx, std::optional<uint32_t> request,
+                                    std::chrono::steady_clock::time_point landed) {
+    if (fileManager_->has_piece(idx) && compression_ && state.rate > 0 && fileManager_->compression_pays(state.rate)) {
+        auto coded = fileManager_->coded_piece(idx);
+        if (!coded) {
+            // compressed on the pool, it comes back through piece_ready like a relayed piece
+            state.waiting.emplace(idx, request);
+            uint64_t id = state.id;
+            fileManager_->encode_piece(idx, [this, fd, id](size_t piece) {
+                piece_ready(fd, id, piece);
+            });
+            return;
+        }
+        if (coded->codec != PieceCodec::RAW) {
+            RequestHeader responseHeader = {PIECE_RES, coded->data.size(), idx, coded->codec, request.value_or(0)};
+            OutItem item;
+            item.head = responseHeader.serialize();
+            item.body = coded->data;
+            item.coded = std::move(coded);
+            item.piece = idx;
+            item.request = request;
+            item.landed = landed;
+            state.out.push_back(std::move(item));
+            return;
+        }
+        // didn't compress, goes out raw
+    }
+
+    if (fileManager_->has_piece(idx)) {
+        PieceExtent extent = fileManager_->extent(idx);
+        RequestHeader responseHeader = {
+            PIECE_RES, 
+            extent.length,
+            idx,
+            PieceCodec::RAW,
+            request.value_or(0)
+        };
+        OutItem item;
+        item.head = responseHeader.serialize();
+        item.file = extent;
+        item.piece = idx;
+        item.request = request;
+        item.landed = landed;
+        state.out.push_back(std::move(item));
+        return;
+    }
+
+    // we are relaying and the piece is still on its way to us, it gets sent
+    // once it lands. The callback runs on the receiving thread so it only
+    // hands the index over to the epoll thread
+    state.waiting.emplace(idx, request);
+    uint64_t id = state.id;
+    fileManager_->register_piece_callback(idx, [this, fd, id](size_t piece) {
+        piece_ready(fd, id, piece, std::chrono::steady_clock::now());
+    });
 }
 
-void ConnectionManager::wait_for_queue(int clientSocket, const std::shared_ptr<RequestContext>& context) {
-    // std::cout << "Waiting for " << context->remainingPieces.size() << " pieces\n" << std::flush;
-    std::unique_lock<std::mutex> lock(context->mutex);
-    while (!context->remainingPieces.empty()) {
-        if (context->availablePieces.empty()) {
-            // std::cout << "No pieces available, waiting...\n" << std::flush;
-            context->cv.wait(lock);
-            // std::cout << "Woke up, available pieces: " << context->availablePieces.size() << "\n" << std::flush;
+// The subscriber says what it has, from then on we pick what it gets: every
+// piece it lacks that the push filter gives it, as soon as we hold it. The
+// pieces still on their way to us move to push_ready in drain_ready, the
+// snapshot is taken after we start collecting landings so none is missed
+void ConnectionManager::serve_subscribe_request(ServeState& state) {
+    if (!fileManager_) {
+        throw std::runtime_error("Cannot serve subscribe request: no FileManager available");
+    }
+    if (state.header.pieceIndex != fileManager_->pieces().size()) {
+        throw std::runtime_error("Subscription for a different number of pieces");
+    }
+    Metrics::count(Metrics::REQUESTS_SERVED);
+
+    PieceBitset has(fileManager_->pieces().size());
+    has.merge_bytes(std::string_view(state.payload.data(), state.payload.size()));
+    for (size_t idx = 0; idx < has.size(); idx++) {
+        if (has.test(idx) || !push_filter_ || !push_filter_(state.peer, idx)) continue;
+        if (fileManager_->has_piece(idx)) {
+            state.push_ready.insert(idx);
+        } else {
+            state.push_later.insert(idx);
         }
+    }
+    std::cout << "Pushing " << state.push_ready.size() + state.push_later.size()
+              << " pieces to " << state.peer << "\n";
+
+    // the connection stays on this until the last piece went out
+    state.subscribed = true;
+    state.serving = true;
+    subscribers_++;
+}
+
+// Tops up what a subscription has queued, returns whether anything was
+// added. The NOT_AVAIL_RES that ends it goes after the last piece, pieces
+// still being compressed would be queued behind it so it waits for them
+bool ConnectionManager::push_pieces(int fd, ServeState& state) {
+    if (!state.subscribed) return false;
+
+    bool queued = false;
+    while (!state.push_ready.empty() && state.out.size() + state.waiting.size() < PUSH_DEPTH) {
+        size_t idx = *state.push_ready.begin();
+        state.push_ready.erase(state.push_ready.begin());
+        queue_piece(fd, state, idx, std::nullopt);
+        Metrics::count(Metrics::PIECES_PUSHED);
+        queued = true;
+    }
+
+    if (state.push_ready.empty() && state.push_later.empty() && state.waiting.empty()) {
+        queue_response(state, NOT_AVAIL_RES);
+        state.subscribed = false;
+        subscribers_--;
+        queued = true;
+    }
+    return queued;
+}
 
-        auto available = std::move(context->availablePieces);
-        lock.unlock();
+// Pieces that haven't started going out are answered with a CANCELLED_RES
+// in their place, so the peer still gets one answer per piece it asked for.
+// One already partly sent finishes, the peer drops it as a duplicate
+void ConnectionManager::serve_cancel_request(ServeState& state) {
+    std::set<size_t> cancelled;
+    for (size_t i = 0; i < state.header.pieceIndex && (i + 1) * sizeof(uint64_t) <= state.payload.size(); i++) {
+        uint64_t idx;
+        std::memcpy(&idx, state.payload.data() + i * sizeof(idx), sizeof(idx));
+        if (idx < fileManager_->num_pieces) cancelled.insert(idx);
+    }
 
-        for (auto idx : available) {
-            send_piece(clientSocket, idx, context);
-            // std::cout << "Sent queued piece " << idx << "\n" << std::flush;
-            
-            lock.lock();
-            context->remainingPieces.erase(idx);
-            lock.unlock();
+    for (auto& item : state.out) {
+        bool piece_data = item.coded || item.file.length > 0;
+        if (item.sent > 0 || !piece_data || !cancelled.count(item.piece)) continue;
+        item = cancelled_item(item.piece, item.request);
+        Metrics::count(Metrics::PIECES_CANCELLED);
+    }
+    for (size_t idx : cancelled) {
+        // still on its way to us or being compressed, the late wakeup finds it gone
+        auto [first, last] = state.waiting.equal_range(idx);
+        for (auto it = first; it != last; ++it) {
+            state.out.push_back(cancelled_item(idx, it->second));
+            Metrics::count(Metrics::PIECES_CANCELLED);
         }
-        lock.lock();
+        state.waiting.erase(first, last);
+        // a subscription just leaves it out
+        state.push_ready.erase(idx);
+        state.push_later.erase(idx);
+    }
+    if (state.next) {
+        state.cancelled.insert(cancelled.begin(), cancelled.end());
     }
-    std::cout << "All pieces sent\n" << std::flush;
 }
 
-void ConnectionManager::process_meta_request(int clientSocket, const RequestHeader& header) {
-    (void) header;  
+ConnectionManager::OutItem ConnectionManager::cancelled_item(size_t idx, std::optional<uint32_t> request) {
+    RequestHeader responseHeader = {CANCELLED_RES, 0, idx, PieceCodec::RAW, request.value_or(0)};
+    OutItem item;
+    item.head = responseHeader.serialize();
+    item.request = request;
+    return item;
+}
 
+// Symbols of a block we hold are made fresh on the pool. A relay still
+// decoding the block passes on what it got so far instead, the symbols this
+// connection hasn't had yet, and says NOT_AVAIL once it runs out
+void ConnectionManager::serve_symbol_request(int fd, ServeState& state) {
     if (!fileManager_) {
-        throw std::runtime_error("Cannot serve metadata request: no FileManager available");
+        throw std::runtime_error("Cannot serve symbol request: no FileManager available");
     }
 
-    std::cout << "Got meta data request\n";
+    uint64_t count = 0;
+    if (state.payload.size() >= sizeof(count)) {
+        std::memcpy(&count, state.payload.data(), sizeof(count));
+    }
+    size_t block = state.header.pieceIndex;
+    Metrics::count(Metrics::REQUESTS_SERVED);
+    if (block >= fileManager_->fountain_blocks() || count == 0) {
+        Metrics::count(Metrics::NOT_AVAIL_SENT);
+        queue_response(state, NOT_AVAIL_RES);
+        return;
+    }
+
+    state.serving = true;
+
+    if (fileManager_->has_block(block)) {
+        state.encoding = true;
+        uint64_t id = state.id;
+        fileManager_->encode_symbols(block, count,
+            [this, fd, id, block](std::vector<std::shared_ptr<const std::string>> symbols) {
+                symbols_ready(fd, id, block, std::move(symbols));
+            });
+        return;
+    }
+
+    size_t& forwarded = state.forwarded[block];
+    auto symbols = fileManager_->received_symbols(block, forwarded);
+    if (symbols.size() > count) symbols.resize(count);
+    forwarded += symbols.size();
+    queue_symbols(state, block, symbols);
+    if (symbols.size() < count) {
+        Metrics::count(Metrics::NOT_AVAIL_SENT);
+        queue_response(state, NOT_AVAIL_RES);
+    }
+}
+
+void ConnectionManager::queue_symbols(ServeState& state, size_t block,
+                                      const std::vector<std::shared_ptr<const std::string>>& symbols) {
+    for (const auto& symbol : symbols) {
+        RequestHeader responseHeader = {SYMBOL_RES, symbol->size(), block};
+        OutItem item;
+        item.head = responseHeader.serialize();
+        item.body = *symbol;
+        item.symbol = symbol;
+        state.out.push_back(std::move(item));
+    }
+}
+
+void ConnectionManager::queue_response(ServeState& state, RequestType type, std::optional<uint32_t> request) {
+    RequestHeader responseHeader = {type, 0, 0, PieceCodec::RAW, request.value_or(0)};
+    OutItem item;
+    item.head = responseHeader.serialize();
+    item.request = request;
+    state.out.push_back(std::move(item));
+}
+
+// Writes queued responses until the socket buffer is full, the connection
+// used up its turn on the interface or the peer's credit ran out. The rest
+// goes out once epoll reports the socket writable again, the send scheduler
+// gives it another turn or a CREDIT_REQ comes
+void ConnectionManager::flush(int fd, ServeState& state) {
+    state.waiting_turn = false;
+    state.waiting_credit = false;
+    while (!state.out.empty()) {
+        OutItem& item = state.out.front();
+        size_t head_end = item.head.size();
+        size_t body_end = head_end + item.body.size();
+        ssize_t sent;
+
+        // a piece takes one credit as it starts going out
+        bool piece_data = item.coded || item.file.length > 0;
+        if (piece_data && item.sent == 0 && state.credit == 0) {
+            state.waiting_credit = true;
+            sender_.idle(fd);
+            return;
+        }
+
+        // pieces and symbols take turns, the small control answers don't
+        bool scheduled = item.coded || item.symbol || item.file.length > 0;
+        size_t allowed = SIZE_MAX;
+        if (scheduled && item.sent < body_end + item.file.length) {
+            allowed = sender_.allowance(fd);
+            if (allowed == 0) {
+                state.waiting_turn = true;
+                return;
+            }
+        }
+
+        if (item.sent == 0) {
+            item.started = std::chrono::steady_clock::now();
+            if (item.landed != std::chrono::steady_clock::time_point{}) {
+                Metrics::record(Metrics::RELAY_DELAY_US,
+                    std::chrono::duration_cast<std::chrono::microseconds>(item.started - item.landed).count());
+            }
+        }
 
-    std::string serializedData = fileManager_->get_metadata().serialize();
-    RequestHeader responseHeader = {META_RES, static_cast<uint32_t>(serializedData.size()),0};
-    std::vector<char> serializedHeader = responseHeader.serialize();
+        if (item.sent < head_end) {
+            // MSG_MORE lets the header share a segment with what follows
+            int flags = MSG_NOSIGNAL | (body_end + item.file.length > head_end ? MSG_MORE : 0);
+            sent = send(fd, item.head.data() + item.sent, std::min(head_end - item.sent, allowed), flags);
+        } else if (item.sent < body_end) {
+            int flags = MSG_NOSIGNAL | (item.file.length > 0 ? MSG_MORE : 0);
+            sent = send(fd, item.body.data() + (item.sent - head_end), std::min(body_end - item.sent, allowed), flags);
+        } else if (item.sent - body_end < item.file.length) {
+            // Hands the file range to the kernel so piece data never gets copied through user space
+            off_t offset = item.file.offset + (item.sent - body_end);
+            sent = sendfile(fd, item.file.fd, &offset, std::min(item.file.length - (item.sent - body_end), allowed));
+            if (sent == 0) {
+                // the backing file is shorter than the extent, should never happen
+                throw std::runtime_error("Unexpected end of file while sending piece");
+            }
+        } else {
+            // pieces tell how fast the peer takes data, which is what
+            // decides whether compressing for it pays
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - item.started).count();
+            if (item.symbol) {
+                Metrics::count(Metrics::SYMBOLS_SERVED);
+            } else if (item.coded || item.file.length > 0) {
+                Metrics::count(Metrics::PIECES_SERVED);
+            }
+            if ((item.coded || item.symbol || item.file.length > 0) && seconds > 0) {
+                double sample = item.sent / seconds;
+                state.rate = state.rate <= 0 ? sample : 0.7 * state.rate + 0.3 * sample;
+                sender_.set_rate(fd, state.rate);
+                tuner_.update(fd);
+            }
+            if (item.request) {
+                auto open = state.open.find(*item.request);
+                if (open != state.open.end() && --open->second == 0) state.open.erase(open);
+            }
+            state.out.pop_front();
+            continue;
+        }
 
-    send_all(clientSocket, std::string_view(serializedHeader.data(), serializedHeader.size()));
-    std::cout << "SENT META header\n";
-    send_all(clientSocket, std::string_view(serializedData)); 
-    std::cout << "SENT META data\n";
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // the others get on with their turns meanwhile
+                if (scheduled) sender_.blocked(fd);
+                return;
+            }
+            if (errno == EPIPE) {
+                throw std::runtime_error("Socket closed by peer");
+            }
+            throw std::runtime_error(std::string("Failed to send data to socket: ") + strerror(errno));
+        }
+        if (piece_data && item.sent == 0 && state.credit != SIZE_MAX) state.credit--;
+        item.sent += sent;
+        if (scheduled) sender_.charge(fd, sent);
+        Metrics::bytes_sent(state.interface, sent);
+    }
+    sender_.idle(fd);
+}
+
+void ConnectionManager::update_events(int fd, ServeState& state) {
+    uint32_t events = 0;
+    // we read until a request is in behind the one put aside, cancels and credit may still come before that
+    bool request_waiting = state.next && state.header_read == sizeof(RequestHeader)
+                           && state.payload_read == state.payload.size();
+    if (!request_waiting) events |= EPOLLIN;
+    // one waiting for its turn is woken by the scheduler, one waiting for credit by the CREDIT_REQ
+    if (!state.out.empty() && !state.waiting_turn && !state.waiting_credit) events |= EPOLLOUT;
+    if (events == state.events) return;
+
+    struct epoll_event client_ev;
+    client_ev.events = events;
+    client_ev.data.fd = fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &client_ev);
+    state.events = events;
+}
+
+void ConnectionManager::close_served(int fd) {
+    auto it = serving_.find(fd);
+    if (it != serving_.end()) {
+        if (it->second.watching) {
+            watchers_--;
+        }
+        if (it->second.subscribed) {
+            subscribers_--;
+        }
+        // callbacks still registered for its pieces find the id gone and do nothing
+        serving_.erase(it);
+    }
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    sender_.remove(fd);
+    dfd_lock(fd);
+    tuner_.forget(fd);
+    close(fd);
+}
+
+// Connections a new send round gave a turn, serving them can start the
+// round after that
+void ConnectionManager::service_woken() {
+    for (auto woken = sender_.take_woken(); !woken.empty(); woken = sender_.take_woken()) {
+        for (int fd : woken) {
+            service(fd);
+        }
+    }
+}
+
+void ConnectionManager::set_file_manager(FileManager& manager) {
+    fileManager_ = &manager;
+    // every piece we land gets announced to whoever watches us, and isn't
+    // waited for anywhere else anymore
+    manager.add_piece_listener([this](size_t idx) {
+        piece_landed(idx);
+        cancel_duplicates(idx);
+    });
+    manager.add_processed_listener([this](size_t idx) {
+        piece_processed(idx);
+    });
+}
+
+void ConnectionManager::piece_ready(int fd, uint64_t id, size_t idx, std::chrono::steady_clock::time_point landed) {
+    std::lock_guard<std::mutex> lock(ready_mutex_);
+    if (wake_fd_ < 0) return;
+    // one wakeup covers every piece that lands before the loop gets to it
+    bool wake = ready_.empty();
+    ready_.push_back({fd, id, idx, landed});
+    if (wake) {
+        uint64_t value = 1;
+        write(wake_fd_, &value, sizeof(value));
+    }
+}
+
+void ConnectionManager::symbols_ready(int fd, uint64_t id, size_t block,
+                                      std::vector<std::shared_ptr<const std::string>> symbols) {
+    std::lock_guard<std::mutex> lock(ready_mutex_);
+    if (wake_fd_ < 0) return;
+    bool wake = ready_.empty() && landed_.empty() && ready_symbols_.empty();
+    ready_symbols_.push_back({fd, id, block, std::move(symbols)});
+    if (wake) {
+        uint64_t value = 1;
+        write(wake_fd_, &value, sizeof(value));
+    }
+}
+
+void ConnectionManager::piece_landed(size_t idx) {
+    std::lock_guard<std::mutex> lock(ready_mutex_);
+    if (wake_fd_ < 0) return;
+    bool wake = ready_.empty() && landed_.empty();
+    landed_.push_back(idx);
+    if (wake) {
+        uint64_t value = 1;
+        write(wake_fd_, &value, sizeof(value));
+    }
+}
+
+void ConnectionManager::drain_ready() {
+    std::vector<ReadyPiece> ready;
+    std::vector<size_t> landed;
+    std::vector<ReadySymbols> ready_symbols;
+    {
+        std::lock_guard<std::mutex> lock(ready_mutex_);
+        ready.swap(ready_);
+        landed.swap(landed_);
+        ready_symbols.swap(ready_symbols_);
+    }
+
+    std::set<int> touched;
+
+    if (watchers_ > 0 && !landed.empty()) {
+        // one HAVE_RES covers everything that landed since the last wakeup
+        RequestHeader header = {HAVE_RES, landed.size() * sizeof(uint64_t), landed.size()};
+        std::vector<char> message = header.serialize();
+        for (size_t idx : landed) {
+            uint64_t value = idx;
+            message.insert(message.end(), reinterpret_cast<const char*>(&value),
+                           reinterpret_cast<const char*>(&value) + sizeof(value));
+        }
+
+        for (auto& [fd, state] : serving_) {
+            if (!state.watching) continue;
+            OutItem item;
+            item.head = message;
+            state.out.push_back(std::move(item));
+            touched.insert(fd);
+        }
+    }
+
+    if (subscribers_ > 0) {
+        for (size_t idx : landed) {
+            for (auto& [fd, state] : serving_) {
+                if (state.subscribed && state.push_later.erase(idx)) {
+                    state.push_ready.insert(idx);
+                    touched.insert(fd);
+                }
+            }
+        }
+    }
+
+    for (const auto& piece : ready) {
+        auto it = serving_.find(piece.fd);
+        if (it == serving_.end() || it->second.id != piece.id) continue;  // connection is gone
+
+        auto& state = it->second;
+        auto waiting = state.waiting.find(piece.idx);
+        if (waiting == state.waiting.end()) continue;
+        auto request = waiting->second;
+        state.waiting.erase(waiting);
+        queue_piece(piece.fd, state, piece.idx, request, piece.landed);
+        touched.insert(piece.fd);
+    }
+
+    for (auto& batch : ready_symbols) {
+        auto it = serving_.find(batch.fd);
+        if (it == serving_.end() || it->second.id != batch.id) continue;
+        it->second.encoding = false;
+        queue_symbols(it->second, batch.block, batch.symbols);
+        touched.insert(batch.fd);
+    }
+
+    for (int fd : touched) {
+        service(fd);
+    }
 }
 
 
 void ConnectionManager::request_pieces(const std::string& destAddress, int destPort, 
                                      size_t single_piece,
                                      const std::vector<std::pair<size_t, size_t>>& ranges,
-                                     const std::vector<size_t>& piece_list) {
+                                     const std::vector<size_t>& piece_list,
+                                     const std::string& localInterface) {
+    send_piece_request(destAddress, destPort, single_piece, ranges, piece_list, localInterface);
+    receive_pieces(destAddress, destPort, localInterface);
+}
+
+size_t ConnectionManager::send_piece_request(const std::string& destAddress, int destPort, 
+                                     size_t single_piece,
+                                     const std::vector<std::pair<size_t, size_t>>& ranges,
+                                     const std::vector<size_t>& piece_list,
+                                     const std::string& localInterface, size_t stream) {
     if (!fileManager_) {
         throw std::runtime_error("No FileManager available for receiving pieces");
     }
 
-    int sock = connect_to(destAddress, destPort, 10);
+    int sock = connect_to(destAddress, destPort, 10, localInterface, stream);
     if (sock < 0){
         throw std::runtime_error("NOT_AVAIL");
     }
@@ -512,138 +1452,390 @@ void ConnectionManager::request_pieces(const std::string& destAddress, int destP
         request.pieces = piece_list;
     }
 
-    std::vector<char> serializedRequest = request.serialize();
-    RequestHeader header = {PIECE_REQ, static_cast<uint32_t>(serializedRequest.size()), 0};
-    std::vector<char> serializedHeader = header.serialize();
-    
-    // Send the request
-    send_all(sock, std::string_view(serializedHeader.data(), serializedHeader.size()));
-    send_all(sock, std::string_view(serializedRequest.data(), serializedRequest.size()));
-
-    // Calculate total expected pieces
-    size_t total_pieces = 0;
-    if (request.types & SINGLE_PIECE) total_pieces++;
+    // every piece expected, in the order asked for
+    std::vector<size_t> pieces;
+    if (request.types & SINGLE_PIECE) pieces.push_back(single_piece);
     if (request.types & PIECE_RANGE) {
         for (const auto& range : ranges) {
-            total_pieces += range.second - range.first + 1;
+            for (size_t idx = range.first; idx <= range.second; idx++) pieces.push_back(idx);
         }
     }
-    if (request.types & PIECE_LIST) total_pieces += piece_list.size();
+    if (request.types & PIECE_LIST) pieces.insert(pieces.end(), piece_list.begin(), piece_list.end());
 
-    // Receive all pieces
-    for (size_t i = 0; i < total_pieces; i++) {
+    std::vector<char> message;
+    std::vector<char> serializedRequest = request.serialize();
+    RequestHeader header = {PIECE_REQ, serializedRequest.size(), 0};
+    {
+        std::lock_guard<std::mutex> lock(inFlightMutex_);
+        ClientFlow& flow = client_flow(sock);
+        if (flow.granted == 0) {
+            // the peer is held to our window from the first request on
+            RequestHeader credit = {CREDIT_REQ, 0, flow.window};
+            message = credit.serialize();
+            flow.granted = flow.window;
+        }
+        header.request = flow.next_id++;
+        AskedRequest asked;
+        asked.id = header.request;
+        asked.pieces.insert(pieces.begin(), pieces.end());
+        asked.sent = std::chrono::steady_clock::now();
+        flow.requests.push_back(std::move(asked));
+        for (size_t idx : pieces) {
+            inFlight_[idx].push_back(sock);
+        }
+    }
+    std::vector<char> headerBytes = header.serialize();
+    message.insert(message.end(), headerBytes.begin(), headerBytes.end());
+    message.insert(message.end(), serializedRequest.begin(), serializedRequest.end());
+
+    // one send, a cancel from another thread must not end up in the middle
+    send_all(sock, std::string_view(message.data(), message.size()));
+    Metrics::count(Metrics::REQUESTS_SENT);
+    return pieces.size();
+}
+
+void ConnectionManager::send_symbol_request(const std::string& destAddress, int destPort, size_t block,
+                                            size_t count, const std::string& localInterface) {
+    if (!fileManager_) {
+        throw std::runtime_error("No FileManager available for receiving symbols");
+    }
+
+    int sock = connect_to(destAddress, destPort, 10, localInterface);
+    if (sock < 0){
+        throw std::runtime_error("NOT_AVAIL");
+    }
+
+    uint64_t wanted = count;
+    RequestHeader header = {SYMBOL_REQ, sizeof(wanted), block};
+    std::vector<char> message = header.serialize();
+    message.insert(message.end(), reinterpret_cast<const char*>(&wanted),
+                   reinterpret_cast<const char*>(&wanted) + sizeof(wanted));
+    {
+        std::lock_guard<std::mutex> lock(inFlightMutex_);
+        ClientFlow& flow = client_flow(sock);
+        AskedRequest asked;
+        asked.id = flow.next_id++;
+        asked.sent = std::chrono::steady_clock::now();
+        flow.requests.push_back(std::move(asked));
+    }
+    send_all(sock, std::string_view(message.data(), message.size()));
+    Metrics::count(Metrics::REQUESTS_SENT);
+}
+
+size_t ConnectionManager::receive_symbols(const std::string& destAddress, int destPort, size_t count,
+                                          const std::string& localInterface) {
+    int sock = connect_to(destAddress, destPort, 10, localInterface);
+    if (sock < 0){
+        throw std::runtime_error("NOT_AVAIL");
+    }
+
+    size_t interface = 0;
+    {
+        std::lock_guard<std::mutex> lock(clientStatsMutex_);
+        interface = clientStats_[sock].interface;
+    }
+
+    for (size_t i = 0; i < count; i++) {
         RequestHeader responseHeader;
         receive_all(sock, reinterpret_cast<char*>(&responseHeader), sizeof(RequestHeader));
+        if (i == 0) symbols_answered(sock);
 
-        // Check if interface is busy
         if (responseHeader.type == BUSY_RES) {
-            throw std::runtime_error("BUSY");  // Special error message for busy case
-        }  
-
+            Metrics::count(Metrics::BUSY_RECEIVED);
+            throw std::runtime_error("BUSY");
+        }
         if (responseHeader.type == NOT_AVAIL_RES) {
-            throw std::runtime_error("NOT_AVAIL");  // Special error message for not available case
-        }      
-        
-        if (responseHeader.type != PIECE_RES) {
-            throw std::runtime_error("Unexpected response type for piece request");
+            Metrics::count(Metrics::NOT_AVAIL_RECEIVED);
+            return i;   // the peer had no more for this block
+        }
+        if (responseHeader.type != SYMBOL_RES) {
+            throw std::runtime_error("Unexpected response type for symbol request");
         }
 
-        // Size check
-        assert(responseHeader.payloadSize == fileManager_->piece_size);
-
-        // Now we use the piece index from the response header
-        if (!fileManager_->has_piece(responseHeader.pieceIndex)) {
-            size_t buffer_size;
-            char* write_buffer = fileManager_->get_piece_buffer(responseHeader.pieceIndex, buffer_size);
-            assert(write_buffer != nullptr);
-            receive_all(sock, write_buffer, responseHeader.payloadSize);
-            fileManager_->update_piece_status(responseHeader.pieceIndex);
-            // if (responseHeader.pieceIndex == 0){
-            //     std::cout<<"BANG BANG address "<< static_cast<const void*>(write_buffer) <<"\n"<<std::flush;
-            // }
-            // std::cout<<"HERE "<< write_buffer[0]<< " THE BUFFER\n"<<std::flush;
-        } else {
-            // Skip the piece if we already have it
-            std::vector<char> dummy_buffer(responseHeader.payloadSize);
-            receive_all(sock, dummy_buffer.data(), responseHeader.payloadSize);
+        size_t block = responseHeader.pieceIndex;
+        if (block >= fileManager_->fountain_blocks()
+            || responseHeader.payloadSize != sizeof(uint64_t) + fileManager_->symbol_size(block)) {
+            throw std::runtime_error("Bad symbol from peer");
         }
-        // std::cout <<"Recieved "<< i<< " of " << total_pieces <<  "\n"<<std::flush;
+        std::string symbol(responseHeader.payloadSize, '\0');
+        receive_all(sock, &symbol[0], symbol.size());
+        Metrics::count(Metrics::SYMBOLS_RECEIVED);
+        Metrics::bytes_received(interface, sizeof(RequestHeader) + symbol.size());
+        fileManager_->symbol_received(block, std::move(symbol));
+        tuner_.update(sock);
     }
+    return count;
 }
 
+void ConnectionManager::watch_pieces(const std::string& destAddress, int destPort, const std::string& localInterface,
+                                     const std::function<void(std::string_view)>& on_bitfield,
+                                     const std::function<void(size_t)>& on_have) {
+    // the peer may not be listening yet, it only starts once it has metadata
+    int sock = -1;
+    while (sock < 0) {
+        {
+            std::lock_guard<std::mutex> lock(watchMutex_);
+            if (watchStopped_) return;
+        }
+        sock = open_connection(destAddress, destPort, 2, localInterface);
+        if (sock < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
 
-bool ConnectionManager::acquire_inter(int socket_fd) {
-    // Find the interface for this socket
-    std::string interface_name;
     {
-        std::shared_lock<std::shared_mutex> socket_lock(socket_map_mutex_);
-        auto socket_it = socket_to_interface_.find(socket_fd);
-        assert(socket_it != socket_to_interface_.end() && "Socket must be associated with an interface");
-        interface_name = socket_it->second;
+        std::lock_guard<std::mutex> lock(watchMutex_);
+        if (watchStopped_) {
+            tuner_.forget(sock);
+            dfd_lock(sock);
+            close(sock);
+            return;
+        }
+        watchFds_.insert(sock);
     }
-    
-    // Now look up the interface state
-    std::shared_lock<std::shared_mutex> interface_lock(interface_map_mutex_);
-    auto interface_it = interface_states_.find(interface_name);
-    assert(interface_it != interface_states_.end() && "Interface must exist in interface states");
 
-    auto& interface_state = interface_it->second;
-    
-    // Try to mark interface as busy
-    bool expected = false;
-    if (!interface_state->is_busy.compare_exchange_strong(expected, true)) {
-        return false; // Interface is already busy
+    try {
+        RequestHeader header = {WATCH_REQ, 0, 0};
+        std::vector<char> serializedHeader = header.serialize();
+        send_all(sock, std::string_view(serializedHeader.data(), serializedHeader.size()));
+
+        std::vector<char> payload;
+        while (true) {
+            RequestHeader responseHeader;
+            receive_all(sock, reinterpret_cast<char*>(&responseHeader), sizeof(RequestHeader));
+            size_t pieces = fileManager_ ? fileManager_->num_pieces : 0;
+            size_t limit = responseHeader.type == BITFIELD_RES ? PieceBitset::byte_size(pieces)
+                         : responseHeader.type == HAVE_RES ? pieces * sizeof(uint64_t) : 0;
+            if (responseHeader.payloadSize > limit
+                || (responseHeader.type == HAVE_RES
+                    && responseHeader.pieceIndex > responseHeader.payloadSize / sizeof(uint64_t))) {
+                throw std::runtime_error("Bad payload size on watch connection");
+            }
+            payload.resize(responseHeader.payloadSize);
+            if (!payload.empty()) {
+                receive_all(sock, payload.data(), payload.size());
+            }
+
+            if (responseHeader.type == BITFIELD_RES) {
+                on_bitfield(std::string_view(payload.data(), payload.size()));
+            } else if (responseHeader.type == HAVE_RES) {
+                for (size_t i = 0; i < responseHeader.pieceIndex; i++) {
+                    uint64_t idx;
+                    std::memcpy(&idx, payload.data() + i * sizeof(idx), sizeof(idx));
+                    on_have(idx);
+                }
+            } else {
+                throw std::runtime_error("Unexpected response type on watch connection");
+            }
+        }
+    } catch (const std::runtime_error& e) {
+        // peer went away or we were told to stop, either way we are done watching
     }
-    
-    interface_state->busy_socket.store(socket_fd);
-    return true;
+
+    {
+        std::lock_guard<std::mutex> lock(watchMutex_);
+        watchFds_.erase(sock);
+    }
+    tuner_.forget(sock);
+    dfd_lock(sock);
+    close(sock);
+}
+
+void ConnectionManager::stop_watching() {
+    std::lock_guard<std::mutex> lock(watchMutex_);
+    watchStopped_ = true;
+    // wakes up the blocked reads, the watchers close their own sockets
+    for (int fd : watchFds_) {
+        shutdown(fd, SHUT_RDWR);
+    }
+}
+
+size_t ConnectionManager::subscribe(const std::string& destAddress, int destPort, const std::string& localInterface) {
+    // a relay only starts listening once it has metadata, give it a moment
+    auto deadline = std::chrono::steady_clock::now() + SUBSCRIBE_WAIT;
+    int sock = open_connection(destAddress, destPort, 2, localInterface);
+    while (sock < 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        sock = open_connection(destAddress, destPort, 2, localInterface);
+    }
+    if (sock < 0) {
+        throw std::runtime_error("Cannot subscribe to " + destAddress);
+    }
+    size_t interface = metrics_interface(sock);
+
+    size_t received = 0;
+    try {
+        // pushed pieces are held to our window like asked for ones
+        std::vector<char> message;
+        {
+            std::lock_guard<std::mutex> lock(inFlightMutex_);
+            ClientFlow& flow = client_flow(sock);
+            RequestHeader credit = {CREDIT_REQ, 0, flow.window};
+            message = credit.serialize();
+            flow.granted = flow.window;
+        }
+        std::string bitfield = fileManager_->pieces().to_bytes();
+        RequestHeader header = {SUBSCRIBE_REQ, bitfield.size(), fileManager_->pieces().size()};
+        std::vector<char> headerBytes = header.serialize();
+        message.insert(message.end(), headerBytes.begin(), headerBytes.end());
+        message.insert(message.end(), bitfield.begin(), bitfield.end());
+        send_all(sock, std::string_view(message.data(), message.size()));
+        Metrics::count(Metrics::REQUESTS_SENT);
+
+        while (true) {
+            RequestHeader responseHeader;
+            receive_all(sock, reinterpret_cast<char*>(&responseHeader), sizeof(RequestHeader));
+            auto header_time = std::chrono::steady_clock::now();
+            if (responseHeader.type == NOT_AVAIL_RES) break;   // that was the last one
+            if (responseHeader.type == CANCELLED_RES) continue;
+            if (responseHeader.type != PIECE_RES) {
+                throw std::runtime_error("Unexpected response type on subscription");
+            }
+            receive_piece(sock, responseHeader, interface);
+            Metrics::record_since(Metrics::PIECE_RECEIVE_US, header_time);
+            received++;
+        }
+    } catch (const std::runtime_error&) {
+        forget_requests(sock);
+        tuner_.forget(sock);
+        dfd_lock(sock);
+        close(sock);
+        throw;
+    }
+
+    forget_requests(sock);
+    tuner_.forget(sock);
+    dfd_lock(sock);
+    close(sock);
+    return received;
 }
 
-void ConnectionManager::release_inter(int socket_fd) {
-    // Get interface name for this socket
-    std::string interface_name;
+void ConnectionManager::receive_pieces(const std::string& destAddress, int destPort,
+                                       const std::string& localInterface, size_t stream) {
+    int sock = connect_to(destAddress, destPort, 10, localInterface, stream);
+    if (sock < 0){
+        throw std::runtime_error("NOT_AVAIL");
+    }
+
+    size_t interface = 0;
     {
-        std::shared_lock<std::shared_mutex> socket_lock(socket_map_mutex_);
-        auto socket_it = socket_to_interface_.find(socket_fd);
-        assert(socket_it != socket_to_interface_.end() && "Socket must be associated with an interface");
-        interface_name = socket_it->second;
+        std::lock_guard<std::mutex> lock(clientStatsMutex_);
+        interface = clientStats_[sock].interface;
     }
-    
-    // Access interface state
-    std::shared_lock<std::shared_mutex> interface_lock(interface_map_mutex_);
-    auto interface_it = interface_states_.find(interface_name);
-    assert(interface_it != interface_states_.end() && "Interface must exist in interface states");
 
-    auto& interface_state = interface_it->second;
-    
-    // Only allow the socket that acquired the interface to release it
-    assert (interface_state->busy_socket.load() == socket_fd);
-    
-    interface_state->busy_socket.store(-1);
-    interface_state->is_busy.store(false);
-}
-
-
-void ConnectionManager::update_inter(int socket_fd, const std::string& inter) {
-   
-   assert(!inter.empty() && "Must find valid interface for peer IP");
-   
-   // Update socket to interface mapping
-   {
-       std::unique_lock<std::shared_mutex> socket_lock(socket_map_mutex_);
-       socket_to_interface_[socket_fd] = inter;
-   }
-   
-   // Update interface state
-   {
-       std::unique_lock<std::shared_mutex> interface_lock(interface_map_mutex_);
-       auto& interface_state = interface_states_[inter];
-       if (!interface_state) {
-           interface_state = std::make_unique<InterfaceState>();
-           interface_state->interface_name = inter;
-       }
-       
-       std::lock_guard<std::mutex> state_lock(interface_state->state_mutex);
-       interface_state->associated_sockets.insert(socket_fd);
-   }
-}
\ No newline at end of file
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(inFlightMutex_);
+            auto flow = flows_.find(sock);
+            if (flow == flows_.end() || flow->second.requests.empty()) return;
+            auto& oldest = flow->second.requests.front();
+            if (!oldest.refused.empty()) {
+                std::string reason = oldest.refused;
+                flow->second.requests.pop_front();
+                throw std::runtime_error(reason);  // Special error message, the caller retries elsewhere
+            }
+            if (oldest.pieces.empty()) {
+                flow->second.requests.pop_front();
+                return;
+            }
+        }
+
+        // answers to the requests behind the oldest are taken as they come
+        RequestHeader responseHeader;
+        receive_all(sock, reinterpret_cast<char*>(&responseHeader), sizeof(RequestHeader));
+        auto header_time = std::chrono::steady_clock::now();
+
+        if (responseHeader.type == BUSY_RES) {
+            Metrics::count(Metrics::BUSY_RECEIVED);
+            request_refused(sock, responseHeader.request, "BUSY");
+            continue;
+        }
+
+        if (responseHeader.type == NOT_AVAIL_RES) {
+            Metrics::count(Metrics::NOT_AVAIL_RECEIVED);
+            request_refused(sock, responseHeader.request, "NOT_AVAIL");
+            continue;
+        }
+
+        if (responseHeader.type == CANCELLED_RES) {
+            // we got it elsewhere and told the peer, it answered for it without the data
+            piece_answered(sock, responseHeader.request, responseHeader.pieceIndex);
+            continue;
+        }
+
+        if (responseHeader.type != PIECE_RES) {
+            throw std::runtime_error("Unexpected response type for piece request");
+        }
+
+        piece_answered(sock, responseHeader.request, responseHeader.pieceIndex);
+        receive_piece(sock, responseHeader, interface);
+        Metrics::record_since(Metrics::PIECE_RECEIVE_US, header_time);
+    }
+}
+
+// Reads the data of a PIECE_RES whose header came in and hands it to the FileManager
+void ConnectionManager::receive_piece(int sock, const RequestHeader& header, size_t interface) {
+    // Size check, the last piece is sent without padding and a compressed one
+    // is only sent when it came out smaller. The header is the peer's word,
+    // anything else would run past the buffer
+    if (header.pieceIndex >= fileManager_->num_pieces) {
+        throw std::runtime_error("Piece index out of range");
+    }
+    size_t length = fileManager_->piece_length(header.pieceIndex);
+    if (header.codec == PieceCodec::RAW ? header.payloadSize != length : header.payloadSize > length) {
+        throw std::runtime_error("Piece payload of the wrong size");
+    }
+
+    // Now we use the piece index from the response header, another
+    // worker may have landed the same piece in the meantime
+    size_t buffer_size;
+    char* write_buffer = fileManager_->get_piece_buffer(header.pieceIndex, buffer_size);
+    if (write_buffer != nullptr && header.payloadSize > buffer_size) {
+        fileManager_->release_piece_buffer(header.pieceIndex, write_buffer);
+        throw std::runtime_error("Piece payload larger than its buffer");
+    }
+    if (write_buffer != nullptr) {
+        std::shared_ptr<CodedPiece> coded;
+        try {
+            if (header.codec == PieceCodec::RAW) {
+                receive_all(sock, write_buffer, header.payloadSize);
+            } else {
+                // inflated on the pool together with the checksum
+                coded = std::make_shared<CodedPiece>();
+                coded->codec = header.codec;
+                coded->data.resize(header.payloadSize);
+                receive_all(sock, &coded->data[0], header.payloadSize);
+            }
+        } catch (const std::runtime_error&) {
+            fileManager_->release_piece_buffer(header.pieceIndex, write_buffer);
+            throw;
+        }
+        {
+            // its credit goes back once the pool is done with it
+            std::lock_guard<std::mutex> lock(inFlightMutex_);
+            auto flow = flows_.find(sock);
+            if (flow != flows_.end()) processing_[header.pieceIndex] = {sock, flow->second.generation};
+        }
+        // checked against its checksum on the pool, relayed once it passes
+        fileManager_->piece_received(header.pieceIndex, write_buffer, std::move(coded));
+        tuner_.update(sock);
+        Metrics::count(Metrics::PIECES_RECEIVED);
+    } else {
+        // Skip the piece if we already have it, it went out before our cancel got there
+        thread_local std::vector<char> scratch(SKIP_CHUNK);
+        for (size_t left = header.payloadSize; left > 0;) {
+            size_t chunk = std::min(left, scratch.size());
+            receive_all(sock, scratch.data(), chunk);
+            left -= chunk;
+        }
+        Metrics::count(Metrics::PIECES_DUPLICATE);
+        size_t grant = 0;
+        {
+            std::lock_guard<std::mutex> lock(inFlightMutex_);
+            auto flow = flows_.find(sock);
+            if (flow != flows_.end()) grant = credit_due(flow->second);
+        }
+        if (grant > 0) send_credit(sock, grant);
+    }
+    Metrics::bytes_received(interface, sizeof(RequestHeader) + header.payloadSize);
+}
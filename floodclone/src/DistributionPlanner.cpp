@@ -0,0 +1,172 @@
+#include "DistributionPlanner.h"
+#include <algorithm>
+#include <queue>
+#include <tuple>
+
+DistributionPlanner::DistributionPlanner(const std::string& source) : source_(source) {}
+
+void DistributionPlanner::add_link(const std::string& from, const std::string& to, const std::string& interface) {
+    links_[from][interface].insert(to);
+}
+
+bool DistributionPlanner::plan() {
+    trees_.clear();
+    slots_ = {0};
+
+    std::set<std::string> nodes{source_};
+    for (const auto& [from, interfaces] : links_) {
+        nodes.insert(from);
+        for (const auto& [interface, neighbors] : interfaces) {
+            nodes.insert(neighbors.begin(), neighbors.end());
+        }
+    }
+    names_.assign(nodes.begin(), nodes.end());
+    std::map<std::string, size_t> id;
+    for (size_t i = 0; i < names_.size(); i++) {
+        id[names_[i]] = i;
+    }
+
+    // one resource per node interface, sending and receiving are separate
+    // budgets since links are full duplex
+    std::map<std::pair<std::string, std::string>, size_t> resources;
+    auto resource = [&](const std::string& node, const std::string& interface) {
+        return resources.emplace(std::make_pair(node, interface), resources.size()).first->second;
+    };
+
+    std::vector<Edge> edges;
+    std::vector<std::vector<size_t>> out(names_.size());
+    for (const auto& [from, interfaces] : links_) {
+        for (const auto& [interface, neighbors] : interfaces) {
+            for (const auto& to : neighbors) {
+                // to receives on whichever of its interfaces reaches back to us
+                std::string back;
+                auto to_links = links_.find(to);
+                if (to_links != links_.end()) {
+                    for (const auto& [to_interface, to_neighbors] : to_links->second) {
+                        if (to_neighbors.count(from)) {
+                            back = to_interface;
+                            break;
+                        }
+                    }
+                }
+                out[id[from]].push_back(edges.size());
+                edges.push_back({id[from], id[to], resource(from, interface), resource(to, back)});
+            }
+        }
+    }
+
+    std::vector<double> tx_left(resources.size(), 1.0), rx_left(resources.size(), 1.0);
+    while (trees_.size() < MAX_TREES && pack_tree(edges, out, id[source_], tx_left, rx_left)) {}
+    if (trees_.empty()) return false;
+
+    // smooth weighted round robin, spreads each tree's pieces evenly over a round
+    double total = 0;
+    for (const auto& tree : trees_) total += tree.rate;
+    std::vector<double> current(trees_.size(), 0);
+    slots_.clear();
+    for (size_t slot = 0; slot < SLOTS; slot++) {
+        size_t pick = 0;
+        for (size_t t = 0; t < trees_.size(); t++) {
+            current[t] += trees_[t].rate;
+            if (current[t] > current[pick]) pick = t;
+        }
+        current[pick] -= total;
+        slots_.push_back(pick);
+    }
+    return true;
+}
+
+// Greedy widest spanning tree: grow from the source, always adding the node
+// whose link would leave the most capacity per child. A child behind an
+// interface that already feeds others only gets a share of it, so on a
+// switch the tree turns into a chain through the hosts behind it instead of
+// a star that splits the source's uplink
+bool DistributionPlanner::pack_tree(const std::vector<Edge>& edges, const std::vector<std::vector<size_t>>& out,
+                                    size_t source, std::vector<double>& tx_left, std::vector<double>& rx_left) {
+    size_t n = names_.size();
+    std::vector<bool> in_tree(n, false);
+    std::vector<size_t> via(n, edges.size());   // edge the node joined through
+    std::vector<long> depth(n, 0);
+    std::vector<size_t> tx_use(tx_left.size(), 0);
+
+    auto score = [&](const Edge& e) {
+        return std::min(tx_left[e.tx] / (tx_use[e.tx] + 1), rx_left[e.rx]);
+    };
+
+    // best score first, then deeper parents: a chain leaves the source's
+    // other links free for the next tree where a star would use them all
+    // up. Then by id so every node builds the same tree
+    using Candidate = std::tuple<double, long, long, long, long>;
+    std::priority_queue<Candidate> heap;
+    auto offer = [&](size_t node) {
+        for (size_t e : out[node]) {
+            if (in_tree[edges[e].to]) continue;
+            heap.emplace(score(edges[e]), depth[node], -static_cast<long>(node),
+                         -static_cast<long>(edges[e].to), -static_cast<long>(e));
+        }
+    };
+
+    in_tree[source] = true;
+    size_t spanned = 1;
+    offer(source);
+    while (!heap.empty() && spanned < n) {
+        auto [best, d, from, to, index] = heap.top();
+        heap.pop();
+        const Edge& e = edges[-index];
+        if (in_tree[e.to]) continue;
+
+        // another child took a share of that uplink since this was queued
+        double now = score(e);
+        if (now < best) {
+            heap.emplace(now, d, from, to, index);
+            continue;
+        }
+
+        in_tree[e.to] = true;
+        via[e.to] = -index;
+        depth[e.to] = depth[e.from] + 1;
+        tx_use[e.tx]++;
+        spanned++;
+        offer(e.to);
+    }
+    if (spanned < n) return false;
+
+    double rate = 1;
+    for (size_t node = 0; node < n; node++) {
+        if (node == source) continue;
+        const Edge& e = edges[via[node]];
+        rate = std::min({rate, tx_left[e.tx] / tx_use[e.tx], rx_left[e.rx]});
+    }
+    // the first tree always goes in, whatever it manages
+    if (rate <= 0 || (!trees_.empty() && rate < MIN_RATE)) return false;
+
+    Tree tree;
+    tree.rate = rate;
+    tree.parent.resize(n);
+    for (size_t node = 0; node < n; node++) {
+        if (node == source) continue;
+        const Edge& e = edges[via[node]];
+        tx_left[e.tx] = std::max(0.0, tx_left[e.tx] - rate);
+        rx_left[e.rx] = std::max(0.0, rx_left[e.rx] - rate);
+        tree.parent[node] = names_[e.from];
+    }
+    trees_.push_back(std::move(tree));
+    return true;
+}
+
+const std::string& DistributionPlanner::parent(const std::string& node, size_t tree) const {
+    static const std::string none;
+    auto it = std::lower_bound(names_.begin(), names_.end(), node);
+    if (it == names_.end() || *it != node) return none;
+    return trees_[tree].parent[it - names_.begin()];
+}
+
+std::vector<std::pair<std::string, std::string>> DistributionPlanner::shared_interfaces() const {
+    std::vector<std::pair<std::string, std::string>> shared;
+    for (const auto& [node, interfaces] : links_) {
+        for (const auto& [interface, neighbors] : interfaces) {
+            if (neighbors.size() > 1) shared.emplace_back(node, interface);
+        }
+    }
+    return shared;
+}
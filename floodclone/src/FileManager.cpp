@@ -1,4 +1,5 @@
 #include "FileManager.h"
+#include "Metrics.h"
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
@@ -12,23 +13,82 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <cassert>
+#include <cstring>
 #include <iostream>
+#include <condition_variable>
+#include <map>
+#include <random>
 
 
 using namespace std;
 namespace fs = std::filesystem;
 
-#define PIECE_SIZE 16384
+#define MIN_PIECE_SIZE 16384
+#define MAX_PIECE_SIZE (4 * 1024 * 1024)
+#define TARGET_PIECES 4096          // files are cut into about this many steady state pieces
+#define STARTUP_STEADY_PIECES 4     // the startup region covers this many steady state pieces
+#define HASH_BLOCK_BYTES (8 * 1024 * 1024)  // the source hashes about this much per pool task
+#define PROGRESS_INTERVAL_MS 1000           // receivers save their piece bitmap at most this often
+#define SEED_SEGMENT_BYTES (64 * 1024 * 1024)  // an old copy is scanned for pieces in segments this big
+#define CODED_CACHE_BYTES (256 * 1024 * 1024)  // compressed pieces kept around for other peers
 
+namespace {
+    // Binary merkle tree over the piece checksums, an odd node out is carried
+    // up a level as is. Receivers recompute it to make sure the leaves they
+    // got are the ones the source published
+    array<char, CHECKSUM_LENGTH> merkle_root(const vector<char>& leaves) {
+        array<char, CHECKSUM_LENGTH> root{};
+        size_t count = leaves.size() / CHECKSUM_LENGTH;
+        if (count == 0) {
+            FileManager::calculate_checksum(nullptr, 0, root.data());
+            return root;
+        }
+
+        vector<char> level(leaves);
+        while (count > 1) {
+            size_t parents = (count + 1) / 2;
+            for (size_t i = 0; i < count / 2; ++i) {
+                // children sit next to each other, hash the pair in place
+                FileManager::calculate_checksum(level.data() + 2 * i * CHECKSUM_LENGTH, 2 * CHECKSUM_LENGTH,
+                                                level.data() + i * CHECKSUM_LENGTH);
+            }
+            if (count % 2) {
+                std::memmove(level.data() + (parents - 1) * CHECKSUM_LENGTH,
+                             level.data() + (count - 1) * CHECKSUM_LENGTH, CHECKSUM_LENGTH);
+            }
+            count = parents;
+        }
+        std::memcpy(root.data(), level.data(), CHECKSUM_LENGTH);
+        return root;
+    }
+
+    string to_hex(const char* data, size_t size) {
+        static const char digits[] = "0123456789abcdef";
+        string hex(2 * size, '0');
+        for (size_t i = 0; i < size; ++i) {
+            unsigned char byte = static_cast<unsigned char>(data[i]);
+            hex[2 * i] = digits[byte >> 4];
+            hex[2 * i + 1] = digits[byte & 0xf];
+        }
+        return hex;
+    }
+}
+
+// ipiece_size = 0 lets the source pick the layout from the file size,
+// receivers always take it from the metadata
 FileManager::FileManager(const std::string& file_path, size_t ipiece_size, const std::string& node_ip,
                          const std::string& pieces_folder, ThreadPool* thread_pool, bool is_source,
-                         const FileMetaData* metadata)
-    : file_path(file_path), piece_size(ipiece_size == 0 ? PIECE_SIZE : ipiece_size), node_ip(node_ip),
-      num_pieces(0), pieces_folder(pieces_folder), thread_pool(thread_pool), is_source(is_source) 
+                         const FileMetaData* metadata, PieceStore::Backend store_backend, bool resume)
+    : file_path(file_path), piece_size(ipiece_size), startup_piece_size(ipiece_size), node_ip(node_ip),
+      num_pieces(0), pieces_folder(pieces_folder), thread_pool(thread_pool), is_source(is_source),
+      store_backend(store_backend), resume(resume)
 {
 
     verify_ip(node_ip);
 
+    std::random_device random;
+    next_seed_ = (uint64_t(random()) << 32) ^ random();
+
     // Handle piece folder creation
     if (!fs::exists(pieces_folder)) {
         fs::create_directories(pieces_folder);
@@ -59,46 +119,135 @@ void FileManager::initialize_source() {
     size_t file_size = fileStream.tellg();
     fileStream.seekg(0, ios::beg);
 
+    // Small pieces at the start of the file keep the store and forward delay
+    // of the first hops low while the pipeline fills up, large ones after
+    // that keep per piece overhead down once everything is streaming
+    if (piece_size == 0) {
+        piece_size = choose_piece_size(file_size, 0);
+        startup_piece_size = MIN_PIECE_SIZE;
+        size_t region = STARTUP_STEADY_PIECES * piece_size;
+        if (file_size <= region) {
+            // too small to bother, small pieces all the way
+            piece_size = startup_piece_size;
+        } else if (piece_size > startup_piece_size) {
+            startup_pieces = region / startup_piece_size;
+        }
+    }
+
     // Calculate number of pieces
-    num_pieces = (file_size + piece_size - 1) / piece_size;
+    size_t startup_bytes = startup_pieces * startup_piece_size;
+    num_pieces = startup_pieces + (file_size - startup_bytes + piece_size - 1) / piece_size;
 
-    int file_fd = open(file_path.c_str(), O_RDONLY);
-    if (file_fd == -1) {
+    source_fd = open(file_path.c_str(), O_RDONLY);
+    if (source_fd == -1) {
         throw runtime_error("Cannot open file: " + file_path);
     }
 
-    // Map the padded file
-    mapped_file = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, file_fd, 0);
+    // Map the file, the fd stays open as pieces are normally sent straight from it
+    mapped_file = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, source_fd, 0);
     if (mapped_file == MAP_FAILED) {
-        close(file_fd);
+        close(source_fd);
+        source_fd = -1;
         throw runtime_error("Failed to mmap source file");
     }
 
 
     // Initialize metadata with actual data for source
-    file_metadata.fileId = "file_hash";  // Replace with actual hash function if I endup implementing relaibility
     file_metadata.filename = fs::path(file_path).filename().string();
     file_metadata.fileSize = file_size;
     file_metadata.numPieces = num_pieces;
-    file_metadata.pieces.resize(num_pieces);
+    file_metadata.pieceSize = piece_size;
+    file_metadata.startupPieceSize = startup_piece_size;
+    file_metadata.startupPieces = startup_pieces;
 
-    // Initialize piece status and metadata
-    for (size_t i = 0; i < num_pieces; ++i) {
-        piece_status.emplace_back(true);  // All pieces are immediately available
-        
-        // Set up piece metadata
-        PieceMetaData pieceMeta;
-        pieceMeta.srcs.push_back(array<char, IP4_LENGTH>());
-        strncpy(pieceMeta.srcs.back().data(), node_ip.c_str(), IP4_LENGTH - 1);
-        // No checksum needed since using TCP
-        
-        // Store metadata
-        file_metadata.pieces[i] = pieceMeta;
+    // TCP only covers the wire, relays with bad memory or disks can still
+    // hand out garbage, so every piece is checked against the source's hash
+    compute_checksums();
+    file_metadata.merkleRoot = merkle_root(file_metadata.checksums);
+    file_metadata.fileId = to_hex(file_metadata.merkleRoot.data(), CHECKSUM_LENGTH);
+
+    // we are the only peer and hold everything
+    file_metadata.peers.push_back(array<char, IP4_LENGTH>());
+    strncpy(file_metadata.peers.back().data(), node_ip.c_str(), IP4_LENGTH - 1);
+    if (num_pieces > 0) {
+        file_metadata.sources.push_back({0, num_pieces - 1, 0});
     }
+
+    // Initialize piece status, all pieces are immediately available
+    piece_status = PieceBitset(num_pieces, true);
+    claimed_pieces_ = PieceBitset(num_pieces, true);
     // deconstruct();
     available_pieces_.store(num_pieces); 
 }
 
+// Runs run(0) .. run(count - 1) on the pool and waits until all are done
+void FileManager::parallel_for(size_t count, const std::function<void(size_t)>& run) {
+    struct Pending {
+        std::mutex mutex;
+        std::condition_variable done;
+        size_t tasks = 0;
+    } pending;
+
+    for (size_t k = 0; k < count; ++k) {
+        if (!thread_pool) {
+            run(k);
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(pending.mutex);
+            pending.tasks++;
+        }
+        thread_pool->enqueue([&run, k, &pending] {
+            run(k);
+            std::lock_guard<std::mutex> lock(pending.mutex);
+            if (--pending.tasks == 0) pending.done.notify_all();
+        });
+    }
+
+    std::unique_lock<std::mutex> lock(pending.mutex);
+    pending.done.wait(lock, [&pending] { return pending.tasks == 0; });
+}
+
+// Splits the pieces into runs of about HASH_BLOCK_BYTES and works on them in parallel
+void FileManager::for_each_block(const std::function<void(size_t, size_t)>& run) {
+    std::vector<size_t> starts;
+    for (size_t i = 0, bytes = 0; i < num_pieces; ++i) {
+        if (starts.empty() || bytes >= HASH_BLOCK_BYTES) {
+            starts.push_back(i);
+            bytes = 0;
+        }
+        bytes += piece_length(i);
+    }
+    starts.push_back(num_pieces);
+
+    parallel_for(starts.size() - 1, [&run, &starts](size_t k) {
+        run(starts[k], starts[k + 1]);
+    });
+}
+
+// Hashes every piece of the mapped source into the checksum column
+void FileManager::compute_checksums() {
+    file_metadata.checksums.assign(num_pieces * CHECKSUM_LENGTH, 0);
+    file_metadata.weakChecksums.assign(num_pieces, 0);
+
+    const char* data = static_cast<const char*>(mapped_file);
+    for_each_block([this, data](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            calculate_checksum(data + piece_offset(i), piece_length(i),
+                               file_metadata.checksums.data() + i * CHECKSUM_LENGTH);
+            file_metadata.weakChecksums[i] = rolling_checksum(data + piece_offset(i), piece_length(i));
+        }
+    });
+}
+
+bool FileManager::verify_piece(size_t i, const char* data) const {
+    if (file_metadata.checksums.empty()) return true;  // nothing to check against
+
+    array<char, CHECKSUM_LENGTH> digest;
+    calculate_checksum(data, piece_length(i), digest.data());
+    return std::memcmp(digest.data(), file_metadata.checksums.data() + i * CHECKSUM_LENGTH, CHECKSUM_LENGTH) == 0;
+}
+
  void  FileManager::deconstruct(){
 
     assert(is_source);
@@ -106,43 +255,133 @@ void FileManager::initialize_source() {
     // Populate metadata for each piece
     // do this in a separate thread to not take away time
     // lock the metadat
+    piece_status = PieceBitset(num_pieces);
     for (size_t i = 0; i < num_pieces; ++i) {
-        piece_status.emplace_back(false);
         thread_pool->enqueue([this, i] {
             split(i); 
-            piece_status[i].store(true);
-        });
+            piece_status.set(i);
+        }, ThreadPool::Priority::Background);
     }
  }
 
 
 void FileManager::initialize_receiver(const FileMetaData& metadata) {
+    // the leaves have to add up to the root or no piece could be trusted
+    if (!metadata.checksums.empty() && merkle_root(metadata.checksums) != metadata.merkleRoot) {
+        throw std::runtime_error("Piece checksums in metadata don't match their merkle root");
+    }
+
     // Directly set the metadata without file reading/deserialization
     file_metadata = metadata;
     num_pieces = metadata.numPieces;
+    piece_size = metadata.pieceSize;
+    startup_piece_size = metadata.startupPieceSize;
+    startup_pieces = metadata.startupPieces;
+
+    // pieces are received into buffers that fit the largest of them
+    bool resuming = resume && can_resume(metadata);
+    store_ = PieceStore::open(store_backend, file_path, file_metadata.fileSize,
+                              std::max(piece_size, startup_piece_size), resuming);
+
+    piece_status = PieceBitset(num_pieces);
+    claimed_pieces_ = PieceBitset(num_pieces);
+
+    if (resuming) {
+        restore_progress();
+    } else {
+        // whatever an earlier run left behind describes a different file now
+        std::remove((file_path + ".pieces").c_str());
+        if (resume) {
+            save_metadata();
+        } else {
+            std::remove((file_path + ".metadata").c_str());
+        }
+    }
+}
 
-    // std::filesystem::path mmaped_fil_path = std::filesystem::path(pieces_folder) / ("reconstructed_" + file_metadata.filename);
-    // std::filesystem::path mmaped_fil_path = std::filesystem::path(pieces_folder) / (file_metadata.filename);
-    merged_fd = open(file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
-    if (merged_fd < 0) {
-        throw std::runtime_error("Cannot create or open reconstructed file: " + file_path);
+// An earlier run can only be picked up if it was receiving the same content
+// cut into the same pieces
+bool FileManager::can_resume(const FileMetaData& metadata) const {
+    try {
+        FileMetaData saved = load_metadata(file_path + ".metadata");
+        return saved.fileId == metadata.fileId && saved.fileSize == metadata.fileSize
+            && saved.numPieces == metadata.numPieces && saved.pieceSize == metadata.pieceSize
+            && saved.startupPieceSize == metadata.startupPieceSize
+            && saved.startupPieces == metadata.startupPieces;
+    } catch (const std::runtime_error& e) {
+        return false;  // nothing saved, or not readable
     }
+}
+
+// Takes back the pieces an earlier run had on disk. The bitmap only lists
+// pieces that were synced before it was written, they are still hashed
+// again when there are checksums so a torn write or a bad disk is never relayed
+void FileManager::restore_progress() {
+    std::ifstream bitmap_file(file_path + ".pieces", std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(bitmap_file)), std::istreambuf_iterator<char>());
+    PieceBitset saved(num_pieces);
+    saved.merge_bytes(bytes);
+
+    for_each_block([this, &saved](size_t first, size_t last) {
+        vector<char> buffer;
+        for (size_t i = saved.find_first_set(first); i < last; i = saved.find_first_set(i + 1)) {
+            if (!file_metadata.checksums.empty()) {
+                buffer.resize(piece_length(i));
+                store_->read(buffer.data(), piece_offset(i), piece_length(i));
+                if (!verify_piece(i, buffer.data())) continue;
+            }
+            store_->written(piece_offset(i), piece_length(i));
+            claimed_pieces_.set(i);
+            piece_status.set(i);
+        }
+    });
+
+    available_pieces_.store(piece_status.count());
+    std::cout << "Resuming " << file_metadata.filename << " with " << available_pieces_.load()
+              << " of " << num_pieces << " pieces on disk\n";
+}
+
+void FileManager::maybe_save_progress() {
+    int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    if (now - last_progress_save_.load() < PROGRESS_INTERVAL_MS) return;
+    if (saving_progress_.exchange(true)) return;
+    last_progress_save_.store(now);
 
-    off_t total_size = num_pieces * piece_size;
-    if (ftruncate(merged_fd, total_size) == -1) {
-        close(merged_fd);
-        throw std::runtime_error("Error setting file size for reconstructed file");
+    auto save = [this] {
+        save_progress();
+        saving_progress_.store(false);
+    };
+    if (thread_pool) {
+        thread_pool->enqueue(save, ThreadPool::Priority::Background);
+    } else {
+        save();
     }
+}
 
-    mapped_file = mmap(nullptr, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, merged_fd, 0);
-    if (mapped_file == MAP_FAILED) {
-        close(merged_fd);
-        throw std::runtime_error("Error mapping reconstructed file into memory");
+// The snapshot is taken before the data sync so it never lists a piece that
+// isn't on disk yet, whatever lands in between waits for the next save
+void FileManager::save_progress() {
+    std::lock_guard<std::mutex> lock(progress_mutex_);
+    std::string bitmap = piece_status.to_bytes();
+    try {
+        store_->sync();
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Not saving progress: " << e.what() << "\n";
+        return;
     }
 
-    for (size_t i = 0; i < num_pieces; ++i) {
-        piece_status.emplace_back(false);
+    // written aside and renamed so a crash mid write keeps the previous bitmap
+    std::string path = file_path + ".pieces";
+    {
+        std::ofstream out(path + ".tmp", std::ios::binary | std::ios::trunc);
+        out.write(bitmap.data(), bitmap.size());
+        if (!out) {
+            std::cerr << "Cannot write " << path << ".tmp\n";
+            return;
+        }
     }
+    std::rename((path + ".tmp").c_str(), path.c_str());
 }
 
 
@@ -153,20 +392,14 @@ void FileManager::split(size_t i) {
     }
 
     // Seek to the beginning of the i-th piece
-    fileStream.seekg(piece_size * i, ios::beg);
+    fileStream.seekg(piece_offset(i), ios::beg);
     
     // Read the i-th chunk of the file
-    vector<char> buffer(piece_size);
-    fileStream.read(buffer.data(), piece_size);
+    vector<char> buffer(piece_length(i));
+    fileStream.read(buffer.data(), buffer.size());
     size_t bytes_read = fileStream.gcount();
     std::string piece_data(buffer.data(), bytes_read);
 
-    // Calculate checksum
-    PieceMetaData pieceMeta;
-    pieceMeta.srcs.push_back(array<char, IP4_LENGTH>());
-    strncpy(pieceMeta.srcs.back().data(), node_ip.c_str(), IP4_LENGTH - 1);
-    // pieceMeta.checksum = calculate_checksum(piece_data); // not required since we ae using tcp and no loss happens
-
     // Define the output file path for this piece
     std::filesystem::path piece_path = std::filesystem::path(pieces_folder) / ("piece_" + std::to_string(i));
     std::ofstream piece_file(piece_path, std::ios::binary);
@@ -177,23 +410,123 @@ void FileManager::split(size_t i) {
     // Write the piece data to the file and close it
     piece_file.write(piece_data.data(), bytes_read);
     piece_file.close();
+}
 
-    // Lock and update file metadata
-    {
-        std::lock_guard<std::mutex> lock(metadata_mutex);
-        file_metadata.pieces[i] = pieceMeta;
+void FileManager::calculate_checksum(const char* data, size_t size, char* out) {
+    SHA256(reinterpret_cast<const unsigned char*>(data), size, reinterpret_cast<unsigned char*>(out));
+}
+
+uint32_t FileManager::rolling_checksum(const char* data, size_t size) {
+    return RollingChecksum(data, size).value();
+}
+
+// Looks for the pieces of the new file anywhere in an old copy, rsync style:
+// the weak checksum of a window is slid along the old copy a byte at a time
+// and only windows whose weak checksum belongs to a piece get a sha256. The
+// old copy is scanned in segments on the pool, once for every piece size
+size_t FileManager::seed_from(const std::string& basis_path) {
+    assert(!is_source);
+    if (file_metadata.weakChecksums.empty() || file_metadata.checksums.empty() || num_pieces == 0) {
+        std::cerr << "Metadata has no checksums to match " << basis_path << " against\n";
+        return 0;
+    }
+
+    int fd = open(basis_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Cannot open old copy " << basis_path << "\n";
+        return 0;
+    }
+    struct stat st;
+    size_t basis_size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    void* mapped = basis_size ? mmap(nullptr, basis_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapped == MAP_FAILED) return 0;
+    madvise(mapped, basis_size, MADV_SEQUENTIAL);
+    const char* basis = static_cast<const char*>(mapped);
+    size_t before = available_pieces_.load();
+
+    // weak checksum -> pieces, one table per piece length. A short last piece
+    // is usually alone in its size, it is only looked for where it would be
+    // if nothing moved and at the very end of the old copy
+    std::map<size_t, std::unordered_multimap<uint32_t, size_t>> by_size;
+    for (size_t i = 0; i < num_pieces; ++i) {
+        by_size[piece_length(i)].emplace(file_metadata.weakChecksums[i], i);
+    }
+    size_t last = num_pieces - 1;
+    size_t last_length = piece_length(last);
+    if (by_size[last_length].size() == 1) {
+        by_size.erase(last_length);
+        for (size_t at : {piece_offset(last), basis_size - std::min(basis_size, last_length)}) {
+            if (at + last_length > basis_size) continue;
+            array<char, CHECKSUM_LENGTH> digest;
+            calculate_checksum(basis + at, last_length, digest.data());
+            if (std::memcmp(digest.data(), file_metadata.checksums.data() + last * CHECKSUM_LENGTH, CHECKSUM_LENGTH) == 0) {
+                seed_piece(last, basis + at);
+                break;
+            }
+        }
+    }
+
+    for (const auto& [window, table] : by_size) {
+        if (window > basis_size) continue;
+        size_t positions = basis_size - window + 1;
+        size_t segments = (positions + SEED_SEGMENT_BYTES - 1) / SEED_SEGMENT_BYTES;
+
+        parallel_for(segments, [&, window = window](size_t s) {
+            size_t pos = s * SEED_SEGMENT_BYTES;
+            size_t end = std::min(positions, pos + SEED_SEGMENT_BYTES);
+            RollingChecksum roll(basis + pos, window);
+            while (pos < end) {
+                auto [first, past] = table.equal_range(roll.value());
+                bool matched = false;
+                array<char, CHECKSUM_LENGTH> digest;
+                bool hashed = false;
+                for (auto it = first; it != past; ++it) {
+                    size_t i = it->second;
+                    if (claimed_pieces_.test(i)) continue;
+                    if (!hashed) {
+                        calculate_checksum(basis + pos, window, digest.data());
+                        hashed = true;
+                    }
+                    if (std::memcmp(digest.data(), file_metadata.checksums.data() + i * CHECKSUM_LENGTH, CHECKSUM_LENGTH) != 0) continue;
+                    // identical pieces all come from the same bytes
+                    matched = seed_piece(i, basis + pos) || matched;
+                }
+
+                if (matched && pos + window < end) {
+                    // blocks of an old copy rarely overlap, go on after this one
+                    pos += window;
+                    roll = RollingChecksum(basis + pos, window);
+                } else if (pos + 1 < positions) {
+                    roll.slide(basis[pos], basis[pos + window]);
+                    pos++;
+                } else {
+                    break;
+                }
+            }
+        });
     }
+
+    munmap(mapped, basis_size);
+    return available_pieces_.load() - before;
 }
 
-std::string FileManager::calculate_checksum(const std::string& data) {
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256(reinterpret_cast<const unsigned char*>(data.c_str()), data.size(), hash);
+// Copies a piece found in an old copy or decoded from symbols into the
+// output, it was checked against its sha256 already
+bool FileManager::seed_piece(size_t i, const char* data) {
+    if (claimed_pieces_.set(i)) return false;
 
-    std::stringstream ss;
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
-        ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+    char* buffer = store_->acquire(piece_offset(i), piece_length(i));
+    std::memcpy(buffer, data, piece_length(i));
+    try {
+        store_->commit(buffer, piece_offset(i), piece_length(i));
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Piece " << i << ": " << e.what() << "\n";
+        claimed_pieces_.reset(i);
+        return false;
     }
-    return ss.str();
+    update_piece_status(i);
+    return true;
 }
 
 // Private method to check the validity of an IP address
@@ -217,8 +550,8 @@ std::string FileManager::save_metadata() {
     // Serialize metadata
     std::string serialized_metadata = file_metadata.serialize();
 
-    // Construct the metadata file path: pieces_folder/original_filename.metadata
-    std::filesystem::path metadata_path = std::filesystem::path(pieces_folder) / (file_metadata.filename + ".metadata");
+    // Construct the metadata file path: file_path.metadata, resume looks for it there
+    std::filesystem::path metadata_path = file_path + ".metadata";
 
     // Open the file and write serialized metadata
     std::ofstream metadata_file(metadata_path, std::ios::binary);
@@ -234,55 +567,289 @@ std::string FileManager::save_metadata() {
     return metadata_path.string();
 }
 
+FileMetaData FileManager::load_metadata(const std::string& path) {
+    std::ifstream metadata_file(path, std::ios::binary);
+    if (!metadata_file) {
+        throw std::runtime_error("Cannot open metadata file: " + path);
+    }
+    std::string data((std::istreambuf_iterator<char>(metadata_file)), std::istreambuf_iterator<char>());
+    return FileMetaData::deserialize(data);
+}
+
 const FileMetaData& FileManager::get_metadata() const {
     return file_metadata;
 }
 
-void FileManager::reconstruct() {
-    
-    // Sync memory to file and resize to original size
-    if (msync(mapped_file, num_pieces * piece_size, MS_SYNC) == -1) {
-        munmap(mapped_file, num_pieces * piece_size);
-        close(merged_fd);
-        throw std::runtime_error("Error syncing mapped memory to file");
+std::string_view FileManager::serialized_metadata() {
+    std::call_once(serialized_once, [this] { serialized = file_metadata.serialize(); });
+    return serialized;
+}
+
+namespace {
+    // appends raw bytes of trivially copyable values
+    template <typename T>
+    void put(std::string& out, const T& value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    // bounds checked cursor over a serialized buffer
+    struct Reader {
+        std::string_view data;
+        size_t offset = 0;
+
+        const char* take(size_t size) {
+            if (size > data.size() - offset) {
+                throw runtime_error("Truncated metadata");
+            }
+            const char* at = data.data() + offset;
+            offset += size;
+            return at;
+        }
+
+        template <typename T>
+        T get() {
+            T value;
+            std::memcpy(&value, take(sizeof(T)), sizeof(T));
+            return value;
+        }
+    };
+
+    constexpr size_t SOURCE_RANGE_WIRE = 2 * sizeof(uint64_t) + sizeof(uint32_t);
+}
+
+string FileMetaData::serialize() const {
+    size_t checksum_width = checksums.empty() ? 0 : CHECKSUM_LENGTH;
+    assert(checksums.empty() || checksums.size() == numPieces * CHECKSUM_LENGTH);
+
+    string out;
+    out.reserve(64 + fileId.size() + filename.size() + peers.size() * IP4_LENGTH
+                + sources.size() * SOURCE_RANGE_WIRE + checksums.size()
+                + weakChecksums.size() * sizeof(uint32_t));
+
+    put(out, FileMetaDataView::MAGIC);
+    put(out, FileMetaDataView::VERSION);
+    put(out, static_cast<uint64_t>(fileSize));
+    put(out, static_cast<uint64_t>(numPieces));
+    put(out, static_cast<uint64_t>(pieceSize));
+    put(out, static_cast<uint64_t>(startupPieceSize));
+    put(out, static_cast<uint64_t>(startupPieces));
+
+    put(out, static_cast<uint32_t>(fileId.size()));
+    put(out, static_cast<uint32_t>(filename.size()));
+    out += fileId;
+    out += filename;
+
+    put(out, static_cast<uint32_t>(peers.size()));
+    for (const auto& peer : peers) {
+        out.append(peer.data(), IP4_LENGTH);
+    }
+
+    put(out, static_cast<uint64_t>(sources.size()));
+    for (const auto& range : sources) {
+        put(out, range.first);
+        put(out, range.last);
+        put(out, range.peer);
+    }
+
+    put(out, static_cast<uint32_t>(checksum_width));
+    if (checksum_width != 0) {
+        out.append(merkleRoot.data(), CHECKSUM_LENGTH);
+        out.append(checksums.data(), checksums.size());
+    }
+
+    assert(weakChecksums.empty() || weakChecksums.size() == numPieces);
+    put(out, static_cast<uint64_t>(weakChecksums.size()));
+    out.append(reinterpret_cast<const char*>(weakChecksums.data()), weakChecksums.size() * sizeof(uint32_t));
+    return out;
+}
+
+FileMetaDataView::FileMetaDataView(std::string_view data) {
+    Reader reader{data};
+    if (reader.get<uint32_t>() != MAGIC || reader.get<uint32_t>() != VERSION) {
+        throw runtime_error("Not a metadata buffer or unsupported version");
+    }
+    file_size_ = reader.get<uint64_t>();
+    num_pieces_ = reader.get<uint64_t>();
+    piece_size_ = reader.get<uint64_t>();
+    startup_piece_size_ = reader.get<uint64_t>();
+    startup_pieces_ = reader.get<uint64_t>();
+
+    uint32_t file_id_len = reader.get<uint32_t>();
+    uint32_t filename_len = reader.get<uint32_t>();
+    file_id_ = std::string_view(reader.take(file_id_len), file_id_len);
+    filename_ = std::string_view(reader.take(filename_len), filename_len);
+
+    peer_count_ = reader.get<uint32_t>();
+    peers_ = reader.take(peer_count_ * IP4_LENGTH);
+
+    source_count_ = reader.get<uint64_t>();
+    if (source_count_ > data.size() / SOURCE_RANGE_WIRE) {
+        throw runtime_error("Truncated metadata");
     }
+    sources_ = reader.take(source_count_ * SOURCE_RANGE_WIRE);
 
-    if (ftruncate(merged_fd, file_metadata.fileSize) == -1) {
-        munmap(mapped_file, num_pieces * piece_size);
-        close(merged_fd);
-        throw std::runtime_error("Error resizing reconstructed file");
+    uint32_t checksum_width = reader.get<uint32_t>();
+    if (checksum_width != 0) {
+        if (checksum_width != CHECKSUM_LENGTH || num_pieces_ > data.size() / CHECKSUM_LENGTH) {
+            throw runtime_error("Bad checksum column in metadata");
+        }
+        merkle_root_ = reader.take(CHECKSUM_LENGTH);
+        checksums_ = reader.take(num_pieces_ * CHECKSUM_LENGTH);
+    }
+
+    uint64_t weak_count = reader.get<uint64_t>();
+    if (weak_count != 0) {
+        if (weak_count != num_pieces_ || weak_count > data.size() / sizeof(uint32_t)) {
+            throw runtime_error("Bad weak checksum column in metadata");
+        }
+        weak_ = reader.take(weak_count * sizeof(uint32_t));
+    }
+}
+
+size_t FileMetaDataView::max_size(std::string_view header) {
+    Reader reader{header};
+    if (reader.get<uint32_t>() != MAGIC || reader.get<uint32_t>() != VERSION) {
+        throw runtime_error("Not a metadata buffer or unsupported version");
+    }
+    uint64_t file_size = reader.get<uint64_t>();
+    uint64_t num_pieces = reader.get<uint64_t>();
+    // every piece holds at least a byte, and the columns below stay far from overflowing
+    if (num_pieces > file_size + 1 || num_pieces > SIZE_MAX / 64) {
+        throw runtime_error("Bad piece count in metadata");
     }
+    // a range per piece plus one per peer is more sources than any real table has
+    return HEADER_SIZE
+        + 2 * sizeof(uint32_t) + 2 * MAX_NAME_LENGTH
+        + sizeof(uint32_t) + MAX_PEERS * IP4_LENGTH
+        + sizeof(uint64_t) + (num_pieces + MAX_PEERS) * SOURCE_RANGE_WIRE
+        + sizeof(uint32_t) + CHECKSUM_LENGTH + num_pieces * CHECKSUM_LENGTH
+        + sizeof(uint64_t) + num_pieces * sizeof(uint32_t);
+}
+
+std::string_view FileMetaDataView::peer(size_t id) const {
+    assert(id < peer_count_);
+    const char* ip = peers_ + id * IP4_LENGTH;
+    return std::string_view(ip, strnlen(ip, IP4_LENGTH));
+}
+
+SourceRange FileMetaDataView::source(size_t i) const {
+    assert(i < source_count_);
+    Reader reader{std::string_view(sources_ + i * SOURCE_RANGE_WIRE, SOURCE_RANGE_WIRE)};
+    SourceRange range;
+    range.first = reader.get<uint64_t>();
+    range.last = reader.get<uint64_t>();
+    range.peer = reader.get<uint32_t>();
+    return range;
+}
+
+std::string_view FileMetaDataView::merkle_root() const {
+    if (!merkle_root_) return {};
+    return std::string_view(merkle_root_, CHECKSUM_LENGTH);
+}
 
+std::string_view FileMetaDataView::checksums() const {
+    if (!checksums_) return {};
+    return std::string_view(checksums_, num_pieces_ * CHECKSUM_LENGTH);
 }
 
+std::string_view FileMetaDataView::checksum(size_t piece) const {
+    assert(checksums_ && piece < num_pieces_);
+    return std::string_view(checksums_ + piece * CHECKSUM_LENGTH, CHECKSUM_LENGTH);
+}
 
+uint32_t FileMetaDataView::weak_checksum(size_t piece) const {
+    assert(weak_ && piece < num_pieces_);
+    uint32_t value;
+    std::memcpy(&value, weak_ + piece * sizeof(uint32_t), sizeof(value));
+    return value;
+}
+
+FileMetaData FileMetaData::deserialize(std::string_view binary) {
+    FileMetaDataView view(binary);
+
+    FileMetaData fileMeta;
+    fileMeta.fileId = string(view.file_id());
+    fileMeta.filename = string(view.filename());
+    fileMeta.fileSize = view.file_size();
+    fileMeta.numPieces = view.num_pieces();
+    fileMeta.pieceSize = view.piece_size();
+    fileMeta.startupPieceSize = view.startup_piece_size();
+    fileMeta.startupPieces = view.startup_pieces();
+
+    fileMeta.peers.resize(view.peer_count());
+    for (size_t i = 0; i < view.peer_count(); ++i) {
+        std::string_view ip = view.peer(i);
+        std::memcpy(fileMeta.peers[i].data(), ip.data(), ip.size());
+    }
+
+    fileMeta.sources.reserve(view.source_count());
+    for (size_t i = 0; i < view.source_count(); ++i) {
+        fileMeta.sources.push_back(view.source(i));
+    }
 
+    std::string_view checksums = view.checksums();
+    fileMeta.checksums.assign(checksums.begin(), checksums.end());
+    if (view.has_checksums()) {
+        std::memcpy(fileMeta.merkleRoot.data(), view.merkle_root().data(), CHECKSUM_LENGTH);
+    }
+    if (view.has_weak_checksums()) {
+        fileMeta.weakChecksums.resize(view.num_pieces());
+        for (size_t i = 0; i < view.num_pieces(); ++i) {
+            fileMeta.weakChecksums[i] = view.weak_checksum(i);
+        }
+    }
+    return fileMeta;
+}
 
+void FileManager::reconstruct() {
+    store_->finish();
+    if (resume) save_progress();
+}
 
 std::string_view FileManager::send(size_t i) {
     assert(i < num_pieces);
-    assert(piece_status[i].load());
+    assert(piece_status.test(i));
+    assert(is_source);
     
-    size_t offset = i * piece_size;
-    const char* piece_data = static_cast<const char*>(mapped_file) + offset;
-    // std::cout << "Memory address of piece_data: " << static_cast<const void*>(piece_data) << std::endl;
-    // std::cout << "Reading memory: " <<piece_data[0] << std::endl;
+    const char* piece_data = static_cast<const char*>(mapped_file) + piece_offset(i);
+    return std::string_view(piece_data, piece_length(i));
+}
 
-    
+PieceExtent FileManager::extent(size_t i) const {
+    assert(i < num_pieces);
+    assert(piece_status.test(i));
+
+    // receivers serve relayed pieces out of the reconstructed file, the
+    // mapping is MAP_SHARED so the page cache already holds what we wrote
+    int fd = is_source ? source_fd : store_->fd();
+    return PieceExtent{fd, static_cast<off_t>(piece_offset(i)), piece_length(i)};
+}
+
+size_t FileManager::piece_offset(size_t i) const {
+    if (i < startup_pieces) {
+        return i * startup_piece_size;
+    }
+    return startup_pieces * startup_piece_size + (i - startup_pieces) * piece_size;
+}
+
+size_t FileManager::piece_length(size_t i) const {
+    assert(i < num_pieces);
     if (i == num_pieces - 1) {
         // Last piece - might be smaller
-        size_t last_piece_size = file_metadata.fileSize - offset;
-        if (last_piece_size < piece_size) {
-            // Need to pad the last piece
-            static std::string padded_piece;  // Static to avoid reallocation
-            padded_piece.resize(piece_size);
-            std::memcpy(padded_piece.data(), piece_data, last_piece_size);
-            std::memset(padded_piece.data() + last_piece_size, 0, piece_size - last_piece_size);
-            return std::string_view(padded_piece);
-        }
+        return file_metadata.fileSize - piece_offset(i);
     }
-    
-    return std::string_view(piece_data, piece_size);
+    return i < startup_pieces ? startup_piece_size : piece_size;
+}
+
+size_t FileManager::choose_piece_size(size_t file_size, size_t bdp_bytes) {
+    // never more than about TARGET_PIECES pieces, and at least one
+    // bandwidth-delay product so a single piece can fill the pipe
+    size_t wanted = std::max((file_size + TARGET_PIECES - 1) / TARGET_PIECES, bdp_bytes);
+    size_t size = MIN_PIECE_SIZE;
+    while (size < wanted && size < MAX_PIECE_SIZE) {
+        size *= 2;
+    }
+    return size;
 }
 
 
@@ -292,9 +859,17 @@ void FileManager::update_piece_status(size_t i) {
     // std::cout << "Updating piece " << i << " status\n" << std::flush;
     assert(i < num_pieces);
 
-    if (!piece_status[i].load()) {  // Only increment if piece wasn't available before
-            piece_status[i].store(true);
-            available_pieces_++;
+    // set reports the old bit so two workers landing the same piece only count it once
+    if (piece_status.set(i)) {
+        return;
+    }
+    available_pieces_++;
+    if (store_ && resume) {
+        maybe_save_progress();
+    }
+
+    for (const auto& listener : piece_listeners_) {
+        listener(i);
     }
    
     // std::cout << "Callbacks size: " << piece_callbacks_.size() << "\n" << std::flush;
@@ -322,33 +897,322 @@ void FileManager::update_piece_status(size_t i) {
 bool FileManager::has_piece(size_t i)
 {
     assert(i < num_pieces);
-    return piece_status[i].load();
+    return piece_status.test(i);
 }
 
 
 char* FileManager::get_piece_buffer(size_t i, size_t& size) {
         assert(i < num_pieces);
-        if (piece_status[i].load()) {
-            return nullptr;  // Already have this piece
+        if (claimed_pieces_.set(i)) {
+            return nullptr;  // Already have this piece, or someone is receiving it
+        }
+        size = piece_length(i);
+        return store_->acquire(piece_offset(i), size);
+}
+
+// Hashing a piece costs about as much as receiving it, so it happens on the
+// pool and the connection goes straight back to reading the next one. The
+// piece only becomes visible to relays and the scheduler once it checks out
+void FileManager::piece_received(size_t i, char* buffer, std::shared_ptr<const CodedPiece> coded) {
+    assert(claimed_pieces_.test(i));
+    auto land = [this, i, buffer, coded] {
+        land_piece(i, buffer, coded);
+        for (const auto& listener : processed_listeners_) {
+            listener(i);
+        }
+    };
+
+    if (thread_pool) {
+        thread_pool->enqueue(land, ThreadPool::Priority::High);
+    } else {
+        land();
+    }
+}
+
+void FileManager::land_piece(size_t i, char* buffer, const std::shared_ptr<const CodedPiece>& coded) {
+    if (coded && !PieceCodec::decode(coded->codec, coded->data.data(), coded->data.size(), buffer, piece_length(i))) {
+        std::cerr << "Piece " << i << " failed to decompress, fetching it again\n";
+        release_piece_buffer(i, buffer);
+        return;
+    }
+    if (!verify_piece(i, buffer)) {
+        Metrics::count(Metrics::CHECKSUM_FAILURES);
+        std::cerr << "Piece " << i << " failed its checksum, fetching it again\n";
+        release_piece_buffer(i, buffer);
+        return;
+    }
+    try {
+        store_->commit(buffer, piece_offset(i), piece_length(i));
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Piece " << i << ": " << e.what() << ", fetching it again\n";
+        claimed_pieces_.reset(i);
+        reclaimed_pieces_++;
+        return;
+    }
+    // relays pass the compressed form on as it came
+    if (coded) cache_coded(i, coded);
+    update_piece_status(i);
+}
+
+std::shared_ptr<const CodedPiece> FileManager::coded_piece(size_t i) {
+    std::lock_guard<std::mutex> lock(coded_mutex_);
+    auto it = coded_.find(i);
+    return it == coded_.end() ? nullptr : it->second;
+}
+
+void FileManager::encode_piece(size_t i, PieceCallback done) {
+    assert(piece_status.test(i) && thread_pool);
+    {
+        std::lock_guard<std::mutex> lock(coded_mutex_);
+        if (!coded_.count(i)) {
+            // a second peer asking while it is being compressed just waits for it
+            auto [it, first] = encoding_.try_emplace(i);
+            it->second.push_back(std::move(done));
+            if (!first) return;
+
+            thread_pool->enqueue([this, i] {
+                auto piece = std::make_shared<CodedPiece>();
+                if (is_source) {
+                    codec_.encode(static_cast<const char*>(mapped_file) + piece_offset(i), piece_length(i), *piece);
+                } else {
+                    vector<char> raw(piece_length(i));
+                    store_->read(raw.data(), piece_offset(i), raw.size());
+                    codec_.encode(raw.data(), raw.size(), *piece);
+                }
+                cache_coded(i, std::move(piece));
+
+                std::vector<PieceCallback> waiting;
+                {
+                    std::lock_guard<std::mutex> lock(coded_mutex_);
+                    waiting = std::move(encoding_[i]);
+                    encoding_.erase(i);
+                }
+                for (const auto& callback : waiting) {
+                    callback(i);
+                }
+            });
+            return;
         }
-        size = piece_size;
-        return static_cast<char*>(mapped_file) + (i * piece_size);
+    }
+    done(i);
+}
+
+void FileManager::cache_coded(size_t i, std::shared_ptr<const CodedPiece> piece) {
+    std::lock_guard<std::mutex> lock(coded_mutex_);
+    auto& slot = coded_[i];
+    if (slot) {
+        coded_bytes_ -= slot->data.size();
+    } else {
+        coded_order_.push_back(i);
+    }
+    coded_bytes_ += piece->data.size();
+    slot = std::move(piece);
+
+    // whatever is still being sent holds on to its own reference
+    while (coded_bytes_ > CODED_CACHE_BYTES && coded_order_.size() > 1) {
+        size_t oldest = coded_order_.front();
+        coded_order_.pop_front();
+        coded_bytes_ -= coded_[oldest]->data.size();
+        coded_.erase(oldest);
+    }
+}
+
+void FileManager::release_piece_buffer(size_t i, char* buffer) {
+    store_->discard(buffer);
+    claimed_pieces_.reset(i);
+    reclaimed_pieces_++;
+}
+
+void FileManager::add_piece_listener(PieceCallback listener) {
+    piece_listeners_.push_back(std::move(listener));
+}
+
+void FileManager::add_processed_listener(PieceCallback listener) {
+    processed_listeners_.push_back(std::move(listener));
 }
 
 void FileManager::register_piece_callback(size_t piece_idx, PieceCallback callback) {
-    std::lock_guard<std::mutex> lock(callbacks_mutex_);
-    piece_callbacks_[piece_idx].push_back(std::move(callback));
-    // handle lost wakeup cases
-    if (piece_status[piece_idx].load()) {
-        // Piece became available between initial check and registration
-        piece_callbacks_[piece_idx].pop_back(); // Remove our callback
-        callback(piece_idx);  // Execute callback
+    {
+        std::lock_guard<std::mutex> lock(callbacks_mutex_);
+        // handle lost wakeup cases, update_piece_status sets the status before
+        // it collects callbacks so one of the two always sees the other
+        if (!piece_status.test(piece_idx)) {
+            piece_callbacks_[piece_idx].push_back(std::move(callback));
+            return;
+        }
+    }
+    // Piece became available between initial check and registration
+    callback(piece_idx);
+}
+
+size_t FileManager::fountain_blocks() const {
+    return (num_pieces + FountainDecoder::BLOCK_PIECES - 1) / FountainDecoder::BLOCK_PIECES;
+}
+
+size_t FileManager::block_end(size_t block) const {
+    return std::min(block_first(block) + FountainDecoder::BLOCK_PIECES, num_pieces);
+}
+
+// pieces are padded out to the longest one in the block
+size_t FileManager::symbol_size(size_t block) const {
+    size_t size = 0;
+    for (size_t i = block_first(block); i < block_end(block); i++) {
+        size = std::max(size, piece_length(i));
+    }
+    return size;
+}
+
+bool FileManager::has_block(size_t block) {
+    for (size_t i = block_first(block); i < block_end(block); i++) {
+        if (!piece_status.test(i)) return false;
+    }
+    return true;
+}
+
+std::shared_ptr<FileManager::BlockDecode> FileManager::block_decode(size_t block) {
+    std::lock_guard<std::mutex> lock(blocks_mutex_);
+    auto& decode = blocks_[block];
+    if (!decode) decode = std::make_shared<BlockDecode>();
+    return decode;
+}
+
+size_t FileManager::block_missing(size_t block) {
+    size_t k = block_end(block) - block_first(block);
+    size_t held = 0;
+    for (size_t i = block_first(block); i < block_end(block); i++) {
+        held += piece_status.test(i);
+    }
+    if (held == k) return 0;
+
+    auto decode = block_decode(block);
+    std::lock_guard<std::mutex> lock(decode->mutex);
+    return decode->decoder ? k - decode->decoder->rank() : k - held;
+}
+
+void FileManager::encode_symbols(size_t block, size_t count, SymbolsCallback done) {
+    assert(has_block(block) && thread_pool);
+    thread_pool->enqueue([this, block, count, done = std::move(done)] {
+        size_t first = block_first(block);
+        size_t k = block_end(block) - first;
+        size_t size = symbol_size(block);
+
+        // receivers read the block back once for the whole batch
+        std::vector<std::string> read;
+        std::vector<const char*> pieces(k);
+        if (is_source) {
+            for (size_t j = 0; j < k; j++) {
+                pieces[j] = static_cast<const char*>(mapped_file) + piece_offset(first + j);
+            }
+        } else {
+            read.resize(k);
+            for (size_t j = 0; j < k; j++) {
+                read[j].resize(piece_length(first + j));
+                store_->read(&read[j][0], piece_offset(first + j), read[j].size());
+                pieces[j] = read[j].data();
+            }
+        }
+
+        std::vector<std::shared_ptr<const std::string>> symbols;
+        for (size_t c = 0; c < count; c++) {
+            uint64_t seed = next_seed_++;
+            auto symbol = std::make_shared<std::string>(sizeof(seed) + size, '\0');
+            std::memcpy(&(*symbol)[0], &seed, sizeof(seed));
+            for (uint64_t bits = FountainDecoder::coefficients(block, seed, k); bits != 0; bits &= bits - 1) {
+                size_t j = __builtin_ctzll(bits);
+                FountainDecoder::xor_into(&(*symbol)[sizeof(seed)], pieces[j], piece_length(first + j));
+            }
+            symbols.push_back(std::move(symbol));
+        }
+        done(std::move(symbols));
+    });
+}
+
+std::vector<std::shared_ptr<const std::string>> FileManager::received_symbols(size_t block, size_t from) {
+    std::shared_ptr<BlockDecode> decode;
+    {
+        std::lock_guard<std::mutex> lock(blocks_mutex_);
+        auto it = blocks_.find(block);
+        if (it == blocks_.end()) return {};
+        decode = it->second;
+    }
+    std::lock_guard<std::mutex> lock(decode->mutex);
+    if (from >= decode->received.size()) return {};
+    return {decode->received.begin() + from, decode->received.end()};
+}
+
+void FileManager::symbol_received(size_t block, std::string symbol) {
+    assert(block < fountain_blocks());
+    auto decode = [this, block, symbol = std::make_shared<const std::string>(std::move(symbol))] {
+        decode_symbol(block, symbol);
+    };
+    if (thread_pool) {
+        thread_pool->enqueue(decode, ThreadPool::Priority::High);
+    } else {
+        decode();
     }
 }
 
+void FileManager::decode_symbol(size_t block, std::shared_ptr<const std::string> symbol) {
+    size_t first = block_first(block);
+    size_t k = block_end(block) - first;
+    size_t size = symbol_size(block);
+    uint64_t seed;
+    if (symbol->size() != sizeof(seed) + size) {
+        std::cerr << "Symbol of block " << block << " has the wrong size, dropping it\n";
+        return;
+    }
+    std::memcpy(&seed, symbol->data(), sizeof(seed));
+
+    auto decode = block_decode(block);
+    std::lock_guard<std::mutex> lock(decode->mutex);
+    if (has_block(block)) return;   // solved while this one was queued
+
+    if (!decode->decoder) {
+        decode->decoder = std::make_unique<FountainDecoder>(k, size);
+        // pieces we hold already count as symbols of just that piece
+        std::string padded;
+        for (size_t j = 0; j < k; j++) {
+            if (!piece_status.test(first + j)) continue;
+            padded.assign(size, '\0');
+            store_->read(&padded[0], piece_offset(first + j), piece_length(first + j));
+            decode->decoder->add(uint64_t(1) << j, padded.data());
+        }
+    }
+
+    FountainDecoder& decoder = *decode->decoder;
+    if (!decoder.add(FountainDecoder::coefficients(block, seed, k), symbol->data() + sizeof(seed))) {
+        return;   // nothing new, a duplicate or a mix of what we had
+    }
+    decode->received.push_back(std::move(symbol));
+    if (!decoder.complete()) return;
+
+    decoder.solve();
+    for (size_t j = 0; j < k; j++) {
+        if (!piece_status.test(first + j) && !verify_piece(first + j, decoder.piece(j).data())) {
+            // one bad symbol spoils the whole block, start it over
+            Metrics::count(Metrics::CHECKSUM_FAILURES);
+            std::cerr << "Block " << block << " failed its checksums, decoding it again\n";
+            decode->decoder.reset();
+            decode->received.clear();
+            return;
+        }
+    }
+    for (size_t j = 0; j < k; j++) {
+        if (!piece_status.test(first + j)) {
+            seed_piece(first + j, decoder.piece(j).data());
+        }
+    }
+    // from here on we make our own symbols for it
+    decode->decoder.reset();
+    decode->received.clear();
+    decode->received.shrink_to_fit();
+}
+
 void FileManager::clean_up(){
     // Unmap and close
-    munmap(mapped_file, num_pieces * piece_size);
-    close(merged_fd);
-    merged_fd = -1;
-}
\ No newline at end of file
+    if (mapped_file != MAP_FAILED) munmap(mapped_file, file_metadata.fileSize);
+    mapped_file = MAP_FAILED;
+    store_.reset();
+    if (source_fd >= 0) close(source_fd);
+    source_fd = -1;
+}
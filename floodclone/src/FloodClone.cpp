@@ -5,12 +5,29 @@
 #include <thread>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <limits>
+#include <algorithm>
+#include <deque>
+#include <set>
+#include <cerrno>
+#include <cmath>
 
 constexpr int LISTEN_PORT = 9089;
+constexpr int COMPLETION_RETRIES = 300;
+constexpr int COMPLETION_RETRY_MS = 100;
+constexpr size_t MAX_STREAMS = 4;         // parallel connections per path
+constexpr double STREAM_HEADROOM = 0.7;    // share of its window a stream is planned to fill
+constexpr int STREAM_RESIZE_MS = 250;
+constexpr size_t FOUNTAIN_BATCH = 8;       // symbols per request
+constexpr size_t FOUNTAIN_SLACK = 2;       // symbols asked for beyond what a block still needs
+constexpr int FOUNTAIN_EMPTY_MS = 20;      // a block a peer had nothing for is left alone this long
+constexpr size_t FOUNTAIN_RETRIES = 10;    // broken connections in a row before a path is given up
 
 FloodClone::FloodClone(const Arguments& args)
     : thread_pool(6), args(args), 
-      start_time(std::chrono::system_clock::now())
+      start_time(std::chrono::system_clock::now()),
+      completion_(args.src_name),
+      planner(args.src_name)
 {
     setup_net_info();
     setup_node();
@@ -37,9 +54,28 @@ void FloodClone::setup_net_info() {
                     route[2]            // path
                 };
                 network_map[src_node][dest_node].push_back(route_info);
+                if (route_info.hop_count == 1) {
+                    planner.add_link(src_node, dest_node, route_info.interface);
+                    completion_.add_link(src_node, dest_node);
+                }
             }
         }
     }
+
+    planned_ = planner.plan();
+    if (!planned_) {
+        std::cout << "Planner: source can't reach every node, falling back to hop order\n";
+        return;
+    }
+    std::cout << "Planner: " << planner.shared_interfaces().size() << " shared interfaces, "
+              << planner.num_trees() << " trees\n";
+    for (size_t t = 0; t < planner.num_trees(); t++) {
+        std::cout << "  tree " << t << " rate " << planner.tree_rate(t);
+        if (args.node_name != args.src_name) {
+            std::cout << ", we get it from " << planner.parent(args.node_name, t);
+        }
+        std::cout << "\n";
+    }
 }
 
 std::vector<std::string> FloodClone::find_immediate_neighbors() {
@@ -126,8 +162,7 @@ std::vector<ConnectionOption> FloodClone::get_ip(const std::string& target_node)
     return connection_options;
 }
 void FloodClone::setup_node() {
-    total_nodes_ = network_map.size();
-    std::cout << "Total nodes "<< total_nodes_ << "\n";
+    std::cout << "Total nodes "<< network_map.size() << "\n";
 
     auto node_ips = ip_map[args.node_name];
     if (node_ips.empty()) {
@@ -137,7 +172,6 @@ void FloodClone::setup_node() {
     std::cout << args.node_name << " using IP " << my_ip << std::endl;
     
     if (args.mode == "source") {
-        total_nodes_ -= 1; // source doens't expect notificaiton from itself
         file_manager = std::make_unique<FileManager>(
             args.file_path, 0, my_ip, 
             args.pieces_dir, &thread_pool, true, nullptr
@@ -148,12 +182,35 @@ void FloodClone::setup_node() {
             my_ip, LISTEN_PORT, thread_pool, *file_manager
         );
     } else {
-
-        total_nodes_ -= 2; // destination doesnt' expect notifiation from src and itself
         connection_manager = std::make_unique<ConnectionManager>(
             my_ip, LISTEN_PORT, thread_pool
         );
     }
+    connection_manager->set_compression(args.compress);
+
+    // a relay passes what it gets on, when it shares our interface with
+    // leaves it gets the bigger share
+    connection_manager->set_send_policy(SendScheduler::parse_policy(args.send_policy));
+    for (const auto& [node, interfaces] : ip_map) {
+        if (node == args.node_name) continue;
+        size_t downstream = downstream_of(node);
+        for (const auto& [iface, ip] : interfaces) {
+            connection_manager->set_fanout(ip, downstream);
+        }
+    }
+
+    // a subscriber gets from us the pieces of the trees we are its parent
+    // in, so every piece crosses each edge of its tree once
+    if (planned_) {
+        std::unordered_map<std::string, std::string> node_of;
+        for (const auto& [node, interfaces] : ip_map) {
+            for (const auto& [iface, ip] : interfaces) node_of[ip] = node;
+        }
+        connection_manager->set_push_filter([this, node_of](const std::string& address, size_t piece) {
+            auto it = node_of.find(address);
+            return it != node_of.end() && planner.parent(it->second, planner.tree_of(piece)) == args.node_name;
+        });
+    }
 }
 
 void FloodClone::start() {
@@ -170,12 +227,10 @@ void FloodClone::start() {
         });
 
         //wait for all the nodes to complete
-        std::unique_lock<std::mutex> lock(node_mtx);
-        while (completed_nodes_ < total_nodes_) {
-            node_change.wait(lock);
-        }
+        wait_for_completion();
 
-        std::cout << "Notification found from " << total_nodes_ << " nodes\n"<<std::flush;
+        std::cout << "Notification found from " << completion_.finish_times().size() << " nodes\n"<<std::flush;
+        write_tuning();
 
         connection_manager->stop_listening();
 
@@ -193,30 +248,45 @@ void FloodClone::start() {
 
         std::cout << "Destination: Started listening thread.\n";
 
-        // First find the closest node we should request from
+        // First find the closest node we should request from, neighbors
+        // nearest to the source come first
         auto neighbors = find_immediate_neighbors();
-        
+        std::sort(neighbors.begin(), neighbors.end(), [this](const std::string& a, const std::string& b) {
+            return std::make_pair(hops_to_source(a), a) < std::make_pair(hops_to_source(b), b);
+        });
 
-        std::vector<ConnectionOption> ips = get_ip(neighbors[0]);
+        std::vector<ConnectionOption> ips = get_paths(neighbors[0]);
         for (auto &ip: ips){
-            std::cout<< "Found IP " << ip.target_ip << "on interface " << ip.local_interface << "\n" << std::flush;
+            std::cout<< "Found IP " << ip.target_ip << " on interface " << ip.local_interface << "\n" << std::flush;
         }
         
         std::cout << "Destination: Requesting from " << neighbors[0] 
                   << " (" << ips[0].target_ip << ")\n";
 
-        // I will need to update request_metadata, connect_to and others to be able to 
-        // reconinze when there are mulitple interfaces
-        auto metadata = connection_manager->request_metadata(ips[0].target_ip, LISTEN_PORT);
+        auto metadata = connection_manager->request_metadata(ips[0].target_ip, LISTEN_PORT, ips[0].local_interface);
+
+        // the old copy usually sits where the new one goes, move it out of
+        // the way before the output gets truncated
+        std::string basis = args.basis;
+        if (!basis.empty() && basis == args.file_path && std::rename(basis.c_str(), (basis + ".basis").c_str()) == 0) {
+            basis += ".basis";
+        }
         
         file_manager = std::make_unique<FileManager>(
             args.file_path, 0, my_ip,
-            args.pieces_dir, &thread_pool, false, &metadata
+            args.pieces_dir, &thread_pool, false, &metadata,
+            PieceStore::parse_backend(args.store), args.resume
         );
 
         std::cout << "Destination: FileManager created. Num pieces: " 
                     << metadata.numPieces << "\n";
 
+        if (!basis.empty()) {
+            size_t found = file_manager->seed_from(basis);
+            std::cout << "Delta: " << found << " of " << metadata.numPieces
+                      << " pieces copied from " << basis << "\n";
+        }
+
         connection_manager->set_file_manager(*file_manager);
 
         // set detsination to listening state only once it has metadata so 
@@ -225,50 +295,14 @@ void FloodClone::start() {
             connection_manager->start_listening();
         });
 
-        
-        while (true) {
-            for (const auto& neighbor : neighbors) {
-                try {
-                    std::vector<ConnectionOption> neighbor_ips = get_ip(neighbor);
-                    std::cout << "Attempting transfer from neighbor: " << neighbor 
-                            << " (" << neighbor_ips[0].target_ip << ")\n";
-
-                    connection_manager->request_pieces(
-                        neighbor_ips[0].target_ip, LISTEN_PORT,
-                        -1,  // no single piece
-                        {{0, metadata.numPieces - 1}},  // request full range
-                        {}   // no specific list
-                    );
-                    
-                    // If we get here, transfer was successful
-                    std::cout << "Transfer completed successfully from " << neighbor << "\n";
-                    goto transfer_complete;  // Break out of both loops
-
-                } catch (const std::runtime_error& e) {
-                    std::string error = e.what();
-                    if (error == "TIMEOUT" || error == "BUSY") {
-                        std::cout << "Neighbor " << neighbor << " is busy, trying next neighbor\n";
-                        continue;
-                    }
-                    else if (error == "NOT_AVAIL"){
-                        std::cout << "Neighbor " << neighbor << " doesn't have any NOT_AVAIL, trying next neighbor\n";
-                        continue;
-                    }
-                    // For non-BUSY errors, rethrow
-                    throw;
-                }
-            }
-            // If we get here, all neighbors were busy - sleep before retrying
-            std::cout << "All neighbors busy, waiting before retry...\n";
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
-        }
-
-        transfer_complete:
-            thread_pool.wait();
-            std::cout << "Client: Received all pieces\n";
-
-       
 
+        if (args.fountain) {
+            download_fountain(metadata, neighbors);
+        } else if (args.push) {
+            download_push(metadata, neighbors);
+        } else {
+            download(metadata, neighbors);
+        }
         thread_pool.wait();
         std::cout << "Client: Received all pieces\n";
 
@@ -280,15 +314,14 @@ void FloodClone::start() {
         }
 
         file_manager->reconstruct();
+        // the moved old copy is only dropped once the new one is whole, a
+        // failed run leaves it behind for the next try
+        if (basis != args.basis) std::remove(basis.c_str());
         record_time();
         
-        notify_completion();
-        
-        std::unique_lock<std::mutex> lock(node_mtx);
-        while (completed_nodes_ < total_nodes_) {
-            node_change.wait(lock);
-        }
-        std::cout << "Finished completion "<< completed_nodes_ << " of " << total_nodes_ << std::flush;
+        wait_for_completion();
+        std::cout << "Finished completion of " << network_map.size() - 1 << " nodes\n" << std::flush;
+        write_tuning();
 
         file_manager->clean_up();
         connection_manager->stop_listening();
@@ -309,6 +342,7 @@ void FloodClone::start() {
     }
 
     is_listening_ = false;
+    shutdown(completion_socket_, SHUT_RDWR);   // wakes the accept
     if (completion_thread_.joinable()) {
         completion_thread_.join();
     }
@@ -320,6 +354,423 @@ void FloodClone::start() {
 
 }
 
+int FloodClone::hops_to_source(const std::string& node) {
+    if (node == args.src_name) return 0;
+
+    auto routes_it = network_map.find(node);
+    if (routes_it == network_map.end()) return std::numeric_limits<int>::max();
+    auto src_routes = routes_it->second.find(args.src_name);
+    if (src_routes == routes_it->second.end()) return std::numeric_limits<int>::max();
+
+    int hops = std::numeric_limits<int>::max();
+    for (const auto& route : src_routes->second) {
+        hops = std::min(hops, route.hop_count);
+    }
+    return hops;
+}
+
+// Requests only ever flow towards the source: a neighbor is upstream when it is
+// closer to the source than us, ties are broken by name. The order is total so
+// two relays can never end up waiting on each other for pieces neither has.
+bool FloodClone::is_upstream(const std::string& neighbor) {
+    return std::make_pair(hops_to_source(neighbor), neighbor) <
+           std::make_pair(hops_to_source(args.node_name), args.node_name);
+}
+
+// Nodes that get pieces through node: its descendants averaged over the
+// plan's trees, or without a plan its one hop neighbors further from the source
+size_t FloodClone::downstream_of(const std::string& node) {
+    size_t count = 0;
+    if (planned_) {
+        for (size_t t = 0; t < planner.num_trees(); t++) {
+            for (const auto& [other, routes] : network_map) {
+                for (std::string up = planner.parent(other, t); !up.empty(); up = planner.parent(up, t)) {
+                    if (up == node) {
+                        count++;
+                        break;
+                    }
+                }
+            }
+        }
+        return (count + planner.num_trees() / 2) / planner.num_trees();
+    }
+
+    auto routes_it = network_map.find(node);
+    if (routes_it == network_map.end()) return 0;
+    for (const auto& [other, routes] : routes_it->second) {
+        bool one_hop = std::any_of(routes.begin(), routes.end(), [](const RouteInfo& r) { return r.hop_count == 1; });
+        if (one_hop && std::make_pair(hops_to_source(node), node) < std::make_pair(hops_to_source(other), other)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Every pair get_ip() returns is a combination of one of our interfaces and
+// one of the neighbor's addresses, but only the pairs the kernel actually
+// routes out of that interface are real links. Keep one of those per local
+// interface so each physical link to the neighbor gets its own connection.
+std::vector<ConnectionOption> FloodClone::get_paths(const std::string& neighbor) {
+    return routed_paths(get_ip(neighbor));
+}
+
+std::vector<ConnectionOption> FloodClone::routed_paths(const std::vector<ConnectionOption>& options) {
+    std::vector<ConnectionOption> paths;
+    std::set<std::string> used_interfaces;
+
+    for (const auto& option : options) {
+        if (used_interfaces.count(option.local_interface)) continue;
+        if (ConnectionManager::route_interface(option.target_ip) != option.local_interface) continue;
+        used_interfaces.insert(option.local_interface);
+        paths.push_back(option);
+    }
+
+    if (paths.empty()) {
+        // routing table doesn't match the topology we were given, let the kernel pick
+        paths.push_back({.target_ip = options[0].target_ip, .local_interface = ""});
+    }
+    return paths;
+}
+
+void FloodClone::download(const FileMetaData& metadata, const std::vector<std::string>& neighbors) {
+    PieceScheduler scheduler(*file_manager, metadata.numPieces);
+
+    // the source's uplink is shared by every node next to it, when an upstream
+    // relay can feed us we leave the source to it and only fall back on it
+    bool has_relay = std::any_of(neighbors.begin(), neighbors.end(), [this](const std::string& n) {
+        return n != args.src_name && is_upstream(n);
+    });
+
+    // with a plan each neighbor is asked blindly only for the pieces of the
+    // trees it is our parent in, the trees are acyclic so no two relays wait
+    // on each other. The source is left to its trees like any relay
+    std::vector<std::string> parents;
+    if (planned_) {
+        for (size_t t = 0; t < planner.num_trees(); t++) {
+            parents.push_back(planner.parent(args.node_name, t));
+        }
+    }
+
+    // deque so the groups stay put while the workers hold on to them
+    std::deque<StreamGroup> groups;
+    std::vector<std::thread> watchers;
+    for (const auto& neighbor : neighbors) {
+        bool is_src = neighbor == args.src_name;
+        size_t peer;
+        if (planned_) {
+            PieceBitset assigned(metadata.numPieces);
+            for (size_t i = 0; i < metadata.numPieces; i++) {
+                if (parents[planner.tree_of(i)] == neighbor) assigned.set(i);
+            }
+            bool feeds_all = std::all_of(parents.begin(), parents.end(), [&](const std::string& p) { return p == neighbor; });
+            peer = scheduler.add_peer(neighbor, false, is_src, is_src && !feeds_all);
+            std::cout << "Scheduling neighbor " << neighbor << " (parent for " << assigned.count() << " pieces)\n";
+            scheduler.assign(peer, std::move(assigned));
+        } else {
+            bool upstream = is_upstream(neighbor);
+            peer = scheduler.add_peer(neighbor, upstream, is_src, is_src && has_relay);
+            std::cout << "Scheduling neighbor " << neighbor << (upstream ? " (upstream)" : "") << "\n";
+        }
+
+        auto options = get_paths(neighbor);
+        for (const auto& option : options) {
+            std::string label = neighbor + " via " + (option.local_interface.empty() ? "default" : option.local_interface);
+            StreamGroup& group = groups.emplace_back();
+            group.option = option;
+            group.piece_size = metadata.pieceSize;
+            for (size_t stream = 0; stream < MAX_STREAMS; stream++) {
+                std::string stream_label = stream ? label + " #" + std::to_string(stream) : label;
+                group.paths.push_back(scheduler.add_path(peer, stream_label, groups.size() - 1));
+            }
+            std::cout << "  path " << label << " (" << option.target_ip << ")\n";
+        }
+
+        // everyone but the source announces what it has, one watch per peer is enough
+        if (!is_src) {
+            watchers.emplace_back([this, &scheduler, peer, option = options[0]]() {
+                connection_manager->watch_pieces(option.target_ip, LISTEN_PORT, option.local_interface,
+                    [&](std::string_view bitfield) { scheduler.merge_have(peer, bitfield); },
+                    [&](size_t piece) { scheduler.mark_have(peer, piece); });
+            });
+        }
+    }
+
+    // one worker per stream so every inbound link is busy at the same time,
+    // streams a group doesn't use yet just wait
+    std::vector<std::thread> workers;
+    for (auto& group : groups) {
+        group.resized = std::chrono::steady_clock::now();
+        for (size_t stream = 0; stream < group.paths.size(); stream++) {
+            workers.emplace_back([this, &scheduler, &group, stream]() {
+                fetch_from(scheduler, group, stream);
+            });
+        }
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    connection_manager->stop_watching();
+    for (auto& watcher : watchers) {
+        watcher.join();
+    }
+
+    if (!scheduler.done()) {
+        throw std::runtime_error("All neighbors failed before the transfer completed");
+    }
+}
+
+// Enough streams that together they can keep rate * rtt in flight with
+// every window only partly full. A stream limited by its window shows up as
+// needing more than it has, streams that sit mostly empty let the group
+// shrink back
+void FloodClone::resize_streams(PieceScheduler& scheduler, StreamGroup& group) {
+    auto now = std::chrono::steady_clock::now();
+    if (now - group.resized < std::chrono::milliseconds(STREAM_RESIZE_MS)) return;
+    group.resized = now;
+
+    auto info = connection_manager->stream_info(group.option.target_ip, LISTEN_PORT, group.option.local_interface, 0);
+    if (!info || info->rtt <= 0 || info->window == 0) return;
+
+    size_t active = group.active.load();
+    double rate = 0;   // bytes per second over all streams
+    for (size_t stream = 0; stream < active; stream++) {
+        rate += scheduler.path_rate(group.paths[stream]) * group.piece_size;
+    }
+    if (rate <= 0) return;
+
+    size_t wanted = streams_wanted(rate, info->rtt, info->window, group.paths.size());
+    if (wanted != active) {
+        std::cout << "Streams to " << scheduler.path_label(group.paths[0]) << ": " << active << " -> " << wanted
+                  << " (rtt " << info->rtt * 1000 << " ms, window " << info->window
+                  << ", " << rate / 1e6 << " MB/s)\n";
+        group.active = wanted;
+    }
+}
+
+size_t FloodClone::streams_wanted(double rate, double rtt, size_t window, size_t max_streams) {
+    double in_flight = rate * rtt;
+    size_t wanted = static_cast<size_t>(std::ceil(in_flight / (STREAM_HEADROOM * window)));
+    return std::clamp<size_t>(wanted, 1, max_streams);
+}
+
+void FloodClone::fetch_from(PieceScheduler& scheduler, StreamGroup& group, size_t stream) {
+    size_t path = group.paths[stream];
+    const std::string& label = scheduler.path_label(path);
+    const std::string& target_ip = group.option.target_ip;
+    const std::string& local_interface = group.option.local_interface;
+
+    // pieces expected for each request already sent, oldest first
+    std::deque<size_t> in_flight;
+
+    while (!scheduler.done()) {
+        bool receiving = false;
+        try {
+            // keep the pipeline full so the link never waits on our next request,
+            // a stream the group no longer uses only finishes what it asked for
+            while (stream < group.active && in_flight.size() < PieceScheduler::PIPELINE_DEPTH) {
+                auto ranges = scheduler.next_batch(path);
+                if (ranges.empty()) break;
+                in_flight.push_back(connection_manager->send_piece_request(
+                    target_ip, LISTEN_PORT,
+                    -1,      // no single piece
+                    ranges,
+                    {},      // no specific list
+                    local_interface,
+                    stream
+                ));
+            }
+
+            if (in_flight.empty()) {
+                // nothing this path can give us right now
+                scheduler.wait_for_work(path, std::chrono::milliseconds(5));
+                continue;
+            }
+
+            receiving = true;
+            connection_manager->receive_pieces(target_ip, LISTEN_PORT, local_interface, stream);
+            in_flight.pop_front();
+            scheduler.complete(path);
+            if (stream == 0) {
+                resize_streams(scheduler, group);
+            }
+        } catch (const std::runtime_error& e) {
+            std::string error = e.what();
+            bool refused = error == "TIMEOUT" || error == "BUSY" || error == "NOT_AVAIL";
+            if (refused && receiving) {
+                // only the oldest request was turned down, the connection is
+                // still in sync and the requests behind it carry on
+                in_flight.pop_front();
+                scheduler.release_oldest(path);
+            } else if (refused && in_flight.empty()) {
+                // could not connect, nothing went out
+                scheduler.release(path);
+            } else {
+                // broken mid stream, whatever is still on the wire is lost
+                scheduler.release(path);
+                connection_manager->close_connection(target_ip, LISTEN_PORT, local_interface, stream);
+                in_flight.clear();
+                if (!refused) {
+                    std::cerr << "Dropping path " << label << ": " << error << "\n";
+                    scheduler.drop_path(path);
+                    return;
+                }
+            }
+            // try again later, the other workers keep going meanwhile
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+// Push mode: we subscribe to our parent in each of the plan's trees and
+// they stream us their trees' pieces as they get them, no request goes out
+// and each link's rate is decided by the sender sharing it. Whatever a
+// parent couldn't deliver is pulled afterwards
+void FloodClone::download_push(const FileMetaData& metadata, const std::vector<std::string>& neighbors) {
+    if (!planned_) {
+        std::cout << "Push: no plan to push along, pulling instead\n";
+        download(metadata, neighbors);
+        return;
+    }
+
+    std::set<std::string> parents;
+    for (size_t t = 0; t < planner.num_trees(); t++) {
+        parents.insert(planner.parent(args.node_name, t));
+    }
+
+    std::vector<std::thread> subscriptions;
+    for (const auto& parent : parents) {
+        subscriptions.emplace_back([this, parent]() {
+            ConnectionOption option = get_paths(parent)[0];
+            try {
+                size_t pieces = connection_manager->subscribe(option.target_ip, LISTEN_PORT, option.local_interface);
+                std::cout << "Push: " << pieces << " pieces from " << parent << "\n";
+            } catch (const std::runtime_error& e) {
+                std::cerr << "Push: lost " << parent << ": " << e.what() << "\n";
+            }
+        });
+    }
+    for (auto& subscription : subscriptions) {
+        subscription.join();
+    }
+
+    thread_pool.wait();   // the last pieces may still be checked
+    size_t missing = metadata.numPieces - file_manager->available_pieces();
+    if (missing > 0) {
+        std::cout << "Push: pulling the " << missing << " pieces left\n";
+        download(metadata, neighbors);
+    }
+}
+
+// Fountain mode: no piece is owed by any particular peer, every path just
+// asks for symbols of a block that still needs them and any mix of peers
+// completes it. Duplicated effort on parallel paths still counts, only the
+// number of symbols asked for beyond what a block needs is capped
+void FloodClone::download_fountain(const FileMetaData& metadata, const std::vector<std::string>& neighbors) {
+    size_t blocks = file_manager->fountain_blocks();
+    std::vector<std::atomic<size_t>> asked(blocks);   // symbols on their way per block
+
+    // every destination starts its stream from the source at its own share
+    // of the file and everyone else asks it for that share first, so
+    // relays hold what their neighbors want instead of all racing for the
+    // same blocks
+    std::vector<std::string> destinations;
+    for (const auto& [node, routes] : network_map) {
+        if (node != args.src_name) destinations.push_back(node);
+    }
+    std::sort(destinations.begin(), destinations.end());
+    auto share = [&](const std::string& node) {
+        size_t rank = std::find(destinations.begin(), destinations.end(), node) - destinations.begin();
+        return rank * blocks / destinations.size();
+    };
+
+    std::vector<std::thread> workers;
+    for (const auto& neighbor : neighbors) {
+        size_t start = share(neighbor == args.src_name ? args.node_name : neighbor);
+        for (const auto& option : get_paths(neighbor)) {
+            std::cout << "Fountain path " << neighbor << " via "
+                      << (option.local_interface.empty() ? "default" : option.local_interface)
+                      << " from block " << start << "\n";
+            workers.emplace_back([this, &asked, start, option]() {
+                fetch_symbols_from(asked, start, option);
+            });
+        }
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    if (file_manager->available_pieces() < metadata.numPieces) {
+        thread_pool.wait();   // the last symbols may still be decoding
+    }
+    if (file_manager->available_pieces() < metadata.numPieces) {
+        throw std::runtime_error("All neighbors failed before the transfer completed");
+    }
+}
+
+// Blocks are asked for in order from start on, wrapping around
+void FloodClone::fetch_symbols_from(std::vector<std::atomic<size_t>>& asked, size_t start, const ConnectionOption& option) {
+    size_t blocks = asked.size();
+    size_t num_pieces = file_manager->get_metadata().numPieces;
+    size_t done = 0;   // blocks from start on that are complete, they stay that way
+    size_t failures = 0;
+    std::unordered_map<size_t, std::chrono::steady_clock::time_point> empty;
+
+    while (file_manager->available_pieces() < num_pieces && done < blocks) {
+        auto now = std::chrono::steady_clock::now();
+        size_t block = blocks;
+        size_t want = 0;
+        bool complete_so_far = true;
+        for (size_t n = done; n < blocks; n++) {
+            size_t b = (start + n) % blocks;
+            size_t missing = file_manager->block_missing(b);
+            if (missing == 0) {
+                if (complete_so_far) done = n + 1;
+                continue;
+            }
+            complete_so_far = false;
+
+            auto skip = empty.find(b);
+            if (skip != empty.end() && skip->second > now) continue;
+            size_t in_flight = asked[b].load();
+            if (in_flight >= missing + FOUNTAIN_SLACK) continue;
+            block = b;
+            want = std::min(missing + FOUNTAIN_SLACK - in_flight, FOUNTAIN_BATCH);
+            break;
+        }
+        if (block == blocks) {
+            // everything left is covered or this peer has nothing for it yet
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            continue;
+        }
+
+        asked[block] += want;
+        size_t got = 0;
+        bool busy = false;
+        try {
+            connection_manager->send_symbol_request(option.target_ip, LISTEN_PORT, block, want, option.local_interface);
+            got = connection_manager->receive_symbols(option.target_ip, LISTEN_PORT, want, option.local_interface);
+            failures = 0;
+        } catch (const std::runtime_error& e) {
+            std::string error = e.what();
+            busy = error == "BUSY";
+            if (!busy && error != "NOT_AVAIL" && error != "TIMEOUT") {
+                // broken mid answer, the rest of it is lost with the connection
+                connection_manager->close_connection(option.target_ip, LISTEN_PORT, option.local_interface);
+                if (++failures > FOUNTAIN_RETRIES) {
+                    std::cerr << "Dropping fountain path to " << option.target_ip << ": " << error << "\n";
+                    asked[block] -= want;
+                    return;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        asked[block] -= want;
+        if (got < want && !busy) {
+            empty[block] = now + std::chrono::milliseconds(FOUNTAIN_EMPTY_MS);
+        }
+    }
+}
+
 void FloodClone::record_time() {
    
     end_time = std::chrono::system_clock::now(); 
@@ -336,6 +787,25 @@ void FloodClone::record_time() {
     timestamp_file << end_micros;
 }
 
+// What the socket tuner settled on for every peer we talked to, next to the
+// timestamps so a run can be checked without digging through the log
+void FloodClone::write_tuning() {
+    nlohmann::json tuning = nlohmann::json::array();
+    for (const auto& choice : connection_manager->tuner().choices()) {
+        tuning.push_back({
+            {"peer", choice.peer},
+            {"rtt_ms", choice.rtt * 1000},
+            {"rate_mbps", choice.rate * 8 / 1e6},
+            {"loss", choice.loss},
+            {"congestion", choice.congestion},
+            {"buffer", choice.buffer},
+            {"notsent_lowat", choice.lowat},
+        });
+    }
+    std::ofstream tuning_file(args.timestamp_file + ".tuning");
+    tuning_file << tuning.dump(2) << "\n";
+}
+
 Arguments parse_args(int argc, char* argv[]) {
     Arguments args;
     for(int i = 1; i < argc; i++) {
@@ -346,19 +816,33 @@ Arguments parse_args(int argc, char* argv[]) {
         else if(arg == "--file") args.file_path = argv[++i];
         else if(arg == "--pieces-dir") args.pieces_dir = argv[++i];
         else if(arg == "--timestamp-file") args.timestamp_file = argv[++i];
+        else if(arg == "--store") args.store = argv[++i];
+        else if(arg == "--resume") args.resume = true;
+        else if(arg == "--basis") args.basis = argv[++i];
+        else if(arg == "--compress") args.compress = true;
+        else if(arg == "--fountain") args.fountain = true;
+        else if(arg == "--push") args.push = true;
+        else if(arg == "--send-policy") args.send_policy = argv[++i];
         else if(arg == "--network-info") args.network_info = nlohmann::json::parse(argv[++i]);
         else if(arg == "--ip-map") args.ip_map = nlohmann::json::parse(argv[++i]);
     }
+    // agent.py doesn't pass --src-name to the source, it is the source
+    if (args.mode == "source" && args.src_name.empty()) args.src_name = args.node_name;
     return args;
 }
 
 
 void FloodClone::setup_completion() {
+    completion_.build(args.node_name);
+
     completion_socket_ = socket(AF_INET, SOCK_STREAM, 0);
     if (completion_socket_ < 0) {
         throw std::runtime_error("Failed to create completion socket");
     }
 
+    int opt = 1;
+    setsockopt(completion_socket_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
     sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY; // listen on any port
@@ -376,6 +860,7 @@ void FloodClone::setup_completion() {
     completion_thread_ = std::thread(&FloodClone::listen_for_completion, this);
 }
 
+// Each connection carries one json message and is closed by the sender
 void FloodClone::listen_for_completion() {
     while (is_listening_) {
         sockaddr_in client_addr;
@@ -384,42 +869,93 @@ void FloodClone::listen_for_completion() {
         int client_fd = accept(completion_socket_, (struct sockaddr*)&client_addr, &client_len);
         if (client_fd < 0) continue;
 
-       
-
-        {
-            std::lock_guard<std::mutex> lock(node_mtx);
-            completed_nodes_++;
-            std::cout << "Node completed. Count: " << completed_nodes_ << "/" 
-                      << total_nodes_ << "\n" << std::flush;
-            node_change.notify_all();
+        std::string data;
+        char buffer[4096];
+        ssize_t n;
+        while ((n = recv(client_fd, buffer, sizeof(buffer), 0)) > 0 || (n < 0 && errno == EINTR)) {
+            if (n > 0) data.append(buffer, n);
         }
-
         close(client_fd);
+
+        nlohmann::json message = nlohmann::json::parse(data, nullptr, false);
+        std::lock_guard<std::mutex> lock(node_mtx);
+        try {
+            completion_.receive(message);
+        } catch (const std::exception& e) {
+            std::cerr << "Dropping completion message: " << e.what() << "\n";
+            continue;
+        }
+        if (message["type"] == "done") {
+            std::cout << "Subtree of " << message["node"].get<std::string>() << " completed\n" << std::flush;
+        }
+        node_change.notify_all();
     }
 }
 
-void FloodClone::notify_completion() {
-    
-    for (const auto& [node, routes] : network_map) {
-        if (node == args.node_name) continue;  // Skip self
-        
-
-        std::cout << "Sending Notification to: " <<  node << "\n" << std::flush;
+// Called once our own part is done (right away at the source), returns when
+// every node is done
+void FloodClone::wait_for_completion() {
+    std::unique_lock<std::mutex> lock(node_mtx);
+    if (!completion_.parent().empty()) {
+        completion_.finished(std::chrono::duration_cast<std::chrono::microseconds>(
+            end_time.time_since_epoch()).count());
+    }
+    node_change.wait(lock, [this]() { return completion_.children_done(); });
+
+    if (!completion_.parent().empty()) {
+        nlohmann::json report = completion_.done_message();
+        lock.unlock();
+        send_completion(completion_.parent(), report);
+        lock.lock();
+        node_change.wait(lock, [this]() { return completion_.all_done(); });
+    } else {
+        // the source ends up with everyone's finish time
+        std::ofstream times_file(args.timestamp_file + ".nodes");
+        for (const auto& [node, micros] : completion_.finish_times()) {
+            times_file << node << " " << micros << "\n";
+        }
+    }
+    lock.unlock();
 
-        std::vector<ConnectionOption>  peer_ips = get_ip(node);
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0) continue;
+    for (const auto& child : completion_.children()) {
+        send_completion(child, CompletionTree::all_done_message());
+    }
+}
 
-        sockaddr_in peer_addr;
-        peer_addr.sin_family = AF_INET;
-        peer_addr.sin_addr.s_addr = inet_addr(peer_ips[0].target_ip.c_str());
-        peer_addr.sin_port = htons(COMPLETION_PORT);
-        std::cout << "Sending Notification: " <<  peer_ips[0].target_ip << ":" << COMPLETION_PORT << "\n" << std::flush;
+void FloodClone::send_completion(const std::string& node, const nlohmann::json& message) {
+    // node is a neighbor, go over the link to it rather than whichever of
+    // its addresses comes first
+    std::string data = message.dump();
+    std::vector<ConnectionOption> peer_ips = get_paths(node);
 
+    sockaddr_in peer_addr;
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_addr.s_addr = inet_addr(peer_ips[0].target_ip.c_str());
+    peer_addr.sin_port = htons(COMPLETION_PORT);
 
-        if (connect(sock, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) >= 0) {
-            std::cout << "Notified completion to " << node << "\n";
+    // the other end may not be up yet when we finish quickly
+    for (int attempt = 0; attempt < COMPLETION_RETRIES; attempt++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) {
+            throw std::runtime_error("Failed to create completion socket");
         }
-        close(sock);
+        if (connect(sock, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) == 0) {
+            size_t sent = 0;
+            while (sent < data.size()) {
+                ssize_t n = send(sock, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                sent += n;
+            }
+            close(sock);
+            if (sent == data.size()) {
+                std::cout << "Sent " << message["type"] << " to " << node << " (" << peer_ips[0].target_ip << ")\n" << std::flush;
+                return;
+            }
+        } else {
+            close(sock);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(COMPLETION_RETRY_MS));
     }
-}
\ No newline at end of file
+    throw std::runtime_error("Could not deliver completion to " + node);
+}
@@ -0,0 +1,79 @@
+#include "Fountain.h"
+#include <cassert>
+#include <cstring>
+
+namespace {
+    uint64_t splitmix64(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+}
+
+uint64_t FountainDecoder::coefficients(uint64_t block, uint64_t seed, size_t k) {
+    assert(k > 0 && k <= 64);
+    uint64_t keep = k == 64 ? ~uint64_t(0) : (uint64_t(1) << k) - 1;
+    uint64_t state = splitmix64(block) ^ seed;
+    uint64_t mask;
+    do {
+        state = splitmix64(state);
+        mask = state & keep;
+    } while (mask == 0);
+    return mask;
+}
+
+void FountainDecoder::xor_into(char* out, const char* in, size_t size) {
+    size_t i = 0;
+    // a word at a time, the compiler widens this further
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t a, b;
+        std::memcpy(&a, out + i, sizeof(a));
+        std::memcpy(&b, in + i, sizeof(b));
+        a ^= b;
+        std::memcpy(out + i, &a, sizeof(a));
+    }
+    for (; i < size; i++) {
+        out[i] ^= in[i];
+    }
+}
+
+FountainDecoder::FountainDecoder(size_t k, size_t symbol_size)
+    : k_(k), symbol_size_(symbol_size), masks_(k, 0), rows_(k) {}
+
+bool FountainDecoder::add(uint64_t mask, const char* data) {
+    std::string row;
+    bool copied = false;
+    while (mask != 0) {
+        size_t pivot = __builtin_ctzll(mask);
+        if (masks_[pivot] == 0) {
+            if (!copied) row.assign(data, symbol_size_);
+            masks_[pivot] = mask;
+            rows_[pivot] = std::move(row);
+            rank_++;
+            return true;
+        }
+        // only copy the symbol once it has to change
+        if (!copied) {
+            row.assign(data, symbol_size_);
+            copied = true;
+        }
+        mask ^= masks_[pivot];
+        xor_into(&row[0], rows_[pivot].data(), symbol_size_);
+    }
+    return false;
+}
+
+void FountainDecoder::solve() {
+    assert(complete());
+    // row j only has bits above j left, clear them from the top down
+    for (size_t j = k_; j-- > 0;) {
+        uint64_t rest = masks_[j] & ~(uint64_t(1) << j);
+        while (rest != 0) {
+            size_t bit = __builtin_ctzll(rest);
+            rest &= rest - 1;
+            xor_into(&rows_[j][0], rows_[bit].data(), symbol_size_);
+        }
+        masks_[j] = uint64_t(1) << j;
+    }
+}
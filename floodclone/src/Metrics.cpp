@@ -0,0 +1,272 @@
+#include "Metrics.h"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <pthread.h>
+
+static const char* COUNTER_NAMES[Metrics::COUNTERS] = {
+    "requests_sent",
+    "requests_served",
+    "pieces_received",
+    "pieces_duplicate",
+    "pieces_served",
+    "pieces_pushed",
+    "pieces_cancelled",
+    "cancels_sent",
+    "pieces_migrated",
+    "symbols_received",
+    "symbols_served",
+    "busy_received",
+    "not_avail_sent",
+    "not_avail_received",
+    "checksum_failures",
+    "connections_accepted",
+    "connect_failures",
+};
+
+static const char* HISTOGRAM_NAMES[Metrics::HISTOGRAMS] = {
+    "request_first_byte_us",
+    "piece_receive_us",
+    "relay_delay_us",
+    "pool_queue_depth",
+};
+
+// a shard is only ever written by its own thread, no read-modify-write needed
+static inline void bump(std::atomic<uint64_t>& value, uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct Metrics::Shard {
+    struct Buckets {
+        std::atomic<uint64_t> counts[BUCKETS] = {};
+        std::atomic<uint64_t> sum{0};
+        std::atomic<uint64_t> max{0};
+    };
+
+    std::atomic<uint64_t> counters[COUNTERS] = {};
+    Buckets histograms[HISTOGRAMS];
+    std::atomic<uint64_t> sent[MAX_INTERFACES] = {};
+    std::atomic<uint64_t> received[MAX_INTERFACES] = {};
+    std::atomic<int64_t> first_byte[MAX_INTERFACES] = {};   // micros since start, 0 until the first byte
+    std::atomic<int64_t> last_byte[MAX_INTERFACES] = {};
+};
+
+struct Metrics::Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::map<std::string, size_t> interfaces;
+    std::vector<std::string> interface_names;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+};
+
+// never destroyed, threads that outlive main still record into it
+Metrics::Registry& Metrics::registry() {
+    static Registry* registry = new Registry;
+    return *registry;
+}
+
+Metrics::Shard& Metrics::shard() {
+    thread_local Shard* mine = nullptr;
+    if (!mine) {
+        auto& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.shards.push_back(std::make_unique<Shard>());
+        mine = r.shards.back().get();
+    }
+    return *mine;
+}
+
+int64_t Metrics::now_micros() {
+    // +1 so that 0 can mean never
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - registry().started).count() + 1;
+}
+
+size_t Metrics::bucket_of(uint64_t value) {
+    if (value < SUB_BUCKETS) return value;
+    size_t exponent = 63 - __builtin_clzll(value);
+    if (exponent > MAX_EXPONENT) return BUCKETS - 1;
+    return (exponent - SUB_BITS + 1) * SUB_BUCKETS + ((value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+uint64_t Metrics::bucket_floor(size_t bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+    size_t exponent = bucket / SUB_BUCKETS + SUB_BITS - 1;
+    return static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - SUB_BITS);
+}
+
+void Metrics::count(Counter counter, uint64_t n) {
+    bump(shard().counters[counter], n);
+}
+
+void Metrics::record(Histogram histogram, uint64_t value) {
+    auto& buckets = shard().histograms[histogram];
+    bump(buckets.counts[bucket_of(value)], 1);
+    bump(buckets.sum, value);
+    if (value > buckets.max.load(std::memory_order_relaxed)) {
+        buckets.max.store(value, std::memory_order_relaxed);
+    }
+}
+
+void Metrics::record_since(Histogram histogram, std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    record(histogram, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
+
+size_t Metrics::interface_index(const std::string& name) {
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    auto it = r.interfaces.find(name);
+    if (it != r.interfaces.end()) return it->second;
+    if (r.interface_names.size() == MAX_INTERFACES) return MAX_INTERFACES - 1;
+    r.interface_names.push_back(name);
+    r.interfaces[name] = r.interface_names.size() - 1;
+    return r.interface_names.size() - 1;
+}
+
+void Metrics::bytes_sent(size_t interface, uint64_t bytes) {
+    auto& s = shard();
+    int64_t now = now_micros();
+    bump(s.sent[interface], bytes);
+    if (s.first_byte[interface].load(std::memory_order_relaxed) == 0) {
+        s.first_byte[interface].store(now, std::memory_order_relaxed);
+    }
+    s.last_byte[interface].store(now, std::memory_order_relaxed);
+}
+
+void Metrics::bytes_received(size_t interface, uint64_t bytes) {
+    auto& s = shard();
+    int64_t now = now_micros();
+    bump(s.received[interface], bytes);
+    if (s.first_byte[interface].load(std::memory_order_relaxed) == 0) {
+        s.first_byte[interface].store(now, std::memory_order_relaxed);
+    }
+    s.last_byte[interface].store(now, std::memory_order_relaxed);
+}
+
+std::string Metrics::dump() {
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    double uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - r.started).count();
+
+    uint64_t counters[COUNTERS] = {};
+    std::vector<std::vector<uint64_t>> buckets(HISTOGRAMS, std::vector<uint64_t>(BUCKETS));
+    uint64_t sums[HISTOGRAMS] = {};
+    uint64_t maxes[HISTOGRAMS] = {};
+    uint64_t sent[MAX_INTERFACES] = {};
+    uint64_t received[MAX_INTERFACES] = {};
+    int64_t first[MAX_INTERFACES] = {};
+    int64_t last[MAX_INTERFACES] = {};
+
+    for (const auto& s : r.shards) {
+        for (size_t c = 0; c < COUNTERS; c++) {
+            counters[c] += s->counters[c].load(std::memory_order_relaxed);
+        }
+        for (size_t h = 0; h < HISTOGRAMS; h++) {
+            for (size_t b = 0; b < BUCKETS; b++) {
+                buckets[h][b] += s->histograms[h].counts[b].load(std::memory_order_relaxed);
+            }
+            sums[h] += s->histograms[h].sum.load(std::memory_order_relaxed);
+            maxes[h] = std::max(maxes[h], s->histograms[h].max.load(std::memory_order_relaxed));
+        }
+        for (size_t i = 0; i < MAX_INTERFACES; i++) {
+            sent[i] += s->sent[i].load(std::memory_order_relaxed);
+            received[i] += s->received[i].load(std::memory_order_relaxed);
+            int64_t f = s->first_byte[i].load(std::memory_order_relaxed);
+            if (f && (!first[i] || f < first[i])) first[i] = f;
+            last[i] = std::max(last[i], s->last_byte[i].load(std::memory_order_relaxed));
+        }
+    }
+
+    nlohmann::json out;
+    out["uptime_s"] = uptime;
+
+    for (size_t c = 0; c < COUNTERS; c++) {
+        out["counters"][COUNTER_NAMES[c]] = counters[c];
+    }
+    auto per = [](uint64_t n, double of) { return of > 0 ? n / of : 0.0; };
+    out["rates"] = {
+        {"not_avail_sent_per_s", per(counters[NOT_AVAIL_SENT], uptime)},
+        {"not_avail_received_per_s", per(counters[NOT_AVAIL_RECEIVED], uptime)},
+        {"not_avail_sent_per_request", per(counters[NOT_AVAIL_SENT], counters[REQUESTS_SERVED])},
+        {"not_avail_received_per_request", per(counters[NOT_AVAIL_RECEIVED], counters[REQUESTS_SENT])},
+    };
+
+    for (size_t h = 0; h < HISTOGRAMS; h++) {
+        uint64_t total = 0;
+        for (uint64_t n : buckets[h]) total += n;
+
+        nlohmann::json histogram;
+        histogram["count"] = total;
+        histogram["mean"] = per(sums[h], total);
+        histogram["max"] = maxes[h];
+        // a quantile is reported as the top of its bucket, capped at the max seen
+        for (auto [name, q] : {std::pair{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}}) {
+            uint64_t seen = 0;
+            uint64_t value = 0;
+            for (size_t b = 0; b < BUCKETS && total; b++) {
+                seen += buckets[h][b];
+                if (seen >= q * total) {
+                    value = b + 1 < BUCKETS ? bucket_floor(b + 1) - 1 : maxes[h];
+                    break;
+                }
+            }
+            histogram[name] = std::min(value, maxes[h]);
+        }
+        nlohmann::json filled = nlohmann::json::array();
+        for (size_t b = 0; b < BUCKETS; b++) {
+            if (buckets[h][b]) filled.push_back({bucket_floor(b), buckets[h][b]});
+        }
+        histogram["buckets"] = filled;   // [lowest value, count] of every bucket in use
+        out["histograms"][HISTOGRAM_NAMES[h]] = histogram;
+    }
+
+    out["interfaces"] = nlohmann::json::object();
+    for (size_t i = 0; i < r.interface_names.size(); i++) {
+        double active = first[i] ? (last[i] - first[i]) / 1e6 : 0;
+        out["interfaces"][r.interface_names[i]] = {
+            {"sent_bytes", sent[i]},
+            {"received_bytes", received[i]},
+            {"active_s", active},
+            {"sent_bytes_per_s", per(sent[i], active)},
+            {"received_bytes_per_s", per(received[i], active)},
+        };
+    }
+    return out.dump(2);
+}
+
+// through a temporary so whoever polls the file never sees half of it
+void Metrics::write(const std::string& path) {
+    std::string text = dump();
+    {
+        std::ofstream file(path + ".tmp");
+        if (!file) {
+            std::cerr << "Cannot write " << path << ".tmp\n";
+            return;
+        }
+        file << text << "\n";
+    }
+    std::rename((path + ".tmp").c_str(), path.c_str());
+}
+
+void Metrics::dump_on_signal(int signo, const std::string& path) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, signo);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+    std::thread([set, path]() {
+        int received;
+        while (sigwait(&set, &received) == 0) {
+            write(path);
+        }
+    }).detach();
+}
@@ -0,0 +1,91 @@
+#include "PieceBitset.h"
+#include <cstring>
+#include <cassert>
+
+
+PieceBitset::PieceBitset(size_t size, bool value)
+    : size_(size), num_words_((size + 63) / 64), words_(new std::atomic<uint64_t>[num_words_]) {
+    for (size_t w = 0; w < num_words_; ++w) {
+        words_[w].store(value ? ~uint64_t(0) : 0, std::memory_order_relaxed);
+    }
+    // bits past the end stay clear so count and scans never see them
+    if (value && size % 64 != 0) {
+        words_[num_words_ - 1].store((uint64_t(1) << (size % 64)) - 1, std::memory_order_relaxed);
+    }
+}
+
+size_t PieceBitset::count() const {
+    size_t total = 0;
+    for (size_t w = 0; w < num_words_; ++w) {
+        total += __builtin_popcountll(words_[w].load(std::memory_order_relaxed));
+    }
+    return total;
+}
+
+template <typename WordAt>
+size_t PieceBitset::scan(size_t from, WordAt word_at) const {
+    if (from >= size_) return size_;
+
+    // the first word can start mid way
+    size_t w = from / 64;
+    uint64_t word = word_at(w) & (~uint64_t(0) << (from % 64));
+    if (word) return w * 64 + __builtin_ctzll(word);
+    w++;
+
+    // then four words per branch, the common case is long runs of complete
+    // (or missing) pieces so most blocks are skipped in one test
+    for (; w + 4 <= num_words_; w += 4) {
+        uint64_t w0 = word_at(w), w1 = word_at(w + 1), w2 = word_at(w + 2), w3 = word_at(w + 3);
+        if ((w0 | w1 | w2 | w3) == 0) continue;
+        if (w0) return w * 64 + __builtin_ctzll(w0);
+        if (w1) return (w + 1) * 64 + __builtin_ctzll(w1);
+        if (w2) return (w + 2) * 64 + __builtin_ctzll(w2);
+        return (w + 3) * 64 + __builtin_ctzll(w3);
+    }
+    for (; w < num_words_; ++w) {
+        word = word_at(w);
+        if (word) return w * 64 + __builtin_ctzll(word);
+    }
+    return size_;
+}
+
+size_t PieceBitset::find_first_set(size_t from) const {
+    return scan(from, [this](size_t w) { return words_[w].load(std::memory_order_relaxed); });
+}
+
+size_t PieceBitset::find_first_clear(size_t from) const {
+    size_t tail = size_ % 64;
+    uint64_t last_mask = tail ? (uint64_t(1) << tail) - 1 : ~uint64_t(0);
+    return scan(from, [this, last_mask](size_t w) {
+        uint64_t clear = ~words_[w].load(std::memory_order_relaxed);
+        return w == num_words_ - 1 ? clear & last_mask : clear;
+    });
+}
+
+size_t PieceBitset::find_first_wanted(const PieceBitset& has, const PieceBitset& ours, size_t from) {
+    assert(has.size_ == ours.size_);
+    return has.scan(from, [&has, &ours](size_t w) {
+        return has.words_[w].load(std::memory_order_relaxed) & ~ours.words_[w].load(std::memory_order_relaxed);
+    });
+}
+
+std::string PieceBitset::to_bytes() const {
+    std::string bytes(num_words_ * sizeof(uint64_t), '\0');
+    for (size_t w = 0; w < num_words_; ++w) {
+        uint64_t word = words_[w].load(std::memory_order_acquire);
+        std::memcpy(&bytes[w * sizeof(uint64_t)], &word, sizeof(word));
+    }
+    return bytes;
+}
+
+void PieceBitset::merge_bytes(std::string_view bytes) {
+    size_t words = std::min(num_words_, bytes.size() / sizeof(uint64_t));
+    for (size_t w = 0; w < words; ++w) {
+        uint64_t word;
+        std::memcpy(&word, bytes.data() + w * sizeof(uint64_t), sizeof(word));
+        if (w == num_words_ - 1 && size_ % 64 != 0) {
+            word &= (uint64_t(1) << (size_ % 64)) - 1;
+        }
+        words_[w].fetch_or(word, std::memory_order_acq_rel);
+    }
+}
@@ -0,0 +1,66 @@
+#include "PieceCodec.h"
+#include <chrono>
+#include <zlib.h>
+
+// fastest level, the point is to win time on slow links not to archive
+#define DEFLATE_LEVEL 1
+
+void PieceCodec::encode(const char* data, size_t size, CodedPiece& piece) {
+    auto start = std::chrono::steady_clock::now();
+
+    uLongf coded_size = compressBound(size);
+    piece.data.resize(coded_size);
+    int result = compress2(reinterpret_cast<Bytef*>(&piece.data[0]), &coded_size,
+                           reinterpret_cast<const Bytef*>(data), size, DEFLATE_LEVEL);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (result != Z_OK || coded_size > size * (1 - MIN_SAVING)) {
+        // incompressible, not worth making the receiver inflate it
+        piece.codec = RAW;
+        piece.data.clear();
+        piece.data.shrink_to_fit();
+        record(size, size, seconds);
+        return;
+    }
+
+    piece.codec = DEFLATE;
+    piece.data.resize(coded_size);
+    piece.data.shrink_to_fit();
+    record(size, coded_size, seconds);
+}
+
+bool PieceCodec::decode(uint16_t codec, const char* data, size_t size, char* out, size_t raw_size) {
+    if (codec != DEFLATE) return false;
+    uLongf out_size = raw_size;
+    int result = uncompress(reinterpret_cast<Bytef*>(out), &out_size,
+                            reinterpret_cast<const Bytef*>(data), size);
+    return result == Z_OK && out_size == raw_size;
+}
+
+void PieceCodec::record(size_t raw, size_t coded, double seconds) {
+    if (raw == 0 || seconds <= 0) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    double speed = raw / seconds;
+    double ratio = static_cast<double>(coded) / raw;
+    if (speed_ <= 0) {
+        speed_ = speed;
+        ratio_ = ratio;
+    } else {
+        speed_ = 0.7 * speed_ + 0.3 * speed;
+        ratio_ = 0.7 * ratio_ + 0.3 * ratio;
+    }
+}
+
+// Sending raw takes raw / link, compressing takes raw / speed plus
+// raw * ratio / link, so it pays when speed * (1 - ratio) > link
+bool PieceCodec::worth_it(double link_rate) {
+    double speed, ratio;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        speed = speed_;
+        ratio = ratio_;
+    }
+    if (speed <= 0) return true;   // never measured, find out
+    if (speed * (1 - ratio) > link_rate) return true;
+    return declined_.fetch_add(1, std::memory_order_relaxed) % PROBE_EVERY == PROBE_EVERY - 1;
+}
@@ -0,0 +1,521 @@
+#include "PieceScheduler.h"
+#include "FileManager.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <cassert>
+#include <tuple>
+
+
+PieceScheduler::PieceScheduler(FileManager& file_manager, size_t num_pieces)
+    : file_manager_(file_manager), num_pieces_(num_pieces),
+      claimed_by_(num_pieces, -1), requested_(num_pieces, 0), availability_(num_pieces, 0) {}
+
+size_t PieceScheduler::add_peer(const std::string& name, bool upstream, bool has_all, bool backup) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Peer peer;
+    peer.name = name;
+    peer.upstream = upstream;
+    peer.has_all = has_all;
+    peer.backup = backup;
+    peer.have = PieceBitset(num_pieces_);
+    if (has_all) {
+        for (auto& count : availability_) count++;
+    }
+    peers_.push_back(std::move(peer));
+    return peers_.size() - 1;
+}
+
+size_t PieceScheduler::add_path(size_t peer, const std::string& label, size_t group) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    assert(peer < peers_.size());
+    Path path;
+    path.peer = peer;
+    path.label = label;
+    path.group = group;
+    paths_.push_back(std::move(path));
+    return paths_.size() - 1;
+}
+
+double PieceScheduler::path_rate(size_t path) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return paths_[path].rate;
+}
+
+void PieceScheduler::assign(size_t peer, PieceBitset pieces) {
+    assert(pieces.size() == num_pieces_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    peers_[peer].assigned = std::move(pieces);
+    work_cv_.notify_all();
+}
+
+void PieceScheduler::mark_have(size_t peer, size_t piece) {
+    assert(piece < num_pieces_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& p = peers_[peer];
+    if (p.has_all || p.have.set(piece)) return;
+    availability_[piece]++;
+    work_cv_.notify_all();
+}
+
+void PieceScheduler::merge_have(size_t peer, std::string_view bitfield) {
+    PieceBitset incoming(num_pieces_);
+    incoming.merge_bytes(bitfield);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& p = peers_[peer];
+    if (p.has_all) return;
+    for (size_t i = incoming.find_first_set(0); i < num_pieces_; i = incoming.find_first_set(i + 1)) {
+        if (!p.have.set(i)) {
+            availability_[i]++;
+        }
+    }
+    work_cv_.notify_all();
+}
+
+bool PieceScheduler::can_serve(const Peer& peer, size_t piece) const {
+    return peer.upstream || peer.has_all || peer.have.test(piece) ||
+           (peer.assigned.size() && peer.assigned.test(piece));
+}
+
+size_t PieceScheduler::batch_size(const Path& path) const {
+    if (path.rate <= 0) {
+        // small first batch so we get a throughput sample quickly
+        return MIN_BATCH * 4;
+    }
+    size_t size = static_cast<size_t>(path.rate * TARGET_BATCH_SECONDS);
+    return std::clamp(size, MIN_BATCH, MAX_BATCH);
+}
+
+std::vector<size_t> PieceScheduler::pick_rarest(size_t path, size_t count) {
+    const auto& p = peers_[paths_[path].peer];
+    // pieces still being verified count as ours, they only come back if they fail
+    const PieceBitset& ours = file_manager_.claimed();
+    bool blind = (p.upstream || p.has_all) && !p.backup;
+
+    // a piece that went missing again may sit behind the cursor
+    size_t reclaimed = file_manager_.reclaimed_pieces();
+    if (reclaimed != reclaimed_seen_) {
+        reclaimed_seen_ = reclaimed;
+        cursor_ = 0;
+    }
+
+    // skip over the prefix that is already done or being fetched
+    cursor_ = ours.find_first_clear(cursor_);
+    while (cursor_ < num_pieces_ && claimed_by_[cursor_] != -1) {
+        cursor_ = ours.find_first_clear(cursor_ + 1);
+    }
+
+    // next piece at or after i this peer could give us, peers we can't ask
+    // blindly only offer what they announced and what the plan routes through them
+    auto next = [&](size_t i) {
+        if (blind) return ours.find_first_clear(i);
+        size_t found = PieceBitset::find_first_wanted(p.have, ours, i);
+        if (p.assigned.size()) {
+            found = std::min(found, PieceBitset::find_first_wanted(p.assigned, ours, i));
+        }
+        return found;
+    };
+
+    // look at a bounded window of candidates so a claim stays cheap on
+    // multi-million piece files. Pieces the peer already holds come first
+    // since they go out right away instead of waiting on its own download,
+    // then rarest first and lowest index on ties which keeps relays
+    // downstream of us streaming in order
+    std::vector<std::tuple<bool, uint16_t, size_t>> candidates;
+    for (size_t i = next(cursor_); i < num_pieces_ && candidates.size() < SCAN_WINDOW; i = next(i + 1)) {
+        if (claimed_by_[i] != -1) continue;
+        // what was moved off this path is for the others
+        if (!migrated_.empty()) {
+            auto moved = migrated_.find(i);
+            if (moved != migrated_.end() && moved->second == path) continue;
+        }
+        bool held = p.has_all || p.have.test(i);
+        candidates.emplace_back(!held, availability_[i], i);
+    }
+
+    count = std::min(count, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end());
+
+    std::vector<size_t> picked;
+    picked.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        picked.push_back(std::get<2>(candidates[i]));
+    }
+    return picked;
+}
+
+// Nothing unclaimed is left for this path: take over the back half of
+// whatever the slowest path still has outstanding. Whichever copy lands
+// second is cancelled, or dropped if it was already on its way
+std::vector<size_t> PieceScheduler::steal(size_t path) {
+    const auto& thief = paths_[path];
+    const auto& thief_peer = peers_[thief.peer];
+    auto now = std::chrono::steady_clock::now();
+
+    int victim = -1;
+    double worst_remaining = 0;
+    std::vector<size_t> victim_missing;
+
+    for (size_t v = 0; v < paths_.size(); v++) {
+        const auto& p = paths_[v];
+        if (v == path || !p.alive || p.batches.empty()) continue;
+
+        std::vector<size_t> missing;
+        for (const auto& batch : p.batches) {
+            for (size_t idx : batch) {
+                if (claimed_by_[idx] == static_cast<int32_t>(v) && can_serve(thief_peer, idx) && !file_manager_.claimed().test(idx)) {
+                    missing.push_back(idx);
+                }
+            }
+        }
+        if (missing.empty()) continue;
+
+        double age = std::chrono::duration<double>(now - p.head_started).count();
+        double remaining;
+        if (p.rate > 0) {
+            remaining = missing.size() / p.rate;
+        } else {
+            // never measured, only consider it slow once it sat on the batch for a while
+            remaining = age > 4 * TARGET_BATCH_SECONDS ? age : 0;
+        }
+
+        // only worth it if the thief is expected to finish its share first,
+        // an unmeasured backup only steps in for stalled paths
+        if (thief_peer.backup && thief.rate <= 0 && age < 4 * TARGET_BATCH_SECONDS) continue;
+        double thief_rate = thief.rate > 0 ? thief.rate : p.rate;
+        if (thief_rate > 0 && (missing.size() / 2.0) / thief_rate >= remaining) continue;
+        if (missing.size() < 2 && age < 4 * TARGET_BATCH_SECONDS) continue;
+
+        if (remaining > worst_remaining) {
+            worst_remaining = remaining;
+            victim = static_cast<int>(v);
+            victim_missing = std::move(missing);
+        }
+    }
+
+    if (victim < 0) return {};
+
+    size_t keep = victim_missing.size() / 2;
+    return std::vector<size_t>(victim_missing.begin() + keep, victim_missing.end());
+}
+
+// Endgame: every piece we miss is on its way and only the last few are
+// left, the transfer now waits on whichever path holds the slowest of them.
+// An idle path asks for them again, as long as its peer has them right now,
+// up to ENDGAME_COPIES paths per piece. The first copy to land wins, the
+// ConnectionManager cancels the others
+std::vector<size_t> PieceScheduler::endgame(size_t path) {
+    const auto& p = paths_[path];
+    const auto& peer = peers_[p.peer];
+    const PieceBitset& ours = file_manager_.claimed();
+    size_t left = num_pieces_ - ours.count();
+    if (left == 0 || left > std::max(ENDGAME_MIN, num_pieces_ / ENDGAME_FRACTION)) return {};
+
+    std::vector<size_t> pieces;
+    size_t wanted = batch_size(p);
+    for (size_t i = ours.find_first_clear(0); i < num_pieces_ && pieces.size() < wanted; i = ours.find_first_clear(i + 1)) {
+        // one nobody asked for yet is pick_rarest's
+        if (requested_[i] == 0 || requested_[i] >= ENDGAME_COPIES) continue;
+        if (peer.has_all || peer.have.test(i)) pieces.push_back(i);
+    }
+    return pieces;
+}
+
+// A sibling stream whose oldest batch is long overdue is most likely stuck
+// behind a retransmit, the link itself is fine since we share it. Its missing
+// pieces are asked for again on this stream, whichever copy lands first wins.
+// Only pieces the peer already holds count, a relay still waiting on a piece
+// isn't stalled
+std::vector<size_t> PieceScheduler::take_stalled(size_t path) {
+    const auto& p = paths_[path];
+    if (p.group == NO_GROUP) return {};
+    const auto& peer = peers_[p.peer];
+    auto now = std::chrono::steady_clock::now();
+
+    for (size_t v = 0; v < paths_.size(); v++) {
+        const auto& sibling = paths_[v];
+        if (v == path || sibling.group != p.group || !sibling.alive || sibling.batches.empty()) continue;
+
+        const auto& batch = sibling.batches.front();
+        double expected = sibling.rate > 0 ? batch.size() / sibling.rate : TARGET_BATCH_SECONDS;
+        double age = std::chrono::duration<double>(now - sibling.head_started).count();
+        if (age < std::max(STALL_FACTOR * expected, MIN_STALL_SECONDS)) continue;
+
+        std::vector<size_t> missing;
+        for (size_t idx : batch) {
+            if (claimed_by_[idx] == static_cast<int32_t>(v) && (peer.has_all || peer.have.test(idx))
+                && !file_manager_.claimed().test(idx)) {
+                missing.push_back(idx);
+            }
+        }
+        if (!missing.empty()) return missing;
+    }
+    return {};
+}
+
+// Pieces moved off a degraded path go to whichever path asks next and
+// whose peer holds them right now, ahead of anything new
+std::vector<size_t> PieceScheduler::take_migrated(size_t path, size_t count) {
+    const auto& peer = peers_[paths_[path].peer];
+    const PieceBitset& ours = file_manager_.claimed();
+    std::vector<size_t> pieces;
+    for (auto it = migrated_.begin(); it != migrated_.end() && pieces.size() < count;) {
+        size_t idx = it->first;
+        if (ours.test(idx) || claimed_by_[idx] != -1) {
+            // came in after all, or someone picked it up meanwhile
+            it = migrated_.erase(it);
+        } else if (it->second != path && (peer.has_all || peer.have.test(idx))) {
+            pieces.push_back(idx);
+            it = migrated_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return pieces;
+}
+
+// pieces of the path's batches that came in through it
+size_t PieceScheduler::in_hand(size_t path) const {
+    const PieceBitset& ours = file_manager_.claimed();
+    size_t count = 0;
+    for (const auto& batch : paths_[path].batches) {
+        for (size_t idx : batch) {
+            if (claimed_by_[idx] == static_cast<int32_t>(path) && ours.test(idx)) count++;
+        }
+    }
+    return count;
+}
+
+// The batch rate only moves once a batch is done, which for a path that
+// slowed down can be a long time. Every SAMPLE_SECONDS whoever holds the
+// lock looks at how many pieces each busy path brought in since the last look
+void PieceScheduler::sample_rates() {
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - sampled_at_).count();
+    if (seconds < SAMPLE_SECONDS) return;
+    sampled_at_ = now;
+
+    for (size_t v = 0; v < paths_.size(); v++) {
+        auto& p = paths_[v];
+        if (!p.alive || p.batches.empty()) {
+            p.samples = 0;
+            continue;
+        }
+        size_t total = p.delivered + in_hand(v);
+        if (p.samples > 0) {
+            double sample = total > p.sampled ? (total - p.sampled) / seconds : 0;
+            p.live_rate = p.samples == 1 ? sample : 0.7 * p.live_rate + 0.3 * sample;
+        }
+        p.sampled = total;
+        p.samples++;
+    }
+    for (size_t v = 0; v < paths_.size(); v++) {
+        if (degraded(v)) migrate(v);
+    }
+}
+
+// Far slower than its batches used to be, and some other path is measured
+// to do far better right now. A relay that waits on its own download looks
+// the same as a link that lost bandwidth, either way the pieces are better
+// asked for elsewhere
+bool PieceScheduler::degraded(size_t path) const {
+    const auto& p = paths_[path];
+    if (!p.alive || p.batches.empty() || p.samples <= DEGRADED_SAMPLES || p.rate <= 0) return false;
+    if (p.live_rate * DEGRADED_FACTOR >= p.rate) return false;
+    for (size_t v = 0; v < paths_.size(); v++) {
+        const auto& other = paths_[v];
+        if (v == path || !other.alive || other.batches.empty() || other.samples <= DEGRADED_SAMPLES) continue;
+        if (other.live_rate > DEGRADED_FACTOR * std::max(p.live_rate, MIN_RATE)) return true;
+    }
+    return false;
+}
+
+// Keeps what the path is expected to deliver in the next TARGET_BATCH_SECONDS
+// and moves the rest of what it has in flight to migrated_. The requests
+// stay out, whichever copy lands first gets the other cancelled. Its rate
+// drops to what it does now so it only gets small batches from here on, and
+// its share of the plan goes to the source as well
+void PieceScheduler::migrate(size_t path) {
+    auto& p = paths_[path];
+    const PieceBitset& ours = file_manager_.claimed();
+    size_t keep = std::max(MIN_BATCH, static_cast<size_t>(p.live_rate * TARGET_BATCH_SECONDS));
+    size_t kept = 0;
+    size_t moved = 0;
+    for (const auto& batch : p.batches) {
+        for (size_t idx : batch) {
+            if (claimed_by_[idx] != static_cast<int32_t>(path) || ours.test(idx)) continue;
+            if (kept < keep) {
+                kept++;
+                continue;
+            }
+            claimed_by_[idx] = -1;
+            cursor_ = std::min(cursor_, idx);
+            migrated_[idx] = path;
+            moved++;
+        }
+    }
+    p.rate = std::max(p.live_rate, MIN_RATE);
+    Metrics::count(Metrics::PIECES_MIGRATED, moved);
+
+    auto& peer = peers_[p.peer];
+    if (!peer.degraded && !peer.has_all && peer.assigned.size()) {
+        peer.degraded = true;
+        for (auto& other : peers_) {
+            if (!other.alive || !other.has_all) continue;
+            if (!other.assigned.size()) other.assigned = PieceBitset(num_pieces_);
+            for (size_t i = peer.assigned.find_first_set(0); i < num_pieces_; i = peer.assigned.find_first_set(i + 1)) {
+                other.assigned.set(i);
+            }
+        }
+    }
+    work_cv_.notify_all();
+}
+
+PieceScheduler::Ranges PieceScheduler::next_batch(size_t path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sample_rates();
+    auto& p = paths_[path];
+    assert(p.batches.size() < PIPELINE_DEPTH && "Path already has a full pipeline");
+    if (!p.alive) return {};
+
+    std::vector<size_t> pieces = take_stalled(path);
+    if (pieces.empty()) {
+        pieces = take_migrated(path, batch_size(p));
+    }
+    if (pieces.empty()) {
+        // a backup only gets what the plan routes through it
+        pieces = pick_rarest(path, batch_size(p));
+    }
+    if (pieces.empty() && p.batches.empty()) {
+        // only re-split once our own pipeline ran dry
+        pieces = endgame(path);
+        if (pieces.empty()) pieces = steal(path);
+    }
+    if (pieces.empty()) return {};
+
+    for (size_t idx : pieces) {
+        claimed_by_[idx] = static_cast<int32_t>(path);
+        requested_[idx]++;
+    }
+    if (p.batches.empty()) {
+        p.head_started = std::chrono::steady_clock::now();
+    }
+    p.batches.push_back(pieces);
+    return to_ranges(std::move(pieces));
+}
+
+void PieceScheduler::unclaim(size_t path, const std::vector<size_t>& pieces) {
+    for (size_t idx : pieces) {
+        if (requested_[idx] > 0) requested_[idx]--;
+        if (claimed_by_[idx] == static_cast<int32_t>(path)) {
+            claimed_by_[idx] = -1;
+            cursor_ = std::min(cursor_, idx);
+        }
+    }
+    work_cv_.notify_all();
+}
+
+void PieceScheduler::complete(size_t path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& p = paths_[path];
+    if (p.batches.empty()) return;
+
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - p.head_started).count();
+    const auto& batch = p.batches.front();
+    if (!batch.empty() && seconds > 0) {
+        double sample = batch.size() / seconds;
+        p.rate = p.rate <= 0 ? sample : 0.7 * p.rate + 0.3 * sample;
+    }
+    p.delivered += std::count_if(batch.begin(), batch.end(), [&](size_t idx) {
+        return claimed_by_[idx] == static_cast<int32_t>(path) && file_manager_.claimed().test(idx);
+    });
+    unclaim(path, batch);
+    p.batches.pop_front();
+    // the next batch was already queued on the connection, it streams from now on
+    p.head_started = now;
+}
+
+void PieceScheduler::release_oldest(size_t path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& p = paths_[path];
+    if (p.batches.empty()) return;
+    unclaim(path, p.batches.front());
+    p.batches.pop_front();
+    p.head_started = std::chrono::steady_clock::now();
+}
+
+void PieceScheduler::release(size_t path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& p = paths_[path];
+    for (const auto& batch : p.batches) {
+        unclaim(path, batch);
+    }
+    p.batches.clear();
+}
+
+void PieceScheduler::drop_path(size_t path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& p = paths_[path];
+    if (!p.alive) return;
+    p.alive = false;
+    for (const auto& batch : p.batches) {
+        unclaim(path, batch);
+    }
+    p.batches.clear();
+
+    bool peer_alive = std::any_of(paths_.begin(), paths_.end(), [&](const Path& other) {
+        return other.peer == p.peer && other.alive;
+    });
+    auto& peer = peers_[p.peer];
+    if (peer_alive || !peer.alive) return;
+
+    peer.alive = false;
+    for (size_t i = 0; i < num_pieces_; i++) {
+        if (peer.has_all || peer.have.test(i)) availability_[i]--;
+    }
+
+    // its share of the plan goes to whoever holds everything, or to every
+    // peer left when nobody does
+    if (peer.assigned.size()) {
+        bool has_source = std::any_of(peers_.begin(), peers_.end(), [](const Peer& other) {
+            return other.alive && other.has_all;
+        });
+        for (auto& other : peers_) {
+            if (!other.alive || (has_source && !other.has_all)) continue;
+            if (!other.assigned.size()) other.assigned = PieceBitset(num_pieces_);
+            for (size_t i = peer.assigned.find_first_set(0); i < num_pieces_; i = peer.assigned.find_first_set(i + 1)) {
+                other.assigned.set(i);
+            }
+        }
+    }
+}
+
+void PieceScheduler::wait_for_work(size_t path, std::chrono::milliseconds timeout) {
+    (void) path;
+    std::unique_lock<std::mutex> lock(mutex_);
+    sample_rates();
+    work_cv_.wait_for(lock, timeout);
+}
+
+bool PieceScheduler::done() const {
+    return file_manager_.available_pieces() >= num_pieces_;
+}
+
+bool PieceScheduler::has_live_peers() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::any_of(peers_.begin(), peers_.end(), [](const Peer& p) { return p.alive; });
+}
+
+PieceScheduler::Ranges PieceScheduler::to_ranges(std::vector<size_t> pieces) {
+    std::sort(pieces.begin(), pieces.end());
+    Ranges ranges;
+    for (size_t idx : pieces) {
+        if (!ranges.empty() && ranges.back().second + 1 == idx) {
+            ranges.back().second = idx;
+        } else {
+            ranges.emplace_back(idx, idx);
+        }
+    }
+    return ranges;
+}
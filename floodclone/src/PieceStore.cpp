@@ -0,0 +1,222 @@
+#include "PieceStore.h"
+#include <iostream>
+#include <stdexcept>
+#include <mutex>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace {
+    constexpr size_t DIRECT_ALIGNMENT = 4096;   // logical block size O_DIRECT needs on every fs we run on
+
+    size_t align_up(size_t value, size_t alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    class MmapStore : public PieceStore {
+    public:
+        MmapStore(const std::string& path, size_t file_size, bool keep_contents)
+            : PieceStore(path, file_size, O_RDWR, keep_contents) {
+            if (file_size_ == 0) return;
+            mapped_ = mmap(nullptr, file_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+            if (mapped_ == MAP_FAILED) {
+                throw std::runtime_error("Error mapping reconstructed file into memory");
+            }
+        }
+
+        ~MmapStore() override {
+            if (mapped_ != MAP_FAILED) munmap(mapped_, file_size_);
+        }
+
+        char* acquire(size_t offset, size_t) override {
+            return static_cast<char*>(mapped_) + offset;
+        }
+
+        // the bytes already are in the page cache, only write-back is left
+        void commit(char*, size_t offset, size_t length) override {
+            written(offset, length);
+        }
+
+        void discard(char*) override {}
+
+    private:
+        void* mapped_ = MAP_FAILED;
+    };
+
+    class PwriteStore : public PieceStore {
+    public:
+        PwriteStore(const std::string& path, size_t file_size, size_t buffer_size, bool keep_contents,
+                    int flags = O_RDWR, size_t alignment = alignof(std::max_align_t))
+            : PieceStore(path, file_size, flags, keep_contents), buffer_size_(align_up(buffer_size, alignment)),
+              alignment_(alignment) {}
+
+        ~PwriteStore() override {
+            for (char* buffer : free_) std::free(buffer);
+        }
+
+        // buffers are recycled, there are only ever as many as pieces being
+        // received or verified at once
+        char* acquire(size_t, size_t) override {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!free_.empty()) {
+                    char* buffer = free_.back();
+                    free_.pop_back();
+                    return buffer;
+                }
+            }
+            void* buffer = nullptr;
+            if (posix_memalign(&buffer, alignment_, buffer_size_) != 0) {
+                throw std::bad_alloc();
+            }
+            return static_cast<char*>(buffer);
+        }
+
+        void commit(char* buffer, size_t offset, size_t length) override {
+            size_t size = write_length(length);
+            size_t done = 0;
+            while (done < size) {
+                ssize_t n = pwrite(fd_, buffer + done, size - done, offset + done);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    discard(buffer);
+                    throw std::runtime_error(std::string("Failed to write piece: ") + strerror(errno));
+                }
+                done += n;
+            }
+            discard(buffer);
+            written(offset, length);
+        }
+
+        void discard(char* buffer) override {
+            std::lock_guard<std::mutex> lock(mutex_);
+            free_.push_back(buffer);
+        }
+
+    protected:
+        virtual size_t write_length(size_t length) const { return length; }
+
+    private:
+        size_t buffer_size_;
+        size_t alignment_;
+        std::mutex mutex_;
+        std::vector<char*> free_;
+    };
+
+    // Writes bypass the page cache, reads (relaying, the final check) go
+    // through a second buffered fd, the kernel keeps the two coherent
+    class DirectStore : public PwriteStore {
+    public:
+        DirectStore(const std::string& path, size_t file_size, size_t buffer_size, bool keep_contents)
+            : PwriteStore(path, file_size, buffer_size, keep_contents, O_RDWR | O_DIRECT, DIRECT_ALIGNMENT) {
+            read_fd_ = ::open(path.c_str(), O_RDONLY);
+            if (read_fd_ < 0) {
+                read_fd_ = fd_;
+                throw std::runtime_error("Cannot open reconstructed file for reading: " + path);
+            }
+        }
+
+    protected:
+        // only the last piece can be short, it is padded out to a block and
+        // finish() trims the file back
+        size_t write_length(size_t length) const override {
+            return align_up(length, DIRECT_ALIGNMENT);
+        }
+    };
+}
+
+PieceStore::Backend PieceStore::parse_backend(const std::string& name) {
+    if (name == "mmap") return Backend::Mmap;
+    if (name == "pwrite") return Backend::Pwrite;
+    if (name == "direct") return Backend::Direct;
+    throw std::runtime_error("Unknown piece store: " + name);
+}
+
+std::unique_ptr<PieceStore> PieceStore::open(Backend backend, const std::string& path,
+                                             size_t file_size, size_t buffer_size, bool keep_contents) {
+    switch (backend) {
+        case Backend::Mmap:
+            return std::make_unique<MmapStore>(path, file_size, keep_contents);
+        case Backend::Pwrite:
+            return std::make_unique<PwriteStore>(path, file_size, buffer_size, keep_contents);
+        case Backend::Direct:
+            try {
+                return std::make_unique<DirectStore>(path, file_size, buffer_size, keep_contents);
+            } catch (const std::runtime_error& e) {
+                // tmpfs and friends refuse O_DIRECT
+                std::cerr << e.what() << ", falling back to pwrite\n";
+                return std::make_unique<PwriteStore>(path, file_size, buffer_size, keep_contents);
+            }
+    }
+    throw std::runtime_error("Unknown piece store");
+}
+
+PieceStore::PieceStore(const std::string& path, size_t file_size, int flags, bool keep_contents)
+    : file_size_(file_size),
+      region_bytes_(new std::atomic<size_t>[(file_size + FLUSH_REGION - 1) / FLUSH_REGION]()) {
+    fd_ = ::open(path.c_str(), flags | O_CREAT | (keep_contents ? 0 : O_TRUNC), 0666);
+    if (fd_ < 0) {
+        throw std::runtime_error("Cannot create or open reconstructed file: " + path + " (" + strerror(errno) + ")");
+    }
+    read_fd_ = fd_;
+
+    // reserve the blocks now so the file doesn't fragment as pieces land out
+    // of order, filesystems without fallocate just get a sparse file. Blocks
+    // that already hold data are left alone
+    if (file_size_ > 0 && fallocate(fd_, 0, 0, file_size_) == -1 && ftruncate(fd_, file_size_) == -1) {
+        close(fd_);
+        throw std::runtime_error("Error setting file size for reconstructed file");
+    }
+}
+
+PieceStore::~PieceStore() {
+    if (read_fd_ != fd_) close(read_fd_);
+    close(fd_);
+}
+
+void PieceStore::written(size_t offset, size_t length) {
+    size_t end = offset + length;
+    while (offset < end) {
+        size_t region = offset / FLUSH_REGION;
+        size_t region_start = region * FLUSH_REGION;
+        size_t region_end = std::min(region_start + FLUSH_REGION, file_size_);
+        size_t chunk = std::min(end, region_end) - offset;
+
+        // the commit that completes a region starts its write-back, nothing waits for it
+        if (region_bytes_[region].fetch_add(chunk) + chunk == region_end - region_start) {
+            sync_file_range(fd_, region_start, region_end - region_start, SYNC_FILE_RANGE_WRITE);
+        }
+        offset += chunk;
+    }
+}
+
+void PieceStore::read(char* out, size_t offset, size_t length) const {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(read_fd_, out + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            throw std::runtime_error("Failed to read back piece data");
+        }
+        done += n;
+    }
+}
+
+void PieceStore::sync() {
+    // regions were written back as they completed, this mostly waits for the last one
+    if (fdatasync(fd_) == -1) {
+        throw std::runtime_error("Error syncing reconstructed file");
+    }
+}
+
+void PieceStore::finish() {
+    sync();
+    if (ftruncate(fd_, file_size_) == -1) {
+        throw std::runtime_error("Error resizing reconstructed file");
+    }
+}
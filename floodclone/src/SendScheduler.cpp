@@ -0,0 +1,120 @@
+#include "SendScheduler.h"
+#include <algorithm>
+#include <stdexcept>
+
+SendScheduler::Policy SendScheduler::parse_policy(const std::string& name) {
+    if (name == "fair") return Policy::FAIR;
+    if (name == "fastest") return Policy::FASTEST;
+    if (name == "fanout") return Policy::FANOUT;
+    throw std::runtime_error("Unknown send policy: " + name);
+}
+
+void SendScheduler::add(int fd, const std::string& interface, const std::string& peer) {
+    Flow& flow = flows_[fd];
+    flow = Flow{};
+    flow.interface = interface;
+    flow.peer = peer;
+    interfaces_[interface].push_back(fd);
+}
+
+void SendScheduler::remove(int fd) {
+    auto it = flows_.find(fd);
+    if (it == flows_.end()) return;
+    std::string interface = it->second.interface;
+    flows_.erase(it);
+    auto& fds = interfaces_[interface];
+    fds.erase(std::remove(fds.begin(), fds.end(), fd), fds.end());
+    next_round(interface);
+}
+
+void SendScheduler::set_rate(int fd, double rate) {
+    auto it = flows_.find(fd);
+    if (it != flows_.end()) it->second.rate = rate;
+}
+
+size_t SendScheduler::allowance(int fd) {
+    auto it = flows_.find(fd);
+    if (it == flows_.end()) return SIZE_MAX;   // not a connection we schedule
+    Flow& flow = it->second;
+    flow.blocked = false;
+    if (!flow.backlogged) {
+        flow.backlogged = true;
+        next_round(flow.interface);
+    }
+    return flow.deficit;
+}
+
+void SendScheduler::charge(int fd, size_t bytes) {
+    auto it = flows_.find(fd);
+    if (it == flows_.end()) return;
+    Flow& flow = it->second;
+    flow.deficit -= std::min(bytes, flow.deficit);
+    if (flow.deficit == 0) next_round(flow.interface);
+}
+
+void SendScheduler::blocked(int fd) {
+    auto it = flows_.find(fd);
+    if (it == flows_.end() || it->second.blocked) return;
+    it->second.blocked = true;
+    next_round(it->second.interface);
+}
+
+void SendScheduler::idle(int fd) {
+    auto it = flows_.find(fd);
+    if (it == flows_.end() || !it->second.backlogged) return;
+    // what is left of its turn isn't kept, a flow that comes back waits for the next round
+    it->second.backlogged = false;
+    it->second.blocked = false;
+    it->second.deficit = 0;
+    next_round(it->second.interface);
+}
+
+std::vector<int> SendScheduler::take_woken() {
+    std::vector<int> woken;
+    woken.swap(woken_);
+    return woken;
+}
+
+double SendScheduler::weight(const Flow& flow) const {
+    double weight = 1;
+    if (policy_ == Policy::FANOUT) {
+        auto it = fanout_.find(flow.peer);
+        weight = 1 + (it == fanout_.end() ? 0 : it->second);
+    } else if (policy_ == Policy::FASTEST && flow.rate > 0) {
+        double total = 0;
+        size_t measured = 0;
+        for (int fd : interfaces_.at(flow.interface)) {
+            const Flow& other = flows_.at(fd);
+            if (other.backlogged && other.rate > 0) {
+                total += other.rate;
+                measured++;
+            }
+        }
+        if (measured > 0 && total > 0) weight = flow.rate / (total / measured);
+    }
+    return std::clamp(weight, MIN_WEIGHT, MAX_WEIGHT);
+}
+
+// A new round starts once no flow with something to send may still write in
+// this one. A blocked flow doesn't hold the others up, the link is only as
+// busy as the sockets that can take data keep it, it just keeps what is left
+// of its turn for when its socket drains
+void SendScheduler::next_round(const std::string& interface) {
+    const auto& fds = interfaces_[interface];
+    bool waiting = false;
+    for (int fd : fds) {
+        const Flow& flow = flows_.at(fd);
+        if (!flow.backlogged) continue;
+        if (flow.deficit > 0 && !flow.blocked) return;
+        if (flow.deficit == 0) waiting = true;
+    }
+    if (!waiting) return;
+
+    for (int fd : fds) {
+        Flow& flow = flows_.at(fd);
+        if (!flow.backlogged) continue;
+        size_t turn = static_cast<size_t>(QUANTUM * weight(flow));
+        if (flow.deficit == 0) woken_.push_back(fd);
+        flow.deficit = std::max(flow.deficit, turn);
+    }
+}
@@ -0,0 +1,198 @@
+#include "SocketTuner.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>   // glibc's tcp_info stops short of the delivery rate
+
+// one number out of /proc/sys, 0 if it isn't there
+static size_t read_limit(const char* path) {
+    std::ifstream file(path);
+    size_t value = 0;
+    file >> value;
+    return value;
+}
+
+SocketTuner::SocketTuner() {
+    // what is loaded, not necessarily what we may switch to, a refused
+    // setsockopt just leaves the default in place
+    std::ifstream available("/proc/sys/net/ipv4/tcp_available_congestion_control");
+    std::string name;
+    while (available >> name) {
+        congestion_available_.insert(name);
+    }
+    rmem_max_ = read_limit("/proc/sys/net/core/rmem_max");
+    wmem_max_ = read_limit("/proc/sys/net/core/wmem_max");
+}
+
+void SocketTuner::configure(int fd, const std::string& peer, Role role) {
+    // requests are small and we coalesce responses with MSG_MORE ourselves,
+    // Nagle only adds a round trip in front of every request
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Socket& socket = sockets_[fd];
+    socket = Socket{};
+    socket.peer = peer;
+    socket.role = role;
+    socket.updated = std::chrono::steady_clock::now();
+
+    // a new stream to a peer we already measured starts where the last one ended
+    Path& path = paths_[peer];
+    apply(fd, role, path);
+}
+
+void SocketTuner::update(int fd) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sockets_.find(fd);
+    if (it == sockets_.end()) return;
+    Socket& socket = it->second;
+    double elapsed = std::chrono::duration<double>(now - socket.updated).count();
+    if (elapsed * 1000 < UPDATE_MS) return;
+
+    auto measured = sample(fd);
+    if (!measured) return;
+    Path& path = paths_[socket.peer];
+
+    // each side trusts what it measures on the data it moves: the sender
+    // its rtt and delivery rate, the receiver the bytes that came in
+    double rtt = socket.role == REQUESTING && measured->rcv_rtt > 0 ? measured->rcv_rtt : measured->rtt;
+    double rate = socket.role == SERVING ? measured->delivery_rate
+                                         : (measured->bytes_received - socket.bytes_received) / elapsed;
+    if (rtt > 0) {
+        path.rtt = path.rtt <= 0 ? rtt : 0.7 * path.rtt + 0.3 * rtt;
+    }
+    // an idle connection says nothing about the path
+    if (rate > 0) {
+        path.rate = path.rate <= 0 ? rate : 0.7 * path.rate + 0.3 * rate;
+    }
+    uint64_t sent = measured->segs_out - socket.segs_out;
+    if (socket.role == SERVING && sent >= 100) {
+        double loss = static_cast<double>(measured->retransmits - socket.retransmits) / sent;
+        path.loss = 0.7 * path.loss + 0.3 * loss;
+    }
+
+    socket.updated = now;
+    socket.retransmits = measured->retransmits;
+    socket.segs_out = measured->segs_out;
+    socket.bytes_received = measured->bytes_received;
+
+    apply(fd, socket.role, path);
+}
+
+void SocketTuner::forget(int fd) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sockets_.erase(fd);
+}
+
+size_t SocketTuner::buffer_for(double rate, double rtt) {
+    double bdp = rate * rtt;
+    if (bdp <= 0) return 0;
+    return std::clamp(static_cast<size_t>(BDP_FACTOR * bdp), MIN_BUFFER, MAX_BUFFER);
+}
+
+size_t SocketTuner::lowat_for(double rate) {
+    if (rate <= 0) return MIN_LOWAT;
+    return std::clamp(static_cast<size_t>(rate * LOWAT_SECONDS), MIN_LOWAT, MAX_LOWAT);
+}
+
+void SocketTuner::apply(int fd, Role role, Path& path) {
+    double bdp = path.rate * path.rtt;
+    path.buffer = std::max(path.buffer, buffer_for(path.rate, path.rtt));
+    if (path.buffer > 0) {
+        if (role == SERVING) {
+            grow_buffer(fd, SO_SNDBUF, SO_SNDBUFFORCE, wmem_max_, path.buffer);
+        } else {
+            grow_buffer(fd, SO_RCVBUF, SO_RCVBUFFORCE, rmem_max_, path.buffer);
+        }
+    }
+
+    // only the sender's side of these matters
+    if (role != SERVING) return;
+
+    path.lowat = lowat_for(path.rate);
+    int lowat = static_cast<int>(path.lowat);
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+
+    if (path.congestion.empty() && (path.loss > LOSSY || bdp > LONG_FAT_BDP) && congestion_available_.count("bbr")) {
+        path.congestion = "bbr";
+        std::cout << "Tuner: path to " << (path.loss > LOSSY ? "lossy" : "long fat")
+                  << " peer, switching to bbr\n";
+    }
+    std::string current = congestion(fd);
+    if (!path.congestion.empty() && current != path.congestion &&
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, path.congestion.c_str(), path.congestion.size()) == 0) {
+        current = path.congestion;
+    }
+    path.in_use = current;
+}
+
+// Setting a buffer turns the kernel's autotuning off for that socket, so it
+// is only ever raised past what autotuning already reached. Without the
+// privilege to go past the sysctl limit a capped value would be worse than
+// autotuning, which may go higher, so that is left alone too
+bool SocketTuner::grow_buffer(int fd, int option, int force_option, size_t limit, size_t bytes) {
+    int current = 0;
+    socklen_t len = sizeof(current);
+    if (getsockopt(fd, SOL_SOCKET, option, &current, &len) < 0) return false;
+    // the kernel reports twice what was asked for, the rest is its bookkeeping
+    if (bytes * 2 <= static_cast<size_t>(current)) return false;
+
+    int value = static_cast<int>(bytes);
+    if (setsockopt(fd, SOL_SOCKET, force_option, &value, sizeof(value)) == 0) return true;
+    if (bytes > limit) return false;
+    return setsockopt(fd, SOL_SOCKET, option, &value, sizeof(value)) == 0;
+}
+
+std::string SocketTuner::congestion(int fd) {
+    char name[16] = {};   // TCP_CA_NAME_MAX, not exported to user space
+    socklen_t len = sizeof(name);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, name, &len) < 0) return "";
+    return std::string(name, strnlen(name, len));
+}
+
+std::optional<SocketTuner::Sample> SocketTuner::sample(int fd) {
+    struct tcp_info info = {};
+    socklen_t info_len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_len) < 0) return std::nullopt;
+
+    int sndbuf = 0, rcvbuf = 0;
+    socklen_t len = sizeof(int);
+    getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+    len = sizeof(int);
+    getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+
+    // older kernels fill in less, what they leave out stays 0
+    Sample result;
+    result.rtt = info.tcpi_rtt / 1e6;
+    result.rcv_rtt = info.tcpi_rcv_rtt / 1e6;
+    result.delivery_rate = info.tcpi_delivery_rate;
+    result.cwnd = static_cast<size_t>(info.tcpi_snd_cwnd) * info.tcpi_snd_mss;
+    result.retransmits = info.tcpi_total_retrans;
+    result.segs_out = info.tcpi_segs_out;
+    result.bytes_received = info.tcpi_bytes_received;
+    result.sndbuf = sndbuf / 2;
+    result.rcvbuf = rcvbuf / 2;
+    return result;
+}
+
+std::vector<SocketTuner::Choice> SocketTuner::choices() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Choice> result;
+    for (const auto& [peer, path] : paths_) {
+        Choice choice;
+        choice.peer = peer;
+        choice.rtt = path.rtt;
+        choice.rate = path.rate;
+        choice.loss = path.loss;
+        choice.congestion = path.in_use;
+        choice.buffer = path.buffer;
+        choice.lowat = path.lowat;
+        result.push_back(std::move(choice));
+    }
+    return result;
+}
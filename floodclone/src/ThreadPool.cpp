@@ -1,41 +1,23 @@
 #include "ThreadPool.h"
+#include "Metrics.h"
 #include <thread>
-#include <queue>
 #include <mutex>
 #include <condition_variable>
-#include <functional>
+
+namespace {
+    // lets push() find the calling worker's own deque
+    thread_local const ThreadPool* current_pool = nullptr;
+    thread_local size_t current_index = 0;
+}
 
 
 ThreadPool::ThreadPool(size_t threads) : stop(false) {
     for (size_t i = 0; i < threads; ++i) {
-
-        // creat each worker with the task of infinitly looking at the work queue
-        workers.emplace_back([this] {
-            while (true) {
-                std::function<void()> task;
-
-                {
-                    // sleep until work is avialable or toled to exit
-                    std::unique_lock<std::mutex> lock(this->queue_mutex);
-                    this->condition.wait(lock, [this] { return this->stop || !this->tasks.empty(); });
-
-                    if (this->stop && this->tasks.empty())
-                        return;
-                    task = std::move(this->tasks.front());
-                    this->tasks.pop();
-                    active_tasks++;  // Increment total active task count
-                }
-
-                task();
-                {
-                    std::unique_lock<std::mutex> lock(this->queue_mutex);
-                    active_tasks--;  // Decrement total active task count
-                    if (tasks.empty() && active_tasks == 0) {
-                        idle_condition.notify_all();  // Signal pool is idle
-                    }
-                }
-            }
-        });
+        queues.push_back(std::make_unique<Worker>());
+    }
+    // creat each worker with the task of infinitly looking at the work queues
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([this, i] { run(i); });
     }
 }
 
@@ -44,18 +26,97 @@ ThreadPool::~ThreadPool() {
    
 }
 
-void ThreadPool::enqueue(std::function<void()> task) {
+void ThreadPool::push(Task task, Priority priority) {
+    size_t target;
+    if (current_pool == this) {
+        target = current_index;
+    } else {
+        target = next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+    }
+
+    size_t level = static_cast<size_t>(priority);
+    pending.fetch_add(1);
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        tasks.emplace(std::move(task));
+        auto& worker = *queues[target];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.queues[level].push_back(std::move(task));
+        worker.sizes[level].fetch_add(1, std::memory_order_relaxed);
+    }
+    queued_by_priority[level].fetch_add(1, std::memory_order_relaxed);
+    Metrics::record(Metrics::POOL_QUEUE_DEPTH, queued.fetch_add(1) + 1);
+
+    // the workers bump sleeping before they check queued, so either they see
+    // the new task or we see them asleep
+    if (sleeping.load() > 0) {
+        // taking the lock orders us with a worker between its check and its wait
+        { std::lock_guard<std::mutex> lock(sleep_mutex); }
+        condition.notify_one();
+    }
+}
+
+bool ThreadPool::take(Worker& worker, size_t priority, bool oldest, Task& task) {
+    if (worker.sizes[priority].load(std::memory_order_relaxed) == 0) return false;
+
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    auto& queue = worker.queues[priority];
+    if (queue.empty()) return false;
+    task = oldest ? queue.pop_front() : queue.pop_back();
+    worker.sizes[priority].fetch_sub(1, std::memory_order_relaxed);
+    queued_by_priority[priority].fetch_sub(1, std::memory_order_relaxed);
+    queued.fetch_sub(1);
+    return true;
+}
+
+bool ThreadPool::pop(size_t self, Task& task) {
+    if (queued.load() == 0) return false;
+
+    size_t count = queues.size();
+    for (size_t priority = 0; priority < PRIORITIES; ++priority) {
+        if (queued_by_priority[priority].load(std::memory_order_relaxed) == 0) continue;
+
+        // our own deque first, oldest task first
+        if (take(*queues[self], priority, true, task)) return true;
+
+        // then steal from the other end of everyone else's
+        for (size_t offset = 1; offset < count; ++offset) {
+            if (take(*queues[(self + offset) % count], priority, false, task)) return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run(size_t self) {
+    current_pool = this;
+    current_index = self;
+
+    while (true) {
+        Task task;
+        if (!pop(self, task)) {
+            // sleep until work is avialable or toled to exit
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            sleeping.fetch_add(1);
+            condition.wait(lock, [this] { return stop || queued.load() > 0; });
+            sleeping.fetch_sub(1);
+
+            if (stop && queued.load() == 0)
+                return;
+            continue;
+        }
+
+        task();
+        task = Task();   // captured state goes away before wait() can return
+
+        if (pending.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            idle_condition.notify_all();  // Signal pool is idle
+        }
     }
-    condition.notify_one();
 }
 
 
 void ThreadPool::join() {
     {
-        std::unique_lock<std::mutex> lock(queue_mutex);
+        std::unique_lock<std::mutex> lock(sleep_mutex);
         stop = true;
     }
     condition.notify_all();
@@ -68,6 +129,6 @@ void ThreadPool::join() {
 }
 
 void ThreadPool::wait() {
-    std::unique_lock<std::mutex> lock(queue_mutex);
-    idle_condition.wait(lock, [this] { return tasks.empty() && active_tasks == 0; });
+    std::unique_lock<std::mutex> lock(idle_mutex);
+    idle_condition.wait(lock, [this] { return pending.load() == 0; });
 }
@@ -1,10 +1,29 @@
 #include "ThreadPool.h"
 #include "FileManager.h"
 #include "ConnectionManager.h"
+#include "Fountain.h"
+#include "DistributionPlanner.h"
+#include "CompletionTree.h"
+#include "FloodClone.h"
+#include "SendScheduler.h"
+#include "PieceScheduler.h"
+#include "PieceCodec.h"
+#include "SocketTuner.h"
 #include <iostream>
 #include <thread>
 #include <chrono>
 #include <fstream>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include <filesystem>
+#include <nlohmann/json.hpp>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
 
 bool compare_files(const std::string& file_path1, const std::string& file_path2) {
     std::ifstream file1(file_path1, std::ios::binary);
@@ -27,6 +46,17 @@ bool compare_files(const std::string& file_path1, const std::string& file_path2)
     );
 }
 
+static int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (ok) {
+        std::cout << "Test passed: " << what << "\n";
+    } else {
+        std::cerr << "Test failed: " << what << "\n";
+        failures++;
+    }
+}
+
 // Shared pointers to track managers
 static std::shared_ptr<ConnectionManager> server_manager;
 static std::shared_ptr<ConnectionManager> client_manager;
@@ -67,6 +97,8 @@ void run_client(ThreadPool& threadPool) {
             {{0, metadata.numPieces - 1}},  // request full range
             {}   // no specific list
         );
+        // pieces are checksummed on the pool before they count as received
+        threadPool.wait();
         std::cout << "Client: Received all pieces\n";
 
         // Verify all pieces received
@@ -94,6 +126,1330 @@ void run_client(ThreadPool& threadPool) {
     }
 }
 
+// a symbol the way encode_symbols makes it: the xor of the pieces its seed
+// picks, short pieces padded with zeros out to size
+std::string make_symbol(const std::vector<std::string>& pieces, uint64_t block, uint64_t seed,
+                        size_t size, uint64_t& mask) {
+    std::string symbol(size, '\0');
+    mask = FountainDecoder::coefficients(block, seed, pieces.size());
+    for (uint64_t bits = mask; bits != 0; bits &= bits - 1) {
+        const std::string& piece = pieces[__builtin_ctzll(bits)];
+        FountainDecoder::xor_into(&symbol[0], piece.data(), piece.size());
+    }
+    return symbol;
+}
+
+std::vector<std::string> random_pieces(std::mt19937_64& rng, size_t k, size_t size, size_t last_size) {
+    std::vector<std::string> pieces(k);
+    for (size_t j = 0; j < k; j++) {
+        pieces[j].resize(j + 1 == k ? last_size : size);
+        for (char& c : pieces[j]) c = static_cast<char>(rng());
+    }
+    return pieces;
+}
+
+bool decodes_to(FountainDecoder& decoder, const std::vector<std::string>& pieces) {
+    if (!decoder.complete()) return false;
+    decoder.solve();
+    for (size_t j = 0; j < pieces.size(); j++) {
+        if (decoder.piece(j).compare(0, pieces[j].size(), pieces[j]) != 0) return false;
+    }
+    return true;
+}
+
+void test_fountain() {
+    std::mt19937_64 rng(7);
+    const size_t k = FountainDecoder::BLOCK_PIECES;
+    const size_t size = 100;
+
+    // twice as many symbols as pieces, fed in random order: it has to
+    // finish from whichever subset comes first and shrug off the rest
+    auto pieces = random_pieces(rng, k, size, size);
+    std::vector<uint64_t> seeds(2 * k);
+    for (auto& seed : seeds) seed = rng();
+    std::shuffle(seeds.begin(), seeds.end(), rng);
+    FountainDecoder decoder(k, size);
+    size_t used = 0;
+    for (uint64_t seed : seeds) {
+        uint64_t mask;
+        std::string symbol = make_symbol(pieces, 3, seed, size, mask);
+        if (decoder.add(mask, symbol.data())) used++;
+    }
+    check(used == k && decoder.rank() == k, "fountain takes exactly block size symbols");
+    check(decodes_to(decoder, pieces), "fountain decodes a random subset of symbols");
+
+    // a symbol seen twice, or one that is the xor of two already in, adds nothing
+    FountainDecoder deficient(k, size);
+    uint64_t mask_a, mask_b;
+    std::string a = make_symbol(pieces, 3, 1, size, mask_a);
+    std::string b = make_symbol(pieces, 3, 2, size, mask_b);
+    deficient.add(mask_a, a.data());
+    deficient.add(mask_b, b.data());
+    std::string sum = a;
+    FountainDecoder::xor_into(&sum[0], b.data(), size);
+    bool repeated = deficient.add(mask_a, a.data());
+    bool combined = mask_a != mask_b && deficient.add(mask_a ^ mask_b, sum.data());
+    check(!repeated && !combined && deficient.rank() == 2 && !deficient.complete(),
+          "fountain ignores dependent symbols");
+    // k - 1 independent symbols leave it one short
+    FountainDecoder short_one(k, size);
+    for (uint64_t seed = 0; short_one.rank() < k - 1; seed++) {
+        uint64_t mask;
+        std::string symbol = make_symbol(pieces, 3, seed, size, mask);
+        short_one.add(mask, symbol.data());
+    }
+    check(!short_one.complete(), "fountain stays undecoded when rank deficient");
+
+    // the file's last block has fewer pieces and its last piece is short
+    const size_t tail_k = 5;
+    auto tail = random_pieces(rng, tail_k, size, size / 3);
+    FountainDecoder tail_decoder(tail_k, size);
+    bool inside = true;
+    for (uint64_t seed = 100; !tail_decoder.complete() && seed < 200; seed++) {
+        uint64_t mask;
+        std::string symbol = make_symbol(tail, 9, seed, size, mask);
+        inside = inside && mask != 0 && mask < (uint64_t(1) << tail_k);
+        tail_decoder.add(mask, symbol.data());
+    }
+    bool decoded = decodes_to(tail_decoder, tail);
+    bool padded = decoded && tail_decoder.piece(tail_k - 1).find_first_not_of('\0', size / 3) == std::string::npos;
+    check(inside && decoded && padded, "fountain decodes a short final block");
+}
+
+bool parse_fails(std::string_view data) {
+    try {
+        FileMetaDataView view(data);
+        return false;
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+}
+
+void test_metadata() {
+    FileMetaData meta;
+    meta.fileId = "abc123";
+    meta.filename = "file.bin";
+    meta.numPieces = 3;
+    meta.fileSize = 40000;
+    meta.pieceSize = 16384;
+    meta.startupPieceSize = 16384;
+    meta.startupPieces = 0;
+    meta.peers.push_back({});
+    std::strncpy(meta.peers[0].data(), "10.0.0.1", IP4_LENGTH - 1);
+    meta.sources.push_back({0, 2, 0});
+    meta.checksums.resize(meta.numPieces * CHECKSUM_LENGTH);
+    for (size_t i = 0; i < meta.checksums.size(); i++) meta.checksums[i] = static_cast<char>(i);
+    meta.merkleRoot.fill('r');
+    meta.weakChecksums = {1, 2, 3};
+
+    std::string bytes = meta.serialize();
+    FileMetaData back = FileMetaData::deserialize(bytes);
+    FileMetaDataView view(bytes);
+    check(back.fileId == meta.fileId && back.filename == meta.filename && back.numPieces == meta.numPieces
+          && back.fileSize == meta.fileSize && back.pieceSize == meta.pieceSize
+          && back.peers == meta.peers && back.sources.size() == 1 && back.sources[0].last == 2
+          && back.checksums == meta.checksums && back.merkleRoot == meta.merkleRoot
+          && back.weakChecksums == meta.weakChecksums && view.peer(0) == "10.0.0.1",
+          "metadata round trips");
+    check(bytes.size() <= FileMetaDataView::max_size(bytes.substr(0, FileMetaDataView::HEADER_SIZE)),
+          "metadata fits its own size bound");
+
+    // every prefix is cut somewhere inside a field
+    bool truncated = true;
+    for (size_t size = 0; size < bytes.size(); size++) {
+        truncated = truncated && parse_fails(std::string_view(bytes.data(), size));
+    }
+    check(truncated, "metadata parser rejects truncated buffers");
+
+    std::string wrong_magic = bytes;
+    wrong_magic[0] ^= 1;
+    std::string wrong_version = bytes;
+    uint32_t old_version = FileMetaDataView::VERSION - 1;
+    std::memcpy(&wrong_version[sizeof(uint32_t)], &old_version, sizeof(old_version));
+    check(parse_fails(wrong_magic) && parse_fails(wrong_version), "metadata parser rejects wrong magic and version");
+
+    // one piece more than the columns carry
+    std::string bad_columns = bytes;
+    uint64_t pieces = meta.numPieces + 1;
+    std::memcpy(&bad_columns[2 * sizeof(uint32_t) + sizeof(uint64_t)], &pieces, sizeof(pieces));
+    // a weak column one short, the buffer still ends right after it
+    std::string short_weak = bytes.substr(0, bytes.size() - sizeof(uint32_t));
+    uint64_t weak_count = meta.numPieces - 1;
+    std::memcpy(&short_weak[short_weak.size() - weak_count * sizeof(uint32_t) - sizeof(uint64_t)],
+                &weak_count, sizeof(weak_count));
+    check(parse_fails(bad_columns) && parse_fails(short_weak),
+          "metadata parser rejects columns that don't match numPieces");
+}
+
+// scratch files for the FileManager tests, removed again at the end
+const std::string SCRATCH = "tests/scratch";
+
+std::string random_bytes(std::mt19937_64& rng, size_t size) {
+    std::string bytes(size, '\0');
+    for (char& c : bytes) c = static_cast<char>(rng());
+    return bytes;
+}
+
+void write_file(const std::string& path, const std::string& bytes) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), bytes.size());
+}
+
+// the tree the long way round: hash neighbours pairwise, an odd one out
+// goes up a level untouched
+std::array<char, CHECKSUM_LENGTH> expected_root(const std::vector<char>& leaves) {
+    std::vector<std::string> level;
+    for (size_t i = 0; i < leaves.size(); i += CHECKSUM_LENGTH) {
+        level.emplace_back(leaves.data() + i, CHECKSUM_LENGTH);
+    }
+    while (level.size() > 1) {
+        std::vector<std::string> up;
+        for (size_t i = 0; i + 1 < level.size(); i += 2) {
+            std::string pair = level[i] + level[i + 1];
+            std::string parent(CHECKSUM_LENGTH, '\0');
+            FileManager::calculate_checksum(pair.data(), pair.size(), &parent[0]);
+            up.push_back(parent);
+        }
+        if (level.size() % 2) up.push_back(level.back());
+        level = std::move(up);
+    }
+    std::array<char, CHECKSUM_LENGTH> root{};
+    std::memcpy(root.data(), level[0].data(), CHECKSUM_LENGTH);
+    return root;
+}
+
+bool receiver_rejects(const FileMetaData& metadata) {
+    try {
+        FileManager receiver(SCRATCH + "/merkle_out.bin", 0, "127.0.0.1", SCRATCH + "/pieces",
+                             nullptr, false, &metadata);
+        return false;
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+}
+
+void test_merkle() {
+    std::filesystem::create_directories(SCRATCH);
+    std::mt19937_64 rng(9);
+    const size_t piece = 1024;
+    // 5 and 3 promote a node on the way up, 4 doesn't, 1 is its own root
+    for (size_t pieces : {1, 3, 4, 5}) {
+        std::string path = SCRATCH + "/merkle_" + std::to_string(pieces) + ".bin";
+        write_file(path, random_bytes(rng, pieces * piece - 100));
+        FileManager source(path, piece, "127.0.0.1", SCRATCH + "/pieces", nullptr, true, nullptr);
+        FileMetaData metadata = source.get_metadata();
+        std::string name = std::to_string(pieces) + (pieces == 1 ? " leaf" : " leaves");
+        check(metadata.numPieces == pieces && metadata.merkleRoot == expected_root(metadata.checksums),
+              "merkle root over " + name);
+        check(!receiver_rejects(metadata), "receiver accepts an intact tree of " + name);
+
+        FileMetaData flipped = metadata;
+        flipped.checksums[(pieces - 1) * CHECKSUM_LENGTH] ^= 1;   // the promoted one when odd
+        check(receiver_rejects(flipped), "receiver rejects a flipped leaf of " + name);
+        source.clean_up();
+    }
+    std::filesystem::remove_all(SCRATCH);
+}
+
+uint64_t pieces_served() {
+    return nlohmann::json::parse(Metrics::dump())["counters"]["pieces_served"].get<uint64_t>();
+}
+
+// receives part of a file, drops the receiver as if the process died and
+// picks the transfer back up with resume on
+void test_resume(ThreadPool& threadPool) {
+    std::filesystem::create_directories(SCRATCH);
+    std::mt19937_64 rng(11);
+    const size_t piece = 1024;
+    const std::string original = SCRATCH + "/resume_in.bin";
+    const std::string output = SCRATCH + "/resume_out.bin";
+    write_file(original, random_bytes(rng, 40 * piece - 300));
+
+    FileManager source(original, piece, "127.0.0.1", SCRATCH + "/source_pieces", &threadPool, true, nullptr);
+    ConnectionManager server("127.0.0.1", 9086, threadPool, source);
+    std::thread listener([&server] { server.start_listening(); });
+
+    std::vector<size_t> first_run;
+    for (size_t i = 0; i < source.get_metadata().numPieces; i += 3) first_run.push_back(i);
+    {
+        ConnectionManager client("127.0.0.1", 8081, threadPool);
+        FileMetaData metadata = client.request_metadata("127.0.0.1", 9086);
+        FileManager receiver(output, 0, "127.0.0.1", SCRATCH + "/receiver_pieces", &threadPool, false, &metadata,
+                             PieceStore::Backend::Mmap, true);
+        client.set_file_manager(receiver);
+        client.request_pieces("127.0.0.1", 9086, -1, {}, first_run);
+        threadPool.wait();
+        // progress goes to disk at most once a second, one more piece after
+        // that makes sure everything before it was saved
+        std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+        first_run.push_back(1);
+        client.request_pieces("127.0.0.1", 9086, 1, {}, {});
+        threadPool.wait();
+    }
+
+    ConnectionManager client("127.0.0.1", 8082, threadPool);
+    FileMetaData metadata = client.request_metadata("127.0.0.1", 9086);
+    FileManager receiver(output, 0, "127.0.0.1", SCRATCH + "/receiver_pieces", &threadPool, false, &metadata,
+                         PieceStore::Backend::Mmap, true);
+    client.set_file_manager(receiver);
+
+    bool kept = receiver.pieces().count() == first_run.size();
+    for (size_t i : first_run) kept = kept && receiver.has_piece(i);
+    check(kept, "resume keeps the pieces received before the interruption");
+
+    std::vector<size_t> missing;
+    for (size_t i = 0; i < metadata.numPieces; i++) {
+        if (!receiver.has_piece(i)) missing.push_back(i);
+    }
+    uint64_t served = pieces_served();
+    client.request_pieces("127.0.0.1", 9086, -1, {}, missing);
+    threadPool.wait();
+    check(pieces_served() - served == missing.size() && receiver.pieces().count() == metadata.numPieces,
+          "resume only fetches the missing pieces");
+
+    receiver.reconstruct();
+    check(compare_files(original, output), "resumed file matches original");
+
+    client.stop_listening();
+    server.stop_listening();
+    listener.join();
+    source.clean_up();
+    receiver.clean_up();
+    std::filesystem::remove_all(SCRATCH);
+}
+
+void test_rolling() {
+    std::mt19937_64 rng(13);
+    std::string data = random_bytes(rng, 5000);
+    const size_t window = 700;
+    RollingChecksum roll(data.data(), window);
+    bool matches = roll.value() == FileManager::rolling_checksum(data.data(), window);
+    for (size_t pos = 1; pos + window <= data.size(); pos++) {
+        roll.slide(data[pos - 1], data[pos - 1 + window]);
+        matches = matches && roll.value() == RollingChecksum(data.data() + pos, window).value();
+    }
+    check(matches, "rolling checksum matches a fresh one after every slide");
+}
+
+// pieces a fresh receiver takes from basis, {SIZE_MAX} if seed_from miscounts them
+std::vector<size_t> seeded(const FileMetaData& metadata, const std::string& name, const std::string& basis) {
+    std::string basis_path = SCRATCH + "/" + name + ".basis";
+    write_file(basis_path, basis);
+    FileManager receiver(SCRATCH + "/" + name + ".out", 0, "127.0.0.1", SCRATCH + "/pieces",
+                         nullptr, false, &metadata);
+    size_t found = receiver.seed_from(basis_path);
+    std::vector<size_t> pieces;
+    for (size_t i = 0; i < metadata.numPieces; i++) {
+        if (receiver.has_piece(i)) pieces.push_back(i);
+    }
+    receiver.clean_up();
+    return found == pieces.size() ? pieces : std::vector<size_t>{SIZE_MAX};
+}
+
+void test_seed() {
+    std::filesystem::create_directories(SCRATCH);
+    std::mt19937_64 rng(17);
+    const size_t piece = 1024;
+    const size_t pieces = 10;
+    std::string file = random_bytes(rng, pieces * piece - 300);   // the last piece is short
+    write_file(SCRATCH + "/seed_in.bin", file);
+    FileManager source(SCRATCH + "/seed_in.bin", piece, "127.0.0.1", SCRATCH + "/pieces", nullptr, true, nullptr);
+    FileMetaData metadata = source.get_metadata();
+
+    std::vector<size_t> all(pieces);
+    for (size_t i = 0; i < pieces; i++) all[i] = i;
+    check(seeded(metadata, "same", file) == all, "seed finds every piece of an identical copy");
+
+    // bytes inserted inside piece 3 shift everything after it
+    size_t insert_at = 3 * piece + 100;
+    std::string shifted = file.substr(0, insert_at) + random_bytes(rng, 37) + file.substr(insert_at);
+    std::vector<size_t> but_three = all;
+    but_three.erase(but_three.begin() + 3);
+    check(seeded(metadata, "shifted", shifted) == but_three, "seed finds pieces after an insertion");
+
+    // only a junk prefix and the short last piece are left at the end
+    std::string tail = random_bytes(rng, 2 * piece) + file.substr((pieces - 1) * piece);
+    check(seeded(metadata, "tail", tail) == std::vector<size_t>{pieces - 1}, "seed finds the short last piece");
+
+    std::string shorter = file.substr(0, 4 * piece + piece / 2);
+    check(seeded(metadata, "shorter", shorter) == std::vector<size_t>({0, 1, 2, 3}),
+          "seed takes what a shorter copy has");
+
+    source.clean_up();
+    std::filesystem::remove_all(SCRATCH);
+}
+
+// every tree's share of a run of pieces is within one of its rate's share
+bool interleaved_by_rate(const DistributionPlanner& planner, size_t pieces) {
+    double total = 0;
+    for (size_t t = 0; t < planner.num_trees(); t++) total += planner.tree_rate(t);
+    std::vector<size_t> counts(planner.num_trees(), 0);
+    for (size_t i = 0; i < pieces; i++) counts[planner.tree_of(i)]++;
+    for (size_t t = 0; t < planner.num_trees(); t++) {
+        if (std::abs(counts[t] - pieces * planner.tree_rate(t) / total) > 1) return false;
+    }
+    return true;
+}
+
+void test_planner() {
+    // everyone on one switch: one uplink each, so a single chain at full rate
+    DistributionPlanner sw("src");
+    std::vector<std::string> hosts{"src", "h1", "h2", "h3"};
+    for (const auto& from : hosts) {
+        for (const auto& to : hosts) {
+            if (from != to) sw.add_link(from, to, "eth0");
+        }
+    }
+    check(sw.plan() && sw.num_trees() == 1 && sw.tree_rate(0) == 1.0, "planner makes one tree on a switch");
+    check(sw.parent("src", 0).empty() && sw.parent("h1", 0) == "src" && sw.parent("h2", 0) == "h1"
+          && sw.parent("h3", 0) == "h2", "planner chains the hosts behind a switch");
+    check(sw.shared_interfaces().size() == hosts.size(), "planner sees every switch port as shared");
+
+    // full mesh of point to point links: the source's three links each start a tree
+    DistributionPlanner mesh("a");
+    std::vector<std::string> nodes{"a", "b", "c", "d"};
+    for (const auto& from : nodes) {
+        for (const auto& to : nodes) {
+            if (from != to) mesh.add_link(from, to, from + "-" + to);
+        }
+    }
+    bool planned = mesh.plan();
+    check(planned && mesh.num_trees() == 3, "planner packs three trees on a 4 node mesh");
+    bool rates = planned;
+    std::set<std::pair<std::string, std::string>> used;
+    size_t edges = 0;
+    for (size_t t = 0; planned && t < mesh.num_trees(); t++) {
+        rates = rates && mesh.tree_rate(t) == 1.0 && mesh.parent("a", t).empty();
+        for (const auto& node : nodes) {
+            if (node == "a") continue;
+            used.emplace(mesh.parent(node, t), node);
+            edges++;
+        }
+    }
+    check(rates && used.size() == edges && edges == 9, "planner mesh trees run at full rate on disjoint links");
+    check(planned && mesh.parent("b", 0) == "a" && mesh.parent("c", 0) == "b" && mesh.parent("d", 0) == "c"
+          && mesh.parent("b", 1) == "c" && mesh.parent("c", 1) == "a" && mesh.parent("d", 1) == "b"
+          && mesh.parent("b", 2) == "d" && mesh.parent("c", 2) == "d" && mesh.parent("d", 2) == "a",
+          "planner mesh parents");
+    check(planned && interleaved_by_rate(mesh, 64) && interleaved_by_rate(mesh, 10)
+          && mesh.tree_of(0) != mesh.tree_of(1) && mesh.tree_of(1) != mesh.tree_of(2)
+          && mesh.tree_of(0) != mesh.tree_of(2), "planner interleaves pieces by rate");
+
+    DistributionPlanner cut("a");
+    cut.add_link("a", "b", "eth0");
+    cut.add_link("c", "a", "eth0");
+    check(!cut.plan(), "planner refuses a node it can't reach");
+}
+
+// every flow always has data and writes in chunks as its turn allows,
+// returns what each one got out of the interface
+// counts the copies of it alive, so a Task that leaks or double destroys
+// its callable shows up
+struct Tracked {
+    static int alive;
+    int* calls;
+    char padding[16] = {};
+    explicit Tracked(int* calls) : calls(calls) { alive++; }
+    Tracked(const Tracked& other) : calls(other.calls) { alive++; }
+    Tracked(Tracked&& other) noexcept : calls(other.calls) { alive++; }
+    ~Tracked() { alive--; }
+    void operator()() const { (*calls)++; }
+};
+int Tracked::alive = 0;
+
+bool wait_until(std::mutex& mutex, std::condition_variable& cv, const std::function<bool()>& done) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return cv.wait_for(lock, std::chrono::seconds(2), done);
+}
+
+void test_thread_pool() {
+    int calls = 0;
+    {
+        Task small(Tracked{&calls});
+        Task moved(std::move(small));
+        Task assigned;
+        assigned = std::move(moved);
+        assigned();
+        check(!small && !moved && assigned && calls == 1 && Tracked::alive == 1, "task moves an inline callable");
+
+        std::array<char, 2 * Task::INLINE_SIZE> big{};
+        Task heap([tracked = Tracked{&calls}, big] { tracked(); });
+        Task heap_moved(std::move(heap));
+        heap_moved();
+        check(!heap && calls == 2 && Tracked::alive == 2, "task moves a callable too big to be inline");
+
+        assigned = std::move(heap_moved);
+        check(Tracked::alive == 1, "task assignment destroys what it held");
+
+        auto owned = std::make_unique<int>(7);
+        Task move_only([owned = std::move(owned), &calls] { calls += *owned; });
+        move_only();
+        check(calls == 9, "task takes move only captures");
+    }
+    check(Tracked::alive == 0, "task destroys its callable");
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    {
+        // one worker held up by a gate while every class is queued behind it
+        ThreadPool pool(1);
+        bool open = false;
+        std::vector<std::string> order;
+        pool.enqueue([&] {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&] { return open; });
+        });
+        auto record = [&](const std::string& name) {
+            return [&, name] {
+                std::lock_guard<std::mutex> lock(mutex);
+                order.push_back(name);
+            };
+        };
+        pool.enqueue(record("background"), ThreadPool::Priority::Background);
+        pool.enqueue(record("normal 1"));
+        pool.enqueue(record("high"), ThreadPool::Priority::High);
+        pool.enqueue(record("normal 2"));
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            open = true;
+        }
+        cv.notify_all();
+        pool.wait();
+        check(order == std::vector<std::string>{"high", "normal 1", "normal 2", "background"},
+              "thread pool runs high before normal before background, oldest first");
+    }
+    {
+        // a worker that blocks after queueing work on its own deque gets it
+        // stolen by the other worker
+        ThreadPool pool(2);
+        const size_t subtasks = 8;
+        size_t done = 0;
+        bool stolen = true;
+        bool finished = false;
+        pool.enqueue([&] {
+            auto self = std::this_thread::get_id();
+            for (size_t i = 0; i < subtasks; i++) {
+                pool.enqueue([&, self] {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stolen = stolen && std::this_thread::get_id() != self;
+                    done++;
+                    cv.notify_all();
+                });
+            }
+            finished = wait_until(mutex, cv, [&] { return done == subtasks; });
+        });
+        pool.wait();
+        check(finished && stolen, "thread pool steals from a busy worker's deque");
+    }
+}
+
+// src feeds a and b, both reach c, d hangs off c. Messages are handed from
+// tree to tree the way the completion port would carry them
+void test_completion_tree() {
+    std::vector<std::pair<std::string, std::string>> links{{"src", "a"}, {"src", "b"}, {"a", "c"}, {"b", "c"}, {"c", "d"}};
+    std::vector<std::string> nodes{"src", "a", "b", "c", "d"};
+    std::map<std::string, CompletionTree> trees;
+    for (const auto& node : nodes) {
+        CompletionTree tree("src");
+        for (const auto& [x, y] : links) tree.add_link(x, y);
+        tree.build(node);
+        trees.emplace(node, tree);
+    }
+    using names = std::vector<std::string>;
+    check(trees.at("src").parent().empty() && trees.at("src").children() == names{"a", "b"}
+          && trees.at("a").parent() == "src" && trees.at("a").children() == names{"c"}
+          && trees.at("b").parent() == "src" && trees.at("b").children().empty()
+          && trees.at("c").parent() == "a" && trees.at("c").children() == names{"d"}
+          && trees.at("d").parent() == "c" && trees.at("d").children().empty(),
+          "completion tree parents are neighbors a hop closer to the source");
+
+    CompletionTree lost("src");
+    lost.add_link("src", "a");
+    lost.add_link("x", "y");
+    bool threw = false;
+    try {
+        lost.build("x");
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    check(threw, "completion tree rejects a node the source can't reach");
+
+    // finishing in reverse hop order, each node reports once its children have
+    bool waits = !trees.at("c").children_done() && !trees.at("src").children_done();
+    for (const std::string node : {"d", "c", "b", "a"}) {
+        CompletionTree& tree = trees.at(node);
+        tree.finished(100 + node[0]);
+        waits = waits && tree.children_done();
+        trees.at(tree.parent()).receive(tree.done_message());
+    }
+    check(waits && trees.at("src").children_done(), "completion done waits for every child's subtree");
+    std::map<std::string, int64_t> expected{{"a", 100 + 'a'}, {"b", 100 + 'b'}, {"c", 100 + 'c'}, {"d", 100 + 'd'}};
+    check(trees.at("src").finish_times() == expected, "completion source gets every node's finish time");
+
+    bool rejected = true;
+    for (const auto& message : {trees.at("a").done_message(), trees.at("c").done_message(), nlohmann::json{{"type", "?"}}}) {
+        try {
+            trees.at("src").receive(message);
+            rejected = false;
+        } catch (const std::exception&) {}
+    }
+    check(rejected, "completion rejects repeated, foreign and unknown messages");
+
+    std::vector<std::string> pending{"src"};
+    while (!pending.empty()) {
+        std::string node = pending.back();
+        pending.pop_back();
+        for (const auto& child : trees.at(node).children()) {
+            trees.at(child).receive(CompletionTree::all_done_message());
+            pending.push_back(child);
+        }
+    }
+    check(std::all_of(nodes.begin() + 1, nodes.end(), [&](const std::string& n) { return trees.at(n).all_done(); }),
+          "completion all_done reaches every node down the tree");
+}
+
+std::map<int, size_t> drain(SendScheduler& scheduler, const std::vector<int>& fds) {
+    const size_t chunk = 64 * 1024;
+    std::map<int, size_t> sent;
+    for (size_t step = 0; step < 2000; step++) {
+        for (int fd : fds) {
+            size_t bytes = std::min(scheduler.allowance(fd), chunk);
+            scheduler.charge(fd, bytes);
+            sent[fd] += bytes;
+        }
+    }
+    return sent;
+}
+
+bool share_near(const std::map<int, size_t>& sent, int fd, int other, double ratio) {
+    double got = static_cast<double>(sent.at(fd)) / sent.at(other);
+    return std::abs(got - ratio) < 0.05 * ratio;
+}
+
+void test_send_scheduler() {
+    SendScheduler fair;
+    fair.set_policy(SendScheduler::Policy::FAIR);
+    fair.add(1, "eth0", "10.0.0.1");
+    fair.add(2, "eth0", "10.0.0.2");
+    fair.set_rate(1, 3e6);
+    auto sent = drain(fair, {1, 2});
+    check(sent[1] > 0 && share_near(sent, 1, 2, 1.0), "send scheduler splits evenly under fair");
+
+    SendScheduler fastest;
+    fastest.set_policy(SendScheduler::Policy::FASTEST);
+    fastest.add(1, "eth0", "10.0.0.1");
+    fastest.add(2, "eth0", "10.0.0.2");
+    fastest.set_rate(1, 3e6);
+    fastest.set_rate(2, 1e6);
+    sent = drain(fastest, {1, 2});
+    check(share_near(sent, 1, 2, 3.0), "send scheduler follows drain rates under fastest");
+
+    SendScheduler fanout;
+    fanout.set_fanout("10.0.0.1", 3);
+    fanout.add(1, "eth0", "10.0.0.1");
+    fanout.add(2, "eth0", "10.0.0.2");
+    fanout.add(3, "eth1", "10.0.1.1");   // another interface doesn't take a share
+    sent = drain(fanout, {1, 2, 3});
+    check(share_near(sent, 1, 2, 4.0) && share_near(sent, 3, 1, 1.0), "send scheduler favours relays under fanout");
+
+    // 2 used up its turn and waits on 1, which then finds its socket full
+    SendScheduler woken;
+    woken.set_policy(SendScheduler::Policy::FAIR);
+    woken.add(1, "eth0", "10.0.0.1");
+    woken.add(2, "eth0", "10.0.0.2");
+    size_t turn = woken.allowance(1);
+    woken.charge(2, woken.allowance(2));
+    woken.take_woken();
+    woken.charge(1, turn / 2);
+    bool waiting = woken.allowance(2) == 0 && woken.take_woken().empty();
+    woken.blocked(1);
+    std::vector<int> next = woken.take_woken();
+    check(waiting && next == std::vector<int>{2} && woken.allowance(2) == turn && woken.allowance(1) == turn,
+          "send scheduler wakes a waiting flow when the other blocks");
+}
+
+// stands in for the network under a PieceScheduler: the pieces land in the
+// receiver the way they would off a connection, by finding them in a copy
+// that only holds those pieces
+void deliver(FileManager& receiver, const std::string& file, size_t piece, const std::vector<size_t>& pieces) {
+    std::string basis;
+    for (size_t i : pieces) basis += file.substr(i * piece, piece);
+    write_file(SCRATCH + "/delivered.bin", basis);
+    receiver.seed_from(SCRATCH + "/delivered.bin");
+}
+
+uint64_t pieces_migrated() {
+    return nlohmann::json::parse(Metrics::dump())["counters"]["pieces_migrated"].get<uint64_t>();
+}
+
+// a path that stops delivering mid batch has its tail moved to a path that
+// keeps going, and doesn't get those pieces back itself
+void test_migration() {
+    std::filesystem::create_directories(SCRATCH);
+    std::mt19937_64 rng(19);
+    const size_t piece = 1024;
+    const size_t pieces = 400;
+    std::string file = random_bytes(rng, pieces * piece);
+    write_file(SCRATCH + "/sched_in.bin", file);
+    FileManager source(SCRATCH + "/sched_in.bin", piece, "127.0.0.1", SCRATCH + "/pieces", nullptr, true, nullptr);
+    FileMetaData metadata = source.get_metadata();
+    FileManager receiver(SCRATCH + "/sched_out.bin", 0, "127.0.0.1", SCRATCH + "/pieces", nullptr, false, &metadata);
+
+    PieceScheduler scheduler(receiver, pieces);
+    size_t slow = scheduler.add_path(scheduler.add_peer("slow", true, true), "slow");
+    size_t fast = scheduler.add_path(scheduler.add_peer("fast", true, true), "fast");
+    auto flatten = [](const PieceScheduler::Ranges& ranges) {
+        std::vector<size_t> out;
+        for (auto [first, last] : ranges) {
+            for (size_t i = first; i <= last; i++) out.push_back(i);
+        }
+        return out;
+    };
+
+    // one batch each at the same rate
+    auto first_slow = flatten(scheduler.next_batch(slow));
+    auto first_fast = flatten(scheduler.next_batch(fast));
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    deliver(receiver, file, piece, first_slow);
+    deliver(receiver, file, piece, first_fast);
+    scheduler.complete(slow);
+    scheduler.complete(fast);
+
+    // then slow goes quiet while fast keeps bringing pieces in
+    auto stuck = flatten(scheduler.next_batch(slow));
+    auto going = flatten(scheduler.next_batch(fast));
+    uint64_t migrated = pieces_migrated();
+    for (size_t sample = 0; sample < 8 && pieces_migrated() == migrated; sample++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        std::vector<size_t> some(going.begin() + std::min(going.size(), sample * 8),
+                                 going.begin() + std::min(going.size(), (sample + 1) * 8));
+        deliver(receiver, file, piece, some);
+        scheduler.wait_for_work(slow, std::chrono::milliseconds(0));
+    }
+    size_t moved = pieces_migrated() - migrated;
+    check(moved > 0 && moved < stuck.size(), "scheduler moves the tail off a path that stopped delivering");
+
+    std::set<size_t> tail(stuck.end() - moved, stuck.end());
+    auto slow_next = flatten(scheduler.next_batch(slow));
+    bool kept_away = std::none_of(slow_next.begin(), slow_next.end(), [&](size_t i) { return tail.count(i); });
+    auto fast_next = flatten(scheduler.next_batch(fast));
+    bool taken = std::all_of(tail.begin(), tail.end(), [&](size_t i) {
+        return std::count(fast_next.begin(), fast_next.end(), i) == 1;
+    });
+    check(!slow_next.empty() && kept_away, "scheduler doesn't hand moved pieces back to the slow path");
+    check(taken, "scheduler gives moved pieces to the fast path");
+
+    source.clean_up();
+    receiver.clean_up();
+    std::filesystem::remove_all(SCRATCH);
+}
+
+// with only the last few pieces missing idle paths ask for them again, but
+// never more than ENDGAME_COPIES paths for one piece
+void test_endgame() {
+    std::filesystem::create_directories(SCRATCH);
+    std::mt19937_64 rng(23);
+    const size_t piece = 1024;
+    const size_t pieces = 20;
+    std::string file = random_bytes(rng, pieces * piece);
+    write_file(SCRATCH + "/endgame_in.bin", file);
+    FileManager source(SCRATCH + "/endgame_in.bin", piece, "127.0.0.1", SCRATCH + "/pieces", nullptr, true, nullptr);
+    FileMetaData metadata = source.get_metadata();
+    FileManager receiver(SCRATCH + "/endgame_out.bin", 0, "127.0.0.1", SCRATCH + "/pieces", nullptr, false, &metadata);
+
+    PieceScheduler scheduler(receiver, pieces);
+    std::vector<size_t> paths;
+    for (size_t peer = 0; peer < 2; peer++) {
+        size_t id = scheduler.add_peer("peer" + std::to_string(peer), true, true);
+        paths.push_back(scheduler.add_path(id, "a"));
+        paths.push_back(scheduler.add_path(id, "b"));
+    }
+    auto count = [](const PieceScheduler::Ranges& ranges) {
+        size_t n = 0;
+        for (auto [first, last] : ranges) n += last - first + 1;
+        return n;
+    };
+
+    // the first path claims the whole file, four pieces land and the other
+    // sixteen are the endgame
+    check(count(scheduler.next_batch(paths[0])) == pieces, "endgame setup claims every piece");
+    deliver(receiver, file, piece, {0, 1, 2, 3});
+    size_t second = count(scheduler.next_batch(paths[1]));
+    size_t third = count(scheduler.next_batch(paths[2]));
+    size_t fourth = count(scheduler.next_batch(paths[3]));
+    check(second == pieces - 4 && third == pieces - 4 && fourth == 0,
+          "endgame asks for a piece on at most three paths");
+
+    source.clean_up();
+    receiver.clean_up();
+    std::filesystem::remove_all(SCRATCH);
+}
+
+// A path that ran out of work takes over the back half of what a slower
+// path still hasn't delivered, and leaves it what already landed
+void test_steal() {
+    std::filesystem::create_directories(SCRATCH);
+    std::mt19937_64 rng(37);
+    const size_t piece = 1024;
+    const size_t pieces = 200;
+    std::string file = random_bytes(rng, pieces * piece);
+    write_file(SCRATCH + "/steal_in.bin", file);
+    FileManager source(SCRATCH + "/steal_in.bin", piece, "127.0.0.1", SCRATCH + "/pieces", nullptr, true, nullptr);
+    FileMetaData metadata = source.get_metadata();
+    FileManager receiver(SCRATCH + "/steal_out.bin", 0, "127.0.0.1", SCRATCH + "/pieces", nullptr, false, &metadata);
+
+    PieceScheduler scheduler(receiver, pieces);
+    size_t slow = scheduler.add_path(scheduler.add_peer("slow", true, true), "slow");
+    size_t fast = scheduler.add_path(scheduler.add_peer("fast", true, true), "fast");
+    auto flatten = [](const PieceScheduler::Ranges& ranges) {
+        std::vector<size_t> out;
+        for (auto [first, last] : ranges) {
+            for (size_t i = first; i <= last; i++) out.push_back(i);
+        }
+        return out;
+    };
+
+    // first batches measure fast at about eight times the rate of slow
+    auto first_slow = flatten(scheduler.next_batch(slow));
+    auto first_fast = flatten(scheduler.next_batch(fast));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    deliver(receiver, file, piece, first_fast);
+    scheduler.complete(fast);
+    std::this_thread::sleep_for(std::chrono::milliseconds(350));
+    deliver(receiver, file, piece, first_slow);
+    scheduler.complete(slow);
+
+    // slow claims about a second's worth and fast takes the rest of the file
+    auto second_slow = flatten(scheduler.next_batch(slow));
+    auto second_fast = flatten(scheduler.next_batch(fast));
+    check(second_slow.size() + second_fast.size() + first_slow.size() + first_fast.size() == pieces,
+          "steal setup claims every piece");
+    deliver(receiver, file, piece, second_fast);
+    scheduler.complete(fast);
+
+    // some of slow's batch lands before fast runs dry
+    std::vector<size_t> landed(second_slow.begin(), second_slow.begin() + 20);
+    deliver(receiver, file, piece, landed);
+    std::vector<size_t> missing(second_slow.begin() + 20, second_slow.end());
+    std::vector<size_t> back_half(missing.begin() + missing.size() / 2, missing.end());
+    check(flatten(scheduler.next_batch(fast)) == back_half, "steal takes the back half of a slower path's missing pieces");
+
+    source.clean_up();
+    receiver.clean_up();
+    std::filesystem::remove_all(SCRATCH);
+}
+
+void test_piece_codec() {
+    std::mt19937_64 rng(43);
+    std::string text;
+    while (text.size() < 64 * 1024) text += "piece " + std::to_string(text.size() % 977) + " of a very compressible file\n";
+    std::string noise = random_bytes(rng, 64 * 1024);
+
+    PieceCodec codec;
+    check(codec.worth_it(1e12), "codec tries compressing before it measured anything");
+
+    CodedPiece coded;
+    codec.encode(text.data(), text.size(), coded);
+    std::string back(text.size(), '\0');
+    check(coded.codec == PieceCodec::DEFLATE && coded.data.size() < text.size() / 2
+          && PieceCodec::decode(coded.codec, coded.data.data(), coded.data.size(), &back[0], back.size()) && back == text,
+          "codec deflates a compressible piece and inflates it back");
+    check(!PieceCodec::decode(coded.codec, coded.data.data(), coded.data.size(), &back[0], back.size() - 1)
+          && !PieceCodec::decode(coded.codec, coded.data.data(), coded.data.size() / 2, &back[0], back.size())
+          && !PieceCodec::decode(PieceCodec::RAW, coded.data.data(), coded.data.size(), &back[0], back.size()),
+          "codec rejects a wrong size, a truncated piece and a raw one");
+
+    CodedPiece raw;
+    PieceCodec incompressible;
+    incompressible.encode(noise.data(), noise.size(), raw);
+    check(raw.codec == PieceCodec::RAW && raw.data.empty(), "codec leaves random data raw");
+
+    // deflate at level 1 beats a link of a byte a second but not one of a
+    // petabyte, that one only gets the occasional probe
+    check(codec.worth_it(1), "codec compresses for a slow link");
+    size_t probes = 0;
+    for (int i = 0; i < 128; i++) probes += codec.worth_it(1e15);
+    check(probes == 2, "codec only probes a fast link every so often");
+    size_t wasted = 0;
+    for (int i = 0; i < 128; i++) wasted += incompressible.worth_it(1);
+    check(wasted == 2, "codec doesn't compress data that never shrinks");
+}
+
+// Sibling streams of one link: a stream re-requests what a sibling whose
+// batch is long overdue still misses, and groups grow with the bandwidth
+// delay product
+void test_streams() {
+    check(FloodClone::streams_wanted(100e6, 0.1, 4 << 20, 4) == 4 && FloodClone::streams_wanted(10e6, 0.1, 1 << 20, 4) == 2
+          && FloodClone::streams_wanted(1e6, 0.001, 4 << 20, 4) == 1 && FloodClone::streams_wanted(1e9, 1, 1 << 20, 4) == 4,
+          "streams cover the bandwidth delay product within the group's size");
+
+    std::filesystem::create_directories(SCRATCH);
+    std::mt19937_64 rng(47);
+    const size_t piece = 1024;
+    const size_t pieces = 200;
+    std::string file = random_bytes(rng, pieces * piece);
+    write_file(SCRATCH + "/streams_in.bin", file);
+    FileManager source(SCRATCH + "/streams_in.bin", piece, "127.0.0.1", SCRATCH + "/pieces", nullptr, true, nullptr);
+    FileMetaData metadata = source.get_metadata();
+    FileManager receiver(SCRATCH + "/streams_out.bin", 0, "127.0.0.1", SCRATCH + "/pieces", nullptr, false, &metadata);
+
+    PieceScheduler scheduler(receiver, pieces);
+    size_t peer = scheduler.add_peer("peer", true, true);
+    size_t a = scheduler.add_path(peer, "a", 0);
+    size_t b = scheduler.add_path(peer, "b", 0);
+    auto flatten = [](const PieceScheduler::Ranges& ranges) {
+        std::vector<size_t> out;
+        for (auto [first, last] : ranges) {
+            for (size_t i = first; i <= last; i++) out.push_back(i);
+        }
+        return out;
+    };
+
+    // both measure fast, then a claims the rest of the file and stalls on it
+    for (size_t path : {a, b}) {
+        deliver(receiver, file, piece, flatten(scheduler.next_batch(path)));
+        scheduler.complete(path);
+    }
+    auto stuck = flatten(scheduler.next_batch(a));
+    check(stuck.size() == pieces - receiver.pieces().count(), "streams setup claims every piece");
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    deliver(receiver, file, piece, std::vector<size_t>(stuck.begin(), stuck.begin() + 10));
+    check(flatten(scheduler.next_batch(b)) == std::vector<size_t>(stuck.begin() + 10, stuck.end()),
+          "stream asks again for everything a stalled sibling still misses");
+
+    source.clean_up();
+    receiver.clean_up();
+    std::filesystem::remove_all(SCRATCH);
+}
+
+void test_socket_tuner() {
+    check(SocketTuner::buffer_for(0, 0.1) == 0 && SocketTuner::buffer_for(1e6, 0) == 0,
+          "tuner leaves buffers to the kernel until the path is measured");
+    check(SocketTuner::buffer_for(1e6, 0.001) == 128 * 1024 && SocketTuner::buffer_for(10e6, 0.05) == 1000000
+          && SocketTuner::buffer_for(1e9, 1) == 64 * 1024 * 1024,
+          "tuner buffers are two bandwidth delay products within their bounds");
+    check(SocketTuner::lowat_for(0) == 128 * 1024 && SocketTuner::lowat_for(1e8) == 500000
+          && SocketTuner::lowat_for(1e10) == 4 * 1024 * 1024,
+          "tuner keeps a few ms of unsent data within its bounds");
+
+    SocketTuner tuner;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    tuner.configure(fd, "10.9.9.9", SocketTuner::SERVING);
+    int lowat = 0;
+    socklen_t len = sizeof(lowat);
+    getsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, &len);
+    auto choices = tuner.choices();
+    check(lowat == 128 * 1024 && choices.size() == 1 && choices[0].peer == "10.9.9.9"
+          && choices[0].lowat == 128 * 1024 && choices[0].buffer == 0,
+          "tuner gives a fresh serving socket the smallest lowat and the kernel's buffers");
+    tuner.forget(fd);
+    close(fd);
+}
+
+// writes every piece of bytes through store, last piece first, and tells
+// whether it all reads back and the file ends up at its size
+bool store_round_trip(PieceStore& store, const std::string& path, const std::string& bytes, size_t piece) {
+    bool ok = true;
+    size_t pieces = (bytes.size() + piece - 1) / piece;
+    for (size_t i = pieces; i-- > 0;) {
+        size_t length = std::min(piece, bytes.size() - i * piece);
+        char* buffer = store.acquire(i * piece, length);
+        std::memcpy(buffer, bytes.data() + i * piece, length);
+        store.commit(buffer, i * piece, length);
+    }
+    std::string back(bytes.size(), '\0');
+    if (!bytes.empty()) store.read(&back[0], 0, back.size());
+    ok = ok && back == bytes;
+    store.finish();
+    std::ifstream file(path, std::ios::binary);
+    std::string on_disk((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return ok && on_disk == bytes;
+}
+
+void test_piece_store() {
+    std::filesystem::create_directories(SCRATCH);
+    std::mt19937_64 rng(41);
+    const size_t piece = 8192;
+    // the short last piece makes the direct store pad its write
+    std::string bytes = random_bytes(rng, 5 * piece + 100);
+    const std::string path = SCRATCH + "/store.bin";
+
+    for (auto [name, backend] : {std::make_pair("mmap", PieceStore::Backend::Mmap),
+                                 std::make_pair("pwrite", PieceStore::Backend::Pwrite),
+                                 std::make_pair("direct", PieceStore::Backend::Direct)}) {
+        std::string label = std::string(name) + " store";
+        {
+            auto store = PieceStore::open(backend, path, bytes.size(), piece);
+            // a buffer given back unused is no piece
+            store->discard(store->acquire(0, piece));
+            check(store_round_trip(*store, path, bytes, piece), label + " writes every piece where it belongs");
+        }
+        {
+            auto store = PieceStore::open(backend, path, bytes.size(), piece, true);
+            std::string back(bytes.size(), '\0');
+            store->read(&back[0], 0, back.size());
+            check(back == bytes, label + " keeps what a resumed file holds");
+        }
+        {
+            auto store = PieceStore::open(backend, path, 0, piece);
+            check(store_round_trip(*store, path, "", piece) && std::filesystem::file_size(path) == 0,
+                  label + " handles a zero length file");
+        }
+    }
+
+    // one fd short of the two the direct store needs, so it fails to open and
+    // the pwrite store takes over with the one that is left
+    int lowest = ::open("/dev/null", O_RDONLY);
+    close(lowest);
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    rlimit tight = limit;
+    tight.rlim_cur = lowest + 1;
+    setrlimit(RLIMIT_NOFILE, &tight);
+    std::unique_ptr<PieceStore> fallback;
+    try {
+        fallback = PieceStore::open(PieceStore::Backend::Direct, path, bytes.size(), piece);
+    } catch (const std::exception&) {
+    }
+    setrlimit(RLIMIT_NOFILE, &limit);
+    check(fallback && fallback->fd() == lowest && store_round_trip(*fallback, path, bytes, piece),
+          "direct store falls back to pwrite when it can't be opened");
+    fallback.reset();
+
+    bool unknown = false;
+    try {
+        PieceStore::parse_backend("tape");
+    } catch (const std::runtime_error&) {
+        unknown = true;
+    }
+    check(unknown && PieceStore::parse_backend("direct") == PieceStore::Backend::Direct, "store names parse");
+    std::filesystem::remove_all(SCRATCH);
+}
+
+// scans checked against the obvious loop, on sizes and bits either side of
+// a word and of the four word blocks the scan skips over
+void test_bitset() {
+    std::mt19937_64 rng(29);
+    bool scans = true;
+    bool bytes = true;
+    for (size_t size : {1, 63, 64, 65, 255, 256, 257, 511, 512, 700}) {
+        for (size_t trial = 0; trial < 20; trial++) {
+            PieceBitset has(size), ours(size);
+            std::vector<bool> has_ref(size), ours_ref(size);
+            // a few bits at the boundaries, long runs everywhere else
+            for (size_t i : {size_t(0), size_t(63), size_t(64), size_t(255), size_t(256), size - 1}) {
+                if (i < size && rng() % 2) { has.set(i); has_ref[i] = true; }
+                if (i < size && rng() % 2) { ours.set(i); ours_ref[i] = true; }
+            }
+            for (size_t i = 0; i < size; i++) {
+                if (rng() % (trial + 2) == 0) { has.set(i); has_ref[i] = true; }
+                if (rng() % 2 == 0 && trial % 3 == 0) { ours.set(i); ours_ref[i] = true; }
+            }
+
+            for (size_t from = 0; from <= size; from++) {
+                size_t clear = from, wanted = from;
+                while (clear < size && ours_ref[clear]) clear++;
+                while (wanted < size && !(has_ref[wanted] && !ours_ref[wanted])) wanted++;
+                scans = scans && ours.find_first_clear(from) == clear
+                        && PieceBitset::find_first_wanted(has, ours, from) == wanted;
+            }
+
+            std::string packed = has.to_bytes();
+            PieceBitset back(size);
+            back.merge_bytes(packed);
+            bytes = bytes && packed.size() == PieceBitset::byte_size(size) && back.to_bytes() == packed
+                    && back.count() == has.count();
+        }
+        // every bit of a full set goes through, bits past the end don't come back
+        PieceBitset full(size, true), merged(size);
+        merged.merge_bytes(std::string(PieceBitset::byte_size(size), '\xff'));
+        bytes = bytes && merged.to_bytes() == full.to_bytes() && merged.count() == size
+                && merged.find_first_clear(0) == size;
+    }
+    check(scans, "bitset find_first_clear and find_first_wanted match a plain scan");
+    check(bytes, "bitset to_bytes and merge_bytes round trip");
+}
+
+void test_metrics_buckets() {
+    std::vector<uint64_t> values;
+    for (uint64_t v = 0; v < 70000; v++) values.push_back(v);
+    for (size_t e = 17; e < 64; e++) {
+        uint64_t power = uint64_t(1) << e;
+        for (uint64_t v : {power - 1, power, power + 1, power + power / 3}) values.push_back(v);
+    }
+    values.push_back(~uint64_t(0));
+    std::sort(values.begin(), values.end());
+
+    bool monotonic = true;
+    bool bounded = true;
+    const uint64_t top = uint64_t(1) << (Metrics::MAX_EXPONENT + 1);
+    for (size_t i = 0; i < values.size(); i++) {
+        uint64_t v = values[i];
+        size_t bucket = Metrics::bucket_of(v);
+        if (i > 0) monotonic = monotonic && bucket >= Metrics::bucket_of(values[i - 1]);
+        bounded = bounded && bucket < Metrics::BUCKETS && Metrics::bucket_floor(bucket) <= v;
+        // below the last bucket a value is never more than one sub bucket above its floor
+        if (v < top) {
+            bounded = bounded && (v - Metrics::bucket_floor(bucket)) * Metrics::SUB_BUCKETS <= v;
+        } else {
+            bounded = bounded && bucket == Metrics::BUCKETS - 1;
+        }
+    }
+    for (size_t b = 1; b < Metrics::BUCKETS; b++) {
+        monotonic = monotonic && Metrics::bucket_floor(b) > Metrics::bucket_floor(b - 1)
+                    && Metrics::bucket_of(Metrics::bucket_floor(b)) == b;
+    }
+    check(monotonic, "metrics buckets grow with the value");
+    check(bounded, "metrics bucket floors are within a sub bucket of the value");
+}
+
+// a source serving a random file from SCRATCH on port, for the tests that
+// need a real server on the other end
+struct LocalSource {
+    std::string path;
+    std::string bytes;
+    FileManager manager;
+    ConnectionManager server;
+    std::thread listener;
+
+    static std::string make(const std::string& path, size_t size, uint64_t seed) {
+        std::filesystem::create_directories(SCRATCH);
+        std::mt19937_64 rng(seed);
+        std::string bytes = random_bytes(rng, size);
+        write_file(path, bytes);
+        return bytes;
+    }
+
+    LocalSource(ThreadPool& pool, const std::string& name, size_t size, size_t piece, int port, uint64_t seed = 1)
+        : path(SCRATCH + "/" + name), bytes(make(path, size, seed)),
+          manager(path, piece, "127.0.0.1", SCRATCH + "/source_pieces", &pool, true, nullptr),
+          server("127.0.0.1", port, pool, manager) {
+        listener = std::thread([this] { server.start_listening(); });
+    }
+
+    ~LocalSource() {
+        server.stop_listening();
+        listener.join();
+        manager.clean_up();
+    }
+};
+
+// plain blocking socket to a local server, -1 if it never came up
+int raw_connect(int port) {
+    for (int attempt = 0; attempt < 100; attempt++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        if (connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+            timeval timeout{2, 0};
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            return sock;
+        }
+        close(sock);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return -1;
+}
+
+// sends request as a PIECE_REQ of its own and tells whether the server hung up on it
+bool server_closes(int port, const PieceRequest& request) {
+    int sock = raw_connect(port);
+    if (sock < 0) return false;
+    std::vector<char> payload = request.serialize();
+    RequestHeader header = {PIECE_REQ, payload.size(), 0};
+    std::vector<char> message = header.serialize();
+    message.insert(message.end(), payload.begin(), payload.end());
+    send(sock, message.data(), message.size(), MSG_NOSIGNAL);
+    char byte;
+    ssize_t got = recv(sock, &byte, 1, 0);
+    close(sock);
+    return got == 0 || (got < 0 && errno == ECONNRESET);
+}
+
+void test_piece_request_bounds(ThreadPool& threadPool) {
+    {
+        LocalSource source(threadPool, "bounds.bin", 10 * 1024, 1024, 9087);
+        PieceRequest past_end{SINGLE_PIECE, 10, {}, {}};
+        PieceRequest backwards{PIECE_RANGE, 0, {{5, 2}}, {}};
+        PieceRequest endless{PIECE_RANGE, 0, {{0, SIZE_MAX}}, {}};
+        PieceRequest listed{PIECE_LIST, 0, {}, {3, 1000}};
+        PieceRequest too_many{PIECE_RANGE | PIECE_LIST, 0, {{0, 9}}, {0}};
+        PieceRequest fine{PIECE_RANGE, 0, {{0, 9}}, {}};
+        check(server_closes(9087, past_end) && server_closes(9087, backwards) && server_closes(9087, endless)
+              && server_closes(9087, listed) && server_closes(9087, too_many),
+              "server closes connections asking for pieces outside the file");
+        check(!server_closes(9087, fine), "server still answers a request for the whole file");
+    }
+    std::filesystem::remove_all(SCRATCH);
+}
+
+// every local interface the kernel routes a neighbor's address out of is a
+// path of its own, combinations routed elsewhere are no link at all
+void test_interface_paths(ThreadPool& threadPool) {
+    check(ConnectionManager::route_interface("127.0.0.1") == "lo", "loopback is routed through lo");
+    auto paths = FloodClone::routed_paths({{"127.0.0.1", "eth9"}, {"127.0.0.1", "lo"}, {"127.0.0.2", "lo"}});
+    check(paths.size() == 1 && paths[0].target_ip == "127.0.0.1" && paths[0].local_interface == "lo",
+          "paths keep one routed option per interface");
+    auto fallback = FloodClone::routed_paths({{"127.0.0.5", "eth9"}, {"127.0.0.6", "eth8"}});
+    check(fallback.size() == 1 && fallback[0].target_ip == "127.0.0.5" && fallback[0].local_interface.empty(),
+          "paths fall back to the kernel's route when no option is routed");
+
+    {
+        LocalSource source(threadPool, "paths.bin", 8 * 1024, 1024, 9091);
+        ConnectionManager client("127.0.0.1", 8084, threadPool);
+        FileMetaData metadata = client.request_metadata("127.0.0.1", 9091, "lo");
+        check(metadata.numPieces == 8, "connection pinned to an interface reaches the peer");
+        client.stop_listening();
+    }
+    std::filesystem::remove_all(SCRATCH);
+}
+
+uint64_t counter(const std::string& name) {
+    return nlohmann::json::parse(Metrics::dump())["counters"][name].get<uint64_t>();
+}
+
+// A relay holding the first 80 of 100 pieces is asked for all of them, and
+// for 80..89 a second time behind that. The rest land here through another
+// route while the relay still waits on them, the cancels that go out must
+// turn every one of those into a CANCELLED_RES. 80 pieces are more than the
+// first credit window, the answers only finish if credit comes back
+void test_cancel_waiting(ThreadPool& threadPool) {
+    std::filesystem::create_directories(SCRATCH);
+    std::mt19937_64 rng(31);
+    const size_t piece = 1024;
+    const size_t pieces = 100;
+    const size_t held = 80;
+    std::string file = random_bytes(rng, pieces * piece);
+    write_file(SCRATCH + "/cancel_in.bin", file);
+    FileManager source(SCRATCH + "/cancel_in.bin", piece, "127.0.0.1", SCRATCH + "/pieces", nullptr, true, nullptr);
+    FileMetaData metadata = source.get_metadata();
+
+    FileManager relay(SCRATCH + "/cancel_relay.bin", 0, "127.0.0.1", SCRATCH + "/pieces", &threadPool, false, &metadata);
+    std::vector<size_t> first, rest, again;
+    for (size_t i = 0; i < pieces; i++) (i < held ? first : rest).push_back(i);
+    for (size_t i = held; i < held + 10; i++) again.push_back(i);
+    deliver(relay, file, piece, first);
+    threadPool.wait();
+    ConnectionManager server("127.0.0.1", 9088, threadPool, relay);
+    std::thread listener([&server] { server.start_listening(); });
+
+    ConnectionManager client("127.0.0.1", 8083, threadPool);
+    FileManager receiver(SCRATCH + "/cancel_out.bin", 0, "127.0.0.1", SCRATCH + "/pieces", &threadPool, false, &metadata);
+    client.set_file_manager(receiver);
+
+    uint64_t served = counter("pieces_served");
+    uint64_t cancelled = counter("pieces_cancelled");
+    uint64_t received = counter("pieces_received");
+    uint64_t duplicate = counter("pieces_duplicate");
+
+    client.send_piece_request("127.0.0.1", 9088, -1, {{0, pieces - 1}}, {});
+    client.send_piece_request("127.0.0.1", 9088, -1, {}, again);
+    bool answered = false;
+    std::thread receiving([&] {
+        try {
+            client.receive_pieces("127.0.0.1", 9088);
+            client.receive_pieces("127.0.0.1", 9088);
+            answered = true;
+        } catch (const std::exception& e) {
+            std::cerr << "Receiving from relay: " << e.what() << "\n";
+        }
+    });
+    for (int waited = 0; receiver.pieces().count() < held && waited < 500; waited++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    deliver(receiver, file, piece, rest);
+    receiving.join();
+    threadPool.wait();
+
+    check(answered && receiver.pieces().count() == pieces, "cancelled pieces the relay waits on complete the requests");
+    check(counter("pieces_served") - served == held && counter("pieces_cancelled") - cancelled == rest.size() + again.size(),
+          "relay sends exactly one answer per piece asked for");
+    check(counter("pieces_received") - received == held && counter("pieces_duplicate") == duplicate,
+          "no piece comes in twice after a cancel");
+
+    // every piece is a duplicate now, each one still gives its credit back
+    client.send_piece_request("127.0.0.1", 9088, -1, {{0, held - 1}}, {});
+    client.receive_pieces("127.0.0.1", 9088);
+    threadPool.wait();
+    check(counter("pieces_duplicate") - duplicate == held, "duplicates return their credit");
+
+    client.stop_listening();
+    server.stop_listening();
+    listener.join();
+    source.clean_up();
+    relay.clean_up();
+    receiver.clean_up();
+    std::filesystem::remove_all(SCRATCH);
+}
+
+// A relay pushes a subscriber the even pieces it lacks: what the relay holds
+// right away, the rest as it lands there, then a NOT_AVAIL_RES ends it
+void test_push(ThreadPool& threadPool) {
+    std::filesystem::create_directories(SCRATCH);
+    std::mt19937_64 rng(53);
+    const size_t piece = 1024;
+    const size_t pieces = 40;
+    std::string file = random_bytes(rng, pieces * piece);
+    write_file(SCRATCH + "/push_in.bin", file);
+    FileManager source(SCRATCH + "/push_in.bin", piece, "127.0.0.1", SCRATCH + "/pieces", nullptr, true, nullptr);
+    FileMetaData metadata = source.get_metadata();
+
+    FileManager relay(SCRATCH + "/push_relay.bin", 0, "127.0.0.1", SCRATCH + "/pieces", &threadPool, false, &metadata);
+    std::vector<size_t> first, rest;
+    for (size_t i = 0; i < pieces; i++) (i < 30 ? first : rest).push_back(i);
+    deliver(relay, file, piece, first);
+    threadPool.wait();
+    ConnectionManager server("127.0.0.1", 9092, threadPool, relay);
+    server.set_push_filter([](const std::string&, size_t idx) { return idx % 2 == 0; });
+    std::thread listener([&server] { server.start_listening(); });
+
+    ConnectionManager client("127.0.0.1", 8085, threadPool);
+    FileManager receiver(SCRATCH + "/push_out.bin", 0, "127.0.0.1", SCRATCH + "/pieces", &threadPool, false, &metadata);
+    client.set_file_manager(receiver);
+    deliver(receiver, file, piece, {0});
+    threadPool.wait();
+
+    std::atomic<bool> ended{false};
+    size_t pushed = 0;
+    std::thread subscriber([&] {
+        try {
+            pushed = client.subscribe("127.0.0.1", 9092, "");
+        } catch (const std::exception& e) {
+            std::cerr << "Subscription: " << e.what() << "\n";
+        }
+        ended = true;
+    });
+    // 2..28 are at the relay already
+    for (int waited = 0; receiver.pieces().count() < 15 && waited < 500; waited++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    check(receiver.pieces().count() == 15 && !ended, "push sends what the relay holds and waits for the rest");
+
+    deliver(relay, file, piece, rest);
+    subscriber.join();
+    threadPool.wait();
+    bool evens = receiver.pieces().count() == 20;
+    for (size_t i = 0; i < pieces; i++) evens = evens && receiver.has_piece(i) == (i % 2 == 0);
+    check(pushed == 19 && evens, "push ends with NOT_AVAIL once every filtered piece went out");
+
+    size_t again = SIZE_MAX;
+    try {
+        again = client.subscribe("127.0.0.1", 9092, "");
+    } catch (const std::exception&) {
+    }
+    check(again == 0, "push to a subscriber that lacks nothing ends right away");
+
+    client.stop_listening();
+    server.stop_listening();
+    listener.join();
+    source.clean_up();
+    relay.clean_up();
+    receiver.clean_up();
+    std::filesystem::remove_all(SCRATCH);
+}
 
 #ifdef TESTING
 int main() {
@@ -133,6 +1489,35 @@ int main() {
     server_thread.join();
     
     std::cout << "Clean shutdown complete\n";
-    return 0;
+
+    // without resume nothing is written next to the output while it comes in
+    check(!std::filesystem::exists("tests/received_test_file.txt.pieces")
+          && !std::filesystem::exists("tests/received_test_file.txt.metadata"),
+          "receiver without resume keeps no progress files");
+
+    test_fountain();
+    test_metadata();
+    test_merkle();
+    test_resume(threadPool);
+    test_rolling();
+    test_seed();
+    test_thread_pool();
+    test_planner();
+    test_completion_tree();
+    test_send_scheduler();
+    test_migration();
+    test_endgame();
+    test_steal();
+    test_streams();
+    test_piece_store();
+    test_piece_codec();
+    test_socket_tuner();
+    test_bitset();
+    test_metrics_buckets();
+    test_piece_request_bounds(threadPool);
+    test_cancel_waiting(threadPool);
+    test_interface_paths(threadPool);
+    test_push(threadPool);
+    return failures == 0 ? 0 : 1;
 }
 #endif